@@ -0,0 +1,104 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ConcurrencyTuner.h"
+
+ConcurrencyTuner::ConcurrencyTuner(int cores) :
+    m_cores(cores < 1 ? 1 : cores),
+    m_probe{1, 1},
+    m_probeRate(0.0),
+    m_levelRate(0.0),
+    m_lastLevelRate(0.0),
+    m_currentRate(0.0),
+    m_current{1, 1},
+    m_trial(false),
+    m_base{1, 1},
+    m_baseRate(0.0),
+    m_windows(0),
+    m_direction(1) {
+}
+
+bool ConcurrencyTuner::fits(const Config& config) const {
+    return config.games >= 1 && config.threads >= 1
+        && config.games * config.threads <= MAX_THREADS_PER_CORE * m_cores;
+}
+
+bool ConcurrencyTuner::nextCalibration(Config& config) const {
+    if (m_probe.threads > m_cores) {
+        return false;
+    }
+    config = m_probe;
+    return true;
+}
+
+void ConcurrencyTuner::calibrated(double movesPerSec) {
+    if (movesPerSec > m_currentRate) {
+        m_current = m_probe;
+        m_currentRate = movesPerSec;
+    }
+    if (movesPerSec > m_levelRate) {
+        m_levelRate = movesPerSec;
+    }
+    auto more = m_probe;
+    more.games++;
+    if (movesPerSec > m_probeRate * (1.0 + MIN_GAIN) && fits(more)) {
+        m_probe = more;
+        m_probeRate = movesPerSec;
+        return;
+    }
+    if (m_levelRate <= m_lastLevelRate * (1.0 + MIN_GAIN)) {
+        // More threads didn't help, more still won't.
+        m_probe.threads = m_cores + 1;
+        return;
+    }
+    m_probe = Config{1, m_probe.threads * 2};
+    m_probeRate = 0.0;
+    m_lastLevelRate = m_levelRate;
+    m_levelRate = 0.0;
+}
+
+ConcurrencyTuner::Config ConcurrencyTuner::nextWindow(double movesPerSec) {
+    if (m_trial) {
+        m_trial = false;
+        m_windows = 0;
+        if (movesPerSec <= m_baseRate * (1.0 + MIN_GAIN)) {
+            // Go back, and try the other way next time.
+            m_current = m_base;
+            m_direction = -m_direction;
+        }
+        return m_current;
+    }
+    if (++m_windows < TRIAL_INTERVAL) {
+        return m_current;
+    }
+    auto trial = m_current;
+    trial.games += m_direction;
+    if (!fits(trial)) {
+        m_direction = -m_direction;
+        trial.games = m_current.games + m_direction;
+        if (!fits(trial)) {
+            m_windows = 0;
+            return m_current;
+        }
+    }
+    m_base = m_current;
+    m_baseRate = movesPerSec;
+    m_current = trial;
+    m_trial = true;
+    return m_current;
+}
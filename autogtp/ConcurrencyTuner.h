@@ -0,0 +1,84 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONCURRENCYTUNER_H
+#define CONCURRENCYTUNER_H
+
+/*
+    Picks how many games to play on each GPU at once, and how many
+    threads every leelaz gets, by the moves/sec they make. Games per
+    hour follow moves/sec, as the games are the same length whatever
+    plays them.
+
+    At startup, calibration tries thread counts doubling from 1, adding
+    games at each as long as it pays, and stops once more threads don't
+    beat fewer. Afterwards, every few
+    windows of play one more or one less game is tried for a window,
+    and kept if it is faster, so the pick follows the host as its load
+    changes.
+*/
+class ConcurrencyTuner {
+public:
+    struct Config {
+        int games;      // per GPU
+        int threads;    // of every leelaz
+    };
+    // Gains below this are taken to be noise.
+    static constexpr double MIN_GAIN = 0.05;
+    // Windows with the picked configuration before trying another.
+    static constexpr int TRIAL_INTERVAL = 4;
+    // leelaz threads per core all the games may add up to. A search
+    // thread waits on the GPU for much of its time.
+    static constexpr int MAX_THREADS_PER_CORE = 2;
+
+    // cores is what one GPU gets of the host.
+    explicit ConcurrencyTuner(int cores);
+
+    // Calibration: the configuration to measure next, and the result
+    // of that measurement. nextCalibration returns false when done.
+    bool nextCalibration(Config& config) const;
+    void calibrated(double movesPerSec);
+
+    // What to play with now.
+    Config current() const { return m_current; }
+    // Takes the moves/sec that current() made over a window of play
+    // and returns what to play the next window with.
+    Config nextWindow(double movesPerSec);
+
+private:
+    bool fits(const Config& config) const;
+
+    int m_cores;
+    // Calibration: where it is, the rate with one game less, and the
+    // best rates with these threads and with half as many.
+    Config m_probe;
+    double m_probeRate;
+    double m_levelRate;
+    double m_lastLevelRate;
+    double m_currentRate;
+    Config m_current;
+    // While a trial runs, what it is compared against.
+    bool m_trial;
+    Config m_base;
+    double m_baseRate;
+    int m_windows;
+    // Games to add on the next trial, 1 or -1.
+    int m_direction;
+};
+
+#endif
@@ -59,6 +59,11 @@ Job(gpu, parent)
 {
 }
 
+CalibrationJob::CalibrationJob(QString gpu, Management *parent) :
+Job(gpu, parent)
+{
+}
+
 WaitJob::WaitJob(QString gpu, Management *parent) :
 Job(gpu, parent)
 {
@@ -166,6 +171,33 @@ void ValidationJob::init(const QMap<QString,QString> &l) {
     m_secondNet = l["secondNet"];
 }
 
+Result CalibrationJob::execute(){
+    Result res(Result::Error);
+    do {
+        Game game(m_network, m_option);
+        if (!game.gameStart(m_leelazMinVersion)) {
+            return res;
+        }
+        do {
+            game.move();
+            if (!game.waitForMove()) {
+                return res;
+            }
+            game.readMove();
+            m_boss->incMoves();
+        } while (game.nextMove() && m_state.load() == RUNNING);
+        game.gameQuit();
+    } while (m_state.load() == RUNNING);
+    // Nothing to upload.
+    res.type(Result::Waited);
+    return res;
+}
+
+void CalibrationJob::init(const QMap<QString,QString> &l) {
+    Job::init(l);
+    m_network = l["network"];
+}
+
 Result WaitJob::execute(){
     Result res(Result::Waited);
     QThread::sleep(m_minutes * 60);
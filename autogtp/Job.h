@@ -75,6 +75,18 @@ private:
     QString m_secondNet;
 };
 
+// Plays moves of throwaway games until finished, only to count them.
+class CalibrationJob : public Job {
+    Q_OBJECT
+public:
+    CalibrationJob(QString gpu, Management *parent);
+    ~CalibrationJob() = default;
+    void init(const QMap<QString,QString> &l);
+    Result execute();
+private:
+    QString m_network;
+};
+
 class WaitJob : public Job {
     Q_OBJECT
 public:
@@ -16,8 +16,11 @@
     along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cmath>
+#include <memory>
 #include <random>
+#include <vector>
 #include <QDir>
 #include <QFileInfo>
 #include <QThread>
@@ -28,24 +31,49 @@
 #include <QRegularExpression>
 #include "Management.h"
 #include "Game.h"
+#include "Job.h"
 
 
-constexpr int RETRY_DELAY_MIN_SEC = 30;
-constexpr int RETRY_DELAY_MAX_SEC = 60 * 60;  // 1 hour
 constexpr int MAX_RETRIES = 3;           // Stop retrying after 3 times
 const QString Leelaz_min_version = "0.11";
 
+namespace {
+
+// Runs a CalibrationJob until it is finished.
+class CalibrationThread : public QThread {
+public:
+    CalibrationThread(const QString& gpu, Management* boss,
+                      const QMap<QString,QString>& parameters)
+        : m_job(gpu, boss), m_failed(false) {
+        m_job.init(parameters);
+    }
+    void run() override {
+        m_failed = m_job.execute().type() == Result::Error;
+    }
+    void finish() { m_job.finish(); }
+    bool failed() const { return m_failed; }
+private:
+    CalibrationJob m_job;
+    bool m_failed;
+};
+
+}
+
 Management::Management(const int gpus,
                        const int games,
                        const QStringList& gpuslist,
                        const int ver,
                        const QString& keep,
                        const QString& debug,
+                       const bool autotune,
                        QMutex* mutex)
     : m_mainMutex(mutex),
     m_syncMutex(),
-    m_gamesThreads(gpus * games),
+    m_gamesThreads(),
+    m_workerGpus(),
+    m_activeGames(gpus, 0),
     m_games(games),
+    m_threads(0),
     m_gpus(gpus),
     m_gpusList(gpuslist),
     m_selfGames(0),
@@ -54,7 +82,22 @@ Management::Management(const int gpus,
     m_keepPath(keep),
     m_debugPath(debug),
     m_version(ver),
-    m_fallBack(Order::Error) {
+    m_fallBack(Order::Error),
+    m_uploadThread(),
+    m_uploader(),
+    m_tuner(),
+    m_windowMoves(0) {
+    if (autotune) {
+        const auto cores = std::max(1, QThread::idealThreadCount() / gpus);
+        m_tuner.reset(new ConcurrencyTuner(cores));
+    }
+    m_uploader.moveToThread(&m_uploadThread);
+    m_uploadThread.start();
+}
+
+Management::~Management() {
+    m_uploadThread.quit();
+    m_uploadThread.wait();
 }
 
 void Management::runTuningProcess(const QString &tuneCmdLine) {
@@ -87,27 +130,134 @@ void Management::giveAssignments() {
     }
     QTextStream(stdout) << "Tuning process finished" << endl;
 
+    if (m_tuner) {
+        calibrate(tuneOrder);
+    }
+
     m_start = std::chrono::high_resolution_clock::now();
+    m_windowStart = m_start;
     m_mainMutex->lock();
-    QString myGpu;
+    m_syncMutex.lock();
     for (int gpu = 0; gpu < m_gpus; ++gpu) {
         for (int game = 0; game < m_games; ++game) {
-            int thread_index = gpu * m_games + game;
-            if (m_gpusList.isEmpty()) {
-                myGpu = "";
-            } else {
-                myGpu = m_gpusList.at(gpu);
-            }
-            QTextStream(stdout) << "Starting thread " << game + 1 ;
-            QTextStream(stdout) << " on GPU " << gpu << endl;
-            m_gamesThreads[thread_index] = new Worker(thread_index, myGpu, this);
-            connect(m_gamesThreads[thread_index],
-                    &Worker::resultReady,
-                    this,
-                    &Management::getResult,
-                    Qt::DirectConnection);
-            m_gamesThreads[thread_index]->order(getWork());
-            m_gamesThreads[thread_index]->start();
+            startWorker(gpu);
+        }
+    }
+    m_syncMutex.unlock();
+}
+
+QString Management::gpuIndex(int gpu) const {
+    if (m_gpusList.isEmpty()) {
+        return "";
+    }
+    return m_gpusList.at(gpu);
+}
+
+void Management::startWorker(int gpu) {
+    const auto thread_index = m_gamesThreads.size();
+    m_activeGames[gpu]++;
+    QTextStream(stdout) << "Starting thread " << m_activeGames[gpu];
+    QTextStream(stdout) << " on GPU " << gpu << endl;
+    auto worker = new Worker(thread_index, gpuIndex(gpu), this);
+    m_gamesThreads.append(worker);
+    m_workerGpus.append(gpu);
+    connect(worker,
+            &Worker::resultReady,
+            this,
+            &Management::getResult,
+            Qt::DirectConnection);
+    worker->order(getWork());
+    worker->start();
+}
+
+// Plays the calibration of the tuner through on every GPU at once, as
+// they share the CPU, and sets the games and threads it picks.
+void Management::calibrate(Order order) {
+    QTextStream(stdout) << "Calibrating games and threads per GPU, "
+                        << "please wait..." << endl;
+    auto config = ConcurrencyTuner::Config{};
+    while (m_tuner->nextCalibration(config)) {
+        const auto rate = measure(order, config);
+        QTextStream(stdout)
+            << config.games << " game(s) of " << config.threads
+            << " thread(s) per GPU: " << rate << " moves/s per GPU" << endl;
+        m_tuner->calibrated(rate);
+    }
+    const auto best = m_tuner->current();
+    m_games = best.games;
+    m_threads = best.threads;
+    QTextStream(stdout)
+        << "Calibration finished, playing " << m_games << " game(s) of "
+        << m_threads << " thread(s) per GPU." << endl;
+}
+
+double Management::measure(Order order,
+                           const ConcurrencyTuner::Config& config) {
+    auto parameters = order.parameters();
+    QString opt = parameters["options"];
+    QRegularExpression re("-t \\d+ ");
+    opt.replace(re, "-t " + QString::number(config.threads) + " ");
+    parameters["options"] = opt;
+
+    std::vector<std::unique_ptr<CalibrationThread>> threads;
+    for (int gpu = 0; gpu < m_gpus; ++gpu) {
+        auto gpuOpt = gpuIndex(gpu);
+        if (!gpuOpt.isEmpty()) {
+            gpuOpt = " --gpu=" + gpuOpt + " ";
+        }
+        for (int game = 0; game < config.games; ++game) {
+            threads.emplace_back(new CalibrationThread(gpuOpt, this,
+                                                       parameters));
+            threads.back()->start();
+        }
+    }
+    QThread::sleep(CALIBRATION_WARMUP_SEC);
+    const auto start_moves = m_movesMade.load();
+    QThread::sleep(CALIBRATION_SEC);
+    const auto moves = m_movesMade.load() - start_moves;
+    for (auto& thread : threads) {
+        thread->finish();
+    }
+    for (auto& thread : threads) {
+        thread->wait();
+        if (thread->failed()) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Only the real games count towards ms/move.
+    m_movesMade.store(0);
+    return double(moves) / CALIBRATION_SEC / m_gpus;
+}
+
+// Ends a window of play after TUNE_WINDOW_SEC and gets what to play
+// the next one with from the tuner.
+void Management::retune() {
+    const auto now = std::chrono::high_resolution_clock::now();
+    const auto elapsed =
+        std::chrono::duration_cast<std::chrono::seconds>(now - m_windowStart);
+    if (elapsed.count() < TUNE_WINDOW_SEC) {
+        return;
+    }
+    const auto moves = m_movesMade.load() - m_windowMoves;
+    m_windowStart = now;
+    m_windowMoves = m_movesMade.load();
+    if (moves == 0) {
+        // The server had us wait, this says nothing about the host.
+        return;
+    }
+    const auto rate = double(moves) / elapsed.count() / m_gpus;
+    const auto next = m_tuner->nextWindow(rate);
+    QTextStream(stdout)
+        << "Autotune: " << rate << " moves/s per GPU with " << m_games
+        << " game(s) of " << m_threads << " thread(s), next "
+        << next.games << " game(s) of " << next.threads << " thread(s)."
+        << endl;
+    m_games = next.games;
+    m_threads = next.threads;
+    // Extra games stop as they end, see getResult.
+    for (int gpu = 0; gpu < m_gpus; ++gpu) {
+        while (m_activeGames[gpu] < m_games) {
+            startWorker(gpu);
         }
     }
 }
@@ -131,8 +281,18 @@ void Management::getResult(Order ord, Result res, int index, int duration) {
         printTimingInfo(duration);
         break;
     }
-    sendAllGames();
-    m_gamesThreads[index]->order(getWork());
+    if (m_tuner) {
+        retune();
+    }
+    const auto gpu = m_workerGpus[index];
+    if (m_activeGames[gpu] > m_games) {
+        // The tuner wants fewer games on this GPU.
+        m_activeGames[gpu]--;
+        QTextStream(stdout) << "Stopping a thread on GPU " << gpu << endl;
+        m_gamesThreads[index]->doFinish();
+    } else {
+        m_gamesThreads[index]->order(getWork());
+    }
     m_syncMutex.unlock();
 
 }
@@ -188,7 +348,12 @@ QString Management::getOptionsString(const QJsonObject &opt, const QString &rnd)
     options.append(getOption(opt, "visits", " -v ", ""));
     options.append(getOption(opt, "resignation_percent", " -r ", "1"));
     options.append(getOption(opt, "randomcnt", " -m ", "30"));
-    options.append(getOption(opt, "threads", " -t ", "1"));
+    if (m_threads > 0) {
+        // Picked by the autotune instead.
+        options.append(" -t " + QString::number(m_threads) + " ");
+    } else {
+        options.append(getOption(opt, "threads", " -t ", "1"));
+    }
     options.append(getBoolOption(opt, "dumbpass", " -d ", true));
     options.append(getBoolOption(opt, "noise", " -n ", true));
     options.append(" --noponder ");
@@ -476,18 +641,6 @@ void Management::archiveFiles(const QString &fileName) {
         }
     }
 }
-void Management::cleanupFiles(const QString &fileName) {
-    QDir dir;
-    QStringList filters;
-    filters << fileName + ".*";
-    dir.setNameFilters(filters);
-    dir.setFilter(QDir::Files | QDir::NoSymLinks);
-    QFileInfoList list = dir.entryInfoList();
-    for (int i = 0; i < list.size(); ++i) {
-        QFile(list.at(i).fileName()).remove();
-    }
-}
-
 void Management::gzipFile(const QString &fileName) {
     QString gzipCmd ="gzip";
 #ifdef WIN32
@@ -497,10 +650,10 @@ void Management::gzipFile(const QString &fileName) {
     QProcess::execute(gzipCmd);
 }
 
-void Management::saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name) {
+QString Management::saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name) {
     QFile f("curl_save" + QUuid::createUuid().toRfc4122().toHex() + ".bin");
     if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        return;
+        return QString();
     }
     QTextStream out(&f);
     out << name << endl;
@@ -511,8 +664,10 @@ void Management::saveCurlCmdLine(const QStringList &prog_cmdline, const QString
         ++it;
     }
     f.close();
+    return f.fileName();
 }
 
+// Uploads left over from an earlier run.
 void Management::sendAllGames() {
     QDir dir;
     QStringList filters;
@@ -521,73 +676,10 @@ void Management::sendAllGames() {
     dir.setFilter(QDir::Files | QDir::NoSymLinks);
     QFileInfoList list = dir.entryInfoList();
     for (int i = 0; i < list.size(); ++i) {
-        QFileInfo fileInfo = list.at(i);
-        QFile file (fileInfo.fileName());
-        if (!file.open(QFile::ReadOnly)) {
-            continue;
-        }
-        QTextStream in(&file);
-        QString name;
-        QString tmp;
-        QStringList lines;
-        int count;
-        in >> name;
-        in >> count;
-        count = 2 * count - 1;
-        for (int i = 0; i < count; i++) {
-            in >> tmp;
-            lines << tmp;
-        }
-        file.close();
-        bool sent = false;
-
-        try {
-            sent = sendCurl(lines);
-            if (sent) {
-                QTextStream(stdout) << "File: " << file.fileName() << " sent" << endl;
-                file.remove();
-                cleanupFiles(name);
-                if (i+1 < list.size()) {
-                    QThread::sleep(10);
-                }
-            }
-        } catch (NetworkException ex) {
-            QTextStream(stdout)
-                << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            QTextStream(stdout)
-                    << "Retrying when next game is finished."
-                    << endl;
-        }
+        m_uploader.enqueue(list.at(i).fileName());
     }
 }
 
-bool Management::sendCurl(const QStringList &lines) {
-    QString prog_cmdline("curl");
-#ifdef WIN32
-    prog_cmdline.append(".exe");
-#endif
-    QStringList::ConstIterator it = lines.constBegin();
-    while (it != lines.constEnd()) {
-        prog_cmdline.append(" " + *it);
-        ++it;
-    }
-    QProcess curl;
-    curl.start(prog_cmdline);
-    curl.waitForFinished(-1);
-    if (curl.exitCode()) {
-        QTextStream(stdout) << "Upload failed. Curl Exit code: "
-            << curl.exitCode() << endl;
-        QTextStream(stdout) << curl.readAllStandardOutput();
-        throw NetworkException("Curl returned non-zero exit code "
-                                   + std::to_string(curl.exitCode()));
-        return false;
-    }
-    QTextStream(stdout) << curl.readAllStandardOutput();
-    return (curl.exitCode() == 0);
-}
-
 /*
 -F winnerhash=223737476718d58a4a5b0f317a1eeeb4b38f0c06af5ab65cb9d76d68d9abadb6
 -F loserhash=92c658d7325fe38f0c8adbbb1444ed17afd891b9f208003c272547a7bcb87909
@@ -623,30 +715,13 @@ void Management::uploadResult(const QMap<QString,QString> &r, const QMap<QString
     prog_cmdline.append("-F sgf=@"+ r["file"] + ".sgf.gz");
     prog_cmdline.append("http://zero.sjeng.org/submit-match");
 
-    bool sent = false;
-    for (auto retries = 0; retries < MAX_RETRIES; retries++) {
-        try {
-            sent = sendCurl(prog_cmdline);
-            break;
-        } catch (NetworkException ex) {
-            QTextStream(stdout)
-                << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            auto retry_delay =
-                std::min<int>(
-                    RETRY_DELAY_MIN_SEC * std::pow(1.5, retries),
-                    RETRY_DELAY_MAX_SEC);
-            QTextStream(stdout) << "Retrying in " << retry_delay << " s."
-                                << endl;
-            QThread::sleep(retry_delay);
-        }
-    }
-    if (!sent) {
-        saveCurlCmdLine(prog_cmdline, r["file"]);
+    const auto spoolFile = saveCurlCmdLine(prog_cmdline, r["file"]);
+    if (spoolFile.isEmpty()) {
+        QTextStream(stdout) << "Unable to save the upload of "
+                            << r["file"] << "." << endl;
         return;
     }
-    cleanupFiles(r["file"]);
+    m_uploader.enqueue(spoolFile);
 }
 
 
@@ -675,28 +750,11 @@ void Management::uploadData(const QMap<QString,QString> &r, const QMap<QString,Q
     prog_cmdline.append("-F trainingdata=@" + r["file"] + ".txt.0.gz");
     prog_cmdline.append("http://zero.sjeng.org/submit");
 
-    bool sent = false;
-    for (auto retries = 0; retries < MAX_RETRIES; retries++) {
-        try {
-            sent = sendCurl(prog_cmdline);
-            break;
-        } catch (NetworkException ex) {
-            QTextStream(stdout)
-                << "Network connection to server failed." << endl;
-            QTextStream(stdout)
-                << ex.what() << endl;
-            auto retry_delay =
-                std::min<int>(
-                    RETRY_DELAY_MIN_SEC * std::pow(1.5, retries),
-                    RETRY_DELAY_MAX_SEC);
-            QTextStream(stdout) << "Retrying in " << retry_delay << " s."
-                                << endl;
-            QThread::sleep(retry_delay);
-        }
-    }
-    if (!sent) {
-        saveCurlCmdLine(prog_cmdline, r["file"]);
+    const auto spoolFile = saveCurlCmdLine(prog_cmdline, r["file"]);
+    if (spoolFile.isEmpty()) {
+        QTextStream(stdout) << "Unable to save the upload of "
+                            << r["file"] << "." << endl;
         return;
     }
-    cleanupFiles(r["file"]);
+    m_uploader.enqueue(spoolFile);
 }
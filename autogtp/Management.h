@@ -25,10 +25,21 @@
 #include <QThread>
 #include <QVector>
 #include <chrono>
+#include <memory>
 #include <stdexcept>
+#include "ConcurrencyTuner.h"
+#include "Uploader.h"
 #include "Worker.h"
 
 constexpr int AUTOGTP_VERSION = 13;
+constexpr int RETRY_DELAY_MIN_SEC = 30;
+constexpr int RETRY_DELAY_MAX_SEC = 60 * 60;  // 1 hour
+// Autotune: every configuration is calibrated by playing with it for
+// this long, after leelaz had time to start. Then games are played in
+// windows this long, see ConcurrencyTuner.
+constexpr int CALIBRATION_WARMUP_SEC = 10;
+constexpr int CALIBRATION_SEC = 30;
+constexpr int TUNE_WINDOW_SEC = 30 * 60;
 class Management : public QObject {
     Q_OBJECT
 public:
@@ -38,8 +49,9 @@ public:
                const int ver,
                const QString& keep,
                const QString& debug,
+               const bool autotune,
                QMutex* mutex);
-    ~Management() = default;
+    ~Management();
     void giveAssignments();
     void incMoves() { m_movesMade++; }
 public slots:
@@ -56,7 +68,12 @@ private:
     QMutex* m_mainMutex;
     QMutex m_syncMutex;
     QVector<Worker*> m_gamesThreads;
+    // The GPU of each worker, and how many are playing on each GPU.
+    QVector<int> m_workerGpus;
+    QVector<int> m_activeGames;
+    // Games per GPU, and leelaz threads if not the server's (0).
     int m_games;
+    int m_threads;
     int m_gpus;
     QStringList m_gpusList;
     int m_selfGames;
@@ -68,6 +85,14 @@ private:
     int m_version;
     std::chrono::high_resolution_clock::time_point m_start;
     Order m_fallBack;
+    // The main thread only waits for the workers, so the uploads run
+    // from the event loop of a thread of their own.
+    QThread m_uploadThread;
+    Uploader m_uploader;
+    // With autotune, and where its current window started.
+    std::unique_ptr<ConcurrencyTuner> m_tuner;
+    std::chrono::high_resolution_clock::time_point m_windowStart;
+    int m_windowMoves;
     Order getWorkInternal(bool tuning);
     Order getWork(bool tuning = false);
     QString getOption(const QJsonObject &ob, const QString &key, const QString &opt, const QString &defValue);
@@ -78,11 +103,15 @@ private:
     void fetchNetwork(const QString &name);
     void printTimingInfo(float duration);
     void runTuningProcess(const QString &tuneCmdLine);
+    QString gpuIndex(int gpu) const;
+    void calibrate(Order order);
+    double measure(Order order, const ConcurrencyTuner::Config& config);
+    // These take m_syncMutex from the caller.
+    void startWorker(int gpu);
+    void retune();
     void gzipFile(const QString &fileName);
-    bool sendCurl(const QStringList &lines);
-    void saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name);
+    QString saveCurlCmdLine(const QStringList &prog_cmdline, const QString &name);
     void archiveFiles(const QString &fileName);
-    void cleanupFiles(const QString &fileName);
     void uploadData(const QMap<QString,QString> &r, const QMap<QString,QString> &l);
     void uploadResult(const QMap<QString, QString> &r, const QMap<QString, QString> &l);
 };
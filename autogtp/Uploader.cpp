@@ -0,0 +1,203 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHttpPart>
+#include <QNetworkRequest>
+#include <QTextStream>
+#include <QTimer>
+#include <QUrl>
+#include "Management.h"
+#include "Uploader.h"
+
+Uploader::Uploader(QObject* parent)
+    : QObject(parent),
+    m_network(this),
+    m_reply(nullptr),
+    m_waiting(false),
+    m_failures(0) {
+}
+
+void Uploader::enqueue(const QString& spoolFile) {
+    QMetaObject::invokeMethod(this, "add", Qt::QueuedConnection,
+                              Q_ARG(QString, spoolFile));
+}
+
+void Uploader::add(const QString& spoolFile) {
+    if (spoolFile == m_spoolFile || m_queue.contains(spoolFile)) {
+        return;
+    }
+    m_queue.enqueue(spoolFile);
+    if (m_reply == nullptr && !m_waiting) {
+        sendNext();
+    }
+}
+
+/*
+A spool file holds the game name, the number of curl arguments and
+the arguments, the form fields as pairs of -F and name=value, where
+a value @file is the contents of file, and the URL last:
+-F networkhash=223737476718d58a4a5b0f317a1eeeb4b38f0c06af5ab65cb9d76d68d9abadb6
+-F sgf=@file
+http://zero.sjeng.org/submit
+*/
+
+QHttpMultiPart* Uploader::readSpoolFile(const QString& spoolFile,
+                                        QString& name, QString& url) {
+    QFile file(spoolFile);
+    if (!file.open(QFile::ReadOnly)) {
+        return nullptr;
+    }
+    QTextStream in(&file);
+    QStringList lines;
+    QString tmp;
+    int count;
+    in >> name;
+    in >> count;
+    count = 2 * count - 1;
+    for (int i = 0; i < count; i++) {
+        in >> tmp;
+        lines << tmp;
+    }
+    file.close();
+
+    auto multiPart = new QHttpMultiPart(QHttpMultiPart::FormDataType);
+    for (int i = 0; i < lines.size(); i++) {
+        if (lines[i] != "-F") {
+            url = lines[i];
+            continue;
+        }
+        if (++i == lines.size()) {
+            break;
+        }
+        const auto field = lines[i];
+        const auto key = field.section('=', 0, 0);
+        const auto value = field.section('=', 1);
+        QHttpPart part;
+        if (value.startsWith('@')) {
+            auto data = new QFile(value.mid(1), multiPart);
+            if (!data->open(QFile::ReadOnly)) {
+                QTextStream(stdout) << "Unable to open " << data->fileName()
+                                    << " for upload." << endl;
+                delete multiPart;
+                return nullptr;
+            }
+            part.setHeader(QNetworkRequest::ContentDispositionHeader,
+                           QVariant("form-data; name=\"" + key
+                                    + "\"; filename=\""
+                                    + QFileInfo(*data).fileName() + "\""));
+            part.setHeader(QNetworkRequest::ContentTypeHeader,
+                           QVariant("application/octet-stream"));
+            part.setBodyDevice(data);
+        } else {
+            part.setHeader(QNetworkRequest::ContentDispositionHeader,
+                           QVariant("form-data; name=\"" + key + "\""));
+            part.setBody(value.toUtf8());
+        }
+        multiPart->append(part);
+    }
+    if (url.isEmpty()) {
+        delete multiPart;
+        return nullptr;
+    }
+    return multiPart;
+}
+
+void Uploader::sendNext() {
+    while (!m_queue.isEmpty()) {
+        m_spoolFile = m_queue.dequeue();
+        QString url;
+        auto multiPart = readSpoolFile(m_spoolFile, m_name, url);
+        if (multiPart == nullptr) {
+            // It can never be sent.
+            QTextStream(stdout) << "Dropping upload " << m_spoolFile
+                                << "." << endl;
+            QFile(m_spoolFile).remove();
+            m_spoolFile.clear();
+            continue;
+        }
+        m_reply = m_network.post(QNetworkRequest(QUrl(url)), multiPart);
+        multiPart->setParent(m_reply);
+        connect(m_reply, &QNetworkReply::finished,
+                this, &Uploader::uploadFinished);
+        return;
+    }
+}
+
+void Uploader::uploadFinished() {
+    auto reply = m_reply;
+    m_reply = nullptr;
+    reply->deleteLater();
+
+    // Like curl did, any answer from the server means it is done with
+    // the upload, only a failed connection or the server failing
+    // calls for another try.
+    const auto status =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status >= 200 && status < 500) {
+        QTextStream(stdout) << reply->readAll();
+        if (status >= 400) {
+            QTextStream(stdout) << "Server refused " << m_spoolFile
+                                << ", HTTP status " << status << "." << endl;
+        }
+        done();
+        sendNext();
+        return;
+    }
+
+    QTextStream(stdout) << "Upload failed. " << reply->errorString() << endl;
+    auto retry_delay =
+        std::min<int>(RETRY_DELAY_MIN_SEC * std::pow(1.5, m_failures),
+                      RETRY_DELAY_MAX_SEC);
+    m_failures++;
+    QTextStream(stdout) << "Retrying in " << retry_delay << " s." << endl;
+    // Keep the order of the games.
+    m_queue.prepend(m_spoolFile);
+    m_spoolFile.clear();
+    m_waiting = true;
+    QTimer::singleShot(retry_delay * 1000, this, SLOT(retry()));
+}
+
+void Uploader::retry() {
+    m_waiting = false;
+    sendNext();
+}
+
+void Uploader::done() {
+    QTextStream(stdout) << "File: " << m_spoolFile << " sent" << endl;
+    QFile(m_spoolFile).remove();
+    cleanupFiles(m_name);
+    m_spoolFile.clear();
+    m_failures = 0;
+}
+
+void Uploader::cleanupFiles(const QString &fileName) {
+    QDir dir;
+    QStringList filters;
+    filters << fileName + ".*";
+    dir.setNameFilters(filters);
+    dir.setFilter(QDir::Files | QDir::NoSymLinks);
+    QFileInfoList list = dir.entryInfoList();
+    for (int i = 0; i < list.size(); ++i) {
+        QFile(list.at(i).fileName()).remove();
+    }
+}
@@ -0,0 +1,69 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include <QHttpMultiPart>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QObject>
+#include <QQueue>
+#include <QString>
+
+/*
+    Sends the finished games to the server from the event loop of the
+    thread it lives in, so a worker goes on with its next game right
+    away. Every upload is spooled to disk first, as the curl_save*.bin
+    file Management::saveCurlCmdLine writes, and only deleted once the
+    server has it, so nothing is lost when the link goes down or
+    autogtp stops. The spooled uploads go out one after the other over
+    the same kept alive connection, a failed one is retried with a
+    growing delay.
+*/
+class Uploader : public QObject {
+    Q_OBJECT
+public:
+    explicit Uploader(QObject* parent = nullptr);
+    ~Uploader() = default;
+    // Can be called from any thread.
+    void enqueue(const QString& spoolFile);
+
+private slots:
+    void add(const QString& spoolFile);
+    void sendNext();
+    void uploadFinished();
+    void retry();
+
+private:
+    QHttpMultiPart* readSpoolFile(const QString& spoolFile, QString& name,
+                                  QString& url);
+    void done();
+    static void cleanupFiles(const QString& fileName);
+
+    QNetworkAccessManager m_network;
+    QQueue<QString> m_queue;
+    QNetworkReply* m_reply;
+    // The spool file being sent, and the game its files belong to.
+    QString m_spoolFile;
+    QString m_name;
+    bool m_waiting;
+    int m_failures;
+};
+
+#endif
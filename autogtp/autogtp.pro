@@ -10,6 +10,7 @@ equals(QT_MAJOR_VERSION, $$QT_REQ_MAJOR_VERSION):lessThan(QT_MINOR_VERSION, $$QT
 }
 
 QT  -= gui
+QT  += network
 
 TARGET = autogtp
 CONFIG   += c++14
@@ -23,7 +24,9 @@ SOURCES += main.cpp \
     Game.cpp \
     Worker.cpp \
     Job.cpp \
-    Management.cpp
+    Management.cpp \
+    Uploader.cpp \
+    ConcurrencyTuner.cpp
 
 HEADERS += \
     Game.h \
@@ -31,4 +34,6 @@ HEADERS += \
     Job.h \
     Order.h \
     Result.h \
-    Management.h
+    Management.h \
+    Uploader.h \
+    ConcurrencyTuner.h
@@ -55,6 +55,11 @@ int main(int argc, char *argv[]) {
         {"u", "gpus"},
               "Index of the GPU to use for multiple GPUs support.",
               "num");
+    QCommandLineOption autotuneOption(
+        {"a", "autotune"},
+              "Pick the games per GPU and the leelaz threads that play "
+              "the most moves/sec on this host, instead of 'gamesNum' and "
+              "the threads the server asks for.");
     QCommandLineOption keepSgfOption(
         {"k", "keepSgf" },
               "Save SGF files after each self-play game.",
@@ -65,6 +70,7 @@ int main(int argc, char *argv[]) {
 
     parser.addOption(gamesNumOption);
     parser.addOption(gpusOption);
+    parser.addOption(autotuneOption);
     parser.addOption(keepSgfOption);
     parser.addOption(keepDebugOption);
 
@@ -110,7 +116,12 @@ int main(int argc, char *argv[]) {
     }
 #endif
     cerr << "AutoGTP v" << AUTOGTP_VERSION << endl;
-    cerr << "Using " << gamesNum << " thread(s) for GPU(s)." << endl;
+    if (parser.isSet(autotuneOption)) {
+        cerr << "Picking the number of threads for GPU(s) at startup."
+             << endl;
+    } else {
+        cerr << "Using " << gamesNum << " thread(s) for GPU(s)." << endl;
+    }
     if (parser.isSet(keepSgfOption)) {
         if (!QDir().mkpath(parser.value(keepSgfOption))) {
             cerr << "Couldn't create output directory for self-play SGF files!"
@@ -128,7 +139,7 @@ int main(int argc, char *argv[]) {
     QMutex mutex;
     Management boss(gpusNum, gamesNum, gpusList, AUTOGTP_VERSION,
                     parser.value(keepSgfOption), parser.value(keepDebugOption),
-                    &mutex);
+                    parser.isSet(autotuneOption), &mutex);
     boss.giveAssignments();
     mutex.lock();
     cerr.flush();
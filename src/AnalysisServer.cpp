@@ -0,0 +1,234 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "AnalysisServer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <exception>
+#include <istream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/format.hpp>
+
+#include "FastBoard.h"
+#include "GameState.h"
+#include "GTP.h"
+#include "Numa.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+using boost::asio::ip::tcp;
+
+constexpr int AnalysisServer::SLICE_PLAYOUTS;
+
+namespace {
+
+// FastBoard::BLACK or FastBoard::WHITE, -1 if color is neither.
+int parse_color(const std::string& color) {
+    if (color == "w" || color == "white") {
+        return FastBoard::WHITE;
+    } else if (color == "b" || color == "black") {
+        return FastBoard::BLACK;
+    }
+    return -1;
+}
+
+std::string handle_command(AnalysisServer& server, GameState& game,
+                           std::unique_ptr<UCTSearch>& search,
+                           std::string command) {
+    // Like GTP::execute, so play_textmove understands the vertices.
+    std::transform(begin(command), end(command), begin(command),
+                   [](unsigned char c) { return std::tolower(c); });
+    std::istringstream cmdstream(command);
+    std::string cmd;
+    cmdstream >> cmd;
+
+    if (cmd == "clear_board") {
+        game.reset_game();
+        search.reset();
+        search = std::make_unique<UCTSearch>();
+        return "=";
+    } else if (cmd == "komi") {
+        float komi;
+        cmdstream >> komi;
+        if (cmdstream.fail()) {
+            return "? syntax not understood";
+        }
+        game.set_komi(komi);
+        return "=";
+    } else if (cmd == "play") {
+        std::string color, vertex;
+        cmdstream >> color >> vertex;
+        if (cmdstream.fail()) {
+            return "? syntax not understood";
+        }
+        if (vertex == "pass") {
+            const auto who = parse_color(color);
+            if (who < 0) {
+                return "? syntax not understood";
+            }
+            game.set_to_move(who);
+            game.play_pass();
+        } else if (!game.play_textmove(color, vertex)) {
+            return "? illegal move";
+        }
+        return "=";
+    } else if (cmd == "analyze") {
+        int playouts;
+        cmdstream >> playouts;
+        if (cmdstream.fail() || playouts < 1) {
+            return "? syntax not understood";
+        }
+        playouts = std::min(playouts, cfg_max_playouts);
+        search->start_search(game);
+        server.search(*search, playouts);
+        return "= " + search->get_analysis();
+    } else if (cmd == "genmove") {
+        std::string color;
+        int playouts;
+        cmdstream >> color >> playouts;
+        const auto who = parse_color(color);
+        if (cmdstream.fail() || who < 0 || playouts < 1) {
+            return "? syntax not understood";
+        }
+        playouts = std::min(playouts, cfg_max_playouts);
+        game.set_to_move(who);
+        search->start_search(game);
+        server.search(*search, playouts);
+        const auto move = search->finish_search();
+        game.play_move(move);
+        return "= " + game.move_to_text(move);
+    } else if (cmd == "final_score") {
+        const auto score = game.final_score();
+        if (score < -0.1f) {
+            return "= W+" + str(boost::format("%.1f") % -score);
+        } else if (score > 0.1f) {
+            return "= B+" + str(boost::format("%.1f") % score);
+        }
+        return "= 0";
+    }
+    return "? unknown command";
+}
+
+void serve_session(AnalysisServer& server,
+                   std::shared_ptr<tcp::socket> socket) {
+    if (cfg_numa) {
+        Numa::bind_next_thread();
+    }
+    const auto client = socket->remote_endpoint().address().to_string();
+    myprintf("Analysis session from %s started.\n", client.c_str());
+    try {
+        auto game = GameState{};
+        game.init_game(BOARD_SIZE, 7.5f);
+        auto search = std::make_unique<UCTSearch>();
+
+        boost::asio::streambuf buffer;
+        std::istream input(&buffer);
+        for (;;) {
+            boost::asio::read_until(*socket, buffer, '\n');
+            auto command = std::string{};
+            std::getline(input, command);
+            if (!command.empty() && command.back() == '\r') {
+                command.pop_back();
+            }
+            if (command.empty()) {
+                continue;
+            }
+            if (command == "quit") {
+                boost::asio::write(*socket, boost::asio::buffer("=\n\n", 3));
+                break;
+            }
+            const auto reply = handle_command(server, game, search, command)
+                             + "\n\n";
+            boost::asio::write(*socket, boost::asio::buffer(reply));
+        }
+    } catch (const std::exception& e) {
+        myprintf("Analysis session from %s failed: %s\n",
+                 client.c_str(), e.what());
+        return;
+    }
+    myprintf("Analysis session from %s ended.\n", client.c_str());
+}
+
+}
+
+AnalysisServer::AnalysisServer(int threads) {
+    for (auto i = 0; i < threads; i++) {
+        m_threads.emplace_back(&AnalysisServer::worker, this);
+    }
+}
+
+void AnalysisServer::search(UCTSearch& search, int playouts) {
+    auto job = Job{search, playouts, 0, false};
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobs.push_back(&job);
+    m_work_cv.notify_all();
+    m_done_cv.wait(lock, [&job]() { return job.done; });
+}
+
+void AnalysisServer::worker() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_work_cv.wait(lock, [this]() { return !m_jobs.empty(); });
+        // Take a slice from the job at the front and send it to the
+        // back of the line.
+        auto job = m_jobs.front();
+        m_jobs.pop_front();
+        const auto slice = std::min(job->remaining, SLICE_PLAYOUTS);
+        job->remaining -= slice;
+        job->running++;
+        if (job->remaining > 0) {
+            m_jobs.push_back(job);
+        }
+        lock.unlock();
+
+        job->search.run_playouts(slice);
+
+        lock.lock();
+        job->running--;
+        if (job->remaining == 0 && job->running == 0) {
+            job->done = true;
+            m_done_cv.notify_all();
+        }
+    }
+}
+
+void AnalysisServer::serve(unsigned short port) {
+    // Like the network, the search threads are shared by all sessions.
+    AnalysisServer server(cfg_num_threads);
+    try {
+        boost::asio::io_service io;
+        tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+        myprintf("Serving analysis sessions on port %d.\n", int(port));
+        for (;;) {
+            auto socket = std::make_shared<tcp::socket>(io);
+            acceptor.accept(*socket);
+            std::thread(serve_session, std::ref(server), socket).detach();
+        }
+    } catch (const std::exception& e) {
+        myprintf("Analysis server failed: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+}
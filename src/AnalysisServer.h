@@ -0,0 +1,85 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ANALYSISSERVER_H_INCLUDED
+#define ANALYSISSERVER_H_INCLUDED
+
+#include "config.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class UCTSearch;
+
+/*
+    Analyzes positions for many clients at once. Every TCP connection is
+    a session with its own game and search tree, but all of them share
+    the network, its NNCache and the transposition table. The search
+    threads take turns between the sessions that have work, a slice of
+    playouts at a time, so the network sees batches made up from many
+    small searches and no session can starve the others.
+
+    The protocol is line based and answers like GTP, "= ..." or "? ...",
+    followed by an empty line:
+      clear_board
+      komi <komi>
+      play <color> <vertex>
+      analyze <playouts>   lz-analyze info line after the search
+      genmove <color> <playouts>
+                           searches and plays the move, like GTP genmove
+      final_score
+      quit
+    analyze and genmove search at most --playouts playouts, if that is
+    given.
+*/
+class AnalysisServer {
+public:
+    // Serves until killed.
+    static void serve(unsigned short port);
+
+    // Runs playouts of search, sharing the threads fairly with the
+    // other sessions. Returns when all of them are done.
+    void search(UCTSearch& search, int playouts);
+
+private:
+    // Playouts a thread runs for a session before moving on.
+    static constexpr auto SLICE_PLAYOUTS = 32;
+
+    struct Job {
+        UCTSearch& search;
+        // Playouts not handed out yet, and slices still running.
+        int remaining;
+        int running;
+        bool done;
+    };
+
+    explicit AnalysisServer(int threads);
+    void worker();
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    // Jobs with playouts left, served round robin.
+    std::deque<Job*> m_jobs;
+    std::vector<std::thread> m_threads;
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Book.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+#include "Zobrist.h"
+
+using namespace Utils;
+
+constexpr std::uint16_t Book::NO_MOVE;
+
+static constexpr std::array<char, 8> MAGIC = {
+    {'L', 'Z', 'B', 'O', 'O', 'K', '0', '1'}
+};
+static constexpr auto PASS_INDEX = NUM_INTERSECTIONS;
+
+Book& Book::get_Book() {
+    static Book book;
+    return book;
+}
+
+bool Book::load(const std::string& filename) {
+    auto file = std::make_unique<MappedFile>(filename);
+    if (file->data() == nullptr) {
+        myprintf("Could not read opening book %s.\n", filename.c_str());
+        return false;
+    }
+    const auto header = reinterpret_cast<const Header*>(file->data());
+    if (file->size() < sizeof(Header)
+        || header->magic != MAGIC || header->version != VERSION) {
+        myprintf("%s is not an opening book.\n", filename.c_str());
+        return false;
+    }
+    if (header->board_size != BOARD_SIZE
+        || file->size() != sizeof(Header) + header->count * sizeof(Entry)) {
+        myprintf("Opening book %s is for another board size.\n",
+                 filename.c_str());
+        return false;
+    }
+    m_entries = reinterpret_cast<const Entry*>(file->data() + sizeof(Header));
+    m_count = header->count;
+    m_komi = header->komi;
+    m_file = std::move(file);
+    myprintf("Opening book %s: %zu positions, komi %.1f.\n",
+             filename.c_str(), m_count, m_komi);
+    return true;
+}
+
+int Book::transform_index(const int index, const int symmetry) {
+    if (index == PASS_INDEX) {
+        return index;
+    }
+    auto x = index % BOARD_SIZE;
+    auto y = index / BOARD_SIZE;
+    if (symmetry & 4) {
+        std::swap(x, y);
+    }
+    if (symmetry & 2) {
+        x = BOARD_SIZE - 1 - x;
+    }
+    if (symmetry & 1) {
+        y = BOARD_SIZE - 1 - y;
+    }
+    return y * BOARD_SIZE + x;
+}
+
+int Book::vertex_to_index(const FastBoard& board, const int vertex) {
+    if (vertex == FastBoard::PASS) {
+        return PASS_INDEX;
+    }
+    const auto xy = board.get_xy(vertex);
+    return xy.second * BOARD_SIZE + xy.first;
+}
+
+int Book::index_to_vertex(const FastBoard& board, const int index) {
+    if (index == PASS_INDEX) {
+        return FastBoard::PASS;
+    }
+    return board.get_vertex(index % BOARD_SIZE, index / BOARD_SIZE);
+}
+
+std::uint64_t Book::canonical_key(const GameState& state, int& symmetry) {
+    const auto& board = state.board;
+    auto keys = std::array<std::uint64_t, 8>{};
+    keys.fill(state.get_to_move() == FastBoard::BLACK
+              ? Zobrist::zobrist_blacktomove : 0);
+    for (auto index = 0; index < NUM_INTERSECTIONS; index++) {
+        const auto color = board.get_square(index_to_vertex(board, index));
+        if (color != FastBoard::BLACK && color != FastBoard::WHITE) {
+            continue;
+        }
+        for (auto s = 0; s < 8; s++) {
+            const auto vertex =
+                index_to_vertex(board, transform_index(index, s));
+            keys[s] ^= Zobrist::zobrist[color][vertex];
+        }
+    }
+    const auto smallest = std::min_element(begin(keys), end(keys));
+    symmetry = static_cast<int>(smallest - begin(keys));
+    return *smallest;
+}
+
+std::vector<Book::Move> Book::lookup(const GameState& state) const {
+    auto moves = std::vector<Move>{};
+    // The stones and the side to move are all the key knows about, so
+    // stay out of positions where ko or passes change what is legal.
+    if (m_count == 0 || state.get_komi() != m_komi
+        || state.board.get_boardsize() != BOARD_SIZE
+        || state.get_passes() != 0 || state.m_komove != 0) {
+        return moves;
+    }
+    auto symmetry = 0;
+    const auto key = canonical_key(state, symmetry);
+    const auto end = m_entries + m_count;
+    const auto entry = std::lower_bound(m_entries, end, key,
+        [](const Entry& e, std::uint64_t k) { return e.key < k; });
+    if (entry == end || entry->key != key) {
+        return moves;
+    }
+    // Turn the moves back into the orientation of state.
+    auto inverse = std::array<int, NUM_INTERSECTIONS + 1>{};
+    for (auto index = 0; index <= NUM_INTERSECTIONS; index++) {
+        inverse[transform_index(index, symmetry)] = index;
+    }
+    for (auto i = 0; i < MAX_MOVES && entry->moves[i] != NO_MOVE; i++) {
+        const auto vertex = index_to_vertex(state.board,
+                                            inverse[entry->moves[i]]);
+        moves.push_back({vertex, static_cast<int>(entry->move_visits[i]),
+                         entry->move_winrates[i]});
+    }
+    return moves;
+}
+
+bool Book::generate(const std::string& filename, const GameState& state,
+                    const int depth, const int width, const int playouts) {
+    auto entries = std::map<std::uint64_t, Entry>{};
+    auto game = state;
+
+    // Depth first, one search at a time with all the threads.
+    std::function<void(int)> expand = [&](const int moves_left) {
+        auto symmetry = 0;
+        const auto key = canonical_key(game, symmetry);
+        if (entries.count(key)) {
+            return;
+        }
+        auto search = std::make_unique<UCTSearch>();
+        search->start_search(game);
+        {
+            ThreadGroup tg(thread_pool);
+            for (auto i = 0; i < cfg_num_threads; i++) {
+                tg.add_task([&search, playouts]() {
+                    search->run_playouts(playouts / cfg_num_threads);
+                });
+            }
+            tg.wait_all();
+        }
+        const auto root_moves = search->get_root_moves();
+        if (root_moves.empty()) {
+            return;
+        }
+
+        auto& entry = entries[key];
+        entry.key = key;
+        entry.visits = 0;
+        entry.winrate = 0.0f;
+        entry.moves.fill(NO_MOVE);
+        entry.move_visits.fill(0);
+        entry.move_winrates.fill(0.0f);
+        for (auto i = size_t{0}; i < root_moves.size() && i < MAX_MOVES; i++) {
+            const auto& move = root_moves[i];
+            entry.moves[i] = static_cast<std::uint16_t>(transform_index(
+                vertex_to_index(game.board, move.vertex), symmetry));
+            entry.move_visits[i] = move.visits;
+            entry.move_winrates[i] = move.winrate;
+        }
+        for (const auto& move : root_moves) {
+            entry.visits += move.visits;
+            entry.winrate += move.visits * move.winrate;
+        }
+        entry.winrate /= entry.visits;
+        myprintf("Book: %zu positions, move %d: %s %s, %d visits.\n",
+                 entries.size(), static_cast<int>(game.get_movenum()) + 1,
+                 game.get_to_move() == FastBoard::BLACK ? "B" : "W",
+                 game.move_to_text(root_moves[0].vertex).c_str(),
+                 static_cast<int>(entry.visits));
+
+        if (moves_left <= 1) {
+            return;
+        }
+        for (auto i = 0; i < width && i < int(root_moves.size()); i++) {
+            const auto vertex = root_moves[i].vertex;
+            if (vertex == FastBoard::PASS) {
+                continue;
+            }
+            game.play_move(vertex);
+            expand(moves_left - 1);
+            game.undo_move();
+        }
+    };
+    expand(depth);
+
+    auto file = std::ofstream{filename, std::ios::binary};
+    auto header = Header{};
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.board_size = BOARD_SIZE;
+    header.komi = state.get_komi();
+    header.padding = 0;
+    header.count = entries.size();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    // std::map keeps them sorted by key.
+    for (const auto& entry : entries) {
+        file.write(reinterpret_cast<const char*>(&entry.second),
+                   sizeof(entry.second));
+    }
+    return bool(file);
+}
@@ -0,0 +1,103 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BOOK_H_INCLUDED
+#define BOOK_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class FastBoard;
+class GameState;
+class MappedFile;
+
+/*
+    An opening book made of deep searches. Every entry is the root of
+    one search: the visits and winrates of its most visited moves.
+
+    Positions are stored under the smallest of the keys of their 8
+    symmetries, with the moves turned the same way, so a line searched
+    in one corner answers for all of them. The file is an array of
+    entries sorted by key, mapped into memory and binary searched.
+*/
+class Book {
+public:
+    struct Move {
+        int vertex;
+        int visits;
+        float winrate;  // for the side to move
+    };
+    // Moves kept per position.
+    static constexpr auto MAX_MOVES = 8;
+
+    static Book& get_Book();
+    bool load(const std::string& filename);
+    // The moves of the book for state, most visited first. Empty if
+    // the position is not in the book.
+    std::vector<Move> lookup(const GameState& state) const;
+
+    // Searches every position reached by following the width most
+    // visited moves for depth moves from state, with playouts each,
+    // and writes them to filename as a book.
+    static bool generate(const std::string& filename, const GameState& state,
+                         int depth, int width, int playouts);
+
+private:
+    static constexpr auto VERSION = 1;
+    static constexpr std::uint16_t NO_MOVE = 0xffff;
+
+    struct Header {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t board_size;
+        float komi;
+        std::uint32_t padding;
+        std::uint64_t count;
+    };
+    struct Entry {
+        std::uint64_t key;
+        std::uint32_t visits;
+        float winrate;
+        // As NNCache policy indices, in the orientation of the key.
+        std::array<std::uint16_t, MAX_MOVES> moves;
+        std::array<std::uint32_t, MAX_MOVES> move_visits;
+        std::array<float, MAX_MOVES> move_winrates;
+    };
+
+    Book() = default;
+    // Key of the stones and the side to move under their symmetry with
+    // the smallest key, and that symmetry.
+    static std::uint64_t canonical_key(const GameState& state,
+                                       int& symmetry);
+    static int transform_index(int index, int symmetry);
+    static int vertex_to_index(const FastBoard& board, int vertex);
+    static int index_to_vertex(const FastBoard& board, int index);
+
+    std::unique_ptr<MappedFile> m_file;
+    const Entry* m_entries{nullptr};
+    size_t m_count{0};
+    float m_komi{0.0f};
+};
+
+#endif
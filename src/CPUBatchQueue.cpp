@@ -0,0 +1,88 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "config.h"
+#include "CPUBatchQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "Trace.h"
+
+constexpr int CPUBatchQueue::BATCH_TIMEOUT_US;
+
+CPUBatchQueue::CPUBatchQueue(size_t batch_size, ForwardFunc forward)
+    : m_batch_size(batch_size), m_forward(std::move(forward)) {
+}
+
+void CPUBatchQueue::forward(const std::vector<float>& input,
+                            std::vector<float>& output) {
+    TraceScope trace("batch_wait", "search");
+    auto entry = Entry{input, output, false};
+    const auto deadline = std::chrono::steady_clock::now()
+                        + std::chrono::microseconds(BATCH_TIMEOUT_US);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queue.push_back(&entry);
+    while (!entry.ready) {
+        const auto timed_out = std::chrono::steady_clock::now() >= deadline;
+        if (m_queue.size() >= m_batch_size
+            || (timed_out && !m_queue.empty())) {
+            run_batch(lock);
+        } else if (timed_out) {
+            // Someone else is running our batch.
+            m_cv.wait(lock);
+        } else {
+            m_cv.wait_until(lock, deadline);
+        }
+    }
+}
+
+void CPUBatchQueue::run_batch(std::unique_lock<std::mutex>& lock) {
+    const auto count = std::min(m_queue.size(), m_batch_size);
+    auto batch = std::vector<Entry*>(begin(m_queue), begin(m_queue) + count);
+    m_queue.erase(begin(m_queue), begin(m_queue) + count);
+    lock.unlock();
+
+    const auto in_size = batch.front()->in.size();
+    const auto out_size = batch.front()->out.size();
+    auto batch_input = std::vector<float>(in_size * count);
+    auto batch_output = std::vector<float>(out_size * count);
+    for (auto i = size_t{0}; i < count; i++) {
+        std::copy(begin(batch[i]->in), end(batch[i]->in),
+                  begin(batch_input) + in_size * i);
+    }
+
+    {
+        TraceScope trace("cpu_batch", "batch", count);
+        m_forward(batch_input, batch_output, count);
+    }
+
+    for (auto i = size_t{0}; i < count; i++) {
+        const auto out_begin = begin(batch_output) + out_size * i;
+        std::copy(out_begin, out_begin + out_size, begin(batch[i]->out));
+    }
+
+    lock.lock();
+    for (auto entry : batch) {
+        entry->ready = true;
+    }
+    m_cv.notify_all();
+}
@@ -0,0 +1,71 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CPUBATCHQUEUE_H_INCLUDED
+#define CPUBATCHQUEUE_H_INCLUDED
+
+#include "config.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+    Collects positions from the search threads so the CPU backend can
+    evaluate several of them in one forward pass. There are no worker
+    threads: the search thread that fills up a batch (or whose wait for
+    one times out) runs it for everyone in it, and the others sleep until
+    their result is ready.
+*/
+class CPUBatchQueue {
+public:
+    using ForwardFunc = std::function<void(const std::vector<float>& input,
+                                           std::vector<float>& output,
+                                           size_t batch_size)>;
+
+    CPUBatchQueue(size_t batch_size, ForwardFunc forward);
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output);
+
+private:
+    struct Entry {
+        const std::vector<float>& in;
+        std::vector<float>& out;
+        bool ready;
+    };
+
+    // How long to wait for a batch to fill up before running whatever
+    // is queued.
+    static constexpr auto BATCH_TIMEOUT_US = 1000;
+
+    // Runs the oldest entries. Called and returns with the lock held.
+    void run_batch(std::unique_lock<std::mutex>& lock);
+
+    const size_t m_batch_size;
+    const ForwardFunc m_forward;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Entry*> m_queue;
+};
+
+#endif
@@ -0,0 +1,355 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef USE_CUDNN
+#include "CuDNN.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+#include "Utils.h"
+
+using namespace Utils;
+
+static void check(const cudaError_t status, const char* what) {
+    if (status != cudaSuccess) {
+        myprintf("CUDA error in %s: %s\n", what, cudaGetErrorString(status));
+        throw std::runtime_error("CUDA error");
+    }
+}
+
+static void check(const cudnnStatus_t status, const char* what) {
+    if (status != CUDNN_STATUS_SUCCESS) {
+        myprintf("cuDNN error in %s: %s\n", what, cudnnGetErrorString(status));
+        throw std::runtime_error("cuDNN error");
+    }
+}
+
+#ifdef USE_HALF
+static const auto DATA_TYPE = CUDNN_DATA_HALF;
+// Tensor cores if the device has them.
+static const auto MATH_TYPE = CUDNN_TENSOR_OP_MATH;
+
+static cudnn_net_t to_cudnn_net_t(const float x) {
+    return __float2half(x);
+}
+
+static float from_cudnn_net_t(const cudnn_net_t x) {
+    return __half2float(x);
+}
+#else
+static const auto DATA_TYPE = CUDNN_DATA_FLOAT;
+static const auto MATH_TYPE = CUDNN_DEFAULT_MATH;
+
+static cudnn_net_t to_cudnn_net_t(const float x) {
+    return x;
+}
+
+static float from_cudnn_net_t(const cudnn_net_t x) {
+    return x;
+}
+#endif
+
+CuDNN_Network::CuDNN_Network(const int gpu, const size_t max_batch_size)
+    : m_gpu(gpu), m_max_batch_size(max_batch_size) {
+    check(cudaSetDevice(m_gpu), "cudaSetDevice");
+    check(cudaStreamCreate(&m_stream), "cudaStreamCreate");
+    check(cudnnCreate(&m_handle), "cudnnCreate");
+    check(cudnnSetStream(m_handle, m_stream), "cudnnSetStream");
+    check(cudnnCreateTensorDescriptor(&m_in_desc),
+          "cudnnCreateTensorDescriptor");
+    check(cudnnCreateTensorDescriptor(&m_out_desc),
+          "cudnnCreateTensorDescriptor");
+
+    // 3x3 with a padding of 1, accumulating in float even for fp16.
+    check(cudnnCreateConvolutionDescriptor(&m_conv_desc),
+          "cudnnCreateConvolutionDescriptor");
+    check(cudnnSetConvolution2dDescriptor(m_conv_desc, 1, 1, 1, 1, 1, 1,
+                                          CUDNN_CROSS_CORRELATION,
+                                          CUDNN_DATA_FLOAT),
+          "cudnnSetConvolution2dDescriptor");
+
+    check(cudnnCreateActivationDescriptor(&m_relu_desc),
+          "cudnnCreateActivationDescriptor");
+    check(cudnnSetActivationDescriptor(m_relu_desc, CUDNN_ACTIVATION_RELU,
+                                       CUDNN_NOT_PROPAGATE_NAN, 0.0),
+          "cudnnSetActivationDescriptor");
+}
+
+CuDNN_Network::~CuDNN_Network() {
+    // Nothing to be done about errors here.
+    cudaSetDevice(m_gpu);
+    for (auto& layer : m_layers) {
+        cudaFree(layer.weights);
+        cudaFree(layer.biases);
+        cudnnDestroyFilterDescriptor(layer.filter_desc);
+        cudnnDestroyTensorDescriptor(layer.bias_desc);
+    }
+    for (auto buffer : m_buffers) {
+        cudaFree(buffer);
+    }
+    cudaFree(m_workspace);
+    cudaFreeHost(m_pinned);
+    cudnnDestroyActivationDescriptor(m_relu_desc);
+    cudnnDestroyConvolutionDescriptor(m_conv_desc);
+    cudnnDestroyTensorDescriptor(m_out_desc);
+    cudnnDestroyTensorDescriptor(m_in_desc);
+    cudnnDestroy(m_handle);
+    cudaStreamDestroy(m_stream);
+}
+
+void CuDNN_Network::push_convolve(const unsigned int filter_size,
+                                  const unsigned int channels,
+                                  const unsigned int outputs,
+                                  const std::vector<float>& weights) {
+    assert(filter_size == 3);
+    (void)filter_size;
+    assert(weights.size() == size_t{outputs} * channels * 9);
+
+    auto layer = ConvLayer{};
+    layer.channels = channels;
+    layer.outputs = outputs;
+    layer.host_weights = weights;
+    layer.host_biases.assign(outputs, 0.0f);
+    m_layers.emplace_back(std::move(layer));
+    upload(m_layers.back());
+}
+
+void CuDNN_Network::push_batchnorm(const unsigned int spatial_size,
+                                   const std::vector<float>& means,
+                                   const std::vector<float>& stddivs) {
+    // Only the batchnorm after the input convolution comes on its own.
+    assert(spatial_size == NUM_INTERSECTIONS);
+    (void)spatial_size;
+    assert(!m_layers.empty() && !m_layers.back().relu);
+    fold_batchnorm(m_layers.back(), means, stddivs);
+    upload(m_layers.back());
+}
+
+void CuDNN_Network::push_residual(const unsigned int filter_size,
+                                  const unsigned int channels,
+                                  const unsigned int outputs,
+                                  const std::vector<float>& weights_1,
+                                  const std::vector<float>& means_1,
+                                  const std::vector<float>& stddivs_1,
+                                  const std::vector<float>& weights_2,
+                                  const std::vector<float>& means_2,
+                                  const std::vector<float>& stddivs_2) {
+    assert(channels == outputs);
+    push_convolve(filter_size, channels, outputs, weights_1);
+    m_layers.back().starts_block = true;
+    push_batchnorm(NUM_INTERSECTIONS, means_1, stddivs_1);
+    push_convolve(filter_size, outputs, outputs, weights_2);
+    m_layers.back().adds_residual = true;
+    push_batchnorm(NUM_INTERSECTIONS, means_2, stddivs_2);
+}
+
+void CuDNN_Network::fold_batchnorm(ConvLayer& layer,
+                                   const std::vector<float>& means,
+                                   const std::vector<float>& stddivs) {
+    // stddiv * (conv(x) + bias - mean) is a convolution with scaled
+    // filters and a new bias.
+    const auto filter_size = size_t{9} * layer.channels;
+    for (auto o = 0; o < layer.outputs; o++) {
+        const auto begin_o = begin(layer.host_weights) + o * filter_size;
+        std::transform(begin_o, begin_o + filter_size, begin_o,
+                       [&](float w) { return w * stddivs[o]; });
+        layer.host_biases[o] = stddivs[o] * (layer.host_biases[o] - means[o]);
+    }
+    layer.relu = true;
+}
+
+void CuDNN_Network::upload(ConvLayer& layer) {
+    check(cudaSetDevice(m_gpu), "cudaSetDevice");
+    if (!layer.filter_desc) {
+        check(cudnnCreateFilterDescriptor(&layer.filter_desc),
+              "cudnnCreateFilterDescriptor");
+        check(cudnnSetFilter4dDescriptor(layer.filter_desc, DATA_TYPE,
+                                         CUDNN_TENSOR_NCHW,
+                                         layer.outputs, layer.channels, 3, 3),
+              "cudnnSetFilter4dDescriptor");
+        check(cudnnCreateTensorDescriptor(&layer.bias_desc),
+              "cudnnCreateTensorDescriptor");
+        check(cudnnSetTensor4dDescriptor(layer.bias_desc, CUDNN_TENSOR_NCHW,
+                                         DATA_TYPE, 1, layer.outputs, 1, 1),
+              "cudnnSetTensor4dDescriptor");
+        check(cudaMalloc(&layer.weights,
+                         layer.host_weights.size() * sizeof(cudnn_net_t)),
+              "cudaMalloc");
+        check(cudaMalloc(&layer.biases,
+                         layer.host_biases.size() * sizeof(cudnn_net_t)),
+              "cudaMalloc");
+    }
+
+    auto copy = [](const std::vector<float>& host, cudnn_net_t* device) {
+        auto converted = std::vector<cudnn_net_t>(host.size());
+        std::transform(begin(host), end(host), begin(converted),
+                       to_cudnn_net_t);
+        check(cudaMemcpy(device, converted.data(),
+                         converted.size() * sizeof(cudnn_net_t),
+                         cudaMemcpyHostToDevice),
+              "cudaMemcpy");
+    };
+    copy(layer.host_weights, layer.weights);
+    copy(layer.host_biases, layer.biases);
+}
+
+const CuDNN_Network::Algorithm& CuDNN_Network::get_algorithm(
+    const ConvLayer& layer, const size_t batch_size) {
+    const auto key = std::make_tuple(layer.channels, layer.outputs,
+                                     batch_size);
+    auto it = m_algorithms.find(key);
+    if (it == end(m_algorithms)) {
+        check(cudnnSetConvolutionMathType(m_conv_desc, MATH_TYPE),
+              "cudnnSetConvolutionMathType");
+        auto results = std::array<cudnnConvolutionFwdAlgoPerf_t,
+                                  CUDNN_CONVOLUTION_FWD_ALGO_COUNT>{};
+        auto returned = 0;
+        check(cudnnFindConvolutionForwardAlgorithm(
+                  m_handle, m_in_desc, layer.filter_desc, m_conv_desc,
+                  m_out_desc, int(results.size()), &returned, results.data()),
+              "cudnnFindConvolutionForwardAlgorithm");
+        // Sorted by time, fastest first.
+        const auto best = std::find_if(
+            begin(results), begin(results) + returned,
+            [](const cudnnConvolutionFwdAlgoPerf_t& result) {
+                return result.status == CUDNN_STATUS_SUCCESS;
+            });
+        if (best == begin(results) + returned) {
+            check(CUDNN_STATUS_NOT_SUPPORTED,
+                  "cudnnFindConvolutionForwardAlgorithm");
+        }
+        it = m_algorithms.emplace(key,
+                                  Algorithm{best->algo, best->mathType}).first;
+
+        if (best->memory > m_workspace_size) {
+            check(cudaFree(m_workspace), "cudaFree");
+            m_workspace = nullptr;
+            check(cudaMalloc(&m_workspace, best->memory), "cudaMalloc");
+            m_workspace_size = best->memory;
+        }
+    }
+    return it->second;
+}
+
+void CuDNN_Network::allocate_buffers() {
+    auto max_channels = 0;
+    for (const auto& layer : m_layers) {
+        max_channels = std::max({max_channels, layer.channels, layer.outputs});
+    }
+    m_buffer_elements = m_max_batch_size * max_channels * NUM_INTERSECTIONS;
+    const auto bytes = m_buffer_elements * sizeof(cudnn_net_t);
+    m_buffers.resize(3);
+    for (auto& buffer : m_buffers) {
+        check(cudaMalloc(&buffer, bytes), "cudaMalloc");
+    }
+    check(cudaMallocHost(&m_pinned, bytes), "cudaMallocHost");
+}
+
+void CuDNN_Network::forward(const std::vector<float>& input,
+                            std::vector<float>& output,
+                            const size_t batch_size) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    assert(batch_size <= m_max_batch_size);
+    // The search threads aren't bound to a device.
+    check(cudaSetDevice(m_gpu), "cudaSetDevice");
+    if (m_buffers.empty()) {
+        allocate_buffers();
+    }
+    assert(input.size() <= m_buffer_elements);
+    assert(output.size() <= m_buffer_elements);
+
+    std::transform(begin(input), end(input), m_pinned, to_cudnn_net_t);
+    check(cudaMemcpyAsync(m_buffers[0], m_pinned,
+                          input.size() * sizeof(cudnn_net_t),
+                          cudaMemcpyHostToDevice, m_stream),
+          "cudaMemcpyAsync");
+
+    // Indices into m_buffers.
+    auto x = size_t{0};
+    auto block_input = size_t{0};
+    const auto batch = int(batch_size);
+    for (const auto& layer : m_layers) {
+        if (layer.starts_block) {
+            block_input = x;
+        }
+        auto y = size_t{0};
+        while (y == x || y == block_input) {
+            y++;
+        }
+
+        check(cudnnSetTensor4dDescriptor(m_in_desc, CUDNN_TENSOR_NCHW,
+                                         DATA_TYPE, batch, layer.channels,
+                                         BOARD_SIZE, BOARD_SIZE),
+              "cudnnSetTensor4dDescriptor");
+        check(cudnnSetTensor4dDescriptor(m_out_desc, CUDNN_TENSOR_NCHW,
+                                         DATA_TYPE, batch, layer.outputs,
+                                         BOARD_SIZE, BOARD_SIZE),
+              "cudnnSetTensor4dDescriptor");
+        const auto& algorithm = get_algorithm(layer, batch_size);
+        check(cudnnSetConvolutionMathType(m_conv_desc, algorithm.math_type),
+              "cudnnSetConvolutionMathType");
+
+        // The scaling factors are float for fp16 data too.
+        const auto alpha = 1.0f;
+        const auto beta = layer.adds_residual ? 1.0f : 0.0f;
+        if (layer.relu) {
+            // z is the output when there's no residual, with beta 0.
+            const auto z = layer.adds_residual ? m_buffers[block_input]
+                                               : m_buffers[y];
+            check(cudnnConvolutionBiasActivationForward(
+                      m_handle, &alpha, m_in_desc, m_buffers[x],
+                      layer.filter_desc, layer.weights, m_conv_desc,
+                      algorithm.algo, m_workspace, m_workspace_size,
+                      &beta, m_out_desc, z, layer.bias_desc, layer.biases,
+                      m_relu_desc, m_out_desc, m_buffers[y]),
+                  "cudnnConvolutionBiasActivationForward");
+        } else {
+            check(cudnnConvolutionForward(
+                      m_handle, &alpha, m_in_desc, m_buffers[x],
+                      layer.filter_desc, layer.weights, m_conv_desc,
+                      algorithm.algo, m_workspace, m_workspace_size,
+                      &beta, m_out_desc, m_buffers[y]),
+                  "cudnnConvolutionForward");
+        }
+        x = y;
+    }
+
+    check(cudaMemcpyAsync(m_pinned, m_buffers[x],
+                          output.size() * sizeof(cudnn_net_t),
+                          cudaMemcpyDeviceToHost, m_stream),
+          "cudaMemcpyAsync");
+    check(cudaStreamSynchronize(m_stream), "cudaStreamSynchronize");
+    std::transform(m_pinned, m_pinned + output.size(), begin(output),
+                   from_cudnn_net_t);
+}
+
+std::string CuDNN_Network::get_device_name() const {
+    auto properties = cudaDeviceProp{};
+    check(cudaGetDeviceProperties(&properties, m_gpu),
+          "cudaGetDeviceProperties");
+    return str(boost::format("CUDA: %s @ %dMHz, cuDNN %d")
+               % properties.name % (properties.clockRate / 1000)
+               % cudnnGetVersion());
+}
+#endif
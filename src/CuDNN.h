@@ -0,0 +1,153 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDNN_H_INCLUDED
+#define CUDNN_H_INCLUDED
+
+#include "config.h"
+
+#ifdef USE_CUDNN
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <cuda_runtime.h>
+#include <cudnn.h>
+#ifdef USE_HALF
+#include <cuda_fp16.h>
+#endif
+
+// Element type of the weights and activations on the device, the host
+// side converts when staging transfers.
+#ifdef USE_HALF
+using cudnn_net_t = __half;
+#else
+using cudnn_net_t = float;
+#endif
+
+/*
+    The residual tower on an NVIDIA GPU through cuDNN, with the OpenCL
+    backend's interface. Every 3x3 convolution is one call of
+    cudnnConvolutionBiasActivationForward: the batchnorm is folded into
+    the filters and the bias, the residual comes in as z and the ReLU is
+    the activation. For each layer shape and batch size cuDNN measures
+    its algorithms once and the fastest one is kept, which is usually
+    its Winograd convolution. With USE_HALF the weights and activations
+    are fp16 and tensor cores may be used.
+
+    One forward pass runs at a time. The search threads batch their
+    positions in a CPUBatchQueue in front of it, like the CPU backend.
+*/
+class CuDNN_Network {
+public:
+    // Up to max_batch_size positions per forward on CUDA device gpu.
+    CuDNN_Network(int gpu, size_t max_batch_size);
+    ~CuDNN_Network();
+    CuDNN_Network(const CuDNN_Network&) = delete;
+    CuDNN_Network& operator=(const CuDNN_Network&) = delete;
+
+    // The filters are plain, outputs x channels x 3 x 3, not Winograd
+    // transformed like those of OpenCL_Network.
+    void push_convolve(unsigned int filter_size,
+                       unsigned int channels,
+                       unsigned int outputs,
+                       const std::vector<float>& weights);
+    // Applies to the convolution pushed last, followed by a ReLU.
+    void push_batchnorm(unsigned int spatial_size,
+                        const std::vector<float>& means,
+                        const std::vector<float>& stddivs);
+    void push_residual(unsigned int filter_size,
+                       unsigned int channels,
+                       unsigned int outputs,
+                       const std::vector<float>& weights_1,
+                       const std::vector<float>& means_1,
+                       const std::vector<float>& stddivs_1,
+                       const std::vector<float>& weights_2,
+                       const std::vector<float>& means_2,
+                       const std::vector<float>& stddivs_2);
+
+    // batch_size positions one after another in input, the tower output
+    // of each in output, like OpenCL_Network::forward without the heads.
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output,
+                 size_t batch_size);
+
+    std::string get_device_name() const;
+
+private:
+    struct ConvLayer {
+        int channels;
+        int outputs;
+        // The second convolution of a residual block adds the input
+        // of the block.
+        bool adds_residual{false};
+        bool starts_block{false};
+        bool relu{false};
+        // Kept to fold in a later push_batchnorm.
+        std::vector<float> host_weights;
+        std::vector<float> host_biases;
+        cudnnFilterDescriptor_t filter_desc{nullptr};
+        cudnnTensorDescriptor_t bias_desc{nullptr};
+        cudnn_net_t* weights{nullptr};
+        cudnn_net_t* biases{nullptr};
+    };
+
+    struct Algorithm {
+        cudnnConvolutionFwdAlgo_t algo;
+        cudnnMathType_t math_type;
+    };
+
+    // Scales the filters and sets the biases, layer gets the ReLU.
+    static void fold_batchnorm(ConvLayer& layer,
+                               const std::vector<float>& means,
+                               const std::vector<float>& stddivs);
+    void upload(ConvLayer& layer);
+    // Measured on first use, see the class comment.
+    const Algorithm& get_algorithm(const ConvLayer& layer,
+                                   size_t batch_size);
+    void allocate_buffers();
+
+    const int m_gpu;
+    const size_t m_max_batch_size;
+    std::mutex m_mutex;
+
+    cudaStream_t m_stream{nullptr};
+    cudnnHandle_t m_handle{nullptr};
+    cudnnTensorDescriptor_t m_in_desc{nullptr};
+    cudnnTensorDescriptor_t m_out_desc{nullptr};
+    cudnnConvolutionDescriptor_t m_conv_desc{nullptr};
+    cudnnActivationDescriptor_t m_relu_desc{nullptr};
+
+    std::vector<ConvLayer> m_layers;
+    // Keyed by channels, outputs and batch size.
+    std::map<std::tuple<int, int, size_t>, Algorithm> m_algorithms;
+
+    // The layer input, its output and the input of the residual block
+    // take turns in these.
+    std::vector<cudnn_net_t*> m_buffers;
+    size_t m_buffer_elements{0};
+    void* m_workspace{nullptr};
+    size_t m_workspace_size{0};
+    // Page-locked, for the uploads and readbacks.
+    cudnn_net_t* m_pinned{nullptr};
+};
+
+#endif
+#endif
@@ -21,7 +21,6 @@
 #include <cassert>
 #include <array>
 #include <iostream>
-#include <queue>
 #include <sstream>
 #include <string>
 
@@ -87,6 +86,8 @@ void FastBoard::set_square(int vertex, FastBoard::square_t content) {
     assert(content >= BLACK && content <= INVAL);
 
     m_square[vertex] = content;
+    m_occupied[BLACK][vertex] = (content == BLACK);
+    m_occupied[WHITE][vertex] = (content == WHITE);
 }
 
 FastBoard::square_t FastBoard::get_square(int x, int y) const {
@@ -112,40 +113,44 @@ void FastBoard::reset_board(int size) {
     m_dirs[3] = -1;
 
     for (int i = 0; i < m_maxsq; i++) {
-        m_square[i]     = INVAL;
-        m_neighbours[i] = 0;
-        m_parent[i]     = MAXSQ;
+        m_square[i]            = INVAL;
+        m_vertex[i].neighbours = 0;
+        m_vertex[i].parent     = MAXSQ;
     }
+    m_occupied[BLACK].reset();
+    m_occupied[WHITE].reset();
+    m_onboard.reset();
 
     for (int i = 0; i < size; i++) {
         for (int j = 0; j < size; j++) {
             int vertex = get_vertex(i, j);
 
             m_square[vertex]          = EMPTY;
+            m_onboard[vertex]         = true;
             m_empty_idx[vertex]       = m_empty_cnt;
             m_empty[m_empty_cnt++]    = vertex;
 
             if (i == 0 || i == size - 1) {
-                m_neighbours[vertex] += (1 << (NBR_SHIFT * BLACK))
+                m_vertex[vertex].neighbours += (1 << (NBR_SHIFT * BLACK))
                                       | (1 << (NBR_SHIFT * WHITE));
-                m_neighbours[vertex] +=  1 << (NBR_SHIFT * EMPTY);
+                m_vertex[vertex].neighbours +=  1 << (NBR_SHIFT * EMPTY);
             } else {
-                m_neighbours[vertex] +=  2 << (NBR_SHIFT * EMPTY);
+                m_vertex[vertex].neighbours +=  2 << (NBR_SHIFT * EMPTY);
             }
 
             if (j == 0 || j == size - 1) {
-                m_neighbours[vertex] += (1 << (NBR_SHIFT * BLACK))
+                m_vertex[vertex].neighbours += (1 << (NBR_SHIFT * BLACK))
                                       | (1 << (NBR_SHIFT * WHITE));
-                m_neighbours[vertex] +=  1 << (NBR_SHIFT * EMPTY);
+                m_vertex[vertex].neighbours +=  1 << (NBR_SHIFT * EMPTY);
             } else {
-                m_neighbours[vertex] +=  2 << (NBR_SHIFT * EMPTY);
+                m_vertex[vertex].neighbours +=  2 << (NBR_SHIFT * EMPTY);
             }
         }
     }
 
-    m_parent[MAXSQ] = MAXSQ;
-    m_libs[MAXSQ]   = 16384;    /* we will subtract from this */
-    m_next[MAXSQ]   = MAXSQ;
+    m_vertex[MAXSQ].parent = MAXSQ;
+    m_vertex[MAXSQ].libs   = 16384;    /* we will subtract from this */
+    m_vertex[MAXSQ].next   = MAXSQ;
 }
 
 bool FastBoard::is_suicide(int i, int color) const {
@@ -158,7 +163,7 @@ bool FastBoard::is_suicide(int i, int color) const {
     for (auto k = 0; k < 4; k++) {
         auto ai = i + m_dirs[k];
 
-        auto libs = m_libs[m_parent[ai]];
+        auto libs = m_vertex[m_vertex[ai].parent].libs;
         if (get_square(ai) == color) {
             if (libs > 1) {
                 // connecting to live group = not suicide
@@ -185,7 +190,7 @@ int FastBoard::count_pliberties(const int i) const {
 // the border of the board has fake neighours of both colors
 int FastBoard::count_neighbours(const int c, const int v) const {
     assert(c == WHITE || c == BLACK || c == EMPTY);
-    return (m_neighbours[v] >> (NBR_SHIFT * c)) & NBR_MASK;
+    return (m_vertex[v].neighbours >> (NBR_SHIFT * c)) & NBR_MASK;
 }
 
 void FastBoard::add_neighbour(const int vtx, const int color) {
@@ -197,18 +202,18 @@ void FastBoard::add_neighbour(const int vtx, const int color) {
     for (int k = 0; k < 4; k++) {
         int ai = vtx + m_dirs[k];
 
-        m_neighbours[ai] += (1 << (NBR_SHIFT * color)) - (1 << (NBR_SHIFT * EMPTY));
+        m_vertex[ai].neighbours += (1 << (NBR_SHIFT * color)) - (1 << (NBR_SHIFT * EMPTY));
 
         bool found = false;
         for (int i = 0; i < nbr_par_cnt; i++) {
-            if (nbr_pars[i] == m_parent[ai]) {
+            if (nbr_pars[i] == m_vertex[ai].parent) {
                 found = true;
                 break;
             }
         }
         if (!found) {
-            m_libs[m_parent[ai]]--;
-            nbr_pars[nbr_par_cnt++] = m_parent[ai];
+            m_vertex[m_vertex[ai].parent].libs--;
+            nbr_pars[nbr_par_cnt++] = m_vertex[ai].parent;
         }
     }
 }
@@ -222,52 +227,37 @@ void FastBoard::remove_neighbour(const int vtx, const int color) {
     for (int k = 0; k < 4; k++) {
         int ai = vtx + m_dirs[k];
 
-        m_neighbours[ai] += (1 << (NBR_SHIFT * EMPTY))
+        m_vertex[ai].neighbours += (1 << (NBR_SHIFT * EMPTY))
                           - (1 << (NBR_SHIFT * color));
 
         bool found = false;
         for (int i = 0; i < nbr_par_cnt; i++) {
-            if (nbr_pars[i] == m_parent[ai]) {
+            if (nbr_pars[i] == m_vertex[ai].parent) {
                 found = true;
                 break;
             }
         }
         if (!found) {
-            m_libs[m_parent[ai]]++;
-            nbr_pars[nbr_par_cnt++] = m_parent[ai];
+            m_vertex[m_vertex[ai].parent].libs++;
+            nbr_pars[nbr_par_cnt++] = m_vertex[ai].parent;
         }
     }
 }
 
 int FastBoard::calc_reach_color(int color) const {
-    auto reachable = 0;
-    auto bd = std::vector<bool>(m_maxsq, false);
-    auto open = std::queue<int>();
-    for (auto i = 0; i < m_boardsize; i++) {
-        for (auto j = 0; j < m_boardsize; j++) {
-            auto vertex = get_vertex(i, j);
-            if (m_square[vertex] == color) {
-                reachable++;
-                bd[vertex] = true;
-                open.push(vertex);
-            }
-        }
-    }
-    while (!open.empty()) {
-        /* colored field, spread */
-        auto vertex = open.front();
-        open.pop();
-
-        for (auto k = 0; k < 4; k++) {
-            auto neighbor = vertex + m_dirs[k];
-            if (!bd[neighbor] && m_square[neighbor] == EMPTY) {
-                reachable++;
-                bd[neighbor] = true;
-                open.push(neighbor);
-            }
-        }
-    }
-    return reachable;
+    // Grow the stones of color into adjacent empty points until
+    // nothing changes.  Shifts that leave the board land on border
+    // vertices, which are never empty.
+    const auto empty = m_onboard & ~(m_occupied[BLACK] | m_occupied[WHITE]);
+    auto reach = m_occupied[color];
+    auto prev = bitboard_t{};
+    do {
+        prev = reach;
+        reach |= ((reach << 1) | (reach >> 1)
+                  | (reach << m_squaresize) | (reach >> m_squaresize))
+                 & empty;
+    } while (reach != prev);
+    return static_cast<int>(reach.count());
 }
 
 // Needed for scoring passed out games not in MC playouts
@@ -326,7 +316,7 @@ void FastBoard::merge_strings(const int ip, const int aip) {
     assert(ip != MAXSQ && aip != MAXSQ);
 
     /* merge stones */
-    m_stones[ip] += m_stones[aip];
+    m_vertex[ip].stones += m_vertex[aip].stones;
 
     /* loop over stones, update parents */
     int newpos = aip;
@@ -343,29 +333,29 @@ void FastBoard::merge_strings(const int ip, const int aip) {
                     int aai = ai + m_dirs[kk];
                     // friendly string shouldn't be ip
                     // ip can also be an aip that has been marked
-                    if (m_parent[aai] == ip) {
+                    if (m_vertex[aai].parent == ip) {
                         found = true;
                         break;
                     }
                 }
 
                 if (!found) {
-                    m_libs[ip]++;
+                    m_vertex[ip].libs++;
                 }
             }
         }
 
-        m_parent[newpos] = ip;
-        newpos = m_next[newpos];
+        m_vertex[newpos].parent = ip;
+        newpos = m_vertex[newpos].next;
     } while (newpos != aip);
 
     /* merge stings */
-    std::swap(m_next[aip], m_next[ip]);
+    std::swap(m_vertex[aip].next, m_vertex[ip].next);
 }
 
 bool FastBoard::is_eye(const int color, const int i) const {
     /* check for 4 neighbors of the same color */
-    int ownsurrounded = (m_neighbours[i] & s_eyemask[color]);
+    int ownsurrounded = (m_vertex[i].neighbours & s_eyemask[color]);
 
     // if not, it can't be an eye
     // this takes advantage of borders being colored
@@ -519,12 +509,12 @@ void FastBoard::set_to_move(int tomove) {
 std::string FastBoard::get_string(int vertex) const {
     std::string result;
 
-    int start = m_parent[vertex];
+    int start = m_vertex[vertex].parent;
     int newpos = start;
 
     do {
         result += move_to_text(newpos) + " ";
-        newpos = m_next[newpos];
+        newpos = m_vertex[newpos].next;
     } while (newpos != start);
 
     // eat last space
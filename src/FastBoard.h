@@ -22,7 +22,7 @@
 #include "config.h"
 
 #include <array>
-#include <queue>
+#include <bitset>
 #include <string>
 #include <utility>
 #include <vector>
@@ -40,7 +40,7 @@ public:
     /*
         largest board supported
     */
-    static constexpr int MAXBOARDSIZE = 19;
+    static constexpr int MAXBOARDSIZE = BOARD_SIZE;
 
     /*
         highest existing square
@@ -112,12 +112,27 @@ protected:
     static const std::array<int,      2> s_eyemask;
     static const std::array<square_t, 4> s_cinvert; /* color inversion */
 
+    /*
+        everything the string and liberty code needs about one vertex,
+        so that looking at a neighbour touches a single cache line
+    */
+    struct vertex_t {
+        unsigned short next;        /* next stone in string */
+        unsigned short parent;      /* parent node of string */
+        unsigned short libs;        /* liberties per string parent */
+        unsigned short stones;      /* stones per string parent */
+        unsigned short neighbours;  /* counts of neighboring stones */
+    };
+
+    /*
+        one bit per vertex, same indexing as m_square
+    */
+    using bitboard_t = std::bitset<MAXSQ>;
+
     std::array<square_t, MAXSQ>            m_square;      /* board contents */
-    std::array<unsigned short, MAXSQ+1>    m_next;        /* next stone in string */
-    std::array<unsigned short, MAXSQ+1>    m_parent;      /* parent node of string */
-    std::array<unsigned short, MAXSQ+1>    m_libs;        /* liberties per string parent */
-    std::array<unsigned short, MAXSQ+1>    m_stones;      /* stones per string parent */
-    std::array<unsigned short, MAXSQ>      m_neighbours;  /* counts of neighboring stones */
+    std::array<vertex_t, MAXSQ+1>          m_vertex;      /* strings and neighbours */
+    std::array<bitboard_t, 2>              m_occupied;    /* stones per color */
+    bitboard_t                             m_onboard;     /* vertices on the board */
     std::array<int, 4>                     m_dirs;        /* movement directions 4 way */
     std::array<int, 2>                     m_prisoners;   /* prisoners per color */
     std::array<unsigned short, MAXSQ>      m_empty;       /* empty squares */
@@ -20,10 +20,13 @@
 #include "FastState.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iterator>
 #include <vector>
 
 #include "FastBoard.h"
+#include "Random.h"
 #include "Utils.h"
 #include "Zobrist.h"
 
@@ -178,3 +181,49 @@ void FastState::set_handicap(int hcap) {
 int FastState::get_handicap() const {
     return m_handicap;
 }
+
+void FastState::perft(int games) const {
+    auto rng = Random{5489};
+    auto checksum = std::uint64_t{0};
+    auto moves = std::uint64_t{0};
+    const auto max_moves = 3 * board.get_boardsize() * board.get_boardsize();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (auto game = 0; game < games; game++) {
+        auto state = *this;
+        auto passes = 0;
+        for (auto n = 0; n < max_moves && passes < 2; n++) {
+            const auto color = state.get_to_move();
+            const auto empties = state.board.m_empty_cnt;
+            auto vertex = int{FastBoard::PASS};
+            if (empties > 0) {
+                // Try the empty points from a random one on, skipping
+                // illegal moves and our own eyes.
+                const auto first = rng.randuint32(empties);
+                for (auto i = 0; i < empties; i++) {
+                    const auto candidate =
+                        state.board.m_empty[(first + i) % empties];
+                    if (state.is_move_legal(color, candidate)
+                        && !state.board.is_eye(color, candidate)) {
+                        vertex = candidate;
+                        break;
+                    }
+                }
+            }
+            passes = (vertex == FastBoard::PASS) ? passes + 1 : 0;
+            state.play_move(color, vertex);
+            moves++;
+        }
+        checksum ^= state.board.get_hash();
+        checksum *= 0xff51afd7ed558ccdULL;
+        checksum += static_cast<std::uint64_t>(
+            state.final_score() * 2.0f + 1000.0f);
+    }
+    const auto stop = std::chrono::steady_clock::now();
+    const auto seconds = std::chrono::duration<double>(stop - start).count();
+
+    myprintf("perft: %d games, %llu moves, %.0f moves/s, checksum %016llx\n",
+             games, static_cast<unsigned long long>(moves),
+             moves / std::max(seconds, 1e-9),
+             static_cast<unsigned long long>(checksum));
+}
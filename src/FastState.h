@@ -54,6 +54,11 @@ public:
     void display_state();
     std::string move_to_text(int move);
 
+    // Play random games from this position and report the speed of the
+    // board code.  The checksum only depends on the rules, so it must not
+    // change when the board implementation does.
+    void perft(int games) const;
+
     FullBoard board;
 
     float m_komi;
@@ -37,7 +37,8 @@ int FullBoard::remove_string(int i) {
         m_ko_hash ^= Zobrist::zobrist[m_square[pos]][pos];
 
         m_square[pos] = EMPTY;
-        m_parent[pos] = MAXSQ;
+        m_occupied[color][pos] = false;
+        m_vertex[pos].parent = MAXSQ;
 
         remove_neighbour(pos, color);
 
@@ -49,7 +50,7 @@ int FullBoard::remove_string(int i) {
         m_ko_hash ^= Zobrist::zobrist[m_square[pos]][pos];
 
         removed++;
-        pos = m_next[pos];
+        pos = m_vertex[pos].next;
     } while (pos != i);
 
     return removed;
@@ -116,10 +117,11 @@ int FullBoard::update_board(const int color, const int i) {
     m_ko_hash ^= Zobrist::zobrist[m_square[i]][i];
 
     m_square[i] = (square_t)color;
-    m_next[i] = i;
-    m_parent[i] = i;
-    m_libs[i] = count_pliberties(i);
-    m_stones[i] = 1;
+    m_occupied[color][i] = true;
+    m_vertex[i].next = i;
+    m_vertex[i].parent = i;
+    m_vertex[i].libs = count_pliberties(i);
+    m_vertex[i].stones = 1;
 
     m_hash ^= Zobrist::zobrist[m_square[i]][i];
     m_ko_hash ^= Zobrist::zobrist[m_square[i]][i];
@@ -128,7 +130,7 @@ int FullBoard::update_board(const int color, const int i) {
     add_neighbour(i, color);
 
     /* did we play into an opponent eye? */
-    auto eyeplay = (m_neighbours[i] & s_eyemask[!color]);
+    auto eyeplay = (m_vertex[i].neighbours & s_eyemask[!color]);
 
     auto captured_stones = 0;
     int captured_sq;
@@ -137,17 +139,17 @@ int FullBoard::update_board(const int color, const int i) {
         int ai = i + m_dirs[k];
 
         if (m_square[ai] == !color) {
-            if (m_libs[m_parent[ai]] <= 0) {
+            if (m_vertex[m_vertex[ai].parent].libs <= 0) {
                 int this_captured = remove_string(ai);
                 captured_sq = ai;
                 captured_stones += this_captured;
             }
         } else if (m_square[ai] == color) {
-            int ip = m_parent[i];
-            int aip = m_parent[ai];
+            int ip = m_vertex[i].parent;
+            int aip = m_vertex[ai].parent;
 
             if (ip != aip) {
-                if (m_stones[ip] >= m_stones[aip]) {
+                if (m_vertex[ip].stones >= m_vertex[aip].stones) {
                     merge_strings(ip, aip);
                 } else {
                     merge_strings(aip, ip);
@@ -166,7 +168,7 @@ int FullBoard::update_board(const int color, const int i) {
     m_empty[m_empty_idx[i]] = lastvertex;
 
     /* check whether we still live (i.e. detect suicide) */
-    if (m_libs[m_parent[i]] == 0) {
+    if (m_vertex[m_vertex[i].parent].libs == 0) {
         assert(captured_stones == 0);
         remove_string(i);
     }
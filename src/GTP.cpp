@@ -20,25 +20,37 @@
 #include "GTP.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <iostream>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "Book.h"
 #include "FastBoard.h"
 #include "FullBoard.h"
 #include "GameState.h"
 #include "Network.h"
+#include "PerfStats.h"
+#include "Review.h"
 #include "SGFTree.h"
 #include "SMP.h"
+#include "TTable.h"
+#include "Trace.h"
 #include "Training.h"
+#include "UCTNode.h"
 #include "UCTSearch.h"
 #include "Utils.h"
 
@@ -56,17 +68,54 @@ int cfg_noise;
 int cfg_random_cnt;
 std::uint64_t cfg_rng_seed;
 bool cfg_dumbpass;
+int cfg_batch_size;
+int cfg_tt_memory;
+int cfg_max_memory;
+std::string cfg_nncache_file;
+int cfg_nncache_file_mb;
+std::string cfg_book_file;
+bool cfg_book_seed;
+std::vector<std::string> cfg_eval_peers;
+int cfg_eval_server_port;
+int cfg_analysis_server_port;
+#ifndef USE_OPENCL
+bool cfg_int8;
+bool cfg_numa;
+#endif
 #ifdef USE_OPENCL
 std::vector<int> cfg_gpus;
+std::vector<int> cfg_gpu_batch_sizes;
+std::vector<int> cfg_gpu_inflight;
 bool cfg_sgemm_exhaustive;
 bool cfg_tune_only;
+bool cfg_tune_background;
+std::string cfg_tuner_import;
+std::string cfg_tuner_export;
+bool cfg_gpu_heads;
+int cfg_cpu_workers;
+#endif
+#ifdef USE_CUDNN
+bool cfg_cudnn;
+int cfg_cuda_device;
 #endif
 float cfg_puct;
 float cfg_softmax_temp;
+int cfg_symmetries;
+int cfg_speculate;
 std::string cfg_weightsfile;
+std::string cfg_binary_weightsfile;
 std::string cfg_logfile;
 FILE* cfg_logfile_handle;
 bool cfg_quiet;
+bool cfg_binary_training;
+int cfg_training_compression;
+int cfg_selfplay_games;
+int cfg_selfplay_total;
+bool cfg_selfplay_debug;
+std::string cfg_perf_log;
+int cfg_perf_log_interval;
+std::string cfg_trace_file;
+int cfg_trace_events;
 std::string cfg_options_str;
 
 void GTP::setup_default_parameters() {
@@ -76,13 +125,36 @@ void GTP::setup_default_parameters() {
     cfg_max_playouts = std::numeric_limits<decltype(cfg_max_playouts)>::max();
     cfg_max_visits = std::numeric_limits<decltype(cfg_max_visits)>::max();
     cfg_lagbuffer_cs = 100;
+    cfg_batch_size = 1;
+    cfg_tt_memory = 16;
+    cfg_max_memory = 0;
+    cfg_nncache_file_mb = 1024;
+    cfg_book_seed = false;
+    cfg_eval_peers = { };
+    cfg_eval_server_port = 0;
+    cfg_analysis_server_port = 0;
+#ifndef USE_OPENCL
+    cfg_int8 = false;
+    cfg_numa = false;
+#endif
 #ifdef USE_OPENCL
     cfg_gpus = { };
+    cfg_gpu_batch_sizes = { };
+    cfg_gpu_inflight = { };
     cfg_sgemm_exhaustive = false;
     cfg_tune_only = false;
+    cfg_tune_background = false;
+    cfg_gpu_heads = false;
+    cfg_cpu_workers = 0;
+#endif
+#ifdef USE_CUDNN
+    cfg_cudnn = false;
+    cfg_cuda_device = 0;
 #endif
     cfg_puct = 0.85f;
     cfg_softmax_temp = 1.0f;
+    cfg_symmetries = 1;
+    cfg_speculate = 0;
     // see UCTSearch::should_resign
     cfg_resignpct = -1;
     cfg_noise = false;
@@ -90,6 +162,13 @@ void GTP::setup_default_parameters() {
     cfg_dumbpass = false;
     cfg_logfile_handle = nullptr;
     cfg_quiet = false;
+    cfg_binary_training = false;
+    cfg_training_compression = 9;
+    cfg_selfplay_games = 0;
+    cfg_selfplay_total = 0;
+    cfg_selfplay_debug = false;
+    cfg_perf_log_interval = 10;
+    cfg_trace_events = 1 << 18;
 
     // C++11 doesn't guarantee *anything* about how random this is,
     // and in MinGW it isn't random at all. But we can mix it in, which
@@ -131,6 +210,14 @@ const std::string GTP::s_commands[] = {
     "kgs-time_settings",
     "kgs-game_over",
     "heatmap",
+    "lz-analyze",
+    "lz-loadnetwork",
+    "lz-perfstats",
+    "lz-trace",
+    "lz-genbook",
+    "lz-review",
+    "lz-savetree",
+    "lz-loadtree",
     ""
 };
 
@@ -164,14 +251,152 @@ std::string GTP::get_life_list(const GameState & game, bool live) {
     return result;
 }
 
-bool GTP::execute(GameState & game, std::string xinput) {
-    std::string input;
-    static auto search = std::make_unique<UCTSearch>();
+namespace {
+
+// A line from stdin. Those answered while pondering only wait to be
+// applied to the game.
+struct InputLine {
+    std::string line;
+    bool answered;
+};
+
+struct InputQueue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<InputLine> lines;
+    // Lines not answered yet.
+    int pending{0};
+    bool eof{false};
+    // The answers would go out between two responses.
+    bool pondering{false};
+    // A command waits or the input ended, polled by every playout.
+    std::atomic<bool> stop{false};
+};
+
+InputQueue input_queue;
+
+// The color and remaining time of a time_left command.
+bool parse_time_left(const std::string& command,
+                     int& color, int& time, int& stones) {
+    std::istringstream cmdstream(command);
+    std::string tmp, who;
+
+    cmdstream >> tmp >> who >> time >> stones;
+    if (cmdstream.fail() || tmp != "time_left") {
+        return false;
+    }
+    if (who == "w" || who == "white") {
+        color = FastBoard::WHITE;
+    } else if (who == "b" || who == "black") {
+        color = FastBoard::BLACK;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+}
+
+void GTP::start_input() {
+    std::thread(read_input).detach();
+}
+
+void GTP::read_input() {
+    auto& queue = input_queue;
+    auto line = std::string{};
+    while (std::getline(std::cin, line)) {
+        log_input(line);
+
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        auto answered = false;
+        // Nothing queued can depend on these, so they need not stop
+        // the search. This holds the lock while answering, so the
+        // search stays on until the answer is out.
+        if (queue.pondering && queue.pending == 0) {
+            const auto input = clean_input(line);
+            if (input.empty() || input[0] == '#') {
+                continue;
+            }
+            std::string command;
+            int id;
+            split_id(input, id, command);
+            if (answer_query(id, command)) {
+                continue;
+            }
+            int color, time, stones;
+            if (parse_time_left(command, color, time, stones)) {
+                gtp_printf(id, "");
+                answered = true;
+            }
+        }
+        queue.lines.push_back({line, answered});
+        if (!answered) {
+            queue.pending++;
+            queue.stop = true;
+        }
+        queue.cv.notify_one();
+    }
+
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.eof = true;
+    queue.stop = true;
+    queue.cv.notify_one();
+}
 
+bool GTP::next_command(GameState& game, std::string& command) {
+    auto& queue = input_queue;
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    for (;;) {
+        queue.cv.wait(lock, [&queue]() {
+            return !queue.lines.empty() || queue.eof;
+        });
+        if (queue.lines.empty()) {
+            return false;
+        }
+        auto next = std::move(queue.lines.front());
+        queue.lines.pop_front();
+        if (!next.answered) {
+            queue.pending--;
+            queue.stop = queue.pending > 0 || queue.eof;
+            command = std::move(next.line);
+            return true;
+        }
+        // A time_left that came in while pondering.
+        std::string answered;
+        int id, color, time, stones;
+        split_id(clean_input(next.line), id, answered);
+        parse_time_left(answered, color, time, stones);
+        game.adjust_time(color, time * 100, stones);
+    }
+}
+
+bool GTP::input_pending() {
+    return input_queue.stop;
+}
+
+void GTP::ponder(UCTSearch& search, const GameState& game) {
+    auto& queue = input_queue;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.pondering = true;
+    }
+    search.ponder(game);
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.pondering = false;
+}
+
+std::string GTP::clean_input(const std::string& xinput) {
+    std::string input;
     bool transform_lowercase = true;
 
     // Required on Unixy systems
-    if (xinput.find("loadsgf") != std::string::npos) {
+    if (xinput.find("loadsgf") != std::string::npos
+        || xinput.find("lz-loadnetwork") != std::string::npos
+        || xinput.find("lz-trace") != std::string::npos
+        || xinput.find("lz-genbook") != std::string::npos
+        || xinput.find("lz-review") != std::string::npos
+        || xinput.find("lz-savetree") != std::string::npos
+        || xinput.find("lz-loadtree") != std::string::npos) {
         transform_lowercase = false;
     }
 
@@ -200,16 +425,12 @@ bool GTP::execute(GameState & game, std::string xinput) {
         }
     }
 
-    std::string command;
-    int id = -1;
+    return input;
+}
 
-    if (input == "") {
-        return true;
-    } else if (input == "exit") {
-        exit(EXIT_SUCCESS);
-    } else if (input.find("#") == 0) {
-        return true;
-    } else if (std::isdigit(input[0])) {
+void GTP::split_id(const std::string& input, int& id, std::string& command) {
+    id = -1;
+    if (std::isdigit(input[0])) {
         std::istringstream strm(input);
         char spacer;
         strm >> id;
@@ -218,8 +439,9 @@ bool GTP::execute(GameState & game, std::string xinput) {
     } else {
         command = input;
     }
+}
 
-    /* process commands */
+bool GTP::answer_query(int id, const std::string& command) {
     if (command == "protocol_version") {
         gtp_printf(id, "%d", GTP_VERSION);
         return true;
@@ -229,9 +451,6 @@ bool GTP::execute(GameState & game, std::string xinput) {
     } else if (command == "version") {
         gtp_printf(id, PROGRAM_VERSION);
         return true;
-    } else if (command == "quit") {
-        gtp_printf(id, "");
-        exit(EXIT_SUCCESS);
     } else if (command.find("known_command") == 0) {
         std::istringstream cmdstream(command);
         std::string tmp;
@@ -242,7 +461,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
         for (int i = 0; s_commands[i].size() > 0; i++) {
             if (tmp == s_commands[i]) {
                 gtp_printf(id, "true");
-                return 1;
+                return true;
             }
         }
 
@@ -255,6 +474,43 @@ bool GTP::execute(GameState & game, std::string xinput) {
         }
         gtp_printf(id, outtmp.c_str());
         return true;
+    }
+    return false;
+}
+
+bool GTP::execute(GameState & game, std::string xinput) {
+    static auto search = std::make_unique<UCTSearch>();
+
+    // A network from lz-loadnetwork is switched to between commands,
+    // when no search is running. The old tree holds its evaluations.
+    if (Network::swap_network()) {
+        TTable::get_TT().clear();
+        // The old search goes first, so the new one gets its whole
+        // share of the tree budget.
+        search.reset();
+        search = std::make_unique<UCTSearch>();
+    }
+
+    const auto input = clean_input(xinput);
+    std::string command;
+    int id = -1;
+
+    if (input == "") {
+        return true;
+    } else if (input == "exit") {
+        exit(EXIT_SUCCESS);
+    } else if (input.find("#") == 0) {
+        return true;
+    } else {
+        split_id(input, id, command);
+    }
+
+    /* process commands */
+    if (answer_query(id, command)) {
+        return true;
+    } else if (command == "quit") {
+        gtp_printf(id, "");
+        exit(EXIT_SUCCESS);
     } else if (command.find("boardsize") == 0) {
         std::istringstream cmdstream(command);
         std::string stmp;
@@ -264,7 +520,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
         cmdstream >> tmp;
 
         if (!cmdstream.fail()) {
-            if (tmp != 19) {
+            if (tmp != BOARD_SIZE) {
                 gtp_fail_printf(id, "unacceptable size");
             } else {
                 float old_komi = game.get_komi();
@@ -280,7 +536,8 @@ bool GTP::execute(GameState & game, std::string xinput) {
     } else if (command.find("clear_board") == 0) {
         Training::clear_training();
         game.reset_game();
-        std::make_unique<UCTSearch>().swap(search);
+        search.reset();
+        search = std::make_unique<UCTSearch>();
         gtp_printf(id, "");
         return true;
     } else if (command.find("komi") == 0) {
@@ -358,7 +615,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
             if (cfg_allow_pondering) {
                 // now start pondering
                 if (!game.has_resigned()) {
-                    search->ponder(game);
+                    ponder(*search, game);
                 }
             }
         } else {
@@ -394,7 +651,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
             if (cfg_allow_pondering) {
                 // now start pondering
                 if (!game.has_resigned()) {
-                    search->ponder(game);
+                    ponder(*search, game);
                 }
             }
         } else {
@@ -477,7 +734,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
                 // KGS sends this after our move
                 // now start pondering
                 if (!game.has_resigned()) {
-                    search->ponder(game);
+                    ponder(*search, game);
                 }
             }
         } else {
@@ -503,12 +760,17 @@ bool GTP::execute(GameState & game, std::string xinput) {
     } else if (command.find("heatmap") == 0) {
         std::istringstream cmdstream(command);
         std::string tmp;
-        int rotation;
+        std::string arg;
 
         cmdstream >> tmp;   // eat heatmap
-        cmdstream >> rotation;
+        cmdstream >> arg;
 
-        if (!cmdstream.fail()) {
+        if (arg == "average") {
+            auto vec = Network::get_scored_moves(
+                &game, Network::Ensemble::AVERAGE, 8);
+            Network::show_heatmap(&game, vec, false);
+        } else if (!arg.empty() && std::isdigit(arg[0])) {
+            auto rotation = std::stoi(arg) % 8;
             auto vec = Network::get_scored_moves(
                 &game, Network::Ensemble::DIRECT, rotation);
             Network::show_heatmap(&game, vec, false);
@@ -604,6 +866,142 @@ bool GTP::execute(GameState & game, std::string xinput) {
             gtp_fail_printf(id, "cannot load file");
         }
         return true;
+    } else if (command.find("lz-loadnetwork") == 0) {
+        // lz-loadnetwork <weights file>
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+
+        cmdstream >> tmp;   // eat lz-loadnetwork
+        cmdstream >> filename;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+            return true;
+        }
+        // Answers right away, the current network plays on until the
+        // new one is loaded.
+        Network::load_network_async(filename);
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-perfstats") == 0) {
+        // lz-perfstats [reset]
+        gtp_printf(id, "%s", PerfStats::to_json().c_str());
+        if (command.find("reset") != std::string::npos) {
+            PerfStats::reset();
+        }
+        return true;
+    } else if (command.find("lz-trace") == 0) {
+        // lz-trace [file]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+
+        cmdstream >> tmp;   // eat lz-trace
+        cmdstream >> filename;
+
+        if (!Trace::enabled()) {
+            gtp_fail_printf(id, "Tracing is off, start with --trace.");
+            return true;
+        }
+        if (cmdstream.fail()) {
+            filename = cfg_trace_file;
+        }
+        if (!Trace::dump(filename)) {
+            gtp_fail_printf(id, "cannot write file");
+            return true;
+        }
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-genbook") == 0) {
+        // lz-genbook <file> <depth> <width> <playouts>
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        int depth, width, playouts;
+
+        cmdstream >> tmp;   // eat lz-genbook
+        cmdstream >> filename >> depth >> width >> playouts;
+
+        if (cmdstream.fail() || depth < 1 || width < 1 || playouts < 1) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        if (!Book::generate(filename, game, depth, width, playouts)) {
+            gtp_fail_printf(id, "cannot write file");
+            return true;
+        }
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-review") == 0) {
+        // lz-review <sgf file> <visits> [positions at once]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        int visits, parallel;
+
+        cmdstream >> tmp;   // eat lz-review
+        cmdstream >> filename >> visits;
+        if (cmdstream.fail() || visits < 1) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        cmdstream >> parallel;
+        if (cmdstream.fail()) {
+            parallel = cfg_num_threads;
+        }
+
+        auto lines = std::vector<std::string>{};
+        try {
+            lines = Review::run(filename, visits, parallel);
+        } catch (const std::exception&) {
+            gtp_fail_printf(id, "cannot load file");
+            return true;
+        }
+        auto out = std::string{};
+        for (const auto& line : lines) {
+            out += (out.empty() ? "" : "\n") + line;
+        }
+        gtp_printf(id, "%s", out.c_str());
+        return true;
+    } else if (command.find("lz-savetree") == 0) {
+        // lz-savetree <file> [min visits]
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+        int min_visits;
+
+        cmdstream >> tmp;   // eat lz-savetree
+        cmdstream >> filename;
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+            return true;
+        }
+        cmdstream >> min_visits;
+        if (cmdstream.fail()) {
+            min_visits = 0;
+        } else if (min_visits < 0) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        if (!search->save_tree(filename, game, min_visits)) {
+            gtp_fail_printf(id, "cannot write file");
+            return true;
+        }
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lz-loadtree") == 0) {
+        // lz-loadtree <file>
+        std::istringstream cmdstream(command);
+        std::string tmp, filename;
+
+        cmdstream >> tmp;   // eat lz-loadtree
+        cmdstream >> filename;
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "Missing filename.");
+            return true;
+        }
+        if (!search->load_tree(filename, game)) {
+            gtp_fail_printf(id, "cannot load file");
+            return true;
+        }
+        gtp_printf(id, "");
+        return true;
     } else if (command.find("kgs-chat") == 0) {
         // kgs-chat (game|private) Name Message
         std::istringstream cmdstream(command);
@@ -656,6 +1054,42 @@ bool GTP::execute(GameState & game, std::string xinput) {
             gtp_fail_printf(id, "syntax not understood");
         }
         return true;
+    } else if (command.find("lz-analyze") == 0) {
+        // lz-analyze [color] [interval in centiseconds]
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        auto interval = 100;
+
+        cmdstream >> tmp;  // eat lz-analyze
+        cmdstream >> tmp;
+        if (!cmdstream.fail()) {
+            if (tmp == "w" || tmp == "white") {
+                game.set_to_move(FastBoard::WHITE);
+                cmdstream >> tmp;
+            } else if (tmp == "b" || tmp == "black") {
+                game.set_to_move(FastBoard::BLACK);
+                cmdstream >> tmp;
+            }
+        }
+        if (!cmdstream.fail()) {
+            auto intstream = std::istringstream(tmp);
+            intstream >> interval;
+            if (intstream.fail() || interval < 1) {
+                gtp_fail_printf(id, "syntax not understood");
+                return true;
+            }
+        }
+
+        // The info lines follow until the next command arrives, which
+        // stops the analysis. The empty line ends the response.
+        if (id != -1) {
+            gtp_printf_raw("=%d\n", id);
+        } else {
+            gtp_printf_raw("=\n");
+        }
+        search->ponder(game, interval);
+        gtp_printf_raw("\n");
+        return true;
     } else if (command.find("netbench") == 0) {
         std::istringstream cmdstream(command);
         std::string tmp;
@@ -672,6 +1106,54 @@ bool GTP::execute(GameState & game, std::string xinput) {
         gtp_printf(id, "");
         return true;
 
+    } else if (command.find("selectbench") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int iterations;
+
+        cmdstream >> tmp;  // eat selectbench
+        cmdstream >> iterations;
+
+        if (!cmdstream.fail()) {
+            UCTNode::benchmark(iterations);
+        } else {
+            UCTNode::benchmark();
+        }
+        gtp_printf(id, "");
+        return true;
+
+    } else if (command.find("perft") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int games;
+
+        cmdstream >> tmp;  // eat perft
+        cmdstream >> games;
+
+        if (cmdstream.fail() || games < 1) {
+            games = 1000;
+        }
+        game.perft(games);
+        gtp_printf(id, "");
+        return true;
+
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    } else if (command.find("int8_report") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int positions;
+
+        cmdstream >> tmp;  // eat int8_report
+        cmdstream >> positions;
+
+        if (!cmdstream.fail()) {
+            Network::int8_accuracy_report(&game, positions);
+        } else {
+            Network::int8_accuracy_report(&game);
+        }
+        gtp_printf(id, "");
+        return true;
+#endif
     } else if (command.find("printsgf") == 0) {
         std::istringstream cmdstream(command);
         std::string tmp, filename;
@@ -708,12 +1190,16 @@ bool GTP::execute(GameState & game, std::string xinput) {
             return true;
         }
 
-        Training::dump_training(who_won, filename);
-
-        if (!cmdstream.fail()) {
-            gtp_printf(id, "");
-        } else {
+        if (cmdstream.fail()) {
             gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        // Only answered once the file is complete.
+        try {
+            Training::dump_training(who_won, filename);
+            gtp_printf(id, "");
+        } catch (const std::exception&) {
+            gtp_fail_printf(id, "cannot write file");
         }
 
         return true;
@@ -724,12 +1210,15 @@ bool GTP::execute(GameState & game, std::string xinput) {
         // tmp will eat "dump_debug"
         cmdstream >> tmp >> filename;
 
-        Training::dump_debug(filename);
-
-        if (!cmdstream.fail()) {
-            gtp_printf(id, "");
-        } else {
+        if (cmdstream.fail()) {
             gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        try {
+            Training::dump_debug(filename);
+            gtp_printf(id, "");
+        } catch (const std::exception&) {
+            gtp_fail_printf(id, "cannot write file");
         }
 
         return true;
@@ -27,6 +27,8 @@
 
 #include "GameState.h"
 
+class UCTSearch;
+
 extern bool cfg_gtp_mode;
 extern bool cfg_allow_pondering;
 extern int cfg_num_threads;
@@ -38,26 +40,80 @@ extern int cfg_noise;
 extern int cfg_random_cnt;
 extern std::uint64_t cfg_rng_seed;
 extern bool cfg_dumbpass;
+extern int cfg_batch_size;
+extern int cfg_tt_memory;
+extern int cfg_max_memory;
+extern std::string cfg_nncache_file;
+extern int cfg_nncache_file_mb;
+extern std::string cfg_book_file;
+extern bool cfg_book_seed;
+extern std::vector<std::string> cfg_eval_peers;
+extern int cfg_eval_server_port;
+extern int cfg_analysis_server_port;
+#ifndef USE_OPENCL
+extern bool cfg_int8;
+extern bool cfg_numa;
+#endif
 #ifdef USE_OPENCL
 extern std::vector<int> cfg_gpus;
+extern std::vector<int> cfg_gpu_batch_sizes;
+extern std::vector<int> cfg_gpu_inflight;
 extern bool cfg_sgemm_exhaustive;
 extern bool cfg_tune_only;
+extern bool cfg_tune_background;
+extern std::string cfg_tuner_import;
+extern std::string cfg_tuner_export;
+extern bool cfg_gpu_heads;
+extern int cfg_cpu_workers;
+#endif
+#ifdef USE_CUDNN
+extern bool cfg_cudnn;
+extern int cfg_cuda_device;
 #endif
 extern float cfg_puct;
 extern float cfg_softmax_temp;
+extern int cfg_symmetries;
+extern int cfg_speculate;
 extern std::string cfg_logfile;
 extern std::string cfg_weightsfile;
+extern std::string cfg_binary_weightsfile;
 extern FILE* cfg_logfile_handle;
 extern bool cfg_quiet;
+extern bool cfg_binary_training;
+extern int cfg_training_compression;
+extern int cfg_selfplay_games;
+extern int cfg_selfplay_total;
+extern bool cfg_selfplay_debug;
+extern std::string cfg_perf_log;
+extern int cfg_perf_log_interval;
+extern std::string cfg_trace_file;
+extern int cfg_trace_events;
 extern std::string cfg_options_str;
 
 class GTP {
 public:
     static bool execute(GameState & game, std::string xinput);
     static void setup_default_parameters();
+
+    // Reads stdin from a thread of its own. While a search ponders
+    // after its response, the commands that need no game, like name
+    // or time_left, are answered right away, and any other stops it.
+    static void start_input();
+    // Waits for the next command to execute. False at the end of input.
+    static bool next_command(GameState& game, std::string& command);
+    // A command waits, so the search should stop.
+    static bool input_pending();
 private:
     static constexpr int GTP_VERSION = 2;
 
+    static void read_input();
+    static std::string clean_input(const std::string& xinput);
+    static void split_id(const std::string& input, int& id,
+                         std::string& command);
+    // The commands that don't depend on the game.
+    static bool answer_query(int id, const std::string& command);
+    static void ponder(UCTSearch& search, const GameState& game);
+
     static std::string get_life_list(const GameState & game, bool live);
     static const std::string s_commands[];
 };
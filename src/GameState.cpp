@@ -36,8 +36,7 @@
 void GameState::init_game(int size, float komi) {
     KoState::init_game(size, komi);
 
-    game_history.clear();
-    game_history.emplace_back(std::make_shared<KoState>(*this));
+    reset_history();
 
     m_timecontrol.set_boardsize(board.get_boardsize());
     m_timecontrol.reset_clocks();
@@ -48,41 +47,46 @@ void GameState::init_game(int size, float komi) {
 void GameState::reset_game() {
     KoState::reset_game();
 
-    game_history.clear();
-    game_history.emplace_back(std::make_shared<KoState>(*this));
+    reset_history();
 
     m_timecontrol.reset_clocks();
 
     m_resigned = FastBoard::EMPTY;
 }
 
+void GameState::reset_history() {
+    m_history = std::make_shared<HistoryNode>(HistoryNode{nullptr, *this});
+    m_future.clear();
+}
+
+void GameState::restore(std::shared_ptr<const HistoryNode> node) {
+    m_history = std::move(node);
+    // This also restores hashes as they're part of state
+    *(static_cast<KoState*>(this)) = m_history->state;
+}
+
 bool GameState::forward_move(void) {
-    if (game_history.size() > m_movenum + 1) {
-        m_movenum++;
-        *(static_cast<KoState*>(this)) = *game_history[m_movenum];
-        return true;
-    } else {
+    if (m_future.empty()) {
         return false;
     }
+    auto next = std::move(m_future.back());
+    m_future.pop_back();
+    restore(std::move(next));
+    return true;
 }
 
 bool GameState::undo_move(void) {
-    if (m_movenum > 0) {
-        m_movenum--;
-
-        // this is not so nice, but it should work
-        *(static_cast<KoState*>(this)) = *game_history[m_movenum];
-
-        // This also restores hashes as they're part of state
-        return true;
-    } else {
+    if (!m_history->parent) {
         return false;
     }
+    assert(m_movenum > 0);
+    m_future.emplace_back(m_history);
+    restore(m_history->parent);
+    return true;
 }
 
 void GameState::rewind(void) {
-    *(static_cast<KoState*>(this)) = *game_history[0];
-    m_movenum = 0;
+    while (undo_move()) {}
 }
 
 void GameState::play_move(int vertex) {
@@ -98,13 +102,18 @@ void GameState::play_move(int color, int vertex) {
         KoState::play_move(color, vertex);
     } else if (vertex == FastBoard::PASS) {
         KoState::play_pass();
-    } else if (vertex == FastBoard::RESIGN) {
-        m_resigned = color;
     }
 
     // cut off any leftover moves from navigating
-    game_history.resize(m_movenum);
-    game_history.emplace_back(std::make_shared<KoState>(*this));
+    m_future.clear();
+    if (vertex == FastBoard::RESIGN) {
+        // Resigning is no move, it takes the place of the current position.
+        m_resigned = color;
+        m_history = std::make_shared<HistoryNode>(
+            HistoryNode{m_history->parent, *this});
+        return;
+    }
+    m_history = std::make_shared<HistoryNode>(HistoryNode{m_history, *this});
 }
 
 bool GameState::play_textmove(std::string color, std::string vertex) {
@@ -200,8 +209,7 @@ void GameState::adjust_time(int color, int time, int stones) {
 void GameState::anchor_game_history(void) {
     // handicap moves don't count in game history
     m_movenum = 0;
-    game_history.clear();
-    game_history.emplace_back(std::make_shared<KoState>(*this));
+    reset_history();
 }
 
 bool GameState::set_fixed_handicap(int handicap) {
@@ -335,6 +343,9 @@ void GameState::place_free_handicap(int stones) {
 
 const FullBoard& GameState::get_past_board(int moves_ago) const {
     assert(moves_ago >= 0 && (unsigned)moves_ago <= m_movenum);
-    assert(m_movenum + 1 <= game_history.size());
-    return game_history[m_movenum - moves_ago]->board;
+    auto node = m_history.get();
+    for (auto i = 0; i < moves_ago; i++) {
+        node = node->parent.get();
+    }
+    return node->state.board;
 }
@@ -68,7 +68,20 @@ public:
 private:
     bool valid_handicap(int stones);
 
-    std::vector<std::shared_ptr<const KoState>> game_history;
+    // A position of the game, linked to the one before it. Never changed
+    // once shared, so copies of the state share the whole game and
+    // copying one costs the same at any move number.
+    struct HistoryNode {
+        std::shared_ptr<const HistoryNode> parent;
+        KoState state;
+    };
+    void reset_history();
+    void restore(std::shared_ptr<const HistoryNode> node);
+
+    // The current position, m_movenum links from the start.
+    std::shared_ptr<const HistoryNode> m_history;
+    // Positions taken back by undo_move, the next one last.
+    std::vector<std::shared_ptr<const HistoryNode>> m_future;
     TimeControl m_timecontrol;
     int m_resigned{FastBoard::EMPTY};
 };
@@ -0,0 +1,278 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "config.h"
+#include "Int8CPU.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INT8_MULTIVERSION
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr auto W = BOARD_SIZE;
+constexpr auto H = BOARD_SIZE;
+constexpr auto SQUARES = W * H;
+// Pixels are done four at a time, the padding rows are all zero.
+constexpr auto SQUARES_PAD = (SQUARES + 3) / 4 * 4;
+constexpr auto FILTER_LEN = 3 * 3;
+constexpr auto DEPTH_ALIGN = 64;
+constexpr auto MAX_ACTIVATION = 127.0f;
+constexpr auto MAX_WEIGHT = 127.0f;
+
+using DotFunc = void (*)(const std::int8_t* weights, const std::uint8_t* col,
+                         std::int32_t* out, int K, int depth);
+
+// out[k * SQUARES_PAD + p] = dot(weights row k, col row p)
+void dot_generic(const std::int8_t* weights, const std::uint8_t* col,
+                 std::int32_t* out, const int K, const int depth) {
+    for (auto k = 0; k < K; k++) {
+        const auto w = weights + k * depth;
+        for (auto p = 0; p < SQUARES_PAD; p++) {
+            const auto a = col + p * depth;
+            auto sum = std::int32_t{0};
+            for (auto d = 0; d < depth; d++) {
+                sum += std::int32_t{w[d]} * std::int32_t{a[d]};
+            }
+            out[k * SQUARES_PAD + p] = sum;
+        }
+    }
+}
+
+#ifdef INT8_MULTIVERSION
+__attribute__((target("avx2")))
+std::int32_t hsum_avx2(__m256i x) {
+    auto sum = _mm_add_epi32(_mm256_castsi256_si128(x),
+                             _mm256_extracti128_si256(x, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+// vpmaddubsw multiplies unsigned by signed bytes and adds adjacent pairs
+// into saturating 16 bit lanes, which is exact for 7 bit activations.
+__attribute__((target("avx2"))) inline
+__m256i madd_avx2(__m256i acc, const std::uint8_t* row, __m256i w,
+                  __m256i ones) {
+    const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row));
+    return _mm256_add_epi32(acc,
+        _mm256_madd_epi16(_mm256_maddubs_epi16(a, w), ones));
+}
+
+__attribute__((target("avx2")))
+void dot_avx2(const std::int8_t* weights, const std::uint8_t* col,
+              std::int32_t* out, const int K, const int depth) {
+    const auto ones = _mm256_set1_epi16(1);
+    for (auto k = 0; k < K; k++) {
+        const auto w = weights + k * depth;
+        for (auto p = 0; p < SQUARES_PAD; p += 4) {
+            const auto a = col + p * depth;
+            auto acc0 = _mm256_setzero_si256();
+            auto acc1 = _mm256_setzero_si256();
+            auto acc2 = _mm256_setzero_si256();
+            auto acc3 = _mm256_setzero_si256();
+            for (auto d = 0; d < depth; d += 32) {
+                const auto wv = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(w + d));
+                acc0 = madd_avx2(acc0, a + 0 * depth + d, wv, ones);
+                acc1 = madd_avx2(acc1, a + 1 * depth + d, wv, ones);
+                acc2 = madd_avx2(acc2, a + 2 * depth + d, wv, ones);
+                acc3 = madd_avx2(acc3, a + 3 * depth + d, wv, ones);
+            }
+            const auto o = out + k * SQUARES_PAD + p;
+            o[0] = hsum_avx2(acc0);
+            o[1] = hsum_avx2(acc1);
+            o[2] = hsum_avx2(acc2);
+            o[3] = hsum_avx2(acc3);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+std::int32_t hsum_avx512(__m512i x) {
+    // The maskz forms, unlike the plain extracts, don't trip gcc's
+    // uninitialized warnings in its own headers.
+    const auto lo = _mm512_maskz_extracti64x4_epi64(0xf, x, 0);
+    const auto hi = _mm512_maskz_extracti64x4_epi64(0xf, x, 1);
+    return hsum_avx2(_mm256_add_epi32(lo, hi));
+}
+
+// vpdpbusd does the same multiply-add with 32 bit accumulation.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void dot_avx512vnni(const std::int8_t* weights, const std::uint8_t* col,
+                    std::int32_t* out, const int K, const int depth) {
+    for (auto k = 0; k < K; k++) {
+        const auto w = weights + k * depth;
+        for (auto p = 0; p < SQUARES_PAD; p += 4) {
+            const auto a = col + p * depth;
+            auto acc0 = _mm512_setzero_si512();
+            auto acc1 = _mm512_setzero_si512();
+            auto acc2 = _mm512_setzero_si512();
+            auto acc3 = _mm512_setzero_si512();
+            for (auto d = 0; d < depth; d += 64) {
+                const auto wv = _mm512_loadu_si512(w + d);
+                acc0 = _mm512_dpbusd_epi32(acc0,
+                    _mm512_loadu_si512(a + 0 * depth + d), wv);
+                acc1 = _mm512_dpbusd_epi32(acc1,
+                    _mm512_loadu_si512(a + 1 * depth + d), wv);
+                acc2 = _mm512_dpbusd_epi32(acc2,
+                    _mm512_loadu_si512(a + 2 * depth + d), wv);
+                acc3 = _mm512_dpbusd_epi32(acc3,
+                    _mm512_loadu_si512(a + 3 * depth + d), wv);
+            }
+            const auto o = out + k * SQUARES_PAD + p;
+            o[0] = hsum_avx512(acc0);
+            o[1] = hsum_avx512(acc1);
+            o[2] = hsum_avx512(acc2);
+            o[3] = hsum_avx512(acc3);
+        }
+    }
+}
+#endif
+
+struct Kernels {
+    const char* name;
+    DotFunc dot;
+};
+
+Kernels select_kernels() {
+#ifdef INT8_MULTIVERSION
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni")
+        && __builtin_cpu_supports("avx512bw")) {
+        return {"AVX-512 VNNI", dot_avx512vnni};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return {"AVX2", dot_avx2};
+    }
+#endif
+    return {"generic", dot_generic};
+}
+
+const Kernels& get_kernels() {
+    static const auto kernels = select_kernels();
+    return kernels;
+}
+
+// Quantizes one position and lays it out as SQUARES_PAD rows of depth
+// bytes, one row per output pixel holding its 3x3 neighbourhood for
+// every input channel. Returns the scale to dequantize with.
+float im2col_quantized(const float* in, std::uint8_t* col,
+                       const int channels, const int depth) {
+    const auto max_in = *std::max_element(in, in + channels * SQUARES);
+    const auto scale = max_in > 0.0f ? max_in / MAX_ACTIVATION : 1.0f;
+    const auto inv_scale = 1.0f / scale;
+
+    std::fill(col, col + SQUARES_PAD * depth, std::uint8_t{0});
+    for (auto y = 0; y < H; y++) {
+        for (auto x = 0; x < W; x++) {
+            auto row = col + (y * W + x) * depth;
+            for (auto c = 0; c < channels; c++) {
+                const auto plane = in + c * SQUARES;
+                for (auto ky = 0; ky < 3; ky++) {
+                    const auto iy = y + ky - 1;
+                    for (auto kx = 0; kx < 3; kx++) {
+                        const auto ix = x + kx - 1;
+                        if (iy >= 0 && iy < H && ix >= 0 && ix < W) {
+                            const auto q = std::lround(plane[iy * W + ix]
+                                                       * inv_scale);
+                            row[c * FILTER_LEN + ky * 3 + kx] =
+                                static_cast<std::uint8_t>(
+                                    std::max(0l, std::min(127l, q)));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return scale;
+}
+
+}
+
+Int8CPU::Conv3::Conv3(const std::vector<float>& weights,
+                      const int outputs, const int channels)
+    : m_outputs(outputs), m_channels(channels) {
+    const auto filter_dim = channels * FILTER_LEN;
+    assert(weights.size() == size_t(outputs * filter_dim));
+    m_depth = (filter_dim + DEPTH_ALIGN - 1) / DEPTH_ALIGN * DEPTH_ALIGN;
+    m_weights.assign(m_outputs * m_depth, std::int8_t{0});
+    m_scales.resize(m_outputs);
+
+    for (auto k = 0; k < m_outputs; k++) {
+        const auto w = weights.data() + k * filter_dim;
+        auto max_w = 0.0f;
+        for (auto d = 0; d < filter_dim; d++) {
+            max_w = std::max(max_w, std::abs(w[d]));
+        }
+        const auto scale = max_w > 0.0f ? max_w / MAX_WEIGHT : 1.0f;
+        for (auto d = 0; d < filter_dim; d++) {
+            m_weights[k * m_depth + d] =
+                static_cast<std::int8_t>(std::lround(w[d] / scale));
+        }
+        m_scales[k] = scale;
+    }
+}
+
+void Int8CPU::Conv3::forward(const float* in, float* out,
+                             const int batch_size,
+                             const float* means, const float* stddivs,
+                             const float* residual) const {
+    const auto& kernels = get_kernels();
+    // im2col_quantized clears col itself, so the buffers can be kept
+    // by the thread between layers and calls.
+    thread_local auto col = std::vector<std::uint8_t>{};
+    thread_local auto acc = std::vector<std::int32_t>{};
+    col.resize(SQUARES_PAD * m_depth);
+    acc.resize(m_outputs * SQUARES_PAD);
+
+    for (auto b = 0; b < batch_size; b++) {
+        const auto in_scale = im2col_quantized(in + b * m_channels * SQUARES,
+                                               col.data(),
+                                               m_channels, m_depth);
+        kernels.dot(m_weights.data(), col.data(), acc.data(),
+                    m_outputs, m_depth);
+
+        const auto offset = b * m_outputs * SQUARES;
+        for (auto k = 0; k < m_outputs; k++) {
+            const auto scale = m_scales[k] * in_scale * stddivs[k];
+            const auto bias = means[k] * stddivs[k];
+            const auto a = acc.data() + k * SQUARES_PAD;
+            auto o = out + offset + k * SQUARES;
+            const auto res = residual ? residual + offset + k * SQUARES
+                                      : nullptr;
+            for (auto p = 0; p < SQUARES; p++) {
+                auto val = scale * a[p] - bias;
+                if (res) {
+                    val += res[p];
+                }
+                o[p] = val > 0.0f ? val : 0.0f;
+            }
+        }
+    }
+}
+
+const char* Int8CPU::get_isa_name() {
+    return get_kernels().name;
+}
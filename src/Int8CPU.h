@@ -0,0 +1,67 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef INT8CPU_H_INCLUDED
+#define INT8CPU_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+    Quantized 3x3 convolutions for the CPU backend (--int8).
+    Weights are stored as int8 with one scale per output channel, taken
+    from the largest weight of that channel. The input planes are
+    quantized per position to 7 bit unsigned values when the convolution
+    runs; the tower only ever sees ReLU outputs and binary input planes,
+    so they are never negative. The 7th bit is left free so the AVX2
+    pairwise multiply-add cannot saturate.
+    Results are dequantized straight into the fused batchnorm, residual
+    and ReLU stage, so the data passed between layers (and to the heads)
+    stays in float.
+*/
+namespace Int8CPU {
+    class Conv3 {
+    public:
+        // weights is the raw outputs x channels x 3 x 3 filter.
+        Conv3(const std::vector<float>& weights, int outputs, int channels);
+        // in is batch_size x channels planes of BOARD_SIZE x BOARD_SIZE, out is
+        // batch_size x outputs planes. residual, if given, is added
+        // before the ReLU.
+        void forward(const float* in, float* out, int batch_size,
+                     const float* means, const float* stddivs,
+                     const float* residual = nullptr) const;
+        int get_outputs() const {
+            return m_outputs;
+        }
+    private:
+        int m_outputs;
+        int m_channels;
+        // Length of one dot product, padded for the widest vector unit.
+        int m_depth;
+        std::vector<std::int8_t> m_weights;
+        std::vector<float> m_scales;
+    };
+
+    // Name of the instruction set the dot products use.
+    const char* get_isa_name();
+}
+
+#endif
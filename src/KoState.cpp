@@ -32,24 +32,106 @@ void KoState::init_game(int size, float komi) {
 
     FastState::init_game(size, komi);
 
-    m_ko_hash_history.clear();
-    m_ko_hash_history.emplace_back(board.get_ko_hash());
+    reset_ko_history();
+    reset_stone_planes();
 }
 
-bool KoState::superko(void) const {
-    auto first = crbegin(m_ko_hash_history);
-    auto last = crend(m_ko_hash_history);
+bool KoState::KoHistory::contains(const std::uint64_t hash) const {
+    if (hash == 0) {
+        return has_zero;
+    }
+    if (table.empty()) {
+        return false;
+    }
+    // The hashes are Zobrist keys, uniform enough to index with.
+    const auto mask = table.size() - 1;
+    for (auto i = hash & mask; table[i] != 0; i = (i + 1) & mask) {
+        if (table[i] == hash) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    auto res = std::find(++first, last, board.get_ko_hash());
+void KoState::KoHistory::insert(const std::uint64_t hash) {
+    hashes.emplace_back(hash);
+    if (hash == 0) {
+        has_zero = true;
+        return;
+    }
+    // At most half full, and a power of two to mask with.
+    if (2 * hashes.size() > table.size()) {
+        auto size = size_t{64};
+        while (size < 4 * hashes.size()) {
+            size *= 2;
+        }
+        auto old = std::vector<std::uint64_t>(size);
+        old.swap(table);
+        for (const auto h : old) {
+            if (h != 0) {
+                const auto mask = table.size() - 1;
+                auto i = h & mask;
+                while (table[i] != 0) {
+                    i = (i + 1) & mask;
+                }
+                table[i] = h;
+            }
+        }
+    }
+    const auto mask = table.size() - 1;
+    auto i = hash & mask;
+    while (table[i] != 0 && table[i] != hash) {
+        i = (i + 1) & mask;
+    }
+    table[i] = hash;
+}
 
-    return (res != last);
+bool KoState::superko(void) const {
+    const auto hash = board.get_ko_hash();
+    // All but the current position, which is the last in the tail.
+    const auto tail_end = begin(m_ko_tail) + m_ko_tail_size - 1;
+    if (std::find(begin(m_ko_tail), tail_end, hash) != tail_end) {
+        return true;
+    }
+    return m_ko_history->contains(hash);
 }
 
 void KoState::reset_game() {
     FastState::reset_game();
 
-    m_ko_hash_history.clear();
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    reset_ko_history();
+    reset_stone_planes();
+}
+
+void KoState::reset_ko_history() {
+    m_ko_history = std::make_shared<KoHistory>();
+    m_ko_tail[0] = board.get_ko_hash();
+    m_ko_tail_size = 1;
+}
+
+void KoState::flush_ko_tail() {
+    auto history = std::make_shared<KoHistory>(*m_ko_history);
+    for (auto i = size_t{0}; i + 1 < m_ko_tail_size; i++) {
+        history->insert(m_ko_tail[i]);
+    }
+    m_ko_history = std::move(history);
+    m_ko_tail[0] = m_ko_tail[m_ko_tail_size - 1];
+    m_ko_tail_size = 1;
+}
+
+void KoState::compact_ko_history() {
+    if (m_ko_tail_size > 1) {
+        flush_ko_tail();
+    }
+}
+
+void KoState::push_ko_hash(const std::uint64_t hash) {
+    if (m_ko_tail_size == KO_TAIL) {
+        // Searches rarely go this deep below their root, which starts
+        // out with an empty tail, see compact_ko_history.
+        flush_ko_tail();
+    }
+    m_ko_tail[m_ko_tail_size++] = hash;
 }
 
 void KoState::play_pass(void) {
@@ -61,10 +143,77 @@ void KoState::play_move(int vertex) {
 }
 
 void KoState::play_move(int color, int vertex) {
+    const auto prisoners = board.get_prisoners(FastBoard::BLACK)
+                         + board.get_prisoners(FastBoard::WHITE);
     if (vertex != FastBoard::PASS && vertex != FastBoard::RESIGN) {
         FastState::play_move(color, vertex);
     } else if (vertex == FastBoard::PASS) {
         FastState::play_pass(color);
     }
-    m_ko_hash_history.push_back(board.get_ko_hash());
+    push_ko_hash(board.get_ko_hash());
+    push_stone_planes(color, vertex, prisoners);
+}
+
+static void fill_stone_planes(const FullBoard& board,
+                              KoState::StonePlanes& planes) {
+    planes[FastBoard::BLACK].reset();
+    planes[FastBoard::WHITE].reset();
+    const auto size = board.get_boardsize();
+    for (auto y = 0; y < size; y++) {
+        for (auto x = 0; x < size; x++) {
+            const auto color = board.get_square(x, y);
+            if (color != FastBoard::EMPTY) {
+                planes[color][y * FastBoard::MAXBOARDSIZE + x] = true;
+            }
+        }
+    }
+}
+
+void KoState::reset_stone_planes() {
+    m_planes_head = 0;
+    for (auto& planes : m_stone_planes) {
+        planes[FastBoard::BLACK].reset();
+        planes[FastBoard::WHITE].reset();
+    }
+    fill_stone_planes(board, m_stone_planes[m_planes_head]);
+}
+
+void KoState::push_stone_planes(int color, int vertex, int prisoners) {
+    const auto prev = m_planes_head;
+    m_planes_head = (m_planes_head + 1) % INPUT_HISTORY;
+    auto& planes = m_stone_planes[m_planes_head];
+    planes = m_stone_planes[prev];
+
+    if (vertex == FastBoard::PASS || vertex == FastBoard::RESIGN) {
+        return;
+    }
+    // Captures (or a suicide) remove stones, which is rare enough
+    // to just rescan the board.
+    const auto now_prisoners = board.get_prisoners(FastBoard::BLACK)
+                             + board.get_prisoners(FastBoard::WHITE);
+    if (now_prisoners != prisoners || board.get_square(vertex) != color) {
+        fill_stone_planes(board, planes);
+        return;
+    }
+    const auto xy = board.get_xy(vertex);
+    planes[color][xy.second * FastBoard::MAXBOARDSIZE + xy.first] = true;
+}
+
+std::uint64_t KoState::get_past_ko_hash(int moves_ago) const {
+    assert(moves_ago >= 0);
+    const auto ago = static_cast<size_t>(moves_ago);
+    if (ago < m_ko_tail_size) {
+        return m_ko_tail[m_ko_tail_size - 1 - ago];
+    }
+    const auto& hashes = m_ko_history->hashes;
+    assert(ago - m_ko_tail_size < hashes.size());
+    return hashes[hashes.size() - 1 - (ago - m_ko_tail_size)];
+}
+
+const KoState::StonePlanes& KoState::get_stone_planes(int moves_ago) const {
+    assert(moves_ago >= 0 && moves_ago < INPUT_HISTORY);
+    assert(static_cast<size_t>(moves_ago) <= m_movenum);
+    const auto index = (m_planes_head + INPUT_HISTORY - moves_ago)
+                     % INPUT_HISTORY;
+    return m_stone_planes[index];
 }
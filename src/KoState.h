@@ -21,13 +21,26 @@
 
 #include "config.h"
 
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <memory>
 #include <vector>
 
+#include "FastBoard.h"
 #include "FastState.h"
 #include "FullBoard.h"
 
 class KoState : public FastState {
 public:
+    // Number of past positions whose stones are kept, see
+    // get_stone_planes.
+    static constexpr auto INPUT_HISTORY = 8;
+    using StonePlane = std::bitset<FastBoard::MAXBOARDSIZE
+                                   * FastBoard::MAXBOARDSIZE>;
+    // Black and white stones, indexed by y * MAXBOARDSIZE + x.
+    using StonePlanes = std::array<StonePlane, 2>;
+
     void init_game(int size, float komi);
     bool superko(void) const;
     void reset_game();
@@ -36,8 +49,46 @@ public:
     void play_move(int color, int vertex);
     void play_move(int vertex);
 
+    // The stones moves_ago plies back, moves_ago < INPUT_HISTORY and
+    // no further back than the start of the game.
+    const StonePlanes& get_stone_planes(int moves_ago) const;
+    // Ko hash of the board moves_ago plies back.
+    std::uint64_t get_past_ko_hash(int moves_ago) const;
+    // Empties the tail into a KoHistory of our own, so the next KO_TAIL
+    // plies played on copies of this state don't copy the KoHistory.
+    // For the root of a search.
+    void compact_ko_history();
+
 private:
-    std::vector<std::uint64_t> m_ko_hash_history;
+    // Ko hashes of the older positions of the game, in order, with an
+    // open addressing set of them. Never changed once shared, so copies
+    // of the state share it.
+    struct KoHistory {
+        std::vector<std::uint64_t> hashes;
+        std::vector<std::uint64_t> table;
+        bool has_zero{false};
+
+        bool contains(std::uint64_t hash) const;
+        void insert(std::uint64_t hash);
+    };
+    // The newest positions are kept here, the current one last, so
+    // playing a move and copying the state don't touch KoHistory.
+    static constexpr auto KO_TAIL = 16;
+
+    void reset_ko_history();
+    void push_ko_hash(std::uint64_t hash);
+    // Moves all of the tail but the current position into KoHistory.
+    void flush_ko_tail();
+
+    void reset_stone_planes();
+    void push_stone_planes(int color, int vertex, int prisoners);
+
+    std::shared_ptr<const KoHistory> m_ko_history;
+    std::array<std::uint64_t, KO_TAIL> m_ko_tail;
+    size_t m_ko_tail_size{0};
+    // Ring of the last INPUT_HISTORY positions, newest at m_planes_head.
+    std::array<StonePlanes, INPUT_HISTORY> m_stone_planes;
+    size_t m_planes_head{0};
 };
 
 #endif
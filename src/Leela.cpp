@@ -29,17 +29,27 @@
 #include <string>
 #include <vector>
 
+#include "AnalysisServer.h"
+#include "Book.h"
 #include "GTP.h"
 #include "GameState.h"
 #include "Network.h"
 #include "NNCache.h"
+#include "Numa.h"
+#include "PerfStats.h"
 #include "Random.h"
+#include "RemoteEval.h"
+#include "SelfPlay.h"
 #include "ThreadPool.h"
+#include "Trace.h"
 #include "Utils.h"
 #include "Zobrist.h"
 
 using namespace Utils;
 
+// Below this the tree can't hold a long search.
+static constexpr auto MIN_MAX_MEMORY = 32;
+
 static void license_blurb() {
     printf(
         "Leela Zero  Copyright (C) 2017-2018  Gian-Carlo Pascutto and contributors\n"
@@ -75,14 +85,104 @@ static void parse_commandline(int argc, char *argv[]) {
                    "Random number generation seed.")
         ("dumbpass,d", "Don't use heuristics for smarter passing.")
         ("weights,w", po::value<std::string>(), "File with network weights.")
+        ("convert-weights", po::value<std::string>(),
+                            "Save the weights as a binary file and exit.")
         ("logfile,l", po::value<std::string>(), "File to log input/output to.")
         ("quiet,q", "Disable all diagnostic output.")
+        ("binary-training", "Write training data in the packed binary "
+                            "format instead of text.")
+        ("training-compression",
+            po::value<int>()->default_value(cfg_training_compression),
+            "gzip level for training data, 0 (none) to 9.")
         ("noponder", "Disable thinking on opponent's time.")
+        ("batchsize", po::value<int>()->default_value(cfg_batch_size),
+                      "Max number of positions per network evaluation.")
+        ("symmetries", po::value<int>()->default_value(cfg_symmetries),
+                       "Average the network over this many of the 8 board "
+                       "symmetries, evaluated as one batch.")
+        ("speculate", po::value<int>()->default_value(cfg_speculate),
+                      "Fill batch slots the search leaves empty with the "
+                      "positions after this many of the most likely moves "
+                      "of every expanded node.")
+        ("tt-memory", po::value<int>()->default_value(cfg_tt_memory),
+                      "Memory for the transposition table in MiB "
+                      "(0 to disable).")
+        ("max-memory", po::value<int>()->default_value(cfg_max_memory),
+                       "Memory for the search tree and the NNCache "
+                       "together in MiB (0 for no limit).")
+        ("nncache-file", po::value<std::string>(),
+                         "Keep network evaluations in this file as well, "
+                         "to be found again by later runs.")
+        ("nncache-file-size",
+            po::value<int>()->default_value(cfg_nncache_file_mb),
+            "Size of a new --nncache-file in MiB.")
+        ("book", po::value<std::string>(),
+                 "Play the moves of this opening book, made with "
+                 "lz-genbook, while the game is in it.")
+        ("book-seed", "Start the search from the book instead of "
+                      "playing its move right away.")
+        ("eval-peer", po::value<std::vector<std::string>>(),
+                      "host:port of a leelaz --eval-server to send network "
+                      "evaluations to. Can be given more than once. "
+                      "Use enough threads to keep all peers busy.")
+        ("eval-server", po::value<int>(),
+                        "Serve network evaluations on this TCP port "
+                        "instead of playing.")
+        ("analysis-server", po::value<int>(),
+                            "Serve analysis sessions on this TCP port "
+                            "instead of playing.")
+        ("selfplay", po::value<int>(),
+                     "Play this many self-play games at once, writing "
+                     "training data, instead of taking GTP commands.")
+        ("selfplay-total", po::value<int>(),
+                           "Stop self-play after this many games.")
+        ("selfplay-debug", "Also write debug data for self-play games.")
+        ("perf-log", po::value<std::string>(),
+                     "Append the time spent in each search phase to this "
+                     "file as JSON, every --perf-log-interval seconds.")
+        ("perf-log-interval",
+            po::value<int>()->default_value(cfg_perf_log_interval),
+            "Seconds between --perf-log lines.")
+        ("trace", po::value<std::string>(),
+                  "Record search and network events and write them to "
+                  "this file in Chrome trace format at exit.")
+        ("trace-events", po::value<int>()->default_value(cfg_trace_events),
+                         "How many of the most recent events --trace keeps.")
+#ifndef USE_OPENCL
+        ("int8", "Run the residual tower with 8-bit integer weights.")
+        ("numa", "Spread the search threads over the NUMA nodes, each "
+                 "with its own copy of the network weights.")
+#endif
 #ifdef USE_OPENCL
         ("gpu",  po::value<std::vector<int> >(),
                 "ID of the OpenCL device(s) to use (disables autodetection).")
+        ("gpu-batchsize", po::value<std::vector<int> >(),
+                "Batch size for each --gpu, in the same order "
+                "(default: --batchsize).")
+        ("gpu-inflight", po::value<std::vector<int> >(),
+                "Number of batches each --gpu may run at once (default: 2).")
         ("full-tuner", "Try harder to find an optimal OpenCL tuning.")
         ("tune-only", "Tune OpenCL only and then exit.")
+        ("tune-background", "Start with a default OpenCL tuning if none "
+                            "is stored yet, and tune while playing.")
+        ("tuner-import", po::value<std::string>(),
+                         "Merge the OpenCL tunings from this file.")
+        ("tuner-export", po::value<std::string>(),
+                         "Write all known OpenCL tunings to this file.")
+        ("gpu-heads", "Evaluate the policy and value heads on the GPU.")
+        ("cpu-workers", po::value<int>()->default_value(cfg_cpu_workers),
+                        "Threads that evaluate positions on the CPU when "
+                        "that is faster than waiting for a GPU.")
+#endif
+#ifdef USE_CUDNN
+        ("backend", po::value<std::string>(),
+#ifdef USE_OPENCL
+                    "Network backend, opencl or cudnn (default: opencl).")
+#else
+                    "Network backend, cpu or cudnn (default: cpu).")
+#endif
+        ("cuda-device", po::value<int>()->default_value(cfg_cuda_device),
+                        "ID of the CUDA device for --backend cudnn.")
 #endif
 #ifdef USE_TUNER
         ("puct", po::value<float>())
@@ -153,6 +253,10 @@ static void parse_commandline(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (vm.count("convert-weights")) {
+        cfg_binary_weightsfile = vm["convert-weights"].as<std::string>();
+    }
+
     if (vm.count("gtp")) {
         cfg_gtp_mode = true;
     }
@@ -176,6 +280,54 @@ static void parse_commandline(int argc, char *argv[]) {
     }
     myprintf("RNG seed: %llu\n", cfg_rng_seed);
 
+    if (vm.count("binary-training")) {
+        cfg_binary_training = true;
+    }
+
+    if (vm.count("training-compression")) {
+        cfg_training_compression = vm["training-compression"].as<int>();
+        if (cfg_training_compression < 0 || cfg_training_compression > 9) {
+            myprintf("Training compression must be between 0 and 9.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("selfplay")) {
+        cfg_selfplay_games = vm["selfplay"].as<int>();
+        if (cfg_selfplay_games < 1) {
+            myprintf("Self-play needs at least 1 game.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!vm.count("playouts") && !vm.count("visits")) {
+            myprintf("Self-play needs --playouts or --visits.\n");
+            exit(EXIT_FAILURE);
+        }
+        // The searches are never interrupted by new input.
+        cfg_allow_pondering = false;
+    }
+    if (vm.count("selfplay-total")) {
+        cfg_selfplay_total = vm["selfplay-total"].as<int>();
+    }
+    if (vm.count("selfplay-debug")) {
+        cfg_selfplay_debug = true;
+    }
+    if (vm.count("perf-log")) {
+        cfg_perf_log = vm["perf-log"].as<std::string>();
+        cfg_perf_log_interval = vm["perf-log-interval"].as<int>();
+        if (cfg_perf_log_interval < 1) {
+            myprintf("The perf log interval must be at least a second.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (vm.count("trace")) {
+        cfg_trace_file = vm["trace"].as<std::string>();
+        cfg_trace_events = vm["trace-events"].as<int>();
+        if (cfg_trace_events < 1) {
+            myprintf("The trace must keep at least one event.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (vm.count("noponder")) {
         cfg_allow_pondering = false;
     }
@@ -190,7 +342,7 @@ static void parse_commandline(int argc, char *argv[]) {
 
     if (vm.count("playouts")) {
         cfg_max_playouts = vm["playouts"].as<int>();
-        if (!vm.count("noponder")) {
+        if (cfg_allow_pondering) {
             myprintf("Nonsensical options: Playouts are restricted but "
                      "thinking on the opponent's time is still allowed. "
                      "Add --noponder if you want a weakened engine.\n");
@@ -223,6 +375,36 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_gpus = vm["gpu"].as<std::vector<int> >();
     }
 
+    if (vm.count("gpu-batchsize")) {
+        cfg_gpu_batch_sizes = vm["gpu-batchsize"].as<std::vector<int> >();
+    }
+
+    if (vm.count("gpu-inflight")) {
+        cfg_gpu_inflight = vm["gpu-inflight"].as<std::vector<int> >();
+    }
+
+    {
+        const auto devices = std::max(size_t{1}, cfg_gpus.size());
+        if (cfg_gpu_batch_sizes.size() > devices
+            || cfg_gpu_inflight.size() > devices) {
+            myprintf("More per-GPU settings than GPUs given.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (const auto value : cfg_gpu_batch_sizes) {
+            if (value < 1 || value > cfg_num_threads) {
+                myprintf("GPU batch size must be between 1 and "
+                         "the number of threads.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (const auto value : cfg_gpu_inflight) {
+            if (value < 1) {
+                myprintf("GPU in-flight count must be at least 1.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
     if (vm.count("full-tuner")) {
         cfg_sgemm_exhaustive = true;
     }
@@ -230,8 +412,175 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("tune-only")) {
         cfg_tune_only = true;
     }
+
+    if (vm.count("tune-background")) {
+        cfg_tune_background = true;
+    }
+
+    if (vm.count("tuner-import")) {
+        cfg_tuner_import = vm["tuner-import"].as<std::string>();
+    }
+
+    if (vm.count("tuner-export")) {
+        cfg_tuner_export = vm["tuner-export"].as<std::string>();
+    }
+
+    if (vm.count("gpu-heads")) {
+        cfg_gpu_heads = true;
+    }
+
+    cfg_cpu_workers = vm["cpu-workers"].as<int>();
+    if (cfg_cpu_workers < 0 || cfg_cpu_workers > MAX_CPUS) {
+        myprintf("CPU workers must be between 0 and %d.\n", MAX_CPUS);
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+#ifdef USE_CUDNN
+    if (vm.count("backend")) {
+        const auto backend = vm["backend"].as<std::string>();
+#ifdef USE_OPENCL
+        const auto default_backend = std::string{"opencl"};
+#else
+        const auto default_backend = std::string{"cpu"};
+#endif
+        if (backend != "cudnn" && backend != default_backend) {
+            myprintf("Backend must be %s or cudnn.\n",
+                     default_backend.c_str());
+            exit(EXIT_FAILURE);
+        }
+        cfg_cudnn = backend == "cudnn";
+    }
+    cfg_cuda_device = vm["cuda-device"].as<int>();
+#ifdef USE_OPENCL
+    if (cfg_cudnn && cfg_gpu_heads) {
+        myprintf("--gpu-heads needs the OpenCL backend.\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+#endif
+
+#ifndef USE_OPENCL
+    if (vm.count("int8")) {
+        cfg_int8 = true;
+    }
+    if (vm.count("numa")) {
+        cfg_numa = Numa::num_nodes() > 1;
+        if (!cfg_numa) {
+            myprintf("Only one NUMA node found, ignoring --numa.\n");
+        }
+    }
 #endif
 
+    if (vm.count("symmetries")) {
+        cfg_symmetries = vm["symmetries"].as<int>();
+        if (cfg_symmetries < 1 || cfg_symmetries > 8) {
+            myprintf("Symmetries must be between 1 and 8.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("batchsize")) {
+        cfg_batch_size = vm["batchsize"].as<int>();
+        if (cfg_batch_size < 1) {
+            myprintf("Batch size must be at least 1.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Searching threads are the only producers, so a batch can never
+        // fill up beyond that. Every self-play game has its own, see
+        // init_global_objects.
+        const auto producers =
+            cfg_num_threads * std::max(1, cfg_selfplay_games);
+        if (cfg_batch_size > producers) {
+            myprintf("Clamping batch size to number of threads = %d\n",
+                     producers);
+            cfg_batch_size = producers;
+        }
+    }
+
+    if (vm.count("speculate")) {
+        cfg_speculate = vm["speculate"].as<int>();
+        if (cfg_speculate < 0) {
+            myprintf("Speculative evaluations can't be negative.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (cfg_speculate > 0 && cfg_symmetries > 1) {
+            myprintf("Speculative evaluations need --symmetries 1.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("tt-memory")) {
+        cfg_tt_memory = vm["tt-memory"].as<int>();
+        if (cfg_tt_memory < 0) {
+            myprintf("Transposition table memory can't be negative.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("max-memory")) {
+        cfg_max_memory = vm["max-memory"].as<int>();
+        if (cfg_max_memory != 0 && cfg_max_memory < MIN_MAX_MEMORY) {
+            myprintf("The memory limit must be at least %d MiB.\n",
+                     MIN_MAX_MEMORY);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("nncache-file")) {
+        cfg_nncache_file = vm["nncache-file"].as<std::string>();
+        cfg_nncache_file_mb = vm["nncache-file-size"].as<int>();
+        if (cfg_nncache_file_mb < 1) {
+            myprintf("The NNCache file needs at least 1 MiB.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("book")) {
+        cfg_book_file = vm["book"].as<std::string>();
+    }
+    if (vm.count("book-seed")) {
+        cfg_book_seed = true;
+    }
+
+    if (vm.count("eval-peer")) {
+        cfg_eval_peers = vm["eval-peer"].as<std::vector<std::string>>();
+        for (const auto& peer : cfg_eval_peers) {
+            const auto colon = peer.rfind(':');
+            if (colon == std::string::npos || colon == 0
+                || colon + 1 == peer.size()) {
+                myprintf("Evaluation peers must be given as host:port.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (vm.count("eval-server")) {
+        cfg_eval_server_port = vm["eval-server"].as<int>();
+        if (cfg_eval_server_port < 1 || cfg_eval_server_port > 65535) {
+            myprintf("Evaluation server port must be between 1 and 65535.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!cfg_eval_peers.empty()) {
+            myprintf("An evaluation server can't use evaluation peers.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("analysis-server")) {
+        cfg_analysis_server_port = vm["analysis-server"].as<int>();
+        if (cfg_analysis_server_port < 1
+            || cfg_analysis_server_port > 65535) {
+            myprintf("Analysis server port must be between 1 and 65535.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (cfg_eval_server_port) {
+            myprintf("Can't run an evaluation and an analysis server "
+                     "at once.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     auto out = std::stringstream{};
     for (auto i = 1; i < argc; i++) {
         out << " " << argv[i];
@@ -243,8 +592,30 @@ static void parse_commandline(int argc, char *argv[]) {
 }
 
 // Setup global objects after command line has been parsed
+static void dump_trace() {
+    if (!Trace::dump(cfg_trace_file)) {
+        myprintf("Could not write the trace to %s.\n", cfg_trace_file.c_str());
+    }
+}
+
 void init_global_objects() {
-    thread_pool.initialize(cfg_num_threads);
+    // Every self-play game searches with threads of its own, its game
+    // thread and the helpers it takes from the pool.
+    const auto pool_threads =
+        cfg_num_threads * std::max(1, cfg_selfplay_games);
+#ifndef USE_OPENCL
+    if (cfg_numa) {
+        // The GTP thread searches too.
+        Numa::bind_next_thread();
+        // Worker i runs on node i modulo the number of nodes.
+        for (auto i = 0; i < pool_threads; i++) {
+            thread_pool.add_thread([i]() { Numa::bind_thread(i); });
+        }
+    } else
+#endif
+    {
+        thread_pool.initialize(pool_threads);
+    }
 
     // Use deterministic random numbers for hashing
     auto rng = std::make_unique<Random>(5489);
@@ -255,7 +626,21 @@ void init_global_objects() {
     // improves reproducibility across platforms.
     Random::get_Rng().seedrandom(cfg_rng_seed);
 
-    NNCache::get_NNCache().set_size_from_playouts(cfg_max_playouts);
+    // With a memory limit the cache gets up to half of it, the tree
+    // the rest.
+    auto cache_mb = NNCache::DEFAULT_SIZE_MB;
+    if (cfg_max_memory) {
+        cache_mb = std::min(cache_mb, cfg_max_memory / 2);
+    }
+    NNCache::get_NNCache().set_size_from_playouts(cfg_max_playouts, cache_mb);
+    if (!cfg_nncache_file.empty()) {
+        NNCache::get_NNCache().open_file(cfg_nncache_file,
+                                         cfg_nncache_file_mb);
+    }
+    if (!cfg_book_file.empty()
+        && !Book::get_Book().load(cfg_book_file)) {
+        exit(EXIT_FAILURE);
+    }
 
     // Initialize network
     Network::initialize();
@@ -283,22 +668,46 @@ int main (int argc, char *argv[]) {
         license_blurb();
     }
 
+    // Before the network, whose command queues are made for profiling.
+    if (!cfg_trace_file.empty()) {
+        Trace::enable(cfg_trace_events);
+        std::atexit(dump_trace);
+    }
+
     init_global_objects();
 
+    if (!cfg_perf_log.empty()) {
+        PerfStats::start_log(cfg_perf_log, cfg_perf_log_interval);
+    }
+
+    if (cfg_eval_server_port) {
+        RemoteEvaluator::serve(cfg_eval_server_port);
+        return 0;
+    }
+    if (cfg_analysis_server_port) {
+        AnalysisServer::serve(cfg_analysis_server_port);
+        return 0;
+    }
+
+    if (cfg_selfplay_games) {
+        SelfPlay::run(cfg_selfplay_games, cfg_selfplay_total);
+        return 0;
+    }
+
     auto maingame = std::make_unique<GameState>();
 
     /* set board limits */
     auto komi = 7.5f;
-    maingame->init_game(19, komi);
+    maingame->init_game(BOARD_SIZE, komi);
 
+    GTP::start_input();
     for(;;) {
         if (!cfg_gtp_mode) {
             maingame->display_state();
             std::cout << "Leela: ";
         }
 
-        if (std::getline(std::cin, input)) {
-            Utils::log_input(input);
+        if (GTP::next_command(*maingame, input)) {
             GTP::execute(*maingame, input);
         } else {
             // eof or other error
@@ -306,10 +715,7 @@ int main (int argc, char *argv[]) {
         }
 
         // Force a flush of the logfile
-        if (cfg_logfile_handle) {
-            fclose(cfg_logfile_handle);
-            cfg_logfile_handle = fopen(cfg_logfile.c_str(), "a");
-        }
+        Utils::flush_log();
     }
 
     return 0;
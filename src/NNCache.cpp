@@ -17,94 +17,175 @@
 */
 
 #include "config.h"
-#include <functional>
+#include <algorithm>
+#include <cmath>
 
 #include "NNCache.h"
+#include "FastBoard.h"
+#include "GTP.h"
+#include "NNCacheFile.h"
+#include "Numa.h"
+#include "PerfStats.h"
 #include "Utils.h"
 
-NNCache::NNCache(int size) : m_size(size) {}
+NNCache::NNCache(int size) {
+    resize(size);
+}
+
+NNCache::~NNCache() = default;
 
 NNCache& NNCache::get_NNCache(void) {
     static NNCache cache;
     return cache;
 }
 
-template <class T>
-inline size_t hash_combine(size_t seed, const T& v) {
-    std::hash<T> hasher;
-    return seed ^ (hasher(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
-}
-
-static size_t compute_hash(const Network::NNPlanes& features) {
-    auto hash = size_t{0};
-    for (const auto& p : features) {
-        hash = hash_combine(hash, p);
-    }
-    return hash;
-}
-
-bool NNCache::lookup(const Network::NNPlanes& features, Network::Netresult & result) {
-    auto hash = compute_hash(features);
+static constexpr auto QUANT_MAX = 65534.0f;
 
-    std::lock_guard<std::mutex> lock(m_mutex);
+bool NNCache::lookup(std::uint64_t key, Network::Netresult & result) {
+    PerfTimer timer(PerfStats::NN_CACHE);
+    auto& shard = get_shard(key);
     ++m_lookups;
 
-    auto iter = m_cache.find(hash);
-    if (iter == m_cache.end()) {
-        return false;  // Not found.
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto& entry = get_entry(shard, key);
+        if (entry.key != 0 && entry.key == key) {
+            ++m_hits;
+            if (entry.speculative) {
+                entry.speculative = false;
+                ++m_speculative_hits;
+            }
+            decode(entry, result);
+            return true;
+        }
     }
 
-    const auto& entry = iter->second;
-    if (entry->features != features) {
-        // Got a hash collision.
-        ++m_collisions;
+    // Not in memory, try the file.
+    if (!m_file) {
         return false;
     }
-
-    // Found it.
-    ++m_hits;
-    result = entry->result;
+    auto entry = Entry{};
+    if (!m_file->lookup(key, Network::get_network_hash(),
+                        entry.winrate, entry.policy)) {
+        return false;
+    }
+    entry.key = key;
+    decode(entry, result);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    get_entry(shard, key) = entry;
     return true;
 }
 
-void NNCache::insert(const Network::NNPlanes& features,
-                     const Network::Netresult& result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
+bool NNCache::contains(std::uint64_t key) {
+    auto& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto& entry = get_entry(shard, key);
+    return entry.key != 0 && entry.key == key;
+}
+
+void NNCache::insert(std::uint64_t key, const Network::Netresult& result,
+                     const bool speculative) {
+    PerfTimer timer(PerfStats::NN_CACHE);
+    auto& shard = get_shard(key);
 
-    auto hash = compute_hash(features);
-    if (m_cache.find(hash) != m_cache.end()) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto& entry = get_entry(shard, key);
+    if (entry.key == key) {
         return;  // Already in the cache.
     }
 
-    m_cache.emplace(hash, std::make_unique<Entry>(features, result));
-    m_order.push_back(hash);
+    // Replaces the previous occupant of the slot, if any.
+    entry.key = key;
+    entry.winrate = result.winrate;
+    for (auto idx = 0; idx < NUM_MOVES; idx++) {
+        const auto prob = result.policy[idx];
+        entry.policy[idx] = prob == 0.0f
+            ? 0 : std::uint16_t(1 + std::lround(prob * QUANT_MAX));
+    }
+    entry.speculative = speculative;
     ++m_inserts;
+    if (speculative) {
+        ++m_speculative_inserts;
+    }
+
+    if (m_file) {
+        m_file->insert(key, Network::get_network_hash(),
+                       entry.winrate, entry.policy);
+    }
+}
 
-    // If the cache is too large, remove the oldest entry.
-    if (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+void NNCache::decode(const Entry& entry, Network::Netresult& result) {
+    for (auto idx = 0; idx < NUM_MOVES; idx++) {
+        const auto quantized = entry.policy[idx];
+        result.policy[idx] = quantized == 0 ? 0.0f : (quantized - 1) / QUANT_MAX;
     }
+    result.winrate = entry.winrate;
+}
+
+void NNCache::open_file(const std::string& filename, const size_t size_mb) {
+    m_file = NNCacheFile::open(filename, size_mb);
 }
 
 void NNCache::resize(int size) {
     m_size = size;
-    while (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    const auto shard_size = std::max(size_t{1}, m_size / NUM_SHARDS);
+#ifndef USE_OPENCL
+    if (cfg_numa) {
+        // Every node gets its share of the shards, allocated and zeroed
+        // there, so no single memory controller serves all lookups.
+        Numa::for_each_node([this, shard_size](int node) {
+            for (auto i = size_t(node); i < NUM_SHARDS;
+                 i += Numa::num_nodes()) {
+                auto& shard = m_shards[i];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.entries = std::vector<Entry>(shard_size);
+            }
+        });
+        return;
+    }
+#endif
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.entries.resize(shard_size);
+    }
+}
+
+void NNCache::clear() {
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto& entry : shard.entries) {
+            entry.key = 0;
+        }
     }
 }
 
-void NNCache::set_size_from_playouts(int max_playouts) {
+void NNCache::set_size_from_playouts(int max_playouts, int max_size_mb) {
     // cache hits are generally from last several moves so setting cache
     // size based on playouts increases the hit rate while balancing memory
-    // usage for low playout instances. 50'000 cache entries is ~250 MB
-    auto max_size = std::min(50'000, std::max(6'000, 3 * max_playouts));
-    NNCache::get_NNCache().resize(max_size);
+    // usage for low playout instances. 350'000 entries is ~250 MB
+    const auto max_size = std::int64_t{max_size_mb} * 1024 * 1024
+                          / std::int64_t{sizeof(Entry)};
+    auto size = std::min(max_size,
+                         std::max(std::int64_t{60'000},
+                                  std::int64_t{3} * max_playouts));
+    NNCache::get_NNCache().resize(int(std::max(std::int64_t{1}, size)));
 }
 
 void NNCache::dump_stats() {
-    Utils::myprintf("NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %u size, %d collisions\n",
-        m_hits, m_lookups, 100. * m_hits / (m_lookups + 1),
-        m_inserts, m_cache.size(), m_collisions);
+    auto used = size_t{0};
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& entry : shard.entries) {
+            if (entry.key != 0) {
+                used++;
+            }
+        }
+    }
+    Utils::myprintf("NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %zu size\n",
+        m_hits.load(), m_lookups.load(), 100. * m_hits / (m_lookups + 1),
+        m_inserts.load(), used);
+    if (m_file) {
+        m_file->dump_stats();
+    }
 }
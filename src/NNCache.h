@@ -21,61 +21,117 @@
 
 #include "config.h"
 
-#include <deque>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <string>
+#include <vector>
 
 #include "Network.h"
 
+class NNCacheFile;
+
 class NNCache {
 public:
     // return the global NNCache
     static NNCache& get_NNCache(void);
 
-    // Set a reasonable size gives max number of playouts
-    void set_size_from_playouts(int max_playouts);
+    // Set a reasonable size gives max number of playouts, using at most
+    // max_size_mb megabytes.
+    void set_size_from_playouts(int max_playouts,
+                                int max_size_mb = DEFAULT_SIZE_MB);
 
     // Resize NNCache
     void resize(int size);
 
-    // Try and find an existing entry.
-    bool lookup(const Network::NNPlanes& features, Network::Netresult & result);
+    // Try and find an existing entry, see Network::get_cache_key.
+    bool lookup(std::uint64_t key, Network::Netresult & result);
+
+    // Insert a new entry. A speculative one counts as a speculative hit
+    // the first time lookup finds it.
+    void insert(std::uint64_t key, const Network::Netresult& result,
+                bool speculative = false);
+
+    // Whether key is in memory, without counting a lookup.
+    bool contains(std::uint64_t key);
 
-    // Insert a new entry.
-    void insert(const Network::NNPlanes& features,
-                const Network::Netresult& result);
+    // Drop every entry, for when the network changes.
+    void clear();
+
+    // Adds the NNCacheFile in filename behind the entries in memory.
+    void open_file(const std::string& filename, size_t size_mb);
 
     // Return the hit rate ratio.
     std::pair<int, int> hit_rate() const {
         return {m_hits, m_lookups};
     }
 
+    // Speculative entries found by lookup, and speculative inserts.
+    std::pair<int, int> speculative_hit_rate() const {
+        return {m_speculative_hits, m_speculative_inserts};
+    }
+
     void dump_stats();
 
+    // Memory taken by the entries.
+    size_t get_memory_used() const {
+        return m_size * sizeof(Entry);
+    }
+
+    static constexpr auto DEFAULT_SIZE_MB = 250;
+
 private:
-    NNCache(int size = 50000);  // ~ 250MB
+    NNCache(int size = 50000);
+    ~NNCache();
 
-    std::mutex m_mutex;
+    // The cache is split in shards with their own lock, so concurrent
+    // search threads rarely wait on each other.
+    static constexpr auto NUM_SHARDS = 64;
+
+    // All intersections plus pass.
+    static constexpr auto NUM_MOVES = POTENTIAL_MOVES;
 
     size_t m_size;
 
     // Statistics
-    int m_hits{0};
-    int m_lookups{0};
-    int m_inserts{0};
-    int m_collisions{0};
-
+    std::atomic<int> m_hits{0};
+    std::atomic<int> m_lookups{0};
+    std::atomic<int> m_inserts{0};
+    std::atomic<int> m_speculative_hits{0};
+    std::atomic<int> m_speculative_inserts{0};
+
+    // Only the 64-bit key is kept to verify a hit, not the input planes.
+    // The policy is indexed like Netresult and stored as 0 for a
+    // probability of 0, as occupied points have, otherwise as the
+    // probability quantized to 1..65535.
     struct Entry {
-        Entry(const Network::NNPlanes& f, const Network::Netresult& r)
-            : features(f), result(r) {}
-        Network::NNPlanes features; // ~ 1KB
-        Network::Netresult result;  // ~ 3KB
+        std::uint64_t key{0};  // 0 if the slot is unused
+        float winrate;
+        std::array<std::uint16_t, NUM_MOVES> policy;  // ~ 0.7KB
+        // Inserted speculatively and not looked up since.
+        bool speculative{false};
+    };
+
+    // Each shard is a fixed-size table indexed by hash. A new entry simply
+    // replaces whatever occupied its slot.
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Entry> entries;
     };
 
-    // Map from hash to {features, result}
-    std::unordered_map<size_t, std::unique_ptr<const Entry>> m_cache;
-    // Order entries were added to the map.
-    std::deque<size_t> m_order;
+    static void decode(const Entry& entry, Network::Netresult& result);
+
+    Shard& get_shard(std::uint64_t key) {
+        return m_shards[key % NUM_SHARDS];
+    }
+    static Entry& get_entry(Shard& shard, std::uint64_t key) {
+        return shard.entries[(key / NUM_SHARDS) % shard.entries.size()];
+    }
+
+    std::array<Shard, NUM_SHARDS> m_shards;
+    std::unique_ptr<NNCacheFile> m_file;
 };
 
 #endif
@@ -0,0 +1,191 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "NNCacheFile.h"
+
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Utils.h"
+
+using namespace Utils;
+
+static constexpr std::array<char, 8> MAGIC = {
+    {'L', 'Z', 'N', 'N', 'C', 'A', 'C', 'H'}
+};
+
+std::unique_ptr<NNCacheFile> NNCacheFile::open(const std::string& filename,
+                                               const size_t size_mb) {
+#ifdef _WIN32
+    (void)size_mb;
+    myprintf("NNCache files are not supported on this platform.\n");
+    return nullptr;
+#else
+    auto file = std::unique_ptr<NNCacheFile>(new NNCacheFile());
+    file->m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file->m_fd >= 0) {
+        // The lock is held until we exit, whoever gets it is the writer.
+        file->m_writable = flock(file->m_fd, LOCK_EX | LOCK_NB) == 0;
+    } else {
+        file->m_fd = ::open(filename.c_str(), O_RDONLY);
+    }
+    if (file->m_fd < 0) {
+        myprintf("Could not open NNCache file %s.\n", filename.c_str());
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(file->m_fd, &st) != 0) {
+        return nullptr;
+    }
+    auto bytes = static_cast<size_t>(st.st_size);
+    const auto creating = bytes == 0;
+    if (creating) {
+        if (!file->m_writable) {
+            myprintf("NNCache file %s is still being created.\n",
+                     filename.c_str());
+            return nullptr;
+        }
+        const auto slots = std::max(size_t{1},
+                                    size_mb * 1024 * 1024 / sizeof(Slot));
+        bytes = sizeof(Header) + slots * sizeof(Slot);
+        if (ftruncate(file->m_fd, bytes) != 0) {
+            myprintf("Could not make room for NNCache file %s.\n",
+                     filename.c_str());
+            return nullptr;
+        }
+    } else if (bytes < sizeof(Header)) {
+        myprintf("%s is not an NNCache file.\n", filename.c_str());
+        return nullptr;
+    }
+
+    const auto protection = file->m_writable ? PROT_READ | PROT_WRITE
+                                             : PROT_READ;
+    auto map = mmap(nullptr, bytes, protection, MAP_SHARED, file->m_fd, 0);
+    if (map == MAP_FAILED) {
+        myprintf("Could not map NNCache file %s.\n", filename.c_str());
+        return nullptr;
+    }
+    file->m_map = static_cast<char*>(map);
+    file->m_map_bytes = bytes;
+
+    auto header = reinterpret_cast<Header*>(file->m_map);
+    if (creating) {
+        // A fresh file reads as zeros, so the slots are empty already.
+        // The magic goes last, readers ignore the file until then.
+        header->version = VERSION;
+        header->slot_bytes = sizeof(Slot);
+        header->slots = (bytes - sizeof(Header)) / sizeof(Slot);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = MAGIC;
+    }
+    if (header->magic != MAGIC || header->version != VERSION
+        || header->slot_bytes != sizeof(Slot)
+        || sizeof(Header) + header->slots * sizeof(Slot) > bytes) {
+        myprintf("%s is not an NNCache file for this build.\n",
+                 filename.c_str());
+        return nullptr;
+    }
+    file->m_slots = reinterpret_cast<Slot*>(file->m_map + sizeof(Header));
+    file->m_slot_count = header->slots;
+
+    // Warm up: reading every key brings the whole file into memory now
+    // instead of one page fault per lookup during the search.
+    madvise(file->m_map, bytes, MADV_WILLNEED);
+    auto used = size_t{0};
+    for (auto i = size_t{0}; i < file->m_slot_count; i++) {
+        if (file->m_slots[i].key.load(std::memory_order_relaxed) != 0) {
+            used++;
+        }
+    }
+    myprintf("NNCache file %s: %zu of %zu entries used%s.\n",
+             filename.c_str(), used, file->m_slot_count,
+             file->m_writable ? "" : ", read only");
+    return file;
+#endif
+}
+
+NNCacheFile::~NNCacheFile() {
+#ifndef _WIN32
+    if (m_map) {
+        munmap(m_map, m_map_bytes);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif
+}
+
+bool NNCacheFile::lookup(const std::uint64_t key, const std::uint64_t net,
+                         float& winrate, Policy& policy) {
+    ++m_lookups;
+    for (auto i = 0; i < PROBES; i++) {
+        auto& slot = m_slots[(key + i) % m_slot_count];
+        const auto slot_key = slot.key.load(std::memory_order_acquire);
+        if (slot_key == 0) {
+            // Slots are filled in probe order, the key isn't further on.
+            return false;
+        }
+        if (slot_key == key && slot.net == net) {
+            winrate = slot.winrate;
+            policy = slot.policy;
+            ++m_hits;
+            return true;
+        }
+    }
+    return false;
+}
+
+void NNCacheFile::insert(const std::uint64_t key, const std::uint64_t net,
+                         const float winrate, const Policy& policy) {
+    if (!m_writable) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_insert_mutex);
+    for (auto i = 0; i < PROBES; i++) {
+        auto& slot = m_slots[(key + i) % m_slot_count];
+        const auto slot_key = slot.key.load(std::memory_order_relaxed);
+        if (slot_key == key && slot.net == net) {
+            return;  // Already in the file.
+        }
+        if (slot_key == 0) {
+            slot.net = net;
+            slot.winrate = winrate;
+            slot.policy = policy;
+            slot.key.store(key, std::memory_order_release);
+            ++m_inserts;
+            return;
+        }
+    }
+    ++m_dropped;
+}
+
+void NNCacheFile::dump_stats() {
+    myprintf("NNCache file: %d/%d hits/lookups = %.1f%% hitrate, "
+             "%d inserts, %d dropped\n",
+             m_hits.load(), m_lookups.load(),
+             100. * m_hits / (m_lookups + 1),
+             m_inserts.load(), m_dropped.load());
+}
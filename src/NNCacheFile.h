@@ -0,0 +1,100 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNCACHEFILE_H_INCLUDED
+#define NNCACHEFILE_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+    A persistent tier behind the NNCache: a hash table of evaluations in
+    a memory mapped file, kept across runs and shared by every leelaz on
+    the host that opens the same file.
+
+    Entries are keyed by the position key and the hash of the network
+    that produced them, so one file serves every network it has seen and
+    switching back to a network finds its entries again. Slots are only
+    ever filled, never overwritten, so readers need no locks: a slot's
+    key is stored last. The first process to open the file is its only
+    writer, the others map it read only and see what the writer adds.
+*/
+class NNCacheFile {
+public:
+    using Policy = std::array<std::uint16_t, POTENTIAL_MOVES>;
+
+    // Opens filename, creating it with room for size_mb megabytes of
+    // entries if it doesn't exist. Returns nullptr if it can't be used.
+    static std::unique_ptr<NNCacheFile> open(const std::string& filename,
+                                             size_t size_mb);
+    ~NNCacheFile();
+    NNCacheFile(const NNCacheFile&) = delete;
+    NNCacheFile& operator=(const NNCacheFile&) = delete;
+
+    bool lookup(std::uint64_t key, std::uint64_t net,
+                float& winrate, Policy& policy);
+    // Does nothing in a read only file, or if the slots the key can go
+    // in are all taken.
+    void insert(std::uint64_t key, std::uint64_t net,
+                float winrate, const Policy& policy);
+
+    void dump_stats();
+
+private:
+    // Slots a key may be stored in, starting at its home slot.
+    static constexpr auto PROBES = 8;
+    static constexpr auto VERSION = 1;
+
+    struct Header {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        // sizeof(Slot), which changes with the board size.
+        std::uint32_t slot_bytes;
+        std::uint64_t slots;
+    };
+    struct Slot {
+        std::atomic<std::uint64_t> key;  // 0 while the slot is empty
+        std::uint64_t net;
+        float winrate;
+        Policy policy;
+    };
+
+    NNCacheFile() = default;
+
+    int m_fd{-1};
+    char* m_map{nullptr};
+    size_t m_map_bytes{0};
+    Slot* m_slots{nullptr};
+    size_t m_slot_count{0};
+    bool m_writable{false};
+    std::mutex m_insert_mutex;
+
+    std::atomic<int> m_hits{0};
+    std::atomic<int> m_lookups{0};
+    std::atomic<int> m_inserts{0};
+    std::atomic<int> m_dropped{0};
+};
+
+#endif
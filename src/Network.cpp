@@ -22,12 +22,19 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iterator>
 #include <memory>
+#include <future>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <boost/utility.hpp>
 #include <boost/format.hpp>
 
@@ -44,50 +51,185 @@
 #include "OpenCLScheduler.h"
 #include "UCTNode.h"
 #endif
-
+#ifdef USE_CUDNN
+#include "CuDNN.h"
+#endif
+#include "CPUBatchQueue.h"
 #include "FastBoard.h"
 #include "FastState.h"
 #include "FullBoard.h"
 #include "GameState.h"
 #include "GTP.h"
-#include "Im2Col.h"
+#include "Int8CPU.h"
+#include "MappedFile.h"
 #include "NNCache.h"
+#include "Numa.h"
+#include "PerfStats.h"
 #include "Random.h"
+#include "RemoteEval.h"
+#include "Speculator.h"
 #include "ThreadPool.h"
 #include "Timing.h"
+#include "Trace.h"
 #include "Utils.h"
+#include "WinogradCPU.h"
+#include "Zobrist.h"
 
 using namespace Utils;
 
-// Input + residual block tower
-static std::vector<std::vector<float>> conv_weights;
-static std::vector<std::vector<float>> conv_biases;
-static std::vector<std::vector<float>> batchnorm_means;
-static std::vector<std::vector<float>> batchnorm_stddivs;
-
-// Policy head
-static std::vector<float> conv_pol_w;
-static std::vector<float> conv_pol_b;
-static std::array<float, 2> bn_pol_w1;
-static std::array<float, 2> bn_pol_w2;
+// Two policy and one value channel come out of the head convolutions.
+static constexpr auto HEAD_CHANNELS = 3;
+
+// Everything loaded from a weights file. load_network_async prepares a
+// second one while the search keeps using net_weights.
+struct NetworkWeights {
+    // Input + residual block tower
+    std::vector<std::vector<float>> conv_weights;
+    std::vector<std::vector<float>> conv_biases;
+    std::vector<std::vector<float>> batchnorm_means;
+    std::vector<std::vector<float>> batchnorm_stddivs;
+
+    // Policy head
+    std::vector<float> conv_pol_w;
+    std::vector<float> conv_pol_b;
+    std::array<float, 2> bn_pol_w1;
+    std::array<float, 2> bn_pol_w2;
+
+    std::array<float, 2 * NUM_INTERSECTIONS * POTENTIAL_MOVES> ip_pol_w;
+    std::array<float, POTENTIAL_MOVES> ip_pol_b;
+
+    // Value head
+    std::vector<float> conv_val_w;
+    std::vector<float> conv_val_b;
+    std::array<float, 1> bn_val_w1;
+    std::array<float, 1> bn_val_w2;
+
+    std::array<float, NUM_INTERSECTIONS * 256> ip1_val_w;
+    std::array<float, 256> ip1_val_b;
+
+    std::array<float, 256> ip2_val_w;
+    std::array<float, 1> ip2_val_b;
+
+    // Both head convolutions as one 1x1 layer with HEAD_CHANNELS
+    // outputs, the policy ones first, made by prepare_weights. Its bias
+    // and batchnorm come down to out = relu(scale * (conv + shift)).
+    std::vector<float> conv_head_w;
+    std::array<float, HEAD_CHANNELS> head_shift;
+    std::array<float, HEAD_CHANNELS> head_scale;
+
+    // Set when the weights came from a binary file, whose 3x3 filters are
+    // already Winograd transformed.
+    bool binary_weights_loaded{false};
+
+    // Of the weights file, see hash_file. Only read on the first
+    // get_network_hash, most runs never need it. The NUMA copies share
+    // it.
+    struct FileHash {
+        std::string filename;
+        std::once_flag once;
+        std::uint64_t hash{0};
+    };
+    std::shared_ptr<FileHash> file_hash{std::make_shared<FileHash>()};
 
-static std::array<float, 261364> ip_pol_w;
-static std::array<float, 362> ip_pol_b;
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    // Only used with --int8, one per convolution layer.
+    std::vector<Int8CPU::Conv3> int8_convs;
+#endif
+};
 
-// Value head
-static std::vector<float> conv_val_w;
-static std::vector<float> conv_val_b;
-static std::array<float, 1> bn_val_w1;
-static std::array<float, 1> bn_val_w2;
+static std::unique_ptr<NetworkWeights> net_weights;
+#ifndef USE_OPENCL
+// With --numa, a copy of net_weights made on each node.
+static std::vector<std::unique_ptr<NetworkWeights>> numa_weights;
+#endif
 
-static std::array<float, 92416> ip1_val_w;
-static std::array<float, 256> ip1_val_b;
+// The weights the CPU backend reads, from the node of the calling
+// thread if there are copies.
+static const NetworkWeights& local_weights() {
+#ifndef USE_OPENCL
+    if (!numa_weights.empty()) {
+        return *numa_weights[Numa::current_node()];
+    }
+#endif
+    return *net_weights;
+}
 
-static std::array<float, 256> ip2_val_w;
-static std::array<float, 1> ip2_val_b;
+// Makes the copies for local_weights, after net_weights changed.
+static void replicate_weights() {
+#ifndef USE_OPENCL
+    numa_weights.clear();
+    if (!cfg_numa) {
+        return;
+    }
+    numa_weights.resize(Numa::num_nodes());
+    Numa::for_each_node([](int node) {
+        numa_weights[node] = std::make_unique<NetworkWeights>(*net_weights);
+    });
+#endif
+}
 
 // Rotation helper
-static std::array<std::array<int, 361>, 8> rotate_nn_idx_table;
+static std::array<std::array<int, NUM_INTERSECTIONS>, 8> rotate_nn_idx_table;
+// The inverse of each rotation in rotate_nn_idx_table.
+static std::array<std::array<int, NUM_INTERSECTIONS>, 8> unrotate_nn_idx_table;
+
+// See evaluations_in_flight, prefetch doesn't count.
+static std::atomic<int> s_evaluations_in_flight{0};
+
+namespace {
+struct InFlight {
+    InFlight() {
+        s_evaluations_in_flight++;
+        if (cfg_speculate > 0) {
+            Speculator::evaluation_started();
+        }
+    }
+    ~InFlight() { s_evaluations_in_flight--; }
+};
+}
+
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+// Only used when cfg_batch_size > 1.
+static std::unique_ptr<CPUBatchQueue> cpu_batch_queue;
+#endif
+
+#ifdef USE_CUDNN
+// Only used with --backend cudnn, the queue batches for the network.
+static std::unique_ptr<CuDNN_Network> cudnn_net;
+static std::unique_ptr<CPUBatchQueue> cudnn_batch_queue;
+#endif
+
+static bool use_cudnn() {
+#ifdef USE_CUDNN
+    return cfg_cudnn;
+#else
+    return false;
+#endif
+}
+
+// Only used with --eval-peer.
+static std::unique_ptr<RemoteEvaluator> remote_evaluator;
+
+// Channels of the network in use. OpenCL sizes its per-thread buffers
+// by them, so it can only switch to a network of the same width.
+static size_t network_channels;
+
+// Handed from the load_network_async thread to swap_network.
+namespace {
+struct PendingNetwork {
+    std::mutex mutex;
+    std::unique_ptr<NetworkWeights> weights;
+#ifdef USE_OPENCL
+    std::vector<std::unique_ptr<OpenCL_Network>> opencl_nets;
+#endif
+#ifdef USE_CUDNN
+    std::unique_ptr<CuDNN_Network> cudnn_net;
+#endif
+    std::string filename;
+};
+}
+
+static PendingNetwork pending_network;
 
 void Network::benchmark(const GameState * state, int iterations) {
     int cpus = cfg_num_threads;
@@ -99,7 +241,7 @@ void Network::benchmark(const GameState * state, int iterations) {
     for (int i = 0; i < cpus; i++) {
         tg.add_task([iters_per_thread, state]() {
             for (int loop = 0; loop < iters_per_thread; loop++) {
-                auto vec = get_scored_moves(state, Ensemble::RANDOM_ROTATION, -1, true);
+                get_scored_moves(state, Ensemble::RANDOM_ROTATION, -1, true);
             }
         });
     };
@@ -111,6 +253,47 @@ void Network::benchmark(const GameState * state, int iterations) {
              iterations, elapsed, (int)(iterations / elapsed));
 }
 
+double Network::benchmark_batch(const GameState* state,
+                               const size_t batch_size,
+                               const int iterations) {
+    auto planes = NNPlanes{};
+    gather_features(state, planes);
+    auto input = std::vector<net_t>{};
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        fill_input(planes, i % 8, input);
+    }
+    const auto convolve_channels = net_weights->conv_pol_w.size()
+                                   / net_weights->conv_pol_b.size();
+    auto output_size = convolve_channels * NUM_INTERSECTIONS;
+#ifdef USE_OPENCL
+    if (cfg_gpu_heads) {
+        output_size = HEAD_OUTPUTS;
+    }
+#endif
+    auto output = std::vector<net_t>(output_size * batch_size);
+
+    Time start;
+    for (auto i = 0; i < iterations; i++) {
+#ifdef USE_CUDNN
+        if (cudnn_net) {
+            cudnn_net->forward(input, output, batch_size);
+            continue;
+        }
+#endif
+#ifdef USE_OPENCL
+        opencl.get_networks()[0]->forward(input, output, batch_size);
+#elif defined(USE_BLAS)
+        if (cfg_int8) {
+            forward_cpu_int8(input, output, batch_size);
+        } else {
+            forward_cpu(input, output, batch_size);
+        }
+#endif
+    }
+    Time end;
+    return Time::timediff_seconds(start, end) * 1e6 / std::max(iterations, 1);
+}
+
 void Network::process_bn_var(std::vector<float>& weights, const float epsilon) {
     for(auto&& w : weights) {
         w = 1.0f / std::sqrt(w + epsilon);
@@ -160,6 +343,49 @@ std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
     return U;
 }
 
+std::vector<float> Network::winograd_inverse_f(const std::vector<float>& U,
+                                               const int outputs,
+                                               const int channels) {
+    // G has a left inverse that only picks and subtracts rows:
+    // f = Ginv.U.transpose(Ginv), exact up to float rounding.
+    auto Ginv = std::array<float, 12>{ 1.0,  0.0,  0.0,  0.0,
+                                       0.0,  1.0, -1.0,  0.0,
+                                       0.0,  0.0,  0.0,  1.0};
+    auto f = std::vector<float>(outputs * channels * 9);
+    auto temp = std::array<float, 12>{};
+
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            auto u = [&](const int xi, const int nu) {
+                return U[xi * (4 * outputs * channels)
+                         + nu * (outputs * channels)
+                         + c * outputs
+                         + o];
+            };
+            for (auto i = 0; i < 3; i++) {
+                for (auto nu = 0; nu < 4; nu++) {
+                    auto acc = 0.0f;
+                    for (auto k = 0; k < 4; k++) {
+                        acc += Ginv[i*4 + k] * u(k, nu);
+                    }
+                    temp[i*4 + nu] = acc;
+                }
+            }
+            for (auto i = 0; i < 3; i++) {
+                for (auto j = 0; j < 3; j++) {
+                    auto acc = 0.0f;
+                    for (auto k = 0; k < 4; k++) {
+                        acc += temp[i*4 + k] * Ginv[j*4 + k];
+                    }
+                    f[o*channels*9 + c*9 + i*3 + j] = acc;
+                }
+            }
+        }
+    }
+
+    return f;
+}
+
 std::vector<float> Network::zeropad_U(const std::vector<float>& U,
                                       const int outputs, const int channels,
                                       const int outputs_pad,
@@ -187,7 +413,8 @@ std::vector<float> Network::zeropad_U(const std::vector<float>& U,
     return Upad;
 }
 
-std::pair<int, int>  Network::load_v1_network(std::ifstream& wtfile) {
+std::pair<int, int>  Network::load_v1_network(std::ifstream& wtfile,
+                                              NetworkWeights& net) {
     // Count size of the network
     myprintf("Detecting residual layers...");
     // We are version 1
@@ -195,20 +422,23 @@ std::pair<int, int>  Network::load_v1_network(std::ifstream& wtfile) {
     // First line was the version number
     auto linecount = size_t{1};
     auto channels = 0;
+    auto lines = std::vector<std::string>{};
     auto line = std::string{};
     while (std::getline(wtfile, line)) {
-        auto iss = std::stringstream{line};
         // Third line of parameters are the convolution layer biases,
         // so this tells us the amount of channels in the residual layers.
         // (Provided they're all equally large - that's not actually required!)
         if (linecount == 2) {
+            auto iss = std::stringstream{line};
             auto count = std::distance(std::istream_iterator<std::string>(iss),
                                        std::istream_iterator<std::string>());
             myprintf("%d channels...", count);
             channels = count;
         }
+        lines.emplace_back(std::move(line));
         linecount++;
     }
+    wtfile.close();
     // 1 format id, 1 input layer (4 x weights), 14 ending weights,
     // the rest are residuals, every residual has 8 x weight lines
     auto residual_blocks = linecount - (1 + 4 + 14);
@@ -219,75 +449,274 @@ std::pair<int, int>  Network::load_v1_network(std::ifstream& wtfile) {
     residual_blocks /= 8;
     myprintf("%d blocks.\n", residual_blocks);
 
-    // Re-read file and process
-    wtfile.clear();
-    wtfile.seekg(0, std::ios::beg);
-
-    // Get the file format id out of the way
-    std::getline(wtfile, line);
+    // Parsing the text is most of the time it takes to load a network,
+    // and every line can be done on its own.
+    auto parsed = std::vector<std::vector<float>>(lines.size());
+    parallel_for(lines.size(), [&lines, &parsed](size_t i) {
+        auto& weights = parsed[i];
+        auto pos = lines[i].c_str();
+        for (;;) {
+            auto end = static_cast<char*>(nullptr);
+            const auto weight = std::strtof(pos, &end);
+            if (end == pos) {
+                break;
+            }
+            weights.emplace_back(weight);
+            pos = end;
+        }
+        std::string().swap(lines[i]);
+    });
 
     auto plain_conv_layers = 1 + (residual_blocks * 2);
     auto plain_conv_wts = plain_conv_layers * 4;
-    linecount = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        float weight;
-        std::istringstream iss(line);
-        while (iss >> weight) {
-            weights.emplace_back(weight);
-        }
+    for (linecount = 0; linecount < parsed.size(); linecount++) {
+        auto& weights = parsed[linecount];
         if (linecount < plain_conv_wts) {
             if (linecount % 4 == 0) {
-                conv_weights.emplace_back(weights);
+                net.conv_weights.emplace_back(std::move(weights));
             } else if (linecount % 4 == 1) {
                 // Redundant in our model, but they encode the
                 // number of outputs so we have to read them in.
-                conv_biases.emplace_back(weights);
+                net.conv_biases.emplace_back(std::move(weights));
             } else if (linecount % 4 == 2) {
-                batchnorm_means.emplace_back(weights);
+                net.batchnorm_means.emplace_back(std::move(weights));
             } else if (linecount % 4 == 3) {
                 process_bn_var(weights);
-                batchnorm_stddivs.emplace_back(weights);
+                net.batchnorm_stddivs.emplace_back(std::move(weights));
             }
         } else if (linecount == plain_conv_wts) {
-            conv_pol_w = std::move(weights);
+            net.conv_pol_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 1) {
-            conv_pol_b = std::move(weights);
+            net.conv_pol_b = std::move(weights);
         } else if (linecount == plain_conv_wts + 2) {
-            std::copy(begin(weights), end(weights), begin(bn_pol_w1));
+            std::copy(begin(weights), end(weights), begin(net.bn_pol_w1));
         } else if (linecount == plain_conv_wts + 3) {
             process_bn_var(weights);
-            std::copy(begin(weights), end(weights), begin(bn_pol_w2));
+            std::copy(begin(weights), end(weights), begin(net.bn_pol_w2));
         } else if (linecount == plain_conv_wts + 4) {
-            std::copy(begin(weights), end(weights), begin(ip_pol_w));
+            // The fully connected layers are tied to the board size.
+            if (weights.size() != net.ip_pol_w.size()) {
+                myprintf("\nThe network is not for a %dx%d board.\n",
+                         BOARD_SIZE, BOARD_SIZE);
+                return {0, 0};
+            }
+            std::copy(begin(weights), end(weights), begin(net.ip_pol_w));
         } else if (linecount == plain_conv_wts + 5) {
-            std::copy(begin(weights), end(weights), begin(ip_pol_b));
+            std::copy(begin(weights), end(weights), begin(net.ip_pol_b));
         } else if (linecount == plain_conv_wts + 6) {
-            conv_val_w = std::move(weights);
+            net.conv_val_w = std::move(weights);
         } else if (linecount == plain_conv_wts + 7) {
-            conv_val_b = std::move(weights);
+            net.conv_val_b = std::move(weights);
         } else if (linecount == plain_conv_wts + 8) {
-            std::copy(begin(weights), end(weights), begin(bn_val_w1));
+            std::copy(begin(weights), end(weights), begin(net.bn_val_w1));
         } else if (linecount == plain_conv_wts + 9) {
             process_bn_var(weights);
-            std::copy(begin(weights), end(weights), begin(bn_val_w2));
+            std::copy(begin(weights), end(weights), begin(net.bn_val_w2));
         } else if (linecount == plain_conv_wts + 10) {
-            std::copy(begin(weights), end(weights), begin(ip1_val_w));
+            if (weights.size() != net.ip1_val_w.size()) {
+                myprintf("\nThe network is not for a %dx%d board.\n",
+                         BOARD_SIZE, BOARD_SIZE);
+                return {0, 0};
+            }
+            std::copy(begin(weights), end(weights), begin(net.ip1_val_w));
         } else if (linecount == plain_conv_wts + 11) {
-            std::copy(begin(weights), end(weights), begin(ip1_val_b));
+            std::copy(begin(weights), end(weights), begin(net.ip1_val_b));
         } else if (linecount == plain_conv_wts + 12) {
-            std::copy(begin(weights), end(weights), begin(ip2_val_w));
+            std::copy(begin(weights), end(weights), begin(net.ip2_val_w));
         } else if (linecount == plain_conv_wts + 13) {
-            std::copy(begin(weights), end(weights), begin(ip2_val_b));
+            std::copy(begin(weights), end(weights), begin(net.ip2_val_b));
         }
-        linecount++;
+        // Free as we go, the network takes enough memory twice over.
+        std::vector<float>().swap(weights);
     }
-    wtfile.close();
 
     return {channels, residual_blocks};
 }
 
-std::pair<int, int> Network::load_network_file(std::string filename) {
+/*
+    Binary weights file: a BinaryHeader, then every array of a v1 text
+    file in the same order, each as a uint32 count followed by that many
+    floats. The arrays are stored ready to use: batchnorm variances
+    already inverted and the 3x3 filters already Winograd transformed.
+    Everything is in native byte order. The file is mapped rather than
+    read, so loading it is little more than a memcpy per array.
+*/
+namespace {
+struct BinaryHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t channels;
+    std::uint32_t residual_blocks;
+};
+// "LZBW" when read back on a little-endian machine.
+constexpr auto BINARY_MAGIC = std::uint32_t{0x57425a4c};
+constexpr auto BINARY_VERSION = std::uint32_t{1};
+
+// Sequential reader over the arrays of a mapped binary weights file.
+class BinaryReader {
+public:
+    BinaryReader(const char* data, size_t size, size_t offset)
+        : m_data(data), m_size(size), m_offset(offset) {}
+
+    bool read(std::vector<float>& out) {
+        auto count = std::uint32_t{};
+        if (m_size - m_offset < sizeof(count)) {
+            return false;
+        }
+        std::memcpy(&count, m_data + m_offset, sizeof(count));
+        m_offset += sizeof(count);
+        if ((m_size - m_offset) / sizeof(float) < count) {
+            return false;
+        }
+        out.resize(count);
+        std::memcpy(out.data(), m_data + m_offset, count * sizeof(float));
+        m_offset += count * sizeof(float);
+        return true;
+    }
+
+    template <size_t N>
+    bool read(std::array<float, N>& out) {
+        auto weights = std::vector<float>{};
+        if (!read(weights) || weights.size() != N) {
+            return false;
+        }
+        std::copy(begin(weights), end(weights), begin(out));
+        return true;
+    }
+private:
+    const char* m_data;
+    size_t m_size;
+    size_t m_offset;
+};
+
+void write_array(std::ofstream& out, const float* data, size_t count) {
+    const auto count32 = static_cast<std::uint32_t>(count);
+    out.write(reinterpret_cast<const char*>(&count32), sizeof(count32));
+    out.write(reinterpret_cast<const char*>(data), count * sizeof(float));
+}
+
+template <typename Container>
+void write_array(std::ofstream& out, const Container& weights) {
+    write_array(out, weights.data(), weights.size());
+}
+}
+
+std::pair<int, int> Network::load_binary_network(std::string filename,
+                                                 NetworkWeights& net) {
+    myprintf("Loading binary weights...");
+    const MappedFile file(filename);
+    auto header = BinaryHeader{};
+    if (file.size() < sizeof(header)) {
+        myprintf("\nCould not read binary weights file: %s\n",
+                 filename.c_str());
+        return {0, 0};
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != BINARY_MAGIC || header.version != BINARY_VERSION) {
+        myprintf("\nBinary weights file is the wrong version.\n");
+        return {0, 0};
+    }
+    myprintf("%d channels...%d blocks.\n",
+             header.channels, header.residual_blocks);
+
+    auto reader = BinaryReader{file.data(), file.size(), sizeof(header)};
+    auto ok = true;
+    const auto plain_conv_layers = 1 + header.residual_blocks * 2;
+    for (auto i = size_t{0}; i < plain_conv_layers && ok; i++) {
+        auto weights = std::vector<float>{};
+        auto biases = std::vector<float>{};
+        auto means = std::vector<float>{};
+        auto stddivs = std::vector<float>{};
+        ok = reader.read(weights) && reader.read(biases)
+             && reader.read(means) && reader.read(stddivs);
+        net.conv_weights.emplace_back(std::move(weights));
+        net.conv_biases.emplace_back(std::move(biases));
+        net.batchnorm_means.emplace_back(std::move(means));
+        net.batchnorm_stddivs.emplace_back(std::move(stddivs));
+    }
+    ok = ok
+        && reader.read(net.conv_pol_w) && reader.read(net.conv_pol_b)
+        && reader.read(net.bn_pol_w1) && reader.read(net.bn_pol_w2)
+        && reader.read(net.ip_pol_w) && reader.read(net.ip_pol_b)
+        && reader.read(net.conv_val_w) && reader.read(net.conv_val_b)
+        && reader.read(net.bn_val_w1) && reader.read(net.bn_val_w2)
+        && reader.read(net.ip1_val_w) && reader.read(net.ip1_val_b)
+        && reader.read(net.ip2_val_w) && reader.read(net.ip2_val_b);
+    if (!ok) {
+        myprintf("Inconsistent number of weights in the file.\n");
+        return {0, 0};
+    }
+
+    net.binary_weights_loaded = true;
+    return {header.channels, header.residual_blocks};
+}
+
+void Network::save_binary_network(std::string filename,
+                                  const NetworkWeights& net,
+                                  const int channels,
+                                  const int residual_blocks) {
+    auto out = std::ofstream{filename, std::ios::binary};
+    auto header = BinaryHeader{BINARY_MAGIC, BINARY_VERSION,
+                               std::uint32_t(channels),
+                               std::uint32_t(residual_blocks)};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (auto i = size_t{0}; i < net.conv_weights.size(); i++) {
+        write_array(out, net.conv_weights[i]);
+        write_array(out, net.conv_biases[i]);
+        write_array(out, net.batchnorm_means[i]);
+        write_array(out, net.batchnorm_stddivs[i]);
+    }
+    write_array(out, net.conv_pol_w);
+    write_array(out, net.conv_pol_b);
+    write_array(out, net.bn_pol_w1);
+    write_array(out, net.bn_pol_w2);
+    write_array(out, net.ip_pol_w);
+    write_array(out, net.ip_pol_b);
+    write_array(out, net.conv_val_w);
+    write_array(out, net.conv_val_b);
+    write_array(out, net.bn_val_w1);
+    write_array(out, net.bn_val_w2);
+    write_array(out, net.ip1_val_w);
+    write_array(out, net.ip1_val_b);
+    write_array(out, net.ip2_val_w);
+    write_array(out, net.ip2_val_b);
+    out.close();
+    if (out.fail()) {
+        myprintf("Could not write binary weights file: %s\n",
+                 filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    myprintf("Wrote binary weights to %s.\n", filename.c_str());
+}
+
+// 64-bit FNV-1a of the contents of filename.
+static std::uint64_t hash_file(const std::string& filename) {
+    auto file = std::ifstream{filename, std::ios::binary};
+    auto buffer = std::vector<char>(1 << 16);
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        const auto count = static_cast<size_t>(file.gcount());
+        for (auto i = size_t{0}; i < count; i++) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= std::uint64_t{1099511628211ULL};
+        }
+    }
+    return hash;
+}
+
+std::pair<int, int> Network::load_network_file(std::string filename,
+                                               NetworkWeights& net) {
+    net.file_hash->filename = filename;
+    {
+        auto binfile = std::ifstream{filename, std::ios::binary};
+        auto magic = std::uint32_t{};
+        if (binfile.read(reinterpret_cast<char*>(&magic), sizeof(magic))
+            && magic == BINARY_MAGIC) {
+            binfile.close();
+            return load_binary_network(filename, net);
+        }
+    }
+
     auto wtfile = std::ifstream{filename};
     if (wtfile.fail()) {
         myprintf("Could not open weights file: %s\n", filename.c_str());
@@ -306,93 +735,246 @@ std::pair<int, int> Network::load_network_file(std::string filename) {
             return {0, 0};
         } else {
             assert(format_version == FORMAT_VERSION);
-            return load_v1_network(wtfile);
+            return load_v1_network(wtfile, net);
         }
     }
 
     return {0, 0};
 }
 
+void Network::prepare_weights(NetworkWeights& net,
+                              const size_t channels,
+                              const size_t residual_blocks) {
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    if (cfg_int8) {
+        // Quantize the plain 3x3 filters, before the Winograd transform.
+        auto convs = std::vector<std::unique_ptr<Int8CPU::Conv3>>(
+            net.conv_weights.size());
+        parallel_for(convs.size(), [&net, &convs](size_t i) {
+            const auto outputs = net.conv_biases[i].size();
+            if (net.binary_weights_loaded) {
+                const auto inputs =
+                    net.conv_weights[i].size() / (outputs * WINOGRAD_TILE);
+                convs[i] = std::make_unique<Int8CPU::Conv3>(
+                    winograd_inverse_f(net.conv_weights[i], outputs, inputs),
+                    outputs, inputs);
+            } else {
+                const auto inputs = net.conv_weights[i].size() / (outputs * 9);
+                convs[i] = std::make_unique<Int8CPU::Conv3>(
+                    net.conv_weights[i], outputs, inputs);
+            }
+        });
+        for (auto& conv : convs) {
+            net.int8_convs.emplace_back(std::move(*conv));
+        }
+    }
+#endif
+
+    net.conv_head_w = net.conv_pol_w;
+    net.conv_head_w.insert(end(net.conv_head_w),
+                           begin(net.conv_val_w), end(net.conv_val_w));
+    for (auto c = 0; c < HEAD_CHANNELS; c++) {
+        const auto policy = c < 2;
+        const auto bias = policy ? net.conv_pol_b[c] : net.conv_val_b[0];
+        const auto mean = policy ? net.bn_pol_w1[c] : net.bn_val_w1[0];
+        net.head_shift[c] = bias - mean;
+        net.head_scale[c] = policy ? net.bn_pol_w2[c] : net.bn_val_w2[0];
+    }
+
+    if (!net.binary_weights_loaded) {
+        // Winograd transform convolution weights, the input convolution
+        // first, then the residual block convolutions.
+        assert(net.conv_weights.size() == 1 + residual_blocks * 2);
+        (void)residual_blocks;
+        parallel_for(net.conv_weights.size(), [&net, channels](size_t i) {
+            const auto inputs = i == 0 ? size_t{INPUT_CHANNELS} : channels;
+            net.conv_weights[i] =
+                winograd_transform_f(net.conv_weights[i], channels, inputs);
+        });
+    }
+}
+
+#ifdef USE_OPENCL
+void Network::push_opencl_weights(OpenCL_Network& opencl_net,
+                                  const NetworkWeights& net,
+                                  const size_t channels,
+                                  const size_t residual_blocks) {
+    auto tuners = opencl_net.getOpenCL().get_sgemm_tuners();
+
+    auto mwg = tuners[0];
+    auto kwg = tuners[2];
+    auto vwm = tuners[3];
+
+    auto weight_index = size_t{0};
+
+    size_t m_ceil = lcm(lcm(channels, mwg), vwm);
+    size_t k_ceil = lcm(lcm(INPUT_CHANNELS, kwg), vwm);
+
+    auto Upad = zeropad_U(net.conv_weights[weight_index],
+                          channels, INPUT_CHANNELS,
+                          m_ceil, k_ceil);
+
+    // Winograd filter transformation changes filter size to 4x4
+    opencl_net.push_convolve(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, Upad);
+    opencl_net.push_batchnorm(NUM_INTERSECTIONS,
+                              net.batchnorm_means[weight_index],
+                              net.batchnorm_stddivs[weight_index]);
+    weight_index++;
+
+    // residual blocks
+    for (auto i = size_t{0}; i < residual_blocks; i++) {
+        auto Upad1 = zeropad_U(net.conv_weights[weight_index],
+                               channels, channels,
+                               m_ceil, m_ceil);
+        auto Upad2 = zeropad_U(net.conv_weights[weight_index + 1],
+                               channels, channels,
+                               m_ceil, m_ceil);
+        opencl_net.push_residual(WINOGRAD_ALPHA, channels, channels,
+                                 Upad1,
+                                 net.batchnorm_means[weight_index],
+                                 net.batchnorm_stddivs[weight_index],
+                                 Upad2,
+                                 net.batchnorm_means[weight_index + 1],
+                                 net.batchnorm_stddivs[weight_index + 1]);
+        weight_index += 2;
+    }
+
+    if (cfg_gpu_heads) {
+        auto to_vector = [](const auto& weights) {
+            return std::vector<float>(begin(weights), end(weights));
+        };
+        opencl_net.push_policy_head(channels,
+                                    net.conv_pol_w, net.conv_pol_b,
+                                    to_vector(net.bn_pol_w1),
+                                    to_vector(net.bn_pol_w2),
+                                    to_vector(net.ip_pol_w),
+                                    to_vector(net.ip_pol_b));
+        opencl_net.push_value_head(channels,
+                                   net.conv_val_w, net.conv_val_b,
+                                   to_vector(net.bn_val_w1),
+                                   to_vector(net.bn_val_w2),
+                                   to_vector(net.ip1_val_w),
+                                   to_vector(net.ip1_val_b),
+                                   to_vector(net.ip2_val_w),
+                                   to_vector(net.ip2_val_b));
+    }
+}
+#endif
+
+#ifdef USE_CUDNN
+std::unique_ptr<CuDNN_Network> Network::make_cudnn_network(
+    const NetworkWeights& net, const size_t channels,
+    const size_t residual_blocks) {
+    auto cudnn = std::make_unique<CuDNN_Network>(cfg_cuda_device,
+                                                 cfg_batch_size);
+    auto weight_index = size_t{0};
+    cudnn->push_convolve(3, INPUT_CHANNELS, channels,
+                         winograd_inverse_f(net.conv_weights[weight_index],
+                                            channels, INPUT_CHANNELS));
+    cudnn->push_batchnorm(NUM_INTERSECTIONS,
+                          net.batchnorm_means[weight_index],
+                          net.batchnorm_stddivs[weight_index]);
+    weight_index++;
+
+    for (auto i = size_t{0}; i < residual_blocks; i++) {
+        cudnn->push_residual(3, channels, channels,
+                             winograd_inverse_f(net.conv_weights[weight_index],
+                                                channels, channels),
+                             net.batchnorm_means[weight_index],
+                             net.batchnorm_stddivs[weight_index],
+                             winograd_inverse_f(net.conv_weights[weight_index + 1],
+                                                channels, channels),
+                             net.batchnorm_means[weight_index + 1],
+                             net.batchnorm_stddivs[weight_index + 1]);
+        weight_index += 2;
+    }
+    return cudnn;
+}
+#endif
+
 void Network::initialize(void) {
     // Prepare rotation table
     for(auto s = 0; s < 8; s++) {
-        for(auto v = 0; v < 19 * 19; v++) {
+        for(auto v = 0; v < NUM_INTERSECTIONS; v++) {
             rotate_nn_idx_table[s][v] = rotate_nn_idx(v, s);
+            unrotate_nn_idx_table[s][rotate_nn_idx_table[s][v]] = v;
         }
     }
 
     // Load network from file
+    const auto load_start = Time();
+    auto loaded = std::make_unique<NetworkWeights>();
     size_t channels, residual_blocks;
-    std::tie(channels, residual_blocks) = load_network_file(cfg_weightsfile);
+    std::tie(channels, residual_blocks) =
+        load_network_file(cfg_weightsfile, *loaded);
     if (channels == 0) {
         exit(EXIT_FAILURE);
     }
-
-    auto weight_index = size_t{0};
-    // Input convolution
-    // Winograd transform convolution weights
-    conv_weights[weight_index] =
-        winograd_transform_f(conv_weights[weight_index],
-                             channels, INPUT_CHANNELS);
-    weight_index++;
-
-    // Residual block convolutions
-    for (auto i = size_t{0}; i < residual_blocks * 2; i++) {
-		conv_weights[weight_index] =
-            winograd_transform_f(conv_weights[weight_index],
-                                 channels, channels);
-        weight_index++;
+    const auto prepare_start = Time();
+    prepare_weights(*loaded, channels, residual_blocks);
+    const auto prepare_end = Time();
+    auto startup = str(boost::format("Startup: weights %.2f s, "
+                                     "transforms %.2f s")
+        % Time::timediff_seconds(load_start, prepare_start)
+        % Time::timediff_seconds(prepare_start, prepare_end));
+
+    if (!cfg_binary_weightsfile.empty()) {
+        save_binary_network(cfg_binary_weightsfile, *loaded,
+                            channels, residual_blocks);
+        exit(EXIT_SUCCESS);
     }
-
+    net_weights = std::move(loaded);
+    replicate_weights();
+    network_channels = channels;
+
+#ifdef USE_CUDNN
+    if (cfg_cudnn) {
+        myprintf("Initializing cuDNN.\n");
+        cudnn_net = make_cudnn_network(*net_weights, channels,
+                                       residual_blocks);
+        myprintf("Selected device: %s\n",
+                 cudnn_net->get_device_name().c_str());
+        cudnn_batch_queue = std::make_unique<CPUBatchQueue>(cfg_batch_size,
+            [](const std::vector<float>& input, std::vector<float>& output,
+               size_t batch_size) {
+                cudnn_net->forward(input, output, batch_size);
+            });
+        startup += str(boost::format(", cuDNN %.2f s")
+            % Time::timediff_seconds(prepare_end, Time()));
+    }
+#endif
 #ifdef USE_OPENCL
-    myprintf("Initializing OpenCL.\n");
-    opencl.initialize(channels);
+    if (!use_cudnn()) {
+        myprintf("Initializing OpenCL.\n");
+#ifdef USE_BLAS
+        opencl.initialize(channels, forward_cpu_device, cfg_cpu_workers);
+#else
+        opencl.initialize(channels);
+#endif
+        const auto opencl_end = Time();
 
-    if (cfg_tune_only) {
-        exit(EXIT_SUCCESS);
-    }
+        if (cfg_tune_only) {
+            exit(EXIT_SUCCESS);
+        }
 
-    for(auto & opencl_net : opencl.get_networks()) {
-        auto tuners = opencl_net->getOpenCL().get_sgemm_tuners();
-
-        auto mwg = tuners[0];
-        auto kwg = tuners[2];
-        auto vwm = tuners[3];
-
-        weight_index = 0;
-
-        size_t m_ceil = lcm(lcm(channels, mwg), vwm);
-        size_t k_ceil = lcm(lcm(INPUT_CHANNELS, kwg), vwm);
-
-        auto Upad = zeropad_U(conv_weights[weight_index],
-                              channels, INPUT_CHANNELS,
-                              m_ceil, k_ceil);
-
-        // Winograd filter transformation changes filter size to 4x4
-        opencl_net->push_convolve(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, Upad);
-        opencl_net->push_batchnorm(361, batchnorm_means[weight_index],
-                                    batchnorm_stddivs[weight_index]);
-        weight_index++;
-
-        // residual blocks
-        for (auto i = size_t{0}; i < residual_blocks; i++) {
-            auto Upad1 = zeropad_U(conv_weights[weight_index],
-                                   channels, channels,
-                                   m_ceil, m_ceil);
-            auto Upad2 = zeropad_U(conv_weights[weight_index + 1],
-                                   channels, channels,
-                                   m_ceil, m_ceil);
-            opencl_net->push_residual(WINOGRAD_ALPHA, channels, channels,
-                                      Upad1,
-                                      batchnorm_means[weight_index],
-                                      batchnorm_stddivs[weight_index],
-                                      Upad2,
-                                      batchnorm_means[weight_index + 1],
-                                      batchnorm_stddivs[weight_index + 1]);
-            weight_index += 2;
+        // Every GPU gets its copy of the weights at the same time.
+        auto uploads = std::vector<std::future<void>>{};
+        for (auto& opencl_net : opencl.get_networks()) {
+            uploads.emplace_back(std::async(std::launch::async,
+                [&opencl_net, channels, residual_blocks]() {
+                    push_opencl_weights(*opencl_net, *net_weights,
+                                        channels, residual_blocks);
+                }));
         }
+        for (auto& upload : uploads) {
+            upload.get();
+        }
+        startup += str(boost::format(", OpenCL %.2f s, upload %.2f s")
+            % Time::timediff_seconds(prepare_end, opencl_end)
+            % Time::timediff_seconds(opencl_end, Time()));
     }
 #endif
+    myprintf("%s.\n", startup.c_str());
 #ifdef USE_BLAS
 #ifndef __APPLE__
 #ifdef USE_OPENBLAS
@@ -407,101 +989,148 @@ void Network::initialize(void) {
     myprintf("BLAS core: MKL %s\n", Version.Processor);
 #endif
 #endif
+    myprintf("Winograd transforms: %s\n", WinogradCPU::get_isa_name());
 #endif
-}
-
-#ifdef USE_BLAS
-void Network::winograd_transform_in(const std::vector<float>& in,
-                                    std::vector<float>& V,
-                                    const int C) {
-    constexpr auto W = 19;
-    constexpr auto H = 19;
-    constexpr auto wtiles = (W + 1) / 2;
-    constexpr auto P = wtiles * wtiles;
-
-    for (auto ch = 0; ch < C; ch++) {
-        for (auto block_y = 0; block_y < wtiles; block_y++) {
-            for (auto block_x = 0; block_x < wtiles; block_x++) {
-
-                // Tiles overlap by 2
-                const auto yin = 2 * block_y - 1;
-                const auto xin = 2 * block_x - 1;
-
-                // Cache input tile and handle zero padding
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile x;
-
-                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
-                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
-                        if ((yin + i) >= 0 && (xin + j) >= 0
-                            && (yin + i) < H && (xin + j) < W) {
-                            x[i][j] = in[ch*(W*H) + (yin+i)*W + (xin+j)];
-                        } else {
-                            x[i][j] = 0.0f;
-                        }
-                    }
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    if (cfg_int8) {
+        myprintf("Int8 dot products: %s\n", Int8CPU::get_isa_name());
+    }
+    if (cfg_batch_size > 1 && !use_cudnn()) {
+        cpu_batch_queue = std::make_unique<CPUBatchQueue>(cfg_batch_size,
+            [](const std::vector<float>& input, std::vector<float>& output,
+               size_t batch_size) {
+                if (cfg_int8) {
+                    forward_cpu_int8(input, output, batch_size);
+                } else {
+                    forward_cpu(input, output, batch_size);
                 }
+            });
+    }
+#endif
+    if (!cfg_eval_peers.empty()) {
+        remote_evaluator = std::make_unique<RemoteEvaluator>(cfg_eval_peers,
+                                                             cfg_batch_size);
+    }
+}
 
-                const auto offset = ch*P + block_y*wtiles + block_x;
-
-                // Calculates transpose(B).x.B
-                // B = [[ 1.0,  0.0,  0.0,  0.0],
-                //      [ 0.0,  1.0, -1.0,  1.0],
-                //      [-1.0,  1.0,  1.0,  0.0],
-                //      [ 0.0,  0.0,  0.0, -1.0]]
-
-                WinogradTile T1, T2;
-
-                T1[0][0] = x[0][0] - x[2][0];
-                T1[0][1] = x[0][1] - x[2][1];
-                T1[0][2] = x[0][2] - x[2][2];
-                T1[0][3] = x[0][3] - x[2][3];
-                T1[1][0] = x[1][0] + x[2][0];
-                T1[1][1] = x[1][1] + x[2][1];
-                T1[1][2] = x[1][2] + x[2][2];
-                T1[1][3] = x[1][3] + x[2][3];
-                T1[2][0] = x[2][0] - x[1][0];
-                T1[2][1] = x[2][1] - x[1][1];
-                T1[2][2] = x[2][2] - x[1][2];
-                T1[2][3] = x[2][3] - x[1][3];
-                T1[3][0] = x[1][0] - x[3][0];
-                T1[3][1] = x[1][1] - x[3][1];
-                T1[3][2] = x[1][2] - x[3][2];
-                T1[3][3] = x[1][3] - x[3][3];
-
-                T2[0][0] = T1[0][0] - T1[0][2];
-                T2[0][1] = T1[0][1] + T1[0][2];
-                T2[0][2] = T1[0][2] - T1[0][1];
-                T2[0][3] = T1[0][1] - T1[0][3];
-                T2[1][0] = T1[1][0] - T1[1][2];
-                T2[1][1] = T1[1][1] + T1[1][2];
-                T2[1][2] = T1[1][2] - T1[1][1];
-                T2[1][3] = T1[1][1] - T1[1][3];
-                T2[2][0] = T1[2][0] - T1[2][2];
-                T2[2][1] = T1[2][1] + T1[2][2];
-                T2[2][2] = T1[2][2] - T1[2][1];
-                T2[2][3] = T1[2][1] - T1[2][3];
-                T2[3][0] = T1[3][0] - T1[3][2];
-                T2[3][1] = T1[3][1] + T1[3][2];
-                T2[3][2] = T1[3][2] - T1[3][1];
-                T2[3][3] = T1[3][1] - T1[3][3];
-
-                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
-                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
-                        V[(i*WINOGRAD_ALPHA + j)*C*P + offset] = T2[i][j];
-                    }
-                }
+void Network::load_network_async(const std::string& filename) {
+    std::thread([filename]() {
+        myprintf("Loading network %s in the background.\n",
+                 filename.c_str());
+        auto loaded = std::make_unique<NetworkWeights>();
+        size_t channels, residual_blocks;
+        std::tie(channels, residual_blocks) =
+            load_network_file(filename, *loaded);
+        if (channels == 0) {
+            myprintf("Keeping the current network.\n");
+            return;
+        }
+        prepare_weights(*loaded, channels, residual_blocks);
+#ifdef USE_CUDNN
+        auto cudnn = std::unique_ptr<CuDNN_Network>{};
+        if (cfg_cudnn) {
+            cudnn = make_cudnn_network(*loaded, channels, residual_blocks);
+        }
+#endif
+#ifdef USE_OPENCL
+        auto opencl_nets = std::vector<std::unique_ptr<OpenCL_Network>>{};
+        if (!use_cudnn()) {
+            auto current_channels = size_t{0};
+            {
+                std::lock_guard<std::mutex> lock(pending_network.mutex);
+                current_channels = network_channels;
+            }
+            if (channels != current_channels) {
+                myprintf("OpenCL can only switch to a network with %d channels.\n",
+                         int(current_channels));
+                return;
+            }
+            opencl_nets = opencl.make_networks();
+            for (auto& opencl_net : opencl_nets) {
+                push_opencl_weights(*opencl_net, *loaded,
+                                    channels, residual_blocks);
             }
         }
+#endif
+        std::lock_guard<std::mutex> lock(pending_network.mutex);
+        pending_network.weights = std::move(loaded);
+#ifdef USE_OPENCL
+        pending_network.opencl_nets = std::move(opencl_nets);
+#endif
+#ifdef USE_CUDNN
+        pending_network.cudnn_net = std::move(cudnn);
+#endif
+        pending_network.filename = filename;
+        myprintf("Network %s is ready.\n", filename.c_str());
+    }).detach();
+}
+
+std::uint64_t Network::get_network_hash() {
+    auto& file_hash = *net_weights->file_hash;
+    std::call_once(file_hash.once, [&file_hash]() {
+        file_hash.hash = hash_file(file_hash.filename);
+    });
+    auto hash = file_hash.hash;
+    // The cached policies are after the softmax.
+    if (cfg_softmax_temp != 1.0f) {
+        auto temp_bits = std::uint32_t{};
+        std::memcpy(&temp_bits, &cfg_softmax_temp, sizeof(temp_bits));
+        hash ^= std::uint64_t{temp_bits} * 0xff51afd7ed558ccdULL;
+    }
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    if (cfg_int8) {
+        hash ^= 0x9e3779b97f4a7c15ULL;
+    }
+#endif
+#ifdef USE_HALF
+    hash ^= 0xc2b2ae3d27d4eb4fULL;
+#endif
+    return hash;
+}
+
+bool Network::swap_network() {
+    std::lock_guard<std::mutex> lock(pending_network.mutex);
+    if (!pending_network.weights) {
+        return false;
+    }
+    // Speculative evaluations still running use the old weights.
+    Speculator::clear();
+    net_weights = std::move(pending_network.weights);
+    replicate_weights();
+    network_channels = net_weights->conv_biases[0].size();
+#ifdef USE_OPENCL
+    if (!use_cudnn()) {
+        opencl.swap_layers(pending_network.opencl_nets);
+        // Now holds the old weights.
+        pending_network.opencl_nets.clear();
+    }
+#endif
+#ifdef USE_CUDNN
+    if (cfg_cudnn) {
+        cudnn_net = std::move(pending_network.cudnn_net);
     }
+#endif
+    cfg_weightsfile = pending_network.filename;
+    NNCache::get_NNCache().clear();
+    myprintf("Switched to network %s.\n", cfg_weightsfile.c_str());
+    return true;
+}
+
+#ifdef USE_BLAS
+void Network::winograd_transform_in(const std::vector<float>& in,
+                                    std::vector<float>& V,
+                                    const int C, const int batch_size) {
+    WinogradCPU::transform_in(in.data(), V.data(), C, batch_size);
 }
 
 void Network::winograd_sgemm(const std::vector<float>& U,
                              std::vector<float>& V,
                              std::vector<float>& M,
-                             const int C, const int K) {
-    constexpr auto P = (19 + 1) * (19 + 1) / WINOGRAD_ALPHA;
+                             const int C, const int K,
+                             const int batch_size) {
+    // The tiles of all positions in the batch are stacked, so each
+    // element of the tile is one GEMM with N = batch_size * tiles.
+    const auto P = batch_size * WINOGRAD_P;
 
     for (auto b = 0; b < WINOGRAD_TILE; b++) {
         auto offset_u = b * K * C;
@@ -520,67 +1149,12 @@ void Network::winograd_sgemm(const std::vector<float>& U,
 
 void Network::winograd_transform_out(const std::vector<float>& M,
                                      std::vector<float>& Y,
-                                     const int K) {
-    constexpr auto W = 19;
-    constexpr auto H = 19;
-    constexpr auto wtiles = (W + 1) / 2;
-    constexpr auto P = wtiles * wtiles;
-
-    for (auto k = 0; k < K; k++) {
-        for (auto block_x = 0; block_x < wtiles; block_x++) {
-            for (auto block_y = 0; block_y < wtiles; block_y++) {
-
-                const auto x = 2 * block_x;
-                const auto y = 2 * block_y;
-
-                const auto b = block_y * wtiles + block_x;
-                std::array<float, WINOGRAD_TILE> temp_m;
-                for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
-                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
-                        temp_m[xi*WINOGRAD_ALPHA + nu] =
-                            M[xi*(WINOGRAD_ALPHA*K*P) + nu*(K*P)+ k*P + b];
-                    }
-                }
-
-                // Calculates transpose(A).temp_m.A
-                //    A = [1.0,  0.0],
-                //        [1.0,  1.0],
-                //        [1.0, -1.0],
-                //        [0.0, -1.0]]
-
-                auto o11 =
-                    temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
-                    temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
-                    temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
-
-                auto o12 =
-                    temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
-                    temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
-                    temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
-
-                auto o21 =
-                    temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
-                    temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
-                    temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
-
-                auto o22 =
-                    temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
-                    temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
-                    temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
-
-                Y[k*(H*W) + (y)*W + (x)] = o11;
-                if (x + 1 < W) {
-                    Y[k*(H*W) + (y)*W + (x+1)] = o12;
-                }
-                if (y + 1 < H) {
-                    Y[k*(H*W) + (y+1)*W + (x)] = o21;
-                    if (x + 1 < W) {
-                        Y[k*(H*W) + (y+1)*W + (x+1)] = o22;
-                    }
-                }
-            }
-        }
-    }
+                                     const int K, const int batch_size,
+                                     const float* means,
+                                     const float* stddivs,
+                                     const float* residual) {
+    WinogradCPU::transform_out(M.data(), Y.data(), K, batch_size,
+                               means, stddivs, residual);
 }
 
 void Network::winograd_convolve3(const int outputs,
@@ -588,166 +1162,216 @@ void Network::winograd_convolve3(const int outputs,
                                  const std::vector<float>& U,
                                  std::vector<float>& V,
                                  std::vector<float>& M,
-                                 std::vector<float>& output) {
+                                 std::vector<float>& output,
+                                 const int batch_size,
+                                 const float* means,
+                                 const float* stddivs,
+                                 const float* residual) {
 
     constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
     const auto input_channels = U.size() / (outputs * filter_len);
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
-}
-
-template<unsigned int filter_size>
-void convolve(size_t outputs,
-              const std::vector<net_t>& input,
-              const std::vector<float>& weights,
-              const std::vector<float>& biases,
-              std::vector<float>& output) {
-    // fixed for 19x19
-    constexpr unsigned int width = 19;
-    constexpr unsigned int height = 19;
-    constexpr unsigned int board_squares = width * height;
-    constexpr unsigned int filter_len = filter_size * filter_size;
-    const auto input_channels = weights.size() / (biases.size() * filter_len);
-    const auto filter_dim = filter_len * input_channels;
-    assert(outputs * board_squares == output.size());
-
-    std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(input_channels, input, col);
-
-    // Weight shape (output, input, filter_size, filter_size)
-    // 96 22 3 3
-    // outputs[96,19x19] = weights[96,22x3x3] x col[22x3x3,19x19]
-    // C←αAB + βC
-    // M Number of rows in matrices A and C.
-    // N Number of columns in matrices B and C.
-    // K Number of columns in matrix A; number of rows in matrix B.
-    // lda The size of the first dimention of matrix A; if you are
-    // passing a matrix A[m][n], the value should be m.
-    //    cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
-    //                ldb, beta, C, N);
-
-    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                // M        N            K
-                outputs, board_squares, filter_dim,
-                1.0f, &weights[0], filter_dim,
-                &col[0], board_squares,
-                0.0f, &output[0], board_squares);
-
-    for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < board_squares; b++) {
-            output[(o * board_squares) + b] =
-                biases[o] + output[(o * board_squares) + b];
-        }
-    }
-}
-
-template<unsigned int inputs,
-         unsigned int outputs,
-         size_t W, size_t B>
-void innerproduct(const std::vector<float>& input,
-                  const std::array<float, W>& weights,
-                  const std::array<float, B>& biases,
-                  std::vector<float>& output) {
-    assert(B == outputs);
-
-    cblas_sgemv(CblasRowMajor, CblasNoTrans,
-                // M     K
-                outputs, inputs,
-                1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
-
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
-
-    for (unsigned int o = 0; o < outputs; o++) {
-        float val = biases[o] + output[o];
-        if (outputs == 256) {
-            val = lambda_ReLU(val);
-        }
-        output[o] = val;
-    }
-}
-
-template <size_t spatial_size>
-void batchnorm(size_t channels,
-               std::vector<float>& data,
-               const float* means,
-               const float* stddivs,
-               const float* eltwise = nullptr)
-{
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
-
-    for (auto c = size_t{0}; c < channels; ++c) {
-        auto mean = means[c];
-        auto scale_stddiv = stddivs[c];
-
-        if (eltwise == nullptr) {
-            // Classical BN
-            auto arr = &data[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU(scale_stddiv * (arr[b] - mean));
-            }
-        } else {
-            // BN + residual add
-            auto arr = &data[c * spatial_size];
-            auto res = &eltwise[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU(res[b] +
-                                     (scale_stddiv * (arr[b] - mean)));
-            }
-        }
-    }
+    winograd_transform_in(input, V, input_channels, batch_size);
+    winograd_sgemm(U, V, M, input_channels, outputs, batch_size);
+    winograd_transform_out(M, output, outputs, batch_size,
+                           means, stddivs, residual);
 }
 
-void Network::forward_cpu(std::vector<float>& input,
-                          std::vector<float>& output) {
+void Network::forward_cpu(const std::vector<float>& input,
+                          std::vector<float>& output,
+                          const size_t batch_size) {
+    PerfTimer timer(PerfStats::NN_COMPUTE);
+    const auto& weights = local_weights();
     // Input convolution
-    constexpr int width = 19;
-    constexpr int height = 19;
+    constexpr int width = BOARD_SIZE;
+    constexpr int height = BOARD_SIZE;
     constexpr int tiles = (width + 1) * (height + 1) / 4;
+    const auto batch = static_cast<int>(batch_size);
     // Calculate output channels
-    const auto output_channels = conv_biases[0].size();
+    const auto output_channels = weights.conv_biases[0].size();
     // Assumes that residual blocks are identical and have same
     // number of inputs and outputs
     const auto input_channels = output_channels;
-    auto conv_out = std::vector<float>(output_channels * width * height);
-
-    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * tiles);
-    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * tiles);
-
-    winograd_convolve3(output_channels, input, conv_weights[0], V, M, conv_out);
-    batchnorm<361>(output_channels, conv_out,
-                   batchnorm_means[0].data(),
-                   batchnorm_stddivs[0].data());
-
-    // Residual tower
-    auto conv_in = std::vector<float>(output_channels * width * height);
-    auto res = std::vector<float>(output_channels * width * height);
-    for (auto i = size_t{1}; i < conv_weights.size(); i += 2) {
-        auto output_channels = conv_biases[i].size();
+    const auto plane_size = batch_size * width * height;
+    // Kept by each thread that runs the network. Only batches larger
+    // than any before need more memory, and these buffers are too big
+    // to come from anywhere but mmap.
+    thread_local auto conv_out = std::vector<float>{};
+    thread_local auto conv_in = std::vector<float>{};
+    thread_local auto conv_mid = std::vector<float>{};
+    thread_local auto V = std::vector<float>{};
+    thread_local auto M = std::vector<float>{};
+    conv_out.resize(output_channels * plane_size);
+    conv_in.resize(output_channels * plane_size);
+    conv_mid.resize(output_channels * plane_size);
+    V.resize(WINOGRAD_TILE * input_channels * tiles * batch_size);
+    M.resize(WINOGRAD_TILE * output_channels * tiles * batch_size);
+
+    winograd_convolve3(output_channels, input, weights.conv_weights[0], V, M, conv_out,
+                       batch,
+                       weights.batchnorm_means[0].data(),
+                       weights.batchnorm_stddivs[0].data());
+
+    // Residual tower. The block input stays in conv_in as the residual,
+    // and the buffers are swapped instead of copied.
+    for (auto i = size_t{1}; i < weights.conv_weights.size(); i += 2) {
+        auto output_channels = weights.conv_biases[i].size();
         std::swap(conv_out, conv_in);
-        std::copy(begin(conv_in), end(conv_in), begin(res));
         winograd_convolve3(output_channels, conv_in,
-	                       conv_weights[i], V, M, conv_out);
-        batchnorm<361>(output_channels, conv_out,
-                       batchnorm_means[i].data(),
-                       batchnorm_stddivs[i].data());
+                           weights.conv_weights[i], V, M, conv_mid,
+                           batch,
+                           weights.batchnorm_means[i].data(),
+                           weights.batchnorm_stddivs[i].data());
+
+        output_channels = weights.conv_biases[i + 1].size();
+        winograd_convolve3(output_channels, conv_mid,
+                           weights.conv_weights[i + 1], V, M, conv_out,
+                           batch,
+                           weights.batchnorm_means[i + 1].data(),
+                           weights.batchnorm_stddivs[i + 1].data(),
+                           conv_in.data());
+    }
+    std::copy(begin(conv_out), end(conv_out), begin(output));
+}
 
-        output_channels = conv_biases[i + 1].size();
+#ifndef USE_OPENCL
+void Network::forward_cpu_int8(const std::vector<float>& input,
+                               std::vector<float>& output,
+                               const size_t batch_size) {
+    PerfTimer timer(PerfStats::NN_COMPUTE);
+    const auto& weights = local_weights();
+    const auto batch = static_cast<int>(batch_size);
+    const auto output_channels = weights.int8_convs[0].get_outputs();
+    const auto plane_size = batch_size * NUM_INTERSECTIONS;
+    // Per thread, like the buffers in forward_cpu.
+    thread_local auto conv_out = std::vector<float>{};
+    thread_local auto conv_in = std::vector<float>{};
+    thread_local auto conv_mid = std::vector<float>{};
+    conv_out.resize(output_channels * plane_size);
+    conv_in.resize(output_channels * plane_size);
+    conv_mid.resize(output_channels * plane_size);
+
+    weights.int8_convs[0].forward(input.data(), conv_out.data(), batch,
+                          weights.batchnorm_means[0].data(),
+                          weights.batchnorm_stddivs[0].data());
+
+    for (auto i = size_t{1}; i < weights.int8_convs.size(); i += 2) {
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-			               conv_weights[i + 1], V, M, conv_out);
-        batchnorm<361>(output_channels, conv_out,
-                       batchnorm_means[i + 1].data(),
-                       batchnorm_stddivs[i + 1].data(),
-                       res.data());
+        weights.int8_convs[i].forward(conv_in.data(), conv_mid.data(), batch,
+                              weights.batchnorm_means[i].data(),
+                              weights.batchnorm_stddivs[i].data());
+        weights.int8_convs[i + 1].forward(conv_mid.data(), conv_out.data(), batch,
+                                  weights.batchnorm_means[i + 1].data(),
+                                  weights.batchnorm_stddivs[i + 1].data(),
+                                  conv_in.data());
     }
     std::copy(begin(conv_out), end(conv_out), begin(output));
 }
+#endif
+
+// By default both network heads are calculated on the CPU. They are
+// irregular and have a much lower compute densitity than the residual
+// layers, which means they don't get much - if any - speedup from being
+// on the GPU. See issue #185. With batching the tower output transfer
+// starts to dominate though, so --gpu-heads can move them to the GPU.
+static void forward_heads_cpu(const std::vector<net_t>& tower_output,
+                              std::vector<float>& policy_out,
+                              std::vector<float>& winrate_out,
+                              const size_t batch_size = 1) {
+    const auto& weights = local_weights();
+    constexpr auto head_size = HEAD_CHANNELS * NUM_INTERSECTIONS;
+    constexpr auto value_hidden = 256;
+    const auto batch = static_cast<int>(batch_size);
+    const auto channels = static_cast<int>(
+        weights.conv_head_w.size() / HEAD_CHANNELS);
+    assert(tower_output.size() >= batch_size * channels * NUM_INTERSECTIONS);
+    assert(policy_out.size() >= batch_size * POTENTIAL_MOVES);
+    assert(winrate_out.size() >= batch_size);
+
+    // Kept by each search thread, so only the first, largest batches
+    // allocate.
+    thread_local auto head_data = std::vector<float>{};
+    thread_local auto hidden_data = std::vector<float>{};
+    head_data.resize(batch_size * head_size);
+    hidden_data.resize(batch_size * value_hidden);
+
+    // Both head convolutions, one pass over the tower output of each
+    // position: [batch][HEAD_CHANNELS][NUM_INTERSECTIONS].
+    for (auto b = 0; b < batch; b++) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    HEAD_CHANNELS, NUM_INTERSECTIONS, channels,
+                    1.0f, weights.conv_head_w.data(), channels,
+                    &tower_output[b * channels * NUM_INTERSECTIONS],
+                    NUM_INTERSECTIONS,
+                    0.0f, &head_data[b * head_size], NUM_INTERSECTIONS);
+    }
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        for (auto c = 0; c < HEAD_CHANNELS; c++) {
+            const auto shift = weights.head_shift[c];
+            const auto scale = weights.head_scale[c];
+            const auto arr = &head_data[b * head_size + c * NUM_INTERSECTIONS];
+            for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+                arr[i] = std::max(0.0f, scale * (arr[i] + shift));
+            }
+        }
+    }
+
+    // The inner products of all positions at once. Each position's
+    // policy channels are followed by its value channel.
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                batch, POTENTIAL_MOVES, 2 * NUM_INTERSECTIONS,
+                1.0f, head_data.data(), head_size,
+                weights.ip_pol_w.data(), 2 * NUM_INTERSECTIONS,
+                0.0f, policy_out.data(), POTENTIAL_MOVES);
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                batch, value_hidden, NUM_INTERSECTIONS,
+                1.0f, &head_data[2 * NUM_INTERSECTIONS], head_size,
+                weights.ip1_val_w.data(), NUM_INTERSECTIONS,
+                0.0f, hidden_data.data(), value_hidden);
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        const auto policy = &policy_out[b * POTENTIAL_MOVES];
+        for (auto i = 0; i < POTENTIAL_MOVES; i++) {
+            policy[i] += weights.ip_pol_b[i];
+        }
+        const auto hidden = &hidden_data[b * value_hidden];
+        for (auto i = 0; i < value_hidden; i++) {
+            hidden[i] = std::max(0.0f, hidden[i] + weights.ip1_val_b[i]);
+        }
+    }
+    cblas_sgemv(CblasRowMajor, CblasNoTrans,
+                batch, value_hidden,
+                1.0f, hidden_data.data(), value_hidden,
+                weights.ip2_val_w.data(), 1,
+                0.0f, winrate_out.data(), 1);
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        winrate_out[b] += weights.ip2_val_b[0];
+    }
+}
+
+#if defined(USE_BLAS) && defined(USE_OPENCL)
+void Network::forward_cpu_device(const std::vector<float>& input,
+                                 std::vector<float>& output,
+                                 const size_t batch_size) {
+    if (!cfg_gpu_heads) {
+        forward_cpu(input, output, batch_size);
+        return;
+    }
+    const auto tower_size = net_weights->conv_pol_w.size()
+                          / net_weights->conv_pol_b.size() * NUM_INTERSECTIONS;
+    auto tower_output = std::vector<float>(batch_size * tower_size);
+    forward_cpu(input, tower_output, batch_size);
+
+    auto policy = std::vector<float>(batch_size * POTENTIAL_MOVES);
+    auto winrate = std::vector<float>(batch_size);
+    forward_heads_cpu(tower_output, policy, winrate, batch_size);
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        const auto out = begin(output) + b * HEAD_OUTPUTS;
+        std::copy(begin(policy) + b * POTENTIAL_MOVES,
+                  begin(policy) + (b + 1) * POTENTIAL_MOVES, out);
+        out[HEAD_OUTPUTS - 1] = winrate[b];
+    }
+}
+#endif
 
 template<typename T>
 T relative_difference(T a, T b) {
@@ -775,6 +1399,27 @@ void compare_net_outputs(std::vector<float>& data,
     // We accept an error up to 5%, but output values
     // smaller than 1/1000th are "rounded up" for the comparison.
     constexpr float relative_error = 5e-2f;
+#ifdef USE_HALF
+    // Half precision storage rounds at every layer, so single small
+    // outputs can easily be off by more than that. Judge the output as
+    // a whole instead: the error norm relative to the reference norm.
+    auto error = 0.0;
+    auto norm = 0.0;
+    for (auto idx = size_t{0}; idx < data.size(); ++idx) {
+        const auto diff = double{data[idx]} - double{ref[idx]};
+        error += diff * diff;
+        norm += double{ref[idx]} * double{ref[idx]};
+    }
+    constexpr auto small_number = 1e-3;
+    const auto err = std::sqrt(error / std::max(norm, small_number));
+    if (std::isnan(err) || err > relative_error) {
+        printf("Error in OpenCL calculation: relative error %f%% "
+               "over %zu outputs\n", err * 100.0, data.size());
+        printf("Update your GPU drivers or reduce the amount of games "
+               "played simultaneously.\n");
+        throw std::runtime_error("OpenCL self-check mismatch.");
+    }
+#else
     for (auto idx = size_t{0}; idx < data.size(); ++idx) {
         auto err = relative_difference(data[idx], ref[idx]);
         if (err > relative_error) {
@@ -785,46 +1430,58 @@ void compare_net_outputs(std::vector<float>& data,
             throw std::runtime_error("OpenCL self-check mismatch.");
         }
     }
+#endif
 }
 #endif
 
 void Network::softmax(const std::vector<float>& input,
                       std::vector<float>& output,
                       float temperature) {
-    assert(&input != &output);
-
     auto alpha = *std::max_element(begin(input),
                                    begin(input) + output.size());
     alpha /= temperature;
 
     auto denom = 0.0f;
-    auto helper = std::vector<float>(output.size());
     for (auto i = size_t{0}; i < output.size(); i++) {
-        auto val   = std::exp((input[i]/temperature) - alpha);
-        helper[i]  = val;
-        denom     += val;
+        output[i] = std::exp((input[i]/temperature) - alpha);
+        denom += output[i];
     }
     for (auto i = size_t{0}; i < output.size(); i++) {
-        output[i] = helper[i] / denom;
+        output[i] /= denom;
     }
 }
 
 Network::Netresult Network::get_scored_moves(
-    const GameState* state, Ensemble ensemble, int rotation, bool skip_cache) {
-    Netresult result;
-    if (state->board.get_boardsize() != 19) {
+    const KoState* state, Ensemble ensemble, int rotation, bool skip_cache) {
+    PerfTimer timer(PerfStats::NN_EVAL);
+    auto result = Netresult{};
+    if (state->board.get_boardsize() != BOARD_SIZE) {
         return result;
     }
 
-    NNPlanes planes;
-    gather_features(state, planes);
+    if (ensemble == AVERAGE) {
+        // Its cache entries are keyed on the planes.
+        NNPlanes planes;
+        gather_features(state, planes);
+        const auto symmetries = rotation == -1 ? cfg_symmetries : rotation;
+        assert(symmetries >= 1 && symmetries <= 8);
+        return get_scored_moves_average(state, planes, symmetries,
+                                        skip_cache);
+    }
 
     // See if we already have this in the cache.
+    const auto cache_key = get_cache_key(state);
     if (!skip_cache) {
-      if (NNCache::get_NNCache().lookup(planes, result)) {
+      if (NNCache::get_NNCache().lookup(cache_key, result)) {
         return result;
       }
     }
+    // From the miss until the result is in the cache.
+    TraceScope trace("nncache_miss", "nncache");
+    const InFlight in_flight;
+
+    NNPlanes planes;
+    gather_features(state, planes);
 
     if (ensemble == DIRECT) {
         assert(rotation >= 0 && rotation <= 7);
@@ -837,109 +1494,358 @@ Network::Netresult Network::get_scored_moves(
     }
 
     // Insert result into cache.
-    NNCache::get_NNCache().insert(planes, result);
+    NNCache::get_NNCache().insert(cache_key, result);
 
     return result;
 }
 
-Network::Netresult Network::get_scored_moves_internal(
-    const GameState* state, NNPlanes & planes, int rotation) {
-    assert(rotation >= 0 && rotation <= 7);
-    assert(INPUT_CHANNELS == planes.size());
-    constexpr int width = 19;
-    constexpr int height = 19;
-    const auto convolve_channels = conv_pol_w.size() / conv_pol_b.size();
-    std::vector<net_t> input_data;
-    std::vector<net_t> output_data(convolve_channels * width * height);
-    std::vector<float> policy_data(2 * width * height);
-    std::vector<float> value_data(1 * width * height);
-    std::vector<float> policy_out((width * height) + 1);
-    std::vector<float> softmax_data((width * height) + 1);
-    std::vector<float> winrate_data(256);
-    std::vector<float> winrate_out(1);
-    // Data layout is input_data[(c * height + h) * width + w]
-    input_data.reserve(INPUT_CHANNELS * width * height);
-    for (int c = 0; c < INPUT_CHANNELS; ++c) {
-        for (int h = 0; h < height; ++h) {
-            for (int w = 0; w < width; ++w) {
-                auto rot_idx = rotate_nn_idx_table[rotation][h * 19 + w];
-                input_data.emplace_back(net_t(planes[c][rot_idx]));
-            }
-        }
+void Network::prefetch(const KoState* state) {
+    if (state->board.get_boardsize() != BOARD_SIZE) {
+        return;
     }
+    auto& cache = NNCache::get_NNCache();
+    const auto cache_key = get_cache_key(state);
+    if (cache.contains(cache_key)) {
+        return;
+    }
+    NNPlanes planes;
+    gather_features(state, planes);
+    const auto rotation = Random::get_Rng().randfix<8>();
+    cache.insert(cache_key, get_scored_moves_internal(state, planes, rotation),
+                 true);
+}
+
+int Network::evaluations_in_flight() {
+    return s_evaluations_in_flight;
+}
+
+void Network::forward_raw(const std::vector<net_t>& input_data,
+                          std::vector<float>& policy_out,
+                          std::vector<float>& winrate_out) {
+    const auto convolve_channels = net_weights->conv_pol_w.size() / net_weights->conv_pol_b.size();
+    std::vector<net_t> output_data(convolve_channels * NUM_INTERSECTIONS);
+#ifdef USE_CUDNN
+    if (cudnn_batch_queue) {
+        cudnn_batch_queue->forward(input_data, output_data);
+        forward_heads_cpu(output_data, policy_out, winrate_out);
+    } else
+#endif
+    {
 #ifdef USE_OPENCL
-    opencl.forward(input_data, output_data);
+        if (cfg_gpu_heads) {
+            // Only the head outputs come back from the GPU.
+            auto head_output = std::vector<net_t>(HEAD_OUTPUTS);
+            opencl.forward(input_data, head_output);
+            std::copy(begin(head_output), begin(head_output) + policy_out.size(),
+                      begin(policy_out));
+            winrate_out[0] = head_output.back();
+        } else {
+            opencl.forward(input_data, output_data);
+            forward_heads_cpu(output_data, policy_out, winrate_out);
+        }
 #elif defined(USE_BLAS) && !defined(USE_OPENCL)
-    forward_cpu(input_data, output_data);
+        if (cpu_batch_queue) {
+            cpu_batch_queue->forward(input_data, output_data);
+        } else if (cfg_int8) {
+            forward_cpu_int8(input_data, output_data);
+        } else {
+            forward_cpu(input_data, output_data);
+        }
+        forward_heads_cpu(output_data, policy_out, winrate_out);
 #endif
+    }
 #ifdef USE_OPENCL_SELFCHECK
-    // Both implementations are available, self-check the OpenCL driver by
+    // Both implementations are available, self-check the GPU driver by
     // running both with a probability of 1/2000.
     if (Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0) {
         auto cpu_output_data = std::vector<float>(output_data.size());
         forward_cpu(input_data, cpu_output_data);
-        compare_net_outputs(output_data, cpu_output_data);
+        if (cfg_gpu_heads) {
+            auto cpu_policy_out = std::vector<float>(policy_out.size());
+            auto cpu_winrate_out = std::vector<float>(winrate_out.size());
+            forward_heads_cpu(cpu_output_data,
+                              cpu_policy_out, cpu_winrate_out);
+            compare_net_outputs(policy_out, cpu_policy_out);
+            compare_net_outputs(winrate_out, cpu_winrate_out);
+        } else {
+            compare_net_outputs(output_data, cpu_output_data);
+        }
     }
 #endif
-    // We calculate both network heads on the CPU. They are irregular
-    // and have a much lower compute densitity than the residual layers,
-    // which means they don't get much - if any - speedup from being on the
-    // GPU. See issue #185.
-
-    // Get the moves
-    convolve<1>(2, output_data, conv_pol_w, conv_pol_b, policy_data);
-    batchnorm<361>(2, policy_data, bn_pol_w1.data(), bn_pol_w2.data());
-    innerproduct<2*361, 362>(policy_data, ip_pol_w, ip_pol_b, policy_out);
-    softmax(policy_out, softmax_data, cfg_softmax_temp);
-    std::vector<float>& outputs = softmax_data;
+}
 
-    // Now get the score
-    convolve<1>(1, output_data, conv_val_w, conv_val_b, value_data);
-    batchnorm<361>(1, value_data, bn_val_w1.data(), bn_val_w2.data());
-    innerproduct<361, 256>(value_data, ip1_val_w, ip1_val_b, winrate_data);
-    innerproduct<256, 1>(winrate_data, ip2_val_w, ip2_val_b, winrate_out);
+void Network::fill_input(const NNPlanes& planes, const int rotation,
+                         std::vector<net_t>& input_data) {
+    // Data layout is input_data[(c * height + h) * width + w]
+    input_data.reserve(input_data.size() + INPUT_CHANNELS * NUM_INTERSECTIONS);
+    for (int c = 0; c < INPUT_CHANNELS; ++c) {
+        for (int idx = 0; idx < NUM_INTERSECTIONS; ++idx) {
+            auto rot_idx = rotate_nn_idx_table[rotation][idx];
+            input_data.emplace_back(net_t(planes[c][rot_idx]));
+        }
+    }
+}
 
-    // Sigmoid
-    auto winrate_sig = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
+void Network::forward(const std::vector<net_t>& input_data,
+                      std::vector<float>& policy_out,
+                      std::vector<float>& winrate_out) {
+    PerfTimer timer(PerfStats::NN_FORWARD);
+    if (!remote_evaluator
+        || !remote_evaluator->forward(input_data, policy_out, winrate_out)) {
+        forward_raw(input_data, policy_out, winrate_out);
+    }
+}
 
-    std::vector<scored_node> result;
-    for (auto idx = size_t{0}; idx < outputs.size(); idx++) {
-        if (idx < 19*19) {
-            auto val = outputs[idx];
-            auto rot_idx = rotate_nn_idx_table[rotation][idx];
-            auto x = rot_idx % 19;
-            auto y = rot_idx / 19;
-            auto rot_vtx = state->board.get_vertex(x, y);
-            if (state->board.get_square(rot_vtx) == FastBoard::EMPTY) {
-                result.emplace_back(val, rot_vtx);
+void Network::forward_batch(const std::vector<net_t>& input_data,
+                            const size_t batch_size,
+                            std::vector<float>& policy_out,
+                            std::vector<float>& winrate_out) {
+    constexpr auto input_size = size_t{INPUT_CHANNELS * NUM_INTERSECTIONS};
+    assert(input_data.size() == batch_size * input_size);
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    if (!remote_evaluator && !use_cudnn()) {
+        const auto tower_size = net_weights->conv_pol_w.size() / net_weights->conv_pol_b.size()
+                              * NUM_INTERSECTIONS;
+        auto output_data = std::vector<net_t>(batch_size * tower_size);
+        if (cfg_int8) {
+            forward_cpu_int8(input_data, output_data, batch_size);
+        } else {
+            forward_cpu(input_data, output_data, batch_size);
+        }
+        forward_heads_cpu(output_data, policy_out, winrate_out, batch_size);
+        return;
+    }
+#endif
+    // The OpenCL scheduler, cuDNN and the evaluation peers only batch
+    // positions of concurrent callers, so these go one by one.
+    auto input = std::vector<net_t>(input_size);
+    auto policy = std::vector<float>(POTENTIAL_MOVES);
+    auto winrate = std::vector<float>(1);
+    for (auto b = size_t{0}; b < batch_size; b++) {
+        std::copy(begin(input_data) + b * input_size,
+                  begin(input_data) + (b + 1) * input_size, begin(input));
+        forward(input, policy, winrate);
+        std::copy(begin(policy), end(policy),
+                  begin(policy_out) + b * POTENTIAL_MOVES);
+        winrate_out[b] = winrate[0];
+    }
+}
+
+Network::Netresult Network::get_scored_moves_average(
+    const KoState* state, NNPlanes & planes, const int symmetries,
+    const bool skip_cache) {
+    const auto keys = get_symmetric_cache_keys(planes, symmetries);
+    auto result = Netresult{};
+    if (!skip_cache) {
+        for (auto s = 0; s < 8; s++) {
+            if (!NNCache::get_NNCache().lookup(keys[s], result)) {
+                continue;
             }
+            // The entry is for the position symmetry s turns this one
+            // into, move its policy back onto our board.
+            if (s != 0) {
+                const auto policy = result.policy;
+                for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+                    result.policy[rotate_nn_idx_table[s][idx]] = policy[idx];
+                }
+            }
+            return result;
+        }
+    }
+
+    // All symmetries go through the network as one batch.
+    const InFlight in_flight;
+    auto input_data = std::vector<net_t>{};
+    for (auto s = 0; s < symmetries; s++) {
+        fill_input(planes, s, input_data);
+    }
+    auto policy_out = std::vector<float>(symmetries * POTENTIAL_MOVES);
+    auto winrate_out = std::vector<float>(symmetries);
+    forward_batch(input_data, symmetries, policy_out, winrate_out);
+
+    auto& policy = result.policy;
+    auto winrate = 0.0f;
+    auto logits = std::vector<float>(POTENTIAL_MOVES);
+    auto probs = std::vector<float>(POTENTIAL_MOVES);
+    for (auto s = 0; s < symmetries; s++) {
+        std::copy(begin(policy_out) + s * POTENTIAL_MOVES,
+                  begin(policy_out) + (s + 1) * POTENTIAL_MOVES,
+                  begin(logits));
+        softmax(logits, probs, cfg_softmax_temp);
+        for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+            policy[rotate_nn_idx_table[s][idx]] += probs[idx];
+        }
+        policy[NUM_INTERSECTIONS] += probs[NUM_INTERSECTIONS];
+        winrate += (1.0f + std::tanh(winrate_out[s])) / 2.0f;
+    }
+
+    for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+        const auto vtx = state->board.get_vertex(idx % BOARD_SIZE,
+                                                 idx / BOARD_SIZE);
+        if (state->board.get_square(vtx) == FastBoard::EMPTY) {
+            policy[idx] /= symmetries;
+        } else {
+            policy[idx] = 0.0f;
+        }
+    }
+    policy[NUM_INTERSECTIONS] /= symmetries;
+    result.winrate = winrate / symmetries;
+
+    NNCache::get_NNCache().insert(keys[0], result);
+    return result;
+}
+
+Network::Netresult Network::get_scored_moves_internal(
+    const KoState* state, NNPlanes & planes, int rotation) {
+    assert(rotation >= 0 && rotation <= 7);
+    assert(INPUT_CHANNELS == planes.size());
+    constexpr int width = BOARD_SIZE;
+    constexpr int height = BOARD_SIZE;
+    // Kept by each search thread, so evaluations don't allocate.
+    thread_local auto input_data = std::vector<net_t>{};
+    thread_local auto policy_out = std::vector<float>((width * height) + 1);
+    thread_local auto softmax_data = std::vector<float>((width * height) + 1);
+    thread_local auto winrate_out = std::vector<float>(1);
+    input_data.clear();
+    fill_input(planes, rotation, input_data);
+    forward(input_data, policy_out, winrate_out);
+    softmax(policy_out, softmax_data, cfg_softmax_temp);
+    const auto& outputs = softmax_data;
+
+    auto result = Netresult{};
+    // Sigmoid
+    result.winrate = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
+
+    for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+        const auto rot_idx = rotate_nn_idx_table[rotation][idx];
+        const auto rot_vtx = state->board.get_vertex(rot_idx % BOARD_SIZE,
+                                                     rot_idx / BOARD_SIZE);
+        if (state->board.get_square(rot_vtx) == FastBoard::EMPTY) {
+            result.policy[rot_idx] = outputs[idx];
+        }
+    }
+    result.policy[NUM_INTERSECTIONS] = outputs[NUM_INTERSECTIONS];
+
+    return result;
+}
+
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+void Network::int8_accuracy_report(const GameState* state,
+                                   const int positions) {
+    if (net_weights->int8_convs.empty()) {
+        myprintf("The int8 network is only loaded with --int8.\n");
+        return;
+    }
+    constexpr int width = BOARD_SIZE;
+    constexpr int height = BOARD_SIZE;
+    const auto convolve_channels = net_weights->conv_pol_w.size() / net_weights->conv_pol_b.size();
+
+    struct Eval {
+        std::vector<float> policy = std::vector<float>(width * height + 1);
+        float winrate;
+    };
+    auto evaluate = [&](const std::vector<float>& input, bool quantized) {
+        auto tower = std::vector<float>(convolve_channels * width * height);
+        if (quantized) {
+            forward_cpu_int8(input, tower);
         } else {
-            result.emplace_back(outputs[idx], FastBoard::PASS);
+            forward_cpu(input, tower);
+        }
+        auto eval = Eval{};
+        auto policy_out = std::vector<float>(width * height + 1);
+        auto winrate_out = std::vector<float>(1);
+        forward_heads_cpu(tower, policy_out, winrate_out);
+        softmax(policy_out, eval.policy, cfg_softmax_temp);
+        eval.winrate = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
+        return eval;
+    };
+
+    auto game = *state;
+    auto evaluated = 0;
+    auto top_move_agrees = 0;
+    auto policy_distance = 0.0;
+    auto value_error = 0.0;
+    auto max_value_error = 0.0;
+    while (evaluated < positions && game.get_passes() < 2) {
+        NNPlanes planes;
+        gather_features(&game, planes);
+        auto input = std::vector<float>();
+        input.reserve(INPUT_CHANNELS * width * height);
+        for (const auto& plane : planes) {
+            for (auto idx = 0; idx < width * height; idx++) {
+                input.emplace_back(float(plane[idx]));
+            }
+        }
+        const auto ref = evaluate(input, false);
+        const auto quant = evaluate(input, true);
+
+        auto argmax = [](const std::vector<float>& v) {
+            return std::max_element(begin(v), end(v)) - begin(v);
+        };
+        top_move_agrees += (argmax(ref.policy) == argmax(quant.policy));
+        // Total variation distance of the two move distributions.
+        auto distance = 0.0;
+        for (auto idx = size_t{0}; idx < ref.policy.size(); idx++) {
+            distance += std::abs(ref.policy[idx] - quant.policy[idx]);
+        }
+        policy_distance += distance / 2.0;
+        const auto diff = std::abs(double{ref.winrate - quant.winrate});
+        value_error += diff;
+        max_value_error = std::max(max_value_error, diff);
+        evaluated++;
+
+        // Continue with a legal move drawn from the fp32 policy.
+        auto moves = std::vector<scored_node>();
+        auto total = 0.0f;
+        for (auto idx = 0; idx < width * height; idx++) {
+            const auto vertex = game.board.get_vertex(idx % width,
+                                                      idx / width);
+            if (game.board.get_square(vertex) == FastBoard::EMPTY
+                && game.is_move_legal(game.get_to_move(), vertex)) {
+                moves.emplace_back(ref.policy[idx], vertex);
+                total += ref.policy[idx];
+            }
         }
+        moves.emplace_back(ref.policy.back(), FastBoard::PASS);
+        total += ref.policy.back();
+        auto pick = Random::get_Rng().randflt() * total;
+        auto move = int{FastBoard::PASS};
+        for (const auto& candidate : moves) {
+            pick -= candidate.first;
+            if (pick <= 0.0f) {
+                move = candidate.second;
+                break;
+            }
+        }
+        game.play_move(move);
     }
 
-    return std::make_pair(result, winrate_sig);
+    if (evaluated == 0) {
+        myprintf("No positions to compare, the game is over.\n");
+        return;
+    }
+    myprintf("int8 vs fp32 over %d positions:\n", evaluated);
+    myprintf("  same top move:    %5.1f%%\n",
+             100.0 * top_move_agrees / evaluated);
+    myprintf("  policy distance:  %6.4f (mean total variation)\n",
+             policy_distance / evaluated);
+    myprintf("  winrate error:    %6.4f mean, %6.4f max\n",
+             value_error / evaluated, max_value_error);
 }
+#endif
 
 void Network::show_heatmap(const FastState * state, Netresult& result, bool topmoves) {
-    auto moves = result.first;
+    std::vector<scored_node> moves;
     std::vector<std::string> display_map;
     std::string line;
 
-    for (unsigned int y = 0; y < 19; y++) {
-        for (unsigned int x = 0; x < 19; x++) {
+    for (unsigned int y = 0; y < BOARD_SIZE; y++) {
+        for (unsigned int x = 0; x < BOARD_SIZE; x++) {
             int vtx = state->board.get_vertex(x, y);
-
-            auto item = std::find_if(moves.cbegin(), moves.cend(),
-                [&vtx](scored_node const& test_item) {
-                return test_item.second == vtx;
-            });
-
-            auto score = 0.0f;
-            // Non-empty squares won't be scored
-            if (item != moves.end()) {
-                score = item->first;
-                assert(vtx == item->second);
+            // Non-empty squares have a score of 0
+            auto score = result.policy[y * BOARD_SIZE + x];
+            if (state->board.get_square(vtx) == FastBoard::EMPTY) {
+                moves.emplace_back(score, vtx);
             }
 
             line += boost::str(boost::format("%3d ") % int(score * 1000));
@@ -953,12 +1859,12 @@ void Network::show_heatmap(const FastState * state, Netresult& result, bool topm
     for (int i = display_map.size() - 1; i >= 0; --i) {
         myprintf("%s\n", display_map[i].c_str());
     }
-    assert(result.first.back().second == FastBoard::PASS);
-    auto pass_score = int(result.first.back().first * 1000);
+    auto pass_score = int(result.policy[NUM_INTERSECTIONS] * 1000);
     myprintf("pass: %d\n", pass_score);
-    myprintf("winrate: %f\n", result.second);
+    myprintf("winrate: %f\n", result.winrate);
 
     if (topmoves) {
+        moves.emplace_back(result.policy[NUM_INTERSECTIONS], FastBoard::PASS);
         std::stable_sort(rbegin(moves), rend(moves));
 
         auto cum = 0.0f;
@@ -974,26 +1880,7 @@ void Network::show_heatmap(const FastState * state, Netresult& result, bool topm
     }
 }
 
-void Network::fill_input_plane_pair(const FullBoard& board,
-                                    BoardPlane& black, BoardPlane& white) {
-    auto idx = 0;
-    for (int j = 0; j < 19; j++) {
-        for(int i = 0; i < 19; i++) {
-            int vtx = board.get_vertex(i, j);
-            auto color = board.get_square(vtx);
-            if (color != FastBoard::EMPTY) {
-                if (color == FastBoard::BLACK) {
-                    black[idx] = true;
-                } else {
-                    white[idx] = true;
-                }
-            }
-            idx++;
-        }
-    }
-}
-
-void Network::gather_features(const GameState* state, NNPlanes & planes) {
+void Network::gather_features(const KoState* state, NNPlanes & planes) {
     planes.resize(INPUT_CHANNELS);
     BoardPlane& black_to_move = planes[2 * INPUT_MOVES];
     BoardPlane& white_to_move = planes[2 * INPUT_MOVES + 1];
@@ -1010,45 +1897,65 @@ void Network::gather_features(const GameState* state, NNPlanes & planes) {
         white_to_move.set();
     }
 
+    static_assert(INPUT_MOVES == KoState::INPUT_HISTORY,
+                  "KoState must keep the history the network sees");
+    static_assert(std::is_same<BoardPlane, KoState::StonePlane>::value,
+                  "KoState planes must match the input planes");
+
     const auto moves = std::min<size_t>(state->get_movenum() + 1, INPUT_MOVES);
-    // Go back in time, fill history boards
+    // The state keeps the occupation planes of its recent history.
     for (auto h = size_t{0}; h < moves; h++) {
-        // collect white, black occupation planes
-        fill_input_plane_pair(state->get_past_board(h),
-                              planes[black_offset + h],
-                              planes[white_offset + h]);
+        const auto& stones = state->get_stone_planes(h);
+        planes[black_offset + h] = stones[FastBoard::BLACK];
+        planes[white_offset + h] = stones[FastBoard::WHITE];
     }
 }
 
-int Network::rotate_nn_idx(const int vertex, int symmetry) {
-    assert(vertex >= 0 && vertex < 19*19);
-    assert(symmetry >= 0 && symmetry < 8);
-    int x = vertex % 19;
-    int y = vertex / 19;
-    int newx;
-    int newy;
-
-    if (symmetry >= 4) {
-        std::swap(x, y);
-        symmetry -= 4;
-    }
-
-    if (symmetry == 0) {
-        newx = x;
-        newy = y;
-    } else if (symmetry == 1) {
-        newx = x;
-        newy = 19 - y - 1;
-    } else if (symmetry == 2) {
-        newx = 19 - x - 1;
-        newy = y;
-    } else {
-        assert(symmetry == 3);
-        newx = 19 - x - 1;
-        newy = 19 - y - 1;
+std::uint64_t Network::get_cache_key(const KoState* state) {
+    // The ko hash covers exactly the stones on a board, which is what the
+    // occupation planes encode.  Mix in each history board in order, and
+    // the side to move.
+    auto key = std::uint64_t{0x9e3779b97f4a7c15ULL};
+    if (state->get_to_move() == FastBoard::BLACK) {
+        key ^= Zobrist::zobrist_blacktomove;
     }
 
-    int newvtx = (newy * 19) + newx;
-    assert(newvtx >= 0 && newvtx < 19*19);
-    return newvtx;
+    const auto moves = std::min<size_t>(state->get_movenum() + 1, INPUT_MOVES);
+    for (auto h = size_t{0}; h < moves; h++) {
+        key ^= state->get_past_ko_hash(h);
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+    }
+    return key;
 }
+
+std::array<std::uint64_t, 8> Network::get_symmetric_cache_keys(
+    const NNPlanes& planes, const int symmetries) {
+    auto keys = std::array<std::uint64_t, 8>{};
+    // Results averaged over a different number of symmetries differ.
+    keys.fill(0xc2b2ae3d27d4eb4fULL * static_cast<std::uint64_t>(symmetries));
+    if (planes[2 * INPUT_MOVES].any()) {
+        for (auto& key : keys) {
+            key ^= Zobrist::zobrist_blacktomove;
+        }
+    }
+    // A stone at idx ends up at unrotate_nn_idx_table[s][idx] in the
+    // position turned by symmetry s.
+    for (auto c = 0; c < 2 * INPUT_MOVES; c++) {
+        const auto& plane = planes[c];
+        if (plane.none()) {
+            continue;
+        }
+        for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+            if (!plane[idx]) {
+                continue;
+            }
+            for (auto s = 0; s < 8; s++) {
+                const auto sym_idx = unrotate_nn_idx_table[s][idx];
+                keys[s] ^= Utils::rotl(Zobrist::zobrist[c % 4][sym_idx], c);
+            }
+        }
+    }
+    return keys;
+}
+
@@ -23,6 +23,8 @@
 
 #include <array>
 #include <bitset>
+#include <cassert>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <utility>
@@ -31,21 +33,51 @@
 
 #include "FastState.h"
 #include "GameState.h"
+#include "KoState.h"
+
+struct NetworkWeights;
+#ifdef USE_OPENCL
+class OpenCL_Network;
+#endif
+#ifdef USE_CUDNN
+class CuDNN_Network;
+#endif
 
 class Network {
 public:
     enum Ensemble {
-        DIRECT, RANDOM_ROTATION
+        DIRECT, RANDOM_ROTATION, AVERAGE
     };
-    using BoardPlane = std::bitset<19*19>;
+    using BoardPlane = std::bitset<NUM_INTERSECTIONS>;
     using NNPlanes = std::vector<BoardPlane>;
     using scored_node = std::pair<float, int>;
-    using Netresult = std::pair<std::vector<scored_node>, float>;
+    // The policy over the board, indexed by y * BOARD_SIZE + x with pass
+    // last, and the winrate of the side to move. Occupied points have
+    // probability 0. Fixed size, so evaluations and NNCache lookups
+    // don't allocate.
+    struct Netresult {
+        std::array<float, POTENTIAL_MOVES> policy;
+        float winrate;
+    };
 
-    static Netresult get_scored_moves(const GameState* state,
+    // With DIRECT, rotation is the symmetry to evaluate. With AVERAGE it
+    // is how many of the 8 symmetries to average, -1 for --symmetries.
+    static Netresult get_scored_moves(const KoState* state,
                                       Ensemble ensemble,
                                       int rotation = -1,
                                       bool skip_cache = false);
+    // Evaluates state like get_scored_moves with RANDOM_ROTATION, only
+    // into the NNCache as a speculative entry. Does nothing if it's
+    // cached already.
+    static void prefetch(const KoState* state);
+    // Evaluations of get_scored_moves between their cache miss and their
+    // result, so waiting for or in a batch.
+    static int evaluations_in_flight();
+    // Runs the local network on already rotated input planes and returns
+    // the head outputs before softmax and tanh. Also serves --eval-server.
+    static void forward_raw(const std::vector<net_t>& input_data,
+                            std::vector<float>& policy_out,
+                            std::vector<float>& winrate_out);
     // File format version
     static constexpr auto FORMAT_VERSION = 1;
     static constexpr auto INPUT_MOVES = 8;
@@ -54,51 +86,179 @@ public:
     // Winograd filter transformation changes 3x3 filters to 4x4
     static constexpr auto WINOGRAD_ALPHA = 4;
     static constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+    static constexpr auto WINOGRAD_WTILES = (BOARD_SIZE + 1) / 2;
+    static constexpr auto WINOGRAD_P = WINOGRAD_WTILES * WINOGRAD_WTILES;
 
     static void initialize();
+    // Loads another weights file on a background thread, the current
+    // network keeps evaluating until swap_network is called.
+    static void load_network_async(const std::string& filename);
+    // Switches to the network load_network_async finished loading, if
+    // there is one, and empties the NNCache. Nothing may be evaluating
+    // at the time. Returns true if it switched.
+    static bool swap_network();
+    // Names the network in use, the precision it runs at and the
+    // softmax temperature, for the entries of an NNCacheFile.
+    static std::uint64_t get_network_hash();
     static void benchmark(const GameState * state, int iterations = 1600);
+    // Runs the batched part of the network, the residual tower and with
+    // --gpu-heads the heads, on batch_size copies of state. Returns the
+    // microseconds per batch.
+    static double benchmark_batch(const GameState* state, size_t batch_size,
+                                  int iterations);
     static void show_heatmap(const FastState * state, Netresult & netres,
                              bool topmoves);
     static void softmax(const std::vector<float>& input,
                         std::vector<float>& output,
                         float temperature = 1.0f);
 
-    static void gather_features(const GameState* state, NNPlanes& planes);
+    static void gather_features(const KoState* state, NNPlanes& planes);
+    // The vertex of the input planes that symmetry turns vertex into.
+    // Inline, so the chunk decoder turns training data the same way
+    // without linking the network.
+    static int rotate_nn_idx(const int vertex, int symmetry);
+    // Key for the input planes of a position, built from the stored
+    // board hashes instead of the planes themselves.
+    static std::uint64_t get_cache_key(const KoState* state);
+    // Keys of an AVERAGE result under each symmetry of the position, so
+    // keys[s] is the key of the position that symmetry s turns it into.
+    // They are built from the planes and never equal get_cache_key.
+    static std::array<std::uint64_t, 8> get_symmetric_cache_keys(
+        const NNPlanes& planes, int symmetries);
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    // Compares the --int8 network against the fp32 one on positions
+    // sampled from the fp32 policy, starting at state.
+    static void int8_accuracy_report(const GameState* state,
+                                     int positions = 100);
+#endif
 private:
-    static std::pair<int, int> load_v1_network(std::ifstream& wtfile);
-    static std::pair<int, int> load_network_file(std::string filename);
+    static std::pair<int, int> load_v1_network(std::ifstream& wtfile,
+                                               NetworkWeights& net);
+    static std::pair<int, int> load_network_file(std::string filename,
+                                                 NetworkWeights& net);
+    static std::pair<int, int> load_binary_network(std::string filename,
+                                                   NetworkWeights& net);
+    static void save_binary_network(std::string filename,
+                                    const NetworkWeights& net,
+                                    int channels, int residual_blocks);
+    // Quantizes for --int8 and Winograd transforms the 3x3 filters.
+    static void prepare_weights(NetworkWeights& net,
+                                size_t channels, size_t residual_blocks);
+#ifdef USE_OPENCL
+    static void push_opencl_weights(OpenCL_Network& opencl_net,
+                                    const NetworkWeights& net,
+                                    size_t channels, size_t residual_blocks);
+#endif
+#ifdef USE_CUDNN
+    // On --cuda-device, with the 3x3 filters Winograd transformed back.
+    static std::unique_ptr<CuDNN_Network> make_cudnn_network(
+        const NetworkWeights& net, size_t channels, size_t residual_blocks);
+#endif
     static void process_bn_var(std::vector<float>& weights,
                                const float epsilon=1e-5f);
 
     static std::vector<float> winograd_transform_f(const std::vector<float>& f,
         const int outputs, const int channels);
+    // Recovers the 3x3 filters from winograd_transform_f output.
+    static std::vector<float> winograd_inverse_f(const std::vector<float>& U,
+        const int outputs, const int channels);
     static std::vector<float> zeropad_U(const std::vector<float>& U,
         const int outputs, const int channels,
         const int outputs_pad, const int channels_pad);
     static void winograd_transform_in(const std::vector<float>& in,
                                       std::vector<float>& V,
-                                      const int C);
+                                      const int C, const int batch_size);
     static void winograd_transform_out(const std::vector<float>& M,
                                        std::vector<float>& Y,
-                                       const int K);
+                                       const int K, const int batch_size,
+                                       const float* means = nullptr,
+                                       const float* stddivs = nullptr,
+                                       const float* residual = nullptr);
+    // If means is given, batchnorm, the residual add and ReLU are
+    // fused into the output transform.
     static void winograd_convolve3(const int outputs,
                                    const std::vector<float>& input,
                                    const std::vector<float>& U,
                                    std::vector<float>& V,
                                    std::vector<float>& M,
-                                   std::vector<float>& output);
+                                   std::vector<float>& output,
+                                   const int batch_size,
+                                   const float* means = nullptr,
+                                   const float* stddivs = nullptr,
+                                   const float* residual = nullptr);
     static void winograd_sgemm(const std::vector<float>& U,
                                std::vector<float>& V,
-                               std::vector<float>& M, const int C, const int K);
-    static int rotate_nn_idx(const int vertex, int symmetry);
-    static void fill_input_plane_pair(
-      const FullBoard& board, BoardPlane& black, BoardPlane& white);
+                               std::vector<float>& M, const int C, const int K,
+                               const int batch_size);
     static Netresult get_scored_moves_internal(
-      const GameState* state, NNPlanes & planes, int rotation);
+      const KoState* state, NNPlanes & planes, int rotation);
+    static Netresult get_scored_moves_average(
+      const KoState* state, NNPlanes & planes, int symmetries,
+      bool skip_cache);
+    // Appends the planes, turned by rotation, in the network input layout.
+    static void fill_input(const NNPlanes& planes, int rotation,
+                           std::vector<net_t>& input_data);
+    // Local network or --eval-peer.
+    static void forward(const std::vector<net_t>& input_data,
+                        std::vector<float>& policy_out,
+                        std::vector<float>& winrate_out);
+    // Same for batch_size positions one after another.
+    static void forward_batch(const std::vector<net_t>& input_data,
+                              size_t batch_size,
+                              std::vector<float>& policy_out,
+                              std::vector<float>& winrate_out);
 #if defined(USE_BLAS)
-    static void forward_cpu(std::vector<float>& input,
-                            std::vector<float>& output);
+    // Runs batch_size positions, stored one after another in input.
+    static void forward_cpu(const std::vector<float>& input,
+                            std::vector<float>& output,
+                            const size_t batch_size = 1);
+#endif
+#if defined(USE_BLAS) && defined(USE_OPENCL)
+    // forward_cpu for the --cpu-workers, with the output of the OpenCL
+    // networks: the heads too with --gpu-heads.
+    static void forward_cpu_device(const std::vector<float>& input,
+                                   std::vector<float>& output,
+                                   size_t batch_size);
+#endif
+#if defined(USE_BLAS) && !defined(USE_OPENCL)
+    // forward_cpu with the quantized convolutions of --int8.
+    static void forward_cpu_int8(const std::vector<float>& input,
+                                 std::vector<float>& output,
+                                 const size_t batch_size = 1);
 #endif
 };
 
+inline int Network::rotate_nn_idx(const int vertex, int symmetry) {
+    assert(vertex >= 0 && vertex < NUM_INTERSECTIONS);
+    assert(symmetry >= 0 && symmetry < 8);
+    int x = vertex % BOARD_SIZE;
+    int y = vertex / BOARD_SIZE;
+    int newx;
+    int newy;
+
+    if (symmetry >= 4) {
+        std::swap(x, y);
+        symmetry -= 4;
+    }
+
+    if (symmetry == 0) {
+        newx = x;
+        newy = y;
+    } else if (symmetry == 1) {
+        newx = x;
+        newy = BOARD_SIZE - y - 1;
+    } else if (symmetry == 2) {
+        newx = BOARD_SIZE - x - 1;
+        newy = y;
+    } else {
+        assert(symmetry == 3);
+        newx = BOARD_SIZE - x - 1;
+        newy = BOARD_SIZE - y - 1;
+    }
+
+    int newvtx = (newy * BOARD_SIZE) + newx;
+    assert(newvtx >= 0 && newvtx < NUM_INTERSECTIONS);
+    return newvtx;
+}
+
 #endif
@@ -0,0 +1,139 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Numa.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+// Node ids can have gaps, look at this many.
+constexpr auto MAX_NODE_IDS = 64;
+
+// "0-3,8-11" to {0, 1, 2, 3, 8, 9, 10, 11}.
+std::vector<int> parse_cpulist(const std::string& list) {
+    auto cpus = std::vector<int>{};
+    auto ranges = std::istringstream{list};
+    auto range = std::string{};
+    while (std::getline(ranges, range, ',')) {
+        auto first = 0;
+        auto last = 0;
+        const auto fields = std::sscanf(range.c_str(), "%d-%d",
+                                        &first, &last);
+        if (fields == 1) {
+            last = first;
+        } else if (fields != 2) {
+            continue;
+        }
+        for (auto cpu = first; cpu <= last; cpu++) {
+            cpus.emplace_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// The cpus of each node, in node order.
+std::vector<std::vector<int>> read_nodes() {
+    auto nodes = std::vector<std::vector<int>>{};
+#ifdef __linux__
+    for (auto id = 0; id < MAX_NODE_IDS; id++) {
+        auto file = std::ifstream{"/sys/devices/system/node/node"
+                                  + std::to_string(id) + "/cpulist"};
+        auto list = std::string{};
+        if (file && std::getline(file, list)) {
+            auto cpus = parse_cpulist(list);
+            if (!cpus.empty()) {
+                nodes.emplace_back(std::move(cpus));
+            }
+        }
+    }
+#endif
+    if (nodes.empty()) {
+        // Binding to an empty node does nothing.
+        nodes.emplace_back();
+    }
+    return nodes;
+}
+
+const std::vector<std::vector<int>>& get_nodes() {
+    static const auto nodes = read_nodes();
+    return nodes;
+}
+
+int& bound_node() {
+    static thread_local auto node = 0;
+    return node;
+}
+
+}
+
+int Numa::num_nodes() {
+    return static_cast<int>(get_nodes().size());
+}
+
+void Numa::bind_thread(int node) {
+    node %= num_nodes();
+    bound_node() = node;
+#ifdef __linux__
+    const auto& cpus = get_nodes()[node];
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (const auto cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpuset);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#endif
+}
+
+int Numa::current_node() {
+    return bound_node();
+}
+
+void Numa::bind_next_thread() {
+    static std::atomic<int> next_node{0};
+    bind_thread(next_node++);
+}
+
+void Numa::for_each_node(const std::function<void(int)>& f) {
+    auto threads = std::vector<std::thread>{};
+    for (auto node = 0; node < num_nodes(); node++) {
+        threads.emplace_back([&f, node]() {
+            bind_thread(node);
+            f(node);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,50 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NUMA_H_INCLUDED
+#define NUMA_H_INCLUDED
+
+#include "config.h"
+
+#include <functional>
+
+/*
+    The NUMA nodes of the machine, read from sysfs on Linux. Elsewhere,
+    or without sysfs, there is a single node and binding does nothing.
+
+    Linux puts a page on the node of the thread that touches it first,
+    so data made by a thread bound to a node stays local to the threads
+    on that node.
+*/
+namespace Numa {
+    // Nodes that have cpus.
+    int num_nodes();
+    // Restricts the calling thread to the cpus of node, modulo the
+    // number of nodes.
+    void bind_thread(int node);
+    // The node the calling thread was bound to, 0 if it never was.
+    int current_node();
+    // Binds the calling thread to the nodes in turn, for threads that
+    // are not started with a node of their own.
+    void bind_next_thread();
+    // Runs f(node) for every node on a thread bound to it, and waits
+    // for all of them to finish.
+    void for_each_node(const std::function<void(int)>& f);
+}
+
+#endif
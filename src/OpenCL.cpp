@@ -29,55 +29,158 @@
 #include <limits>
 #include <stdexcept>
 
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 
 #include "Network.h"
 #include "GTP.h"
+#include "PerfStats.h"
+#include "Trace.h"
 #include "Utils.h"
 #include "Tuner.h"
 
 using namespace Utils;
 
 static std::string cl_args =
+    "-DBOARD_SIZE=" + std::to_string(BOARD_SIZE) + " "
+#ifdef USE_HALF
+    "-DUSE_HALF -DPRECISION=16 "
+#endif
     "-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero";
 
 static std::string sourceCode_config = R"(
+#ifdef USE_HALF
+    // Storage only: loads widen to float, so the transforms, batchnorm
+    // and heads still do their arithmetic in single precision.
+    typedef half net_t;
+    #define vload_net_t(offset,p) vload_half(offset,p)
+    #define vstore_net_t(data,offset,p) vstore_half(data,offset,p)
+#else
     typedef float net_t;
     #define vload_net_t(offset,p) ((p)[(offset)])
     #define vstore_net_t(data,offset,p) (((p)[(offset)])=(data))
+#endif
 )";
 
 static std::string sourceCode_convolve3 = R"(
-__kernel void in_transform(__global net_t *in, __global float *V,
+// The Winograd input transform of the 4x4 tile x, stored at offset in
+// each of the 16 Cpad x Ppad matrices of V.
+void in_transform_tile(float x[4][4], __global net_t *V,
+                       const int offset, const int CPpad) {
+    float T1[4][4];
+    float T2[4][4];
+
+    T1[0][0] = x[0][0] - x[2][0];
+    T1[0][1] = x[0][1] - x[2][1];
+    T1[0][2] = x[0][2] - x[2][2];
+    T1[0][3] = x[0][3] - x[2][3];
+    T1[1][0] = x[1][0] + x[2][0];
+    T1[1][1] = x[1][1] + x[2][1];
+    T1[1][2] = x[1][2] + x[2][2];
+    T1[1][3] = x[1][3] + x[2][3];
+    T1[2][0] = x[2][0] - x[1][0];
+    T1[2][1] = x[2][1] - x[1][1];
+    T1[2][2] = x[2][2] - x[1][2];
+    T1[2][3] = x[2][3] - x[1][3];
+    T1[3][0] = x[1][0] - x[3][0];
+    T1[3][1] = x[1][1] - x[3][1];
+    T1[3][2] = x[1][2] - x[3][2];
+    T1[3][3] = x[1][3] - x[3][3];
+
+    T2[0][0] = T1[0][0] - T1[0][2];
+    T2[0][1] = T1[0][1] + T1[0][2];
+    T2[0][2] = T1[0][2] - T1[0][1];
+    T2[0][3] = T1[0][1] - T1[0][3];
+    T2[1][0] = T1[1][0] - T1[1][2];
+    T2[1][1] = T1[1][1] + T1[1][2];
+    T2[1][2] = T1[1][2] - T1[1][1];
+    T2[1][3] = T1[1][1] - T1[1][3];
+    T2[2][0] = T1[2][0] - T1[2][2];
+    T2[2][1] = T1[2][1] + T1[2][2];
+    T2[2][2] = T1[2][2] - T1[2][1];
+    T2[2][3] = T1[2][1] - T1[2][3];
+    T2[3][0] = T1[3][0] - T1[3][2];
+    T2[3][1] = T1[3][1] + T1[3][2];
+    T2[3][2] = T1[3][2] - T1[3][1];
+    T2[3][3] = T1[3][1] - T1[3][3];
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            vstore_net_t(T2[i][j], (i*4 + j)*CPpad + offset, V);
+        }
+    }
+}
+
+// The output transform of block b of output k. o gets the outputs at
+// (x, y), (x+1, y), (x, y+1) and (x+1, y+1) of the block.
+void out_transform_tile(__global net_t *M, const int k,
+                        const int Kpad, const int Ppad, const int b,
+                        float o[4]) {
+    float temp_m[16];
+    for (int xi = 0; xi < 4; xi++) {
+        for (int nu = 0; nu < 4; nu++) {
+            temp_m[xi*4 + nu] =
+                vload_net_t(xi*(4*Kpad*Ppad) + nu*(Kpad*Ppad) + b*Kpad + k, M);
+        }
+    }
+
+    o[0] = temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
+           temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
+           temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
+
+    o[1] = temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
+           temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
+           temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
+
+    o[2] = temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
+           temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
+           temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
+
+    o[3] = temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
+           temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
+           temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+}
+
+__kernel void in_transform(__global net_t *in, __global net_t *V,
                            const int C, const int Cpad,
-                           const int Ppad) {
-    const int W = 19;
-    const int H = 19;
+                           const int Ppad, const int batch_size) {
+    const int W = BOARD_SIZE;
+    const int H = BOARD_SIZE;
     const int WTILES = (W + 1) / 2;
     const int P = WTILES*WTILES;
 
+    // Tiles of all boards in the batch are laid out one after
+    // another, so the SGEMM sees N = batch_size * P.
     const int block = get_global_id(0);
     const int ch = get_global_id(1);
 
-    const int block_x = block % WTILES;
-    const int block_y = block / WTILES;
+    const int batch = block / P;
+    const int board_block = block % P;
+    const int block_x = board_block % WTILES;
+    const int block_y = board_block / WTILES;
 
     // Tiles overlap by 2
     const int yin = 2 * block_y - 1;
     const int xin = 2 * block_x - 1;
 
-    if (block < P && ch < C) {
+    if (block < batch_size * P && ch < C) {
 
         // Cache input tile and handle zero padding
+        const int in_offset = (batch*C + ch)*(W*H);
         float x[4][4];
         for (int i = 0; i < 4; i++) {
             for (int j = 0; j < 4; j++) {
                 if ((yin+i) >= 0 && (xin+j) >= 0 && (yin+i) < H && (xin+j) < W) {
-                    x[i][j] = vload_net_t(ch*(W*H) + (yin+i)*W + (xin+j), in);
+                    x[i][j] = vload_net_t(in_offset + (yin+i)*W + (xin+j), in);
                 } else {
                     x[i][j] = 0.0f;
                 }
@@ -85,152 +188,116 @@ __kernel void in_transform(__global net_t *in, __global float *V,
         }
 
         const int offset = ch*Ppad + block;
+        in_transform_tile(x, V, offset, Cpad*Ppad);
+    }
+}
 
-        float T1[4][4];
-        float T2[4][4];
-
-        T1[0][0] = x[0][0] - x[2][0];
-        T1[0][1] = x[0][1] - x[2][1];
-        T1[0][2] = x[0][2] - x[2][2];
-        T1[0][3] = x[0][3] - x[2][3];
-        T1[1][0] = x[1][0] + x[2][0];
-        T1[1][1] = x[1][1] + x[2][1];
-        T1[1][2] = x[1][2] + x[2][2];
-        T1[1][3] = x[1][3] + x[2][3];
-        T1[2][0] = x[2][0] - x[1][0];
-        T1[2][1] = x[2][1] - x[1][1];
-        T1[2][2] = x[2][2] - x[1][2];
-        T1[2][3] = x[2][3] - x[1][3];
-        T1[3][0] = x[1][0] - x[3][0];
-        T1[3][1] = x[1][1] - x[3][1];
-        T1[3][2] = x[1][2] - x[3][2];
-        T1[3][3] = x[1][3] - x[3][3];
-
-        T2[0][0] = T1[0][0] - T1[0][2];
-        T2[0][1] = T1[0][1] + T1[0][2];
-        T2[0][2] = T1[0][2] - T1[0][1];
-        T2[0][3] = T1[0][1] - T1[0][3];
-        T2[1][0] = T1[1][0] - T1[1][2];
-        T2[1][1] = T1[1][1] + T1[1][2];
-        T2[1][2] = T1[1][2] - T1[1][1];
-        T2[1][3] = T1[1][1] - T1[1][3];
-        T2[2][0] = T1[2][0] - T1[2][2];
-        T2[2][1] = T1[2][1] + T1[2][2];
-        T2[2][2] = T1[2][2] - T1[2][1];
-        T2[2][3] = T1[2][1] - T1[2][3];
-        T2[3][0] = T1[3][0] - T1[3][2];
-        T2[3][1] = T1[3][1] + T1[3][2];
-        T2[3][2] = T1[3][2] - T1[3][1];
-        T2[3][3] = T1[3][1] - T1[3][3];
+// in_transform of the input planes as forward uploads them, one bit per
+// intersection, the first in the lowest bit of the first word.
+__kernel void in_transform_packed(__global const uint *in, __global net_t *V,
+                                  const int C, const int Cpad,
+                                  const int Ppad, const int batch_size) {
+    const int W = BOARD_SIZE;
+    const int H = BOARD_SIZE;
+    const int WTILES = (W + 1) / 2;
+    const int P = WTILES*WTILES;
+    const int WORDS = (W*H + 31) / 32;
+
+    const int block = get_global_id(0);
+    const int ch = get_global_id(1);
+
+    const int batch = block / P;
+    const int board_block = block % P;
+    const int block_x = board_block % WTILES;
+    const int block_y = board_block / WTILES;
+
+    const int yin = 2 * block_y - 1;
+    const int xin = 2 * block_x - 1;
 
+    if (block < batch_size * P && ch < C) {
+        const int in_offset = (batch*C + ch)*WORDS;
+        float x[4][4];
         for (int i = 0; i < 4; i++) {
             for (int j = 0; j < 4; j++) {
-                V[(i*4 + j)*Cpad*Ppad + offset] = T2[i][j];
+                if ((yin+i) >= 0 && (xin+j) >= 0 && (yin+i) < H && (xin+j) < W) {
+                    const int idx = (yin+i)*W + (xin+j);
+                    x[i][j] = (in[in_offset + idx / 32] >> (idx % 32)) & 1;
+                } else {
+                    x[i][j] = 0.0f;
+                }
             }
         }
+
+        const int offset = ch*Ppad + block;
+        in_transform_tile(x, V, offset, Cpad*Ppad);
     }
 }
 
-__kernel void out_transform(__global float *M, __global net_t *Y,
-                            const int K, const int Kpad, const int Ppad) {
-    const int W = 19;
-    const int H = 19;
+__kernel void out_transform(__global net_t *M, __global net_t *Y,
+                            const int K, const int Kpad, const int Ppad,
+                            const int batch_size) {
+    const int W = BOARD_SIZE;
+    const int H = BOARD_SIZE;
     const int WTILES = (W + 1) / 2;
     const int P = WTILES * WTILES;
 
     int k = get_global_id(0);
     int block = get_global_id(1);
 
-    const int block_x = block % WTILES;
-    const int block_y = block / WTILES;
+    const int batch = block / P;
+    const int board_block = block % P;
+    const int block_x = board_block % WTILES;
+    const int block_y = board_block / WTILES;
 
     int x = 2*block_x;
     int y = 2*block_y;
 
-    if (k < K && block < P) {
-        int b = block_y * WTILES + block_x;
-        float temp_m[16];
-        for (int xi = 0; xi < 4; xi++) {
-            for (int nu = 0; nu < 4; nu++) {
-                temp_m[xi*4 + nu] = M[xi*(4*Kpad*Ppad) + nu*(Kpad*Ppad)+ b*Kpad + k];
-            }
-        }
-
-        float o11 = temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
-                    temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
-                    temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
-
-        float o12 = temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
-                    temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
-                    temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
-
-        float o21 = temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
-                    temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
-                    temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
-
-        float o22 = temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
-                    temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
-                    temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+    if (k < K && block < batch_size * P) {
+        const int out_offset = (batch*K + k)*(H*W);
+        float o[4];
+        out_transform_tile(M, k, Kpad, Ppad, block, o);
 
-        vstore_net_t(o11, k*(H*W) + (y)*W + (x), Y);
+        vstore_net_t(o[0], out_offset + (y)*W + (x), Y);
         if (x+1 < W) {
-            vstore_net_t(o12, k*(H*W) + (y)*W + (x+1), Y);
+            vstore_net_t(o[1], out_offset + (y)*W + (x+1), Y);
         }
         if (y+1 < H) {
-            vstore_net_t(o21, k*(H*W) + (y+1)*W + (x), Y);
+            vstore_net_t(o[2], out_offset + (y+1)*W + (x), Y);
             if (x+1 < W) {
-                vstore_net_t(o22, k*(H*W) + (y+1)*W + (x+1), Y);
+                vstore_net_t(o[3], out_offset + (y+1)*W + (x+1), Y);
             }
         }
     }
 }
 
-__kernel void out_transform_fused_bn(__global float *M,
+__kernel void out_transform_fused_bn(__global net_t *M,
                                      __global net_t *Y,
                                      const int K,
                                      const int Kpad, const int Ppad,
+                                     const int batch_size,
                                      __global const net_t * residual,
                                      __constant const net_t * means,
                                      __constant const net_t * stddivs) {
-    const int W = 19;
-    const int H = 19;
+    const int W = BOARD_SIZE;
+    const int H = BOARD_SIZE;
     const int WTILES = (W + 1) / 2;
     const int P = WTILES * WTILES;
 
     int k = get_global_id(0);
     int block = get_global_id(1);
 
-    const int block_x = block % WTILES;
-    const int block_y = block / WTILES;
+    const int batch = block / P;
+    const int board_block = block % P;
+    const int block_x = board_block % WTILES;
+    const int block_y = board_block / WTILES;
 
     int x = 2*block_x;
     int y = 2*block_y;
 
-    if (k < K && block < P) {
-        int b = block_y * WTILES + block_x;
-        float temp_m[16];
-        for (int xi = 0; xi < 4; xi++) {
-            for (int nu = 0; nu < 4; nu++) {
-                temp_m[xi*4 + nu] = M[xi*(4*Kpad*Ppad) + nu*(Kpad*Ppad)+ b*Kpad + k];
-            }
-        }
-
+    if (k < K && block < batch_size * P) {
+        const int out_offset = (batch*K + k)*(H*W);
         float o[4];
-        o[0] = temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
-               temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
-               temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
-
-        o[1] = temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
-               temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
-               temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
-
-        o[2] = temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
-               temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
-               temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
-
-        o[3] = temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
-               temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
-               temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+        out_transform_tile(M, k, Kpad, Ppad, block, o);
 
         const float mean = vload_net_t(k, means);
         const float scale_stddiv = vload_net_t(k, stddivs);
@@ -243,13 +310,91 @@ __kernel void out_transform_fused_bn(__global float *M,
             if (pred[i]) {
                 o[i] = scale_stddiv * (o[i] - mean);
                 if (residual) {
-                    o[i] += vload_net_t(k*(H*W) + a[i], residual);
+                    o[i] += vload_net_t(out_offset + a[i], residual);
                 }
                 o[i] = o[i] > 0 ? o[i] : 0.0f;
-                vstore_net_t(o[i], k*(H*W) + a[i], Y);
+                vstore_net_t(o[i], out_offset + a[i], Y);
+            }
+        }
+    }
+}
+
+// out_transform_fused_bn followed by the in_transform of the next
+// layer, which has our outputs as its channels. A work group has the
+// whole board of kg outputs in local memory, so the next layer's input
+// tiles are read from there instead of from global memory. Y gets the
+// outputs too if it is given, as the next residual or for the heads.
+//   cl::NDRange global(K, P, batch_size), local(kg, P, 1)
+__kernel void out_transform_fused_bn_in(__global net_t *M,
+                                        __global net_t *Y,
+                                        __global net_t *V,
+                                        const int K,
+                                        const int Kpad, const int Ppad,
+                                        const int Cpad,
+                                        __global const net_t * residual,
+                                        __constant const net_t * means,
+                                        __constant const net_t * stddivs,
+                                        __local float * ybuf) {
+    const int W = BOARD_SIZE;
+    const int H = BOARD_SIZE;
+    const int WTILES = (W + 1) / 2;
+    const int P = WTILES * WTILES;
+
+    const int k = get_global_id(0);
+    const int kg = get_local_id(0);
+    const int board_block = get_global_id(1);
+    const int batch = get_global_id(2);
+    const int block = batch * P + board_block;
+
+    const int block_x = board_block % WTILES;
+    const int block_y = board_block / WTILES;
+
+    const int x = 2*block_x;
+    const int y = 2*block_y;
+
+    __local float * plane = ybuf + kg * (W*H);
+    const int out_offset = (batch*K + k)*(H*W);
+
+    float o[4];
+    out_transform_tile(M, k, Kpad, Ppad, block, o);
+
+    const float mean = vload_net_t(k, means);
+    const float scale_stddiv = vload_net_t(k, stddivs);
+
+    const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
+
+    const int a[4] = {(y)*W + (x), (y)*W + (x+1), (y+1)*W + (x), (y+1)*W + (x+1)};
+
+    for (int i = 0; i < 4; i++) {
+        if (pred[i]) {
+            o[i] = scale_stddiv * (o[i] - mean);
+            if (residual) {
+                o[i] += vload_net_t(out_offset + a[i], residual);
+            }
+            o[i] = o[i] > 0 ? o[i] : 0.0f;
+            plane[a[i]] = o[i];
+            if (Y) {
+                vstore_net_t(o[i], out_offset + a[i], Y);
+            }
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Tiles overlap by 2
+    const int yin = y - 1;
+    const int xin = x - 1;
+    float xt[4][4];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            if ((yin+i) >= 0 && (xin+j) >= 0 && (yin+i) < H && (xin+j) < W) {
+                xt[i][j] = plane[(yin+i)*W + (xin+j)];
+            } else {
+                xt[i][j] = 0.0f;
             }
         }
     }
+    in_transform_tile(xt, V, k*Ppad + block, Cpad*Ppad);
 }
 )";
 
@@ -259,9 +404,10 @@ static std::string sourceCode_utility = R"(
                             __global const net_t * residual,
                             __constant const net_t * means,
                             __constant const net_t * stddivs) {
-        // cl::NDRange global(outputs, 19*19);
+        // cl::NDRange global(outputs, BOARD_SIZE*BOARD_SIZE, batch_size);
         const int gx = get_global_id(0);
         const int gy = get_global_id(1);
+        const int gz = get_global_id(2);
 
         const int output = gx;
         const int outputs      = get_global_size(0);
@@ -270,6 +416,12 @@ static std::string sourceCode_utility = R"(
         const unsigned int o = output;
         const unsigned int b = gy;
 
+        in += gz * outputs * channel_size;
+        out += gz * outputs * channel_size;
+        if (residual) {
+            residual += gz * outputs * channel_size;
+        }
+
         const float mean = vload_net_t(o, means);
         const float scale_stddiv = vload_net_t(o, stddivs);
 
@@ -282,6 +434,59 @@ static std::string sourceCode_utility = R"(
         // ReLU
         vstore_net_t(sum > 0 ? sum : 0.0f, o * channel_size + b, out);
     }
+
+    // 1x1 convolution with bias, followed by batchnorm and ReLU.
+    __kernel void head_convolve(__global const net_t * in,
+                                __global net_t * out,
+                                __global const net_t * weights,
+                                __global const net_t * biases,
+                                __global const net_t * means,
+                                __global const net_t * stddivs,
+                                const int channels) {
+        // cl::NDRange global(outputs, BOARD_SIZE*BOARD_SIZE, batch_size);
+        const int o = get_global_id(0);
+        const int b = get_global_id(1);
+        const int gz = get_global_id(2);
+
+        const int outputs      = get_global_size(0);
+        const int channel_size = get_global_size(1);
+
+        in += gz * channels * channel_size;
+        out += gz * outputs * channel_size;
+
+        float sum = vload_net_t(o, biases);
+        for (int c = 0; c < channels; c++) {
+            sum += vload_net_t(o * channels + c, weights)
+                 * vload_net_t(c * channel_size + b, in);
+        }
+        sum = vload_net_t(o, stddivs) * (sum - vload_net_t(o, means));
+        vstore_net_t(sum > 0 ? sum : 0.0f, o * channel_size + b, out);
+    }
+
+    // Fully connected layer, one work item per output.
+    __kernel void head_innerproduct(__global const net_t * in,
+                                    __global net_t * out,
+                                    __global const net_t * weights,
+                                    __global const net_t * biases,
+                                    const int inputs,
+                                    const int out_stride,
+                                    const int out_offset,
+                                    const int relu) {
+        // cl::NDRange global(outputs, batch_size);
+        const int o = get_global_id(0);
+        const int gy = get_global_id(1);
+
+        in += gy * inputs;
+
+        float sum = vload_net_t(o, biases);
+        for (int i = 0; i < inputs; i++) {
+            sum += vload_net_t(o * inputs + i, weights) * vload_net_t(i, in);
+        }
+        if (relu && sum < 0) {
+            sum = 0.0f;
+        }
+        vstore_net_t(sum, gy * out_stride + out_offset + o, out);
+    }
 )";
 
 const std::string sourceCode_sgemm =
@@ -300,20 +505,110 @@ void OpenCL::ensure_thread_initialized() {
         // Make kernels
         opencl_thread_data.m_in_transform_kernel =
             cl::Kernel(m_program, "in_transform");
+        opencl_thread_data.m_in_transform_packed_kernel =
+            cl::Kernel(m_program, "in_transform_packed");
         opencl_thread_data.m_sgemm_kernel =
             cl::Kernel(m_program, "XgemmBatched");
         opencl_thread_data.m_out_transform_kernel =
             cl::Kernel(m_program, "out_transform");
         opencl_thread_data.m_out_transform_bn_kernel =
             cl::Kernel(m_program, "out_transform_fused_bn");
+        opencl_thread_data.m_out_transform_bn_in_kernel =
+            cl::Kernel(m_program, "out_transform_fused_bn_in");
         opencl_thread_data.m_batchnorm_kernel =
             cl::Kernel(m_program, "batchnorm");
+        opencl_thread_data.m_head_convolve_kernel =
+            cl::Kernel(m_program, "head_convolve");
+        opencl_thread_data.m_head_innerproduct_kernel =
+            cl::Kernel(m_program, "head_innerproduct");
+        // Profiling is what times the kernels for the trace.
+        const auto properties = Trace::enabled()
+            ? cl_command_queue_properties{CL_QUEUE_PROFILING_ENABLE}
+            : cl_command_queue_properties{0};
         opencl_thread_data.m_commandqueue =
-            cl::CommandQueue(m_context, m_device);
+            cl::CommandQueue(m_context, m_device, properties);
         opencl_thread_data.m_is_initialized = true;
     }
 }
 
+#ifdef USE_HALF
+// IEEE 754 binary16 conversions with round-to-nearest-even, matching
+// vstore_half on the device.
+device_net_t to_device_net_t(float x) {
+    auto bits = std::uint32_t{};
+    std::memcpy(&bits, &x, sizeof(bits));
+
+    const auto sign = static_cast<std::uint32_t>((bits >> 16) & 0x8000);
+    const auto float_exp = static_cast<int>((bits >> 23) & 0xff);
+    auto mantissa = bits & 0x7fffff;
+
+    if (float_exp == 0xff) {
+        // Inf stays inf, NaN stays (quiet) NaN.
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    const auto exponent = float_exp - 127 + 15;
+    if (exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        // Result is subnormal or zero.
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const auto shift = static_cast<std::uint32_t>(14 - exponent);
+        auto result = mantissa >> shift;
+        const auto rest = mantissa & ((1u << shift) - 1);
+        const auto halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (result & 1))) {
+            result++;
+        }
+        return sign | result;
+    }
+    auto result = sign | (exponent << 10) | (mantissa >> 13);
+    const auto rest = mantissa & 0x1fff;
+    // A carry out of the mantissa correctly bumps the exponent.
+    if (rest > 0x1000 || (rest == 0x1000 && (result & 1))) {
+        result++;
+    }
+    return result;
+}
+
+float from_device_net_t(device_net_t x) {
+    const auto sign = static_cast<std::uint32_t>(x & 0x8000) << 16;
+    const auto exponent = static_cast<std::uint32_t>((x >> 10) & 0x1f);
+    auto mantissa = static_cast<std::uint32_t>(x & 0x3ff);
+
+    auto bits = std::uint32_t{};
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal half, normalize it.
+        auto shift = 0u;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            shift++;
+        }
+        bits = sign | ((127 - 15 + 1 - shift) << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    auto result = 0.0f;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+#else
+device_net_t to_device_net_t(float x) {
+    return x;
+}
+
+float from_device_net_t(device_net_t x) {
+    return x;
+}
+#endif
+
 void OpenCL_Network::add_weights(size_t layer,
                                  size_t size,
                                  const float * weights) {
@@ -321,9 +616,9 @@ void OpenCL_Network::add_weights(size_t layer,
         m_layers.push_back(Layer());
     }
 
-    auto converted_weights = std::vector<net_t>();
+    auto converted_weights = std::vector<device_net_t>();
     for(auto i = size_t{0}; i < size; i++) {
-        converted_weights.emplace_back(weights[i]);
+        converted_weights.emplace_back(to_device_net_t(weights[i]));
     }
 
     auto weightSize = size * sizeof(decltype(converted_weights)::value_type);
@@ -331,76 +626,296 @@ void OpenCL_Network::add_weights(size_t layer,
         m_opencl.m_context,
         CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
         weightSize,
-        const_cast<net_t*>(converted_weights.data()));
+        const_cast<device_net_t*>(converted_weights.data()));
 }
 
-void OpenCL_Network::forward(const std::vector<net_t>& input,
-                             std::vector<net_t>& output) {
-    constexpr auto width = 19;
-    constexpr auto height = 19;
+namespace {
+struct EventWaiter {
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_done{false};
+    cl_int m_status{CL_COMPLETE};
+};
+}
+
+static void CL_CALLBACK event_complete(cl_event, cl_int status,
+                                       void* user_data) {
+    auto waiter = static_cast<EventWaiter*>(user_data);
+    std::lock_guard<std::mutex> lock(waiter->m_mutex);
+    waiter->m_status = status;
+    waiter->m_done = true;
+    waiter->m_cv.notify_one();
+}
+
+// Sleep until the event completes. Unlike queue.finish(), which most
+// drivers implement as a spin, this leaves the core to the search
+// threads while the device works.
+static void wait_for_event(cl::CommandQueue& queue, cl::Event& event) {
+    EventWaiter waiter;
+    event.setCallback(CL_COMPLETE, event_complete, &waiter);
+    // The callback can only fire once the commands reach the device.
+    queue.flush();
+
+    std::unique_lock<std::mutex> lock(waiter.m_mutex);
+    waiter.m_cv.wait(lock, [&waiter]{ return waiter.m_done; });
+    if (waiter.m_status < 0) {
+        throw cl::Error(waiter.m_status, "clEnqueueReadBuffer");
+    }
+}
+
+using KernelEvents = std::vector<std::pair<const char*, cl::Event>>;
+
+// An event to time the next kernel under name, if tracing.
+static cl::Event* trace_event(KernelEvents& events, const char* name) {
+    if (!Trace::enabled()) {
+        return nullptr;
+    }
+    events.emplace_back(name, cl::Event{});
+    return &events.back().second;
+}
+
+// Puts the kernels of the last forward pass on the trace. The device
+// clock is matched up with the host's at the end of the readback,
+// which has just completed.
+static void trace_kernels(KernelEvents& events, cl::Event& read_done) {
+    const auto host_end = Trace::now_ns();
+    const auto device_end = static_cast<std::int64_t>(
+        read_done.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+    const auto offset = host_end - device_end;
+    const auto tid = Trace::thread_id();
+    for (auto& kernel : events) {
+        const auto start = static_cast<std::int64_t>(
+            kernel.second.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+        const auto end = static_cast<std::int64_t>(
+            kernel.second.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+        Trace::record(kernel.first, "kernel", offset + start, end - start,
+                      -1, Trace::DEVICE, tid);
+    }
+    events.clear();
+}
+
+std::unique_ptr<OpenCL_Network::Buffers> OpenCL_Network::acquire_buffers() {
+    std::unique_lock<std::mutex> lock(m_buffers_mutex);
+    m_buffers_cv.wait(lock, [this]() {
+        return !m_free_buffers.empty()
+            || m_buffers_allocated < m_max_in_flight;
+    });
+    if (!m_free_buffers.empty()) {
+        auto buffers = std::move(m_free_buffers.back());
+        m_free_buffers.pop_back();
+        return buffers;
+    }
+    m_buffers_allocated++;
+    lock.unlock();
+    return allocate_buffers();
+}
+
+void OpenCL_Network::release_buffers(std::unique_ptr<Buffers> buffers) {
+    {
+        std::lock_guard<std::mutex> lock(m_buffers_mutex);
+        m_free_buffers.emplace_back(std::move(buffers));
+    }
+    m_buffers_cv.notify_one();
+}
+
+std::unique_ptr<OpenCL_Network::Buffers> OpenCL_Network::allocate_buffers() {
+    constexpr auto width = BOARD_SIZE;
+    constexpr auto height = BOARD_SIZE;
     constexpr auto tiles = WINOGRAD_P;
-    constexpr auto one_plane = width * height * sizeof(net_t);
+    constexpr auto one_plane = width * height * sizeof(device_net_t);
+    const auto max_batch_size = static_cast<size_t>(m_opencl.m_batch_size);
+    auto buffers = std::make_unique<Buffers>();
 
-    m_opencl.ensure_thread_initialized();
+    unsigned int max_channels = 0;
+    for (const auto& layer : m_layers) {
+        max_channels = std::max(max_channels,
+                                std::max(layer.channels, layer.outputs));
+    }
 
-    if (!opencl_thread_data.m_buffers_allocated) {
-        unsigned int max_channels = 0;
-        for (const auto& layer : m_layers) {
-            max_channels = std::max(max_channels,
-                                    std::max(layer.channels, layer.outputs));
-        }
+    const auto mwg = m_opencl.m_sgemm_tuners.mwg;
+    const auto nwg = m_opencl.m_sgemm_tuners.nwg;
+    const auto vwm = m_opencl.m_sgemm_tuners.vwm;
+    const auto vwn = m_opencl.m_sgemm_tuners.vwn;
 
-        const auto mwg = m_opencl.m_sgemm_tuners.mwg;
-        const auto nwg = m_opencl.m_sgemm_tuners.nwg;
-        const auto vwm = m_opencl.m_sgemm_tuners.vwm;
-        const auto vwn = m_opencl.m_sgemm_tuners.vwn;
+    const auto m_ceil = lcm(lcm(max_channels, mwg), vwm);
+    const auto n_ceil = lcm(lcm(tiles * max_batch_size, nwg), vwn);
 
-        const auto m_ceil = lcm(lcm(max_channels, mwg), vwm);
-        const auto n_ceil = lcm(lcm(tiles, nwg), vwn);
+    // The activations between layers are unpadded planes, only the
+    // Winograd domain V and M are padded for the sgemm.
+    const auto alloc_inSize = max_batch_size * max_channels * one_plane;
+    const auto alloc_vm_size =
+        WINOGRAD_TILE * m_ceil * n_ceil * sizeof(device_net_t);
 
-        const auto alloc_inSize = m_ceil * m_ceil *  max_channels * sizeof(net_t);
-        const auto alloc_vm_size = WINOGRAD_TILE * m_ceil * n_ceil * sizeof(net_t);
+    auto v_zeros = std::vector<device_net_t>(
+        alloc_vm_size / sizeof(device_net_t));
 
-        auto v_zeros = std::vector<float>(alloc_vm_size);
+    buffers->m_inBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE, alloc_inSize);
+    buffers->m_tmpBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE, alloc_inSize);
+    buffers->m_residualBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE, alloc_inSize);
+    buffers->m_VBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+        alloc_vm_size, v_zeros.data(), nullptr);
+    buffers->m_MBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
 
-        opencl_thread_data.m_inBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_tmpBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_residualBuffer = cl::Buffer(
+    if (has_heads()) {
+        // The policy head has the most planes (2) and the value head
+        // the largest hidden layer (256).
+        auto max_head_planes = size_t{1};
+        for (const auto& layer : m_layers) {
+            if (layer.is_policy_head || layer.is_value_head) {
+                max_head_planes = std::max(max_head_planes,
+                                           size_t{layer.outputs});
+            }
+        }
+        const auto alloc_convSize = max_batch_size * max_head_planes
+                                  * width * height * sizeof(device_net_t);
+        const auto alloc_ipSize =
+            max_batch_size * 256 * sizeof(device_net_t);
+        const auto alloc_outSize =
+            max_batch_size * HEAD_OUTPUTS * sizeof(device_net_t);
+        buffers->m_headConvBuffer = cl::Buffer(
             m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_VBuffer = cl::Buffer(
+            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_convSize);
+        buffers->m_headIpBuffer = cl::Buffer(
             m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-            alloc_vm_size, v_zeros.data(), nullptr);
-        opencl_thread_data.m_MBuffer = cl::Buffer(
+            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_ipSize);
+        buffers->m_headOutBuffer = cl::Buffer(
             m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
-        opencl_thread_data.m_buffers_allocated = true;
+            CL_MEM_READ_WRITE, alloc_outSize);
     }
 
-    cl::Buffer & inBuffer = opencl_thread_data.m_inBuffer;
-    cl::Buffer & tmpBuffer = opencl_thread_data.m_tmpBuffer;
-    cl::Buffer & VBuffer = opencl_thread_data.m_VBuffer;
-    cl::Buffer & MBuffer = opencl_thread_data.m_MBuffer;
-    cl::Buffer & residualBuffer = opencl_thread_data.m_residualBuffer;
+    const auto alloc_packedInSize =
+        max_batch_size * m_layers.front().channels * INPUT_WORDS
+        * sizeof(cl_uint);
+    const auto alloc_pinnedOutSize = has_heads()
+        ? max_batch_size * HEAD_OUTPUTS * sizeof(device_net_t)
+        : max_batch_size * m_layers.back().outputs * one_plane;
+    auto& queue = opencl_thread_data.m_commandqueue;
+    buffers->m_packedInBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_ONLY, alloc_packedInSize);
+    buffers->m_pinnedInBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, alloc_packedInSize);
+    buffers->m_pinnedOutBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, alloc_pinnedOutSize);
+    buffers->m_pinnedIn = static_cast<cl_uint*>(
+        queue.enqueueMapBuffer(buffers->m_pinnedInBuffer,
+                               CL_TRUE, CL_MAP_WRITE,
+                               0, alloc_packedInSize));
+    buffers->m_pinnedOut = static_cast<device_net_t*>(
+        queue.enqueueMapBuffer(buffers->m_pinnedOutBuffer,
+                               CL_TRUE, CL_MAP_READ,
+                               0, alloc_pinnedOutSize));
+
+    return buffers;
+}
+
+void OpenCL_Network::forward(const std::vector<net_t>& input,
+                             std::vector<net_t>& output,
+                             const size_t batch_size) {
+    PerfTimer timer(PerfStats::NN_COMPUTE);
+    constexpr auto width = BOARD_SIZE;
+    constexpr auto height = BOARD_SIZE;
+    constexpr auto one_plane = width * height * sizeof(device_net_t);
+
+    m_opencl.ensure_thread_initialized();
+
+    // Buffers are sized for the largest batch we will ever be given.
+    assert(batch_size <= static_cast<size_t>(m_opencl.m_batch_size));
+
+    // Back to the pool when done, even if the driver throws.
+    struct Lease {
+        OpenCL_Network& network;
+        std::unique_ptr<Buffers> buffers;
+        ~Lease() {
+            network.release_buffers(std::move(buffers));
+        }
+    };
+    const Lease lease{*this, acquire_buffers()};
+    auto& buffers = *lease.buffers;
+
+    cl::Buffer & inBuffer = buffers.m_inBuffer;
+    cl::Buffer & tmpBuffer = buffers.m_tmpBuffer;
+    cl::Buffer & VBuffer = buffers.m_VBuffer;
+    cl::Buffer & MBuffer = buffers.m_MBuffer;
+    cl::Buffer & residualBuffer = buffers.m_residualBuffer;
     cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
 
-    const auto inSize = sizeof(net_t) * input.size();
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, input.data());
+    // Stage through pinned memory so the upload is non-blocking and
+    // the caller's vector is free to be reused immediately. The input
+    // planes only hold 0 and 1, so they go up one bit per intersection,
+    // and in_transform_packed expands them on the device.
+    const auto planes = input.size() / NUM_INTERSECTIONS;
+    const auto packed = buffers.m_pinnedIn;
+    std::fill(packed, packed + planes * INPUT_WORDS, cl_uint{0});
+    for (auto p = size_t{0}; p < planes; p++) {
+        const auto plane = input.data() + p * NUM_INTERSECTIONS;
+        const auto words = packed + p * INPUT_WORDS;
+        for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+            assert(plane[idx] == net_t{0} || plane[idx] == net_t{1});
+            if (plane[idx] != net_t{0}) {
+                words[idx / 32] |= cl_uint{1} << (idx % 32);
+            }
+        }
+    }
+    queue.enqueueWriteBuffer(buffers.m_packedInBuffer, CL_FALSE, 0,
+                             planes * INPUT_WORDS * sizeof(cl_uint), packed);
 
+    // VBuffer holds the transformed inBuffer, see convolve3.
+    auto v_transformed = false;
     for (const auto& layer : m_layers) {
-        if (layer.is_batchnorm) {
+        if (layer.is_policy_head) {
+            // Reads the tower output in inBuffer, writes the logits for
+            // each position to the start of its slot in the result.
+            auto conv_weights = begin(layer.weights);
+            auto ip_weights = begin(layer.weights) + 4;
+            head_convolve(layer.channels, layer.outputs,
+                          inBuffer, buffers.m_headConvBuffer,
+                          conv_weights, batch_size);
+            head_innerproduct(layer.outputs * width * height,
+                              width * height + 1,
+                              buffers.m_headConvBuffer,
+                              buffers.m_headOutBuffer,
+                              HEAD_OUTPUTS, 0, false,
+                              ip_weights, batch_size);
+        } else if (layer.is_value_head) {
+            auto conv_weights = begin(layer.weights);
+            auto ip1_weights = begin(layer.weights) + 4;
+            auto ip2_weights = begin(layer.weights) + 6;
+            constexpr auto value_hidden = 256;
+            head_convolve(layer.channels, layer.outputs,
+                          inBuffer, buffers.m_headConvBuffer,
+                          conv_weights, batch_size);
+            head_innerproduct(layer.outputs * width * height, value_hidden,
+                              buffers.m_headConvBuffer,
+                              buffers.m_headIpBuffer,
+                              value_hidden, 0, true,
+                              ip1_weights, batch_size);
+            head_innerproduct(value_hidden, 1,
+                              buffers.m_headIpBuffer,
+                              buffers.m_headOutBuffer,
+                              HEAD_OUTPUTS, HEAD_OUTPUTS - 1, false,
+                              ip2_weights, batch_size);
+        } else if (layer.is_batchnorm) {
             auto bn_weights = begin(layer.weights);
             batchnorm(layer.outputs,
                       layer.filter_size,
                       inBuffer,
                       tmpBuffer,
                       nullptr,
-                      bn_weights);
+                      bn_weights,
+                      batch_size);
             std::swap(inBuffer, tmpBuffer);
         } else if (layer.is_residual_block) {
             assert(layer.channels == layer.outputs);
@@ -408,26 +923,65 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
             auto bn1_weights   = begin(layer.weights) + 1;
             auto conv2_weights = begin(layer.weights) + 3;
             auto bn2_weights   = begin(layer.weights) + 4;
-            const auto inBufferSize = layer.channels * one_plane;
-            queue.enqueueCopyBuffer(inBuffer, residualBuffer, 0, 0, inBufferSize);
-            convolve3(layer.channels,
-                      layer.outputs,
-                      inBuffer,
-                      VBuffer,
-                      MBuffer,
-                      conv1_weights,
-                      nullptr,
-                      &bn1_weights);
-            convolve3(layer.channels,
-                      layer.outputs,
-                      inBuffer,
-                      VBuffer,
-                      MBuffer,
-                      conv2_weights,
-                      &residualBuffer,
-                      &bn2_weights);
+            if (fused_group_size(layer.outputs) != 0) {
+                // Between the convolutions of a block, and from one
+                // block to the next, the activations stay transformed
+                // in VBuffer. inBuffer keeps the input of the block, so
+                // it's also the residual, added in place.
+                const auto next_is_residual = &layer != &m_layers.back()
+                    && (&layer + 1)->is_residual_block;
+                convolve3(layer.channels,
+                          layer.outputs,
+                          inBuffer,
+                          VBuffer,
+                          MBuffer,
+                          conv1_weights,
+                          nullptr,
+                          &bn1_weights,
+                          batch_size,
+                          v_transformed, false, true);
+                convolve3(layer.channels,
+                          layer.outputs,
+                          inBuffer,
+                          VBuffer,
+                          MBuffer,
+                          conv2_weights,
+                          &inBuffer,
+                          &bn2_weights,
+                          batch_size,
+                          true, true, next_is_residual);
+                v_transformed = next_is_residual;
+            } else {
+                const auto inBufferSize = batch_size * layer.channels * one_plane;
+                queue.enqueueCopyBuffer(inBuffer, residualBuffer, 0, 0, inBufferSize);
+                convolve3(layer.channels,
+                          layer.outputs,
+                          inBuffer,
+                          VBuffer,
+                          MBuffer,
+                          conv1_weights,
+                          nullptr,
+                          &bn1_weights,
+                          batch_size);
+                convolve3(layer.channels,
+                          layer.outputs,
+                          inBuffer,
+                          VBuffer,
+                          MBuffer,
+                          conv2_weights,
+                          &residualBuffer,
+                          &bn2_weights,
+                          batch_size);
+            }
         } else  {
             auto conv_weights = begin(layer.weights);
+            // The input convolution reads the packed upload.
+            const auto is_input = &layer == &m_layers.front();
+            if (is_input) {
+                transform_packed_input(layer.channels,
+                                       buffers.m_packedInBuffer, VBuffer,
+                                       batch_size);
+            }
             // plain convolution
             convolve3(layer.channels,
                      layer.outputs,
@@ -436,15 +990,69 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
                      MBuffer,
                      conv_weights,
                      nullptr,
-                     nullptr);
+                     nullptr,
+                     batch_size,
+                     is_input);
         }
     }
 
-    const auto finalSize = m_layers.back().outputs * one_plane;
-    queue.enqueueReadBuffer(inBuffer, CL_FALSE, 0, finalSize, output.data());
+    auto& finalBuffer = has_heads() ? buffers.m_headOutBuffer
+                                    : inBuffer;
+    const auto finalSize = has_heads()
+        ? batch_size * HEAD_OUTPUTS * sizeof(device_net_t)
+        : batch_size * m_layers.back().outputs * one_plane;
+    auto read_done = cl::Event{};
+    queue.enqueueReadBuffer(finalBuffer, CL_FALSE, 0, finalSize,
+                            buffers.m_pinnedOut,
+                            nullptr, &read_done);
+    wait_for_event(queue, read_done);
+    if (Trace::enabled()) {
+        trace_kernels(opencl_thread_data.m_kernel_events, read_done);
+    }
 
-    std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
-    queue.finish();
+    const auto finalCount = finalSize / sizeof(device_net_t);
+    std::transform(buffers.m_pinnedOut,
+                   buffers.m_pinnedOut + finalCount,
+                   begin(output), from_device_net_t);
+}
+
+void OpenCL_Network::transform_packed_input(const int channels,
+                                            cl::Buffer& bufferPacked,
+                                            cl::Buffer& bufferV,
+                                            const size_t batch_size) {
+    cl::Kernel & kernel = opencl_thread_data.m_in_transform_packed_kernel;
+
+    const auto nwg = m_opencl.m_sgemm_tuners.nwg;
+    const auto kwg = m_opencl.m_sgemm_tuners.kwg;
+    const auto vwm = m_opencl.m_sgemm_tuners.vwm;
+    const auto vwn = m_opencl.m_sgemm_tuners.vwn;
+    const auto wavefront_size = m_opencl.m_wavefront_size;
+
+    // The same V layout as in_transform in convolve3.
+    const auto tiles = WINOGRAD_P * batch_size;
+    const auto wgs = lcm(tiles, wavefront_size);
+    const auto n_ceil = int(lcm(lcm(tiles, nwg), vwn));
+    const auto k_ceil = int(lcm(lcm(channels, kwg), vwm));
+
+    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    auto& events = opencl_thread_data.m_kernel_events;
+    try {
+        kernel.setArg(0, bufferPacked);
+        kernel.setArg(1, bufferV);
+        kernel.setArg(2, channels);
+        kernel.setArg(3, k_ceil);
+        kernel.setArg(4, n_ceil);
+        kernel.setArg(5, static_cast<int>(batch_size));
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                   cl::NDRange(wgs, channels), cl::NullRange,
+                                   nullptr,
+                                   trace_event(events, "in_transform_packed"));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in transform_packed_input: " << e.what() << ": "
+                  << e.err() << std::endl;
+        throw;
+    }
 }
 
 void OpenCL_Network::convolve3(int channels, int outputs,
@@ -453,12 +1061,17 @@ void OpenCL_Network::convolve3(int channels, int outputs,
                               cl::Buffer& bufferM,
                               weight_slice_t weights,
                               cl::Buffer* bufferResidual,
-                              weight_slice_t* bn_weights) {
+                              weight_slice_t* bn_weights,
+                              const size_t batch_size,
+                              const bool input_transformed,
+                              const bool store_output,
+                              const bool transform_output) {
 
     cl::Kernel & in_transform_kernel = opencl_thread_data.m_in_transform_kernel;
     cl::Kernel & sgemm_kernel = opencl_thread_data.m_sgemm_kernel;
     cl::Kernel & out_transform_kernel = opencl_thread_data.m_out_transform_kernel;
     cl::Kernel & out_transform_bn_kernel = opencl_thread_data.m_out_transform_bn_kernel;
+    cl::Kernel & out_transform_bn_in_kernel = opencl_thread_data.m_out_transform_bn_in_kernel;
 
     auto mwg = m_opencl.m_sgemm_tuners.mwg;
     auto nwg = m_opencl.m_sgemm_tuners.nwg;
@@ -478,7 +1091,7 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     assert(vwn != 0);
     assert(wavefront_size != 0);
 
-    constexpr auto tiles = WINOGRAD_P;
+    const auto tiles = WINOGRAD_P * batch_size;
 
     auto wgs = lcm(tiles, wavefront_size);
     auto m_ceil = int(lcm(lcm(outputs, mwg), vwm));
@@ -486,20 +1099,26 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     auto k_ceil = int(lcm(lcm(channels, kwg), vwm));
 
     cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    auto& events = opencl_thread_data.m_kernel_events;
 
-    try {
-        in_transform_kernel.setArg(0, bufferInOut);
-        in_transform_kernel.setArg(1, bufferV);
-        in_transform_kernel.setArg(2, channels);
-        in_transform_kernel.setArg(3, k_ceil);
-        in_transform_kernel.setArg(4, n_ceil);
-
-        queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
-                                   cl::NDRange(wgs, channels));
-    } catch (const cl::Error &e) {
-        std::cerr << "Error in convolve3: " << e.what() << ": "
-            << e.err() << std::endl;
-        throw;
+    if (!input_transformed) {
+        try {
+            in_transform_kernel.setArg(0, bufferInOut);
+            in_transform_kernel.setArg(1, bufferV);
+            in_transform_kernel.setArg(2, channels);
+            in_transform_kernel.setArg(3, k_ceil);
+            in_transform_kernel.setArg(4, n_ceil);
+            in_transform_kernel.setArg(5, static_cast<int>(batch_size));
+
+            queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
+                                       cl::NDRange(wgs, channels), cl::NullRange,
+                                       nullptr,
+                                       trace_event(events, "in_transform"));
+        } catch (const cl::Error &e) {
+            std::cerr << "Error in convolve3: " << e.what() << ": "
+                << e.err() << std::endl;
+            throw;
+        }
     }
 
     try {
@@ -517,7 +1136,8 @@ void OpenCL_Network::convolve3(int channels, int outputs,
                                   (cl::size_type)WINOGRAD_TILE};
 
         queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
-                                   size_sgemm, local_sgemm);
+                                   size_sgemm, local_sgemm,
+                                   nullptr, trace_event(events, "sgemm"));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3: " << e.what() << ": "
             << e.err() << std::endl;
@@ -525,31 +1145,71 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     }
 
     try {
-        if (bn_weights) {
+        if (transform_output) {
+            assert(bn_weights);
+            // The next convolution has our outputs as its channels.
+            const auto next_k_ceil = int(lcm(lcm(outputs, kwg), vwm));
+            const auto group = fused_group_size(outputs);
+            assert(group != 0);
+
+            out_transform_bn_in_kernel.setArg(0, bufferM);
+            if (store_output) {
+                out_transform_bn_in_kernel.setArg(1, bufferInOut);
+            } else {
+                out_transform_bn_in_kernel.setArg(1, nullptr);
+            }
+            out_transform_bn_in_kernel.setArg(2, bufferV);
+            out_transform_bn_in_kernel.setArg(3, outputs);
+            out_transform_bn_in_kernel.setArg(4, m_ceil);
+            out_transform_bn_in_kernel.setArg(5, n_ceil);
+            out_transform_bn_in_kernel.setArg(6, next_k_ceil);
+            if (bufferResidual) {
+                out_transform_bn_in_kernel.setArg(7, *bufferResidual);
+            } else {
+                out_transform_bn_in_kernel.setArg(7, nullptr);
+            }
+            out_transform_bn_in_kernel.setArg(8, (*bn_weights)[0]);
+            out_transform_bn_in_kernel.setArg(9, (*bn_weights)[1]);
+            out_transform_bn_in_kernel.setArg(10,
+                cl::Local(group * NUM_INTERSECTIONS * sizeof(float)));
+
+            queue.enqueueNDRangeKernel(out_transform_bn_in_kernel, cl::NullRange,
+                                       cl::NDRange(outputs, WINOGRAD_P, batch_size),
+                                       cl::NDRange(group, WINOGRAD_P, 1),
+                                       nullptr,
+                                       trace_event(events, "out_transform_bn_in"));
+        } else if (bn_weights) {
+            assert(store_output);
             out_transform_bn_kernel.setArg(0, bufferM);
             out_transform_bn_kernel.setArg(1, bufferInOut);
             out_transform_bn_kernel.setArg(2, outputs);
             out_transform_bn_kernel.setArg(3, m_ceil);
             out_transform_bn_kernel.setArg(4, n_ceil);
+            out_transform_bn_kernel.setArg(5, static_cast<int>(batch_size));
             if (bufferResidual) {
-                out_transform_bn_kernel.setArg(5, *bufferResidual);
+                out_transform_bn_kernel.setArg(6, *bufferResidual);
             } else {
-                out_transform_bn_kernel.setArg(5, nullptr);
+                out_transform_bn_kernel.setArg(6, nullptr);
             }
-            out_transform_bn_kernel.setArg(6, (*bn_weights)[0]);
-            out_transform_bn_kernel.setArg(7, (*bn_weights)[1]);
+            out_transform_bn_kernel.setArg(7, (*bn_weights)[0]);
+            out_transform_bn_kernel.setArg(8, (*bn_weights)[1]);
 
             queue.enqueueNDRangeKernel(out_transform_bn_kernel, cl::NullRange,
-                                       cl::NDRange(outputs, wgs));
+                                       cl::NDRange(outputs, wgs),
+                                       cl::NullRange, nullptr,
+                                       trace_event(events, "out_transform_bn"));
         } else {
             out_transform_kernel.setArg(0, bufferM);
             out_transform_kernel.setArg(1, bufferInOut);
             out_transform_kernel.setArg(2, outputs);
             out_transform_kernel.setArg(3, m_ceil);
             out_transform_kernel.setArg(4, n_ceil);
+            out_transform_kernel.setArg(5, static_cast<int>(batch_size));
 
             queue.enqueueNDRangeKernel(out_transform_kernel, cl::NullRange,
-                                       cl::NDRange(outputs, wgs));
+                                       cl::NDRange(outputs, wgs),
+                                       cl::NullRange, nullptr,
+                                       trace_event(events, "out_transform"));
         }
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3: " << e.what() << ": "
@@ -558,19 +1218,36 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     }
 }
 
+size_t OpenCL_Network::fused_group_size(const int outputs) const {
+    const auto& dims = m_opencl.m_max_workgroup_dims;
+    if (dims.size() < 2 || dims[1] < WINOGRAD_P) {
+        return 0;
+    }
+    // Each output takes a board of local memory, so keep the groups small.
+    for (auto group = size_t{8}; group > 0; group /= 2) {
+        if (outputs % group == 0 && group <= dims[0]
+            && group * WINOGRAD_P <= m_opencl.m_fused_workgroup_size) {
+            return group;
+        }
+    }
+    return 0;
+}
+
 void OpenCL_Network::batchnorm(int outputs,
                                int channel_size,
                                cl::Buffer& bufferInput,
                                cl::Buffer& bufferOutput,
                                cl::Buffer* bufferResidual,
-                               weight_slice_t weights) {
+                               weight_slice_t weights,
+                               const size_t batch_size) {
     cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
 
     cl::Kernel & batchnorm_kernel = opencl_thread_data.m_batchnorm_kernel;
+    auto& events = opencl_thread_data.m_kernel_events;
 
     size_t channelGroup = 1;
-    if (channel_size == 361) {
-        channelGroup = 19;
+    if (channel_size == NUM_INTERSECTIONS) {
+        channelGroup = BOARD_SIZE;
     }
 
     try {
@@ -585,8 +1262,9 @@ void OpenCL_Network::batchnorm(int outputs,
         batchnorm_kernel.setArg(4, weights[1]);
 
         queue.enqueueNDRangeKernel(batchnorm_kernel, cl::NullRange,
-                                   cl::NDRange(outputs, channel_size),
-                                   cl::NDRange(std::min(8, outputs), channelGroup));
+                                   cl::NDRange(outputs, channel_size, batch_size),
+                                   cl::NDRange(std::min(8, outputs), channelGroup, 1),
+                                   nullptr, trace_event(events, "batchnorm"));
     } catch (const cl::Error &e) {
         std::cerr << "Error in batchnorm: " << e.what() << ": "
             << e.err() << std::endl;
@@ -594,6 +1272,62 @@ void OpenCL_Network::batchnorm(int outputs,
     }
 }
 
+void OpenCL_Network::head_convolve(int channels, int outputs,
+                                   cl::Buffer& bufferInput,
+                                   cl::Buffer& bufferOutput,
+                                   weight_slice_t weights,
+                                   const size_t batch_size) {
+    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    cl::Kernel & kernel = opencl_thread_data.m_head_convolve_kernel;
+
+    try {
+        kernel.setArg(0, bufferInput);
+        kernel.setArg(1, bufferOutput);
+        kernel.setArg(2, weights[0]);
+        kernel.setArg(3, weights[1]);
+        kernel.setArg(4, weights[2]);
+        kernel.setArg(5, weights[3]);
+        kernel.setArg(6, channels);
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                   cl::NDRange(outputs, NUM_INTERSECTIONS, batch_size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in head_convolve: " << e.what() << ": "
+            << e.err() << std::endl;
+        throw;
+    }
+}
+
+void OpenCL_Network::head_innerproduct(int inputs, int outputs,
+                                       cl::Buffer& bufferInput,
+                                       cl::Buffer& bufferOutput,
+                                       int output_stride,
+                                       int output_offset,
+                                       bool relu,
+                                       weight_slice_t weights,
+                                       const size_t batch_size) {
+    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    cl::Kernel & kernel = opencl_thread_data.m_head_innerproduct_kernel;
+
+    try {
+        kernel.setArg(0, bufferInput);
+        kernel.setArg(1, bufferOutput);
+        kernel.setArg(2, weights[0]);
+        kernel.setArg(3, weights[1]);
+        kernel.setArg(4, inputs);
+        kernel.setArg(5, output_stride);
+        kernel.setArg(6, output_offset);
+        kernel.setArg(7, static_cast<int>(relu));
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                   cl::NDRange(outputs, batch_size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in head_innerproduct: " << e.what() << ": "
+            << e.err() << std::endl;
+        throw;
+    }
+}
+
 template<class T>
 static std::string opencl_dev_type_to_string(T type) {
     if (type == CL_DEVICE_TYPE_CPU) {
@@ -612,6 +1346,77 @@ static std::string trim(std::string trim_me) {
     return trim_me;
 }
 
+// Built programs are kept in the current directory, like the tuning
+// results, under a hash of everything that goes into them.
+static std::string program_cache_filename(const cl::Device& device,
+                                          const std::string& source,
+                                          const std::string& args) {
+    const auto platform = cl::Platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    const auto key = device.getInfo<CL_DEVICE_VENDOR>() + "\n"
+                   + device.getInfo<CL_DEVICE_NAME>() + "\n"
+                   + device.getInfo<CL_DEVICE_VERSION>() + "\n"
+                   + device.getInfo<CL_DRIVER_VERSION>() + "\n"
+                   + platform.getInfo<CL_PLATFORM_VERSION>() + "\n"
+                   + args + "\n" + source;
+    // 64-bit FNV-1a.
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    for (const auto c : key) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= std::uint64_t{1099511628211ULL};
+    }
+    return str(boost::format("leelaz_opencl_program_%016x") % hash);
+}
+
+// The program of the binary in filename, built. Not initialized if
+// there is no such file or the driver won't take it.
+static cl::Program load_program_binary(const cl::Context& context,
+                                       const cl::Device& device,
+                                       const std::string& filename,
+                                       const std::string& args) {
+    auto file = std::ifstream{filename, std::ios::binary};
+    if (!file) {
+        return cl::Program{};
+    }
+    const auto binary = std::vector<unsigned char>(
+        std::istreambuf_iterator<char>(file),
+        std::istreambuf_iterator<char>());
+    try {
+        auto program = cl::Program(context, std::vector<cl::Device>{device},
+                                   cl::Program::Binaries{binary});
+        program.build(args.c_str());
+        return program;
+    } catch (const cl::Error&) {
+        myprintf("Ignoring OpenCL program cache %s, it does not build.\n",
+                 filename.c_str());
+        return cl::Program{};
+    }
+}
+
+static void save_program_binary(const cl::Program& program,
+                                const std::string& filename) {
+    const auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+    if (binaries.size() != 1 || binaries[0].empty()) {
+        return;
+    }
+    // Every GPU of a kind builds the same program, so write a file of
+    // our own and move it into place, never a half written one.
+    const auto tmpname = filename + "." + std::to_string(
+        std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        auto file = std::ofstream{tmpname, std::ios::binary};
+        file.write(reinterpret_cast<const char*>(binaries[0].data()),
+                   binaries[0].size());
+        if (!file) {
+            file.close();
+            std::remove(tmpname.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpname.c_str());
+    }
+}
+
 void OpenCL::process_tuners(std::string tuners) {
     std::string buf;
     std::stringstream ss(tuners);
@@ -703,7 +1508,17 @@ std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
     return tuners;
 }
 
-void OpenCL::initialize(const int channels, const std::vector<int> & gpus, bool silent) {
+OpenCL::~OpenCL() {
+    if (m_tuner_thread.joinable()) {
+        m_tuner_cancel = true;
+        m_tuner_thread.join();
+    }
+}
+
+void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
+                        const int batch_size, bool silent) {
+    m_batch_size = batch_size;
+
     std::vector<cl::Platform> platforms;
     try {
         cl::Platform::get(&platforms);
@@ -804,6 +1619,15 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus, bool
     myprintf("Selected device: %s\n", trim(best_device.getInfo<CL_DEVICE_NAME>()).c_str());
     myprintf("with OpenCL %2.1f capability.\n", best_version);
 
+#ifdef USE_HALF
+    auto extensions = best_device.getInfo<CL_DEVICE_EXTENSIONS>();
+    if (extensions.find("cl_khr_fp16") == std::string::npos) {
+        myprintf("This build uses half precision, but the device does not "
+                 "support cl_khr_fp16.\n");
+        throw std::runtime_error("OpenCL device lacks half precision support.");
+    }
+#endif
+
     cl::Context context;
     try {
         context = cl::Context(best_device);
@@ -814,33 +1638,42 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus, bool
     m_context = context;
     m_device = best_device;
 
-    // Make program of the source code in the context
-    try {
-        m_program = cl::Program(m_context,
-                                  sourceCode_config
-                                + sourceCode_convolve3
-                                + sourceCode_utility
-                                + sourceCode_sgemm);
-    } catch (const cl::Error &e) {
-        myprintf("Error getting kernels: %s: %d", e.what(), e.err());
-        throw std::runtime_error("Error getting OpenCL kernels.");
-    }
-
     m_cl_args = cl_args;
 
     auto t = Tuner(*this, m_context, m_device);
     auto sgemm_tuners =
-        t.load_sgemm_tuners(channels, WINOGRAD_P, channels, WINOGRAD_TILE);
+        t.load_sgemm_tuners(channels, WINOGRAD_P * m_batch_size,
+                            channels, WINOGRAD_TILE);
+
+    const auto source = sourceCode_config
+                      + sourceCode_convolve3
+                      + sourceCode_utility
+                      + sourceCode_sgemm;
+    const auto args = cl_args + sgemm_tuners;
+    const auto cache_filename =
+        program_cache_filename(m_device, source, args);
+    m_program = load_program_binary(m_context, m_device, cache_filename,
+                                    args);
+    if (m_program()) {
+        myprintf("Loaded OpenCL program from %s.\n", cache_filename.c_str());
+    } else {
+        // Make program of the source code in the context
+        try {
+            m_program = cl::Program(m_context, source);
+        } catch (const cl::Error &e) {
+            myprintf("Error getting kernels: %s: %d", e.what(), e.err());
+            throw std::runtime_error("Error getting OpenCL kernels.");
+        }
 
-    // Build program for these specific devices
-    try {
-        std::string args = cl_args;
-        args += sgemm_tuners;
-        m_program.build(args.c_str());
-    } catch (const cl::Error&) {
-        myprintf("Error building kernels: %s\n",
-                 m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device).c_str());
-        throw std::runtime_error("Error building OpenCL kernels.");
+        // Build program for these specific devices
+        try {
+            m_program.build(args.c_str());
+        } catch (const cl::Error&) {
+            myprintf("Error building kernels: %s\n",
+                     m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device).c_str());
+            throw std::runtime_error("Error building OpenCL kernels.");
+        }
+        save_program_binary(m_program, cache_filename);
     }
 
     ensure_thread_initialized();
@@ -853,6 +1686,9 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus, bool
 
     m_max_workgroup_size = best_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
     m_max_workgroup_dims = best_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    m_fused_workgroup_size =
+        opencl_thread_data.m_out_transform_bn_in_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+            best_device);
 
     myprintf("Max workgroup size: %d\n", m_max_workgroup_size);
     myprintf("Max workgroup dimensions: ");
@@ -25,16 +25,34 @@
 #define CL_HPP_TARGET_OPENCL_VERSION    120
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <CL/cl2.hpp>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include <mutex>
+#include <thread>
 
 #include "Tuner.h"
 
-static constexpr auto WINOGRAD_P = (19 + 1) * (19 + 1) / 4;
+static constexpr auto WINOGRAD_P = (BOARD_SIZE + 1) * (BOARD_SIZE + 1) / 4;
 static constexpr auto WINOGRAD_TILE = 4 * 4;
+// With the heads on the GPU, forward() returns the 362 policy logits
+// and the value head output for each position.
+static constexpr auto HEAD_OUTPUTS = POTENTIAL_MOVES + 1;
+
+// Element type of the weights and activations in device memory. The host
+// side always works in float and converts when staging transfers.
+#ifdef USE_HALF
+using device_net_t = cl_half;
+#else
+using device_net_t = float;
+#endif
+
+device_net_t to_device_net_t(float x);
+float from_device_net_t(device_net_t x);
 
 class OpenCL;
 
@@ -47,6 +65,8 @@ private:
     bool is_batchnorm{false};
     bool is_innerproduct{false};
     bool is_residual_block{false};
+    bool is_policy_head{false};
+    bool is_value_head{false};
     std::vector<cl::Buffer> weights;
 };
 
@@ -57,21 +77,24 @@ private:
     bool m_is_initialized{false};
     cl::CommandQueue m_commandqueue;
     cl::Kernel m_in_transform_kernel;
+    cl::Kernel m_in_transform_packed_kernel;
     cl::Kernel m_sgemm_kernel;
     cl::Kernel m_out_transform_kernel;
     cl::Kernel m_out_transform_bn_kernel;
+    cl::Kernel m_out_transform_bn_in_kernel;
     cl::Kernel m_batchnorm_kernel;
-    cl::Buffer m_inBuffer;
-    cl::Buffer m_tmpBuffer;
-    cl::Buffer m_VBuffer;
-    cl::Buffer m_MBuffer;
-    cl::Buffer m_residualBuffer;
-    bool m_buffers_allocated{false};
+    cl::Kernel m_head_convolve_kernel;
+    cl::Kernel m_head_innerproduct_kernel;
+    // Kernels of the forward pass in flight, when tracing.
+    std::vector<std::pair<const char*, cl::Event>> m_kernel_events;
 };
 
 class OpenCL_Network {
 public:
-    OpenCL_Network(OpenCL & opencl) : m_opencl(opencl) {}
+    // At most max_in_flight forward passes run at once, each with a set
+    // of device buffers from the pool of this network.
+    OpenCL_Network(OpenCL & opencl, size_t max_in_flight = 2)
+        : m_opencl(opencl), m_max_in_flight(max_in_flight) {}
     OpenCL & getOpenCL() {
         return m_opencl;
     }
@@ -120,44 +143,162 @@ public:
         m_layers[layer].channels = channels;
     }
 
+    // 1x1 convolution + batchnorm, then the innerproduct to the moves.
+    void push_policy_head(unsigned int channels,
+                          const std::vector<float>& conv_weights,
+                          const std::vector<float>& conv_biases,
+                          const std::vector<float>& bn_means,
+                          const std::vector<float>& bn_stddivs,
+                          const std::vector<float>& ip_weights,
+                          const std::vector<float>& ip_biases) {
+        size_t layer = get_layer_count();
+        push_weights(layer, conv_weights);
+        push_weights(layer, conv_biases);
+        push_weights(layer, bn_means);
+        push_weights(layer, bn_stddivs);
+        push_weights(layer, ip_weights);
+        push_weights(layer, ip_biases);
+        m_layers[layer].is_policy_head = true;
+        m_layers[layer].channels = channels;
+        m_layers[layer].outputs = conv_biases.size();
+        m_layers[layer].filter_size = 1;
+    }
+
+    // 1x1 convolution + batchnorm, then two innerproducts to the winrate.
+    void push_value_head(unsigned int channels,
+                         const std::vector<float>& conv_weights,
+                         const std::vector<float>& conv_biases,
+                         const std::vector<float>& bn_means,
+                         const std::vector<float>& bn_stddivs,
+                         const std::vector<float>& ip1_weights,
+                         const std::vector<float>& ip1_biases,
+                         const std::vector<float>& ip2_weights,
+                         const std::vector<float>& ip2_biases) {
+        size_t layer = get_layer_count();
+        push_weights(layer, conv_weights);
+        push_weights(layer, conv_biases);
+        push_weights(layer, bn_means);
+        push_weights(layer, bn_stddivs);
+        push_weights(layer, ip1_weights);
+        push_weights(layer, ip1_biases);
+        push_weights(layer, ip2_weights);
+        push_weights(layer, ip2_biases);
+        m_layers[layer].is_value_head = true;
+        m_layers[layer].channels = channels;
+        m_layers[layer].outputs = conv_biases.size();
+        m_layers[layer].filter_size = 1;
+    }
+
+    bool has_heads() const {
+        return !m_layers.empty()
+            && (m_layers.back().is_policy_head
+                || m_layers.back().is_value_head);
+    }
+
     size_t get_layer_count() const {
         return m_layers.size();
     }
 
-    void forward(const std::vector<net_t>& input, std::vector<net_t>& output);
+    // Exchanges the weights with another network on the same device.
+    void swap_layers(OpenCL_Network& other) {
+        std::swap(m_layers, other.m_layers);
+    }
+
+    void forward(const std::vector<net_t>& input, std::vector<net_t>& output,
+                 const size_t batch_size = 1);
 
 private:
     using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
 
+    // Words of an input plane as forward uploads it, one bit per
+    // intersection.
+    static constexpr auto INPUT_WORDS = (NUM_INTERSECTIONS + 31) / 32;
+
+    // Device memory of one forward pass, sized for the largest batch.
+    // The search threads share them, so adding threads doesn't take
+    // any more memory on the device.
+    struct Buffers {
+        cl::Buffer m_inBuffer;
+        cl::Buffer m_tmpBuffer;
+        cl::Buffer m_VBuffer;
+        cl::Buffer m_MBuffer;
+        cl::Buffer m_residualBuffer;
+        cl::Buffer m_headConvBuffer;
+        cl::Buffer m_headIpBuffer;
+        cl::Buffer m_headOutBuffer;
+        // The input planes, INPUT_WORDS per plane.
+        cl::Buffer m_packedInBuffer;
+        // Page-locked staging buffers, mapped once, so that uploads and
+        // readbacks are plain DMA transfers that overlap with kernel work.
+        cl::Buffer m_pinnedInBuffer;
+        cl::Buffer m_pinnedOutBuffer;
+        cl_uint * m_pinnedIn{nullptr};
+        device_net_t * m_pinnedOut{nullptr};
+    };
+    // Waits while max_in_flight passes hold buffers.
+    std::unique_ptr<Buffers> acquire_buffers();
+    void release_buffers(std::unique_ptr<Buffers> buffers);
+    std::unique_ptr<Buffers> allocate_buffers();
+
     void push_weights(size_t layer, const std::vector<float>& weights) {
         add_weights(layer, weights.size(), weights.data());
     }
     void add_weights(size_t layer, size_t size, const float* weights);
 
+    // With input_transformed, bufferV already holds the transformed
+    // input. transform_output leaves the transformed output in bufferV
+    // for a next convolution of the same size, store_output writes it
+    // to bufferInOut. Both need bn_weights and fused_group_size.
     void convolve3(int channels, int outputs,
                     cl::Buffer& bufferInOut, cl::Buffer& bufferV,
                     cl::Buffer& bufferM, weight_slice_t weights,
                     cl::Buffer* bufferResidual,
-                    weight_slice_t* bn_weights);
+                    weight_slice_t* bn_weights,
+                    const size_t batch_size,
+                    bool input_transformed = false,
+                    bool store_output = true,
+                    bool transform_output = false);
+    // Writes the Winograd transform of the packed input planes to bufferV,
+    // for convolve3 with input_transformed.
+    void transform_packed_input(int channels, cl::Buffer& bufferPacked,
+                                cl::Buffer& bufferV,
+                                const size_t batch_size);
+    // Outputs per work group of out_transform_fused_bn_in, which needs
+    // whole boards in a work group. 0 if the device can't run it.
+    size_t fused_group_size(int outputs) const;
     void batchnorm(int outputs, int channel_size, cl::Buffer& input,
                    cl::Buffer& output, cl::Buffer* residual,
-                   weight_slice_t weights);
+                   weight_slice_t weights,
+                   const size_t batch_size);
+    void head_convolve(int channels, int outputs, cl::Buffer& input,
+                       cl::Buffer& output, weight_slice_t weights,
+                       const size_t batch_size);
+    void head_innerproduct(int inputs, int outputs, cl::Buffer& input,
+                           cl::Buffer& output, int output_stride,
+                           int output_offset, bool relu,
+                           weight_slice_t weights,
+                           const size_t batch_size);
 
     OpenCL & m_opencl;
-
-    // this mutex is not required for correctness, but this exists simply
-    // because queue.finish() is a busy wait and having a lot of threads
-    // waiting here is counterproductive CPU-wise.  At least std::mutex
-    // isn't busy wait so it should be better.
-    std::mutex m_queue_finish_mutex;
     std::vector<Layer> m_layers;
+
+    const size_t m_max_in_flight;
+    std::mutex m_buffers_mutex;
+    std::condition_variable m_buffers_cv;
+    std::vector<std::unique_ptr<Buffers>> m_free_buffers;
+    size_t m_buffers_allocated{0};
 };
 
 class OpenCL {
     friend class OpenCL_Network;
     friend class Tuner;
 public:
-    void initialize(const int channels, const std::vector<int> & gpus, bool silent = false);
+    ~OpenCL();
+    void initialize(const int channels, const std::vector<int> & gpus,
+                    const int batch_size, bool silent = false);
+    int get_batch_size() const {
+        return m_batch_size;
+    }
     void ensure_thread_initialized(void);
     std::string get_device_name();
 
@@ -178,10 +319,15 @@ private:
         size_t mdimc, ndimc;
     };
     sgemm_tuners m_sgemm_tuners;
+    int m_batch_size{1};
     size_t m_wavefront_size{0};
     size_t m_max_workgroup_size{0};
     std::vector<size_t> m_max_workgroup_dims;
+    size_t m_fused_workgroup_size{0};
     bool m_init_ok{false};
+    // Set by --tune-background, see Tuner::load_sgemm_tuners.
+    std::thread m_tuner_thread;
+    std::atomic<bool> m_tuner_cancel{false};
 };
 
 extern thread_local ThreadData opencl_thread_data;
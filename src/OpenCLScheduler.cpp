@@ -18,64 +18,345 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <iterator>
+
 #include "GTP.h"
 #include "Random.h"
+#include "Trace.h"
+#include "Utils.h"
 #include "OpenCLScheduler.h"
 
+using namespace Utils;
+
+constexpr int OpenCLScheduler::BATCH_TIMEOUT_US;
+
 thread_local auto current_thread_gpu_num = size_t{0};
 OpenCLScheduler opencl;
 
-void OpenCLScheduler::initialize(const int channels) {
+OpenCLScheduler::~OpenCLScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    for (auto& worker : m_worker_threads) {
+        worker.join();
+    }
+}
+
+void OpenCLScheduler::initialize(const int channels,
+                                 CPUForward cpu_forward,
+                                 const int cpu_workers) {
+    // Per-device settings, in --gpu order, fall back to the global ones.
+    const auto device_state = [](const size_t index) {
+        auto state = DeviceState{};
+        state.batch_size = static_cast<size_t>(
+            index < cfg_gpu_batch_sizes.size() ? cfg_gpu_batch_sizes[index]
+                                               : cfg_batch_size);
+        state.max_in_flight =
+            index < cfg_gpu_inflight.size() ? cfg_gpu_inflight[index] : 2;
+        return state;
+    };
+
+    if (!cfg_tuner_import.empty()) {
+        Tuner::import_database(cfg_tuner_import);
+    }
+
     // multi-gpu?
     if (!cfg_gpus.empty()) {
-        auto silent{false};
-        for(auto gpu : cfg_gpus) {
+        // The GPUs build their kernels and tune at the same time, each
+        // from a thread of its own, so its thread data goes with it.
+        // GPUs of the same model tune only once, see Tuner.
+        auto inits = std::vector<std::future<void>>{};
+        for (auto i = size_t{0}; i < cfg_gpus.size(); i++) {
+            const auto state = device_state(i);
             auto opencl = std::make_unique<OpenCL>();
-            auto net = std::make_unique<OpenCL_Network>(*opencl);
-            opencl->initialize(channels, {gpu}, silent);
+            auto net = std::make_unique<OpenCL_Network>(
+                *opencl, state.max_in_flight);
+            // Only the first GPU dumps the full list of GPUs.
+            inits.emplace_back(std::async(std::launch::async,
+                [&opencl = *opencl, channels, gpu = cfg_gpus[i],
+                 batch_size = state.batch_size, silent = i != 0]() {
+                    opencl.initialize(channels, {gpu}, batch_size, silent);
+                }));
             m_opencl.push_back(std::move(opencl));
             m_networks.push_back(std::move(net));
+            m_devices.push_back(state);
+        }
+        for (auto& init : inits) {
+            init.get();
+        }
+    } else {
+        const auto state = device_state(0);
+        auto opencl = std::make_unique<OpenCL>();
+        auto net = std::make_unique<OpenCL_Network>(*opencl,
+                                                    state.max_in_flight);
+        opencl->initialize(channels, {}, state.batch_size);
 
-            // Clear thread data on every init call.  We don't know which GPU
-            // this thread will be eventually be assigned to
-            opencl_thread_data = ThreadData();
+        m_opencl.push_back(std::move(opencl));
+        m_networks.push_back(std::move(net));
+        m_devices.push_back(state);
+    }
+
+    // With --tune-background the tuner threads export again once they
+    // are done, see Tuner::load_sgemm_tuners.
+    if (!cfg_tuner_export.empty()) {
+        Tuner::export_database(cfg_tuner_export);
+    }
 
-            // starting next GPU, let's not dump full list of GPUs
-            silent = true;
+    if (cpu_forward && cpu_workers > 0) {
+        // Batches of one, so its share of the positions can be small.
+        auto state = DeviceState{};
+        state.is_cpu = true;
+        state.max_in_flight = cpu_workers;
+        m_devices.push_back(state);
+        m_cpu_forward = std::move(cpu_forward);
+    }
+
+    // A single GPU without batching is run directly from the search
+    // threads, see forward().
+    if (m_devices.size() == 1 && m_devices[0].batch_size == 1) {
+        return;
+    }
+
+    m_stats_start = std::chrono::steady_clock::now();
+    for(size_t gnum = 0; gnum < m_devices.size(); gnum++) {
+        // One worker thread per batch that may be in flight.  The default
+        // of 2 lets us fully utilize the GPU, since the worker thread
+        // consists of some CPU work for task preparation.
+        for(auto i = 0; i < m_devices[gnum].max_in_flight; i++) {
+            m_worker_threads.emplace_back([this, gnum] {
+                batch_worker(gnum);
+            });
+        }
+    }
+}
+
+double OpenCLScheduler::estimated_finish_us(const size_t gnum) const {
+    const auto& device = m_devices[gnum];
+    const auto positions = std::min(m_forward_queue.size(),
+                                    device.batch_size);
+    const auto waiting = device.is_cpu ? 0 : device.in_flight;
+    return (waiting + 1) * positions * device.us_per_position;
+}
+
+bool OpenCLScheduler::should_dispatch(const size_t gnum) const {
+    // Positions that GPUs expected to finish sooner than this one can
+    // still pick up right now.  Only leftovers beyond that are ours.
+    // A GPU that has not been measured yet estimates 0 and so gets
+    // work early on.
+    const auto own_finish = estimated_finish_us(gnum);
+    if (m_devices[gnum].is_cpu) {
+        // It only adds to the throughput if it beats the GPUs even
+        // when they first have to finish what they are running.
+        for (size_t other = 0; other < m_devices.size(); other++) {
+            if (!m_devices[other].is_cpu
+                && estimated_finish_us(other) <= own_finish) {
+                return false;
+            }
+        }
+    }
+    auto faster_capacity = size_t{0};
+    for (size_t other = 0; other < m_devices.size(); other++) {
+        const auto& device = m_devices[other];
+        if (other == gnum || device.in_flight >= device.max_in_flight) {
+            continue;
         }
+        if (estimated_finish_us(other) < own_finish) {
+            faster_capacity += device.batch_size
+                * (device.max_in_flight - device.in_flight);
+        }
+    }
+    return m_forward_queue.size() > faster_capacity;
+}
+
+void OpenCLScheduler::batch_worker(const size_t gnum) {
+    current_thread_gpu_num = gnum;
 
-        for(size_t gnum = 0; gnum < m_networks.size(); gnum++) {
-            // launch the worker thread.  2 threads so that we can fully
-            // utilize GPU, since the worker thread consists of some CPU
-            // work for task preparation.
-            constexpr auto num_threads = 2;
-            for(auto i = 0; i < num_threads; i++) {
-                m_threadpool.add_thread([gnum] {
-                    current_thread_gpu_num = gnum;
+    const auto batch_size = m_devices[gnum].batch_size;
+    auto batch_input = std::vector<net_t>();
+    auto batch_output = std::vector<net_t>();
+
+    while (true) {
+        auto batch = std::list<std::shared_ptr<ForwardQueueEntry>>{};
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this, gnum] {
+                return !m_running
+                    || (!m_forward_queue.empty() && should_dispatch(gnum));
+            });
+            if (!m_running && m_forward_queue.empty()) {
+                return;
+            }
+            // Give the other search threads a moment to fill the batch.
+            if (m_forward_queue.size() < batch_size) {
+                m_cv.wait_for(lock,
+                              std::chrono::microseconds(BATCH_TIMEOUT_US),
+                              [this, batch_size] {
+                    return !m_running
+                        || m_forward_queue.size() >= batch_size;
                 });
             }
+            // Another worker may have emptied the queue while we waited.
+            const auto count = std::min(m_forward_queue.size(), batch_size);
+            if (count == 0) {
+                continue;
+            }
+            auto last = begin(m_forward_queue);
+            std::advance(last, count);
+            batch.splice(end(batch), m_forward_queue,
+                         begin(m_forward_queue), last);
+
+            auto& device = m_devices[gnum];
+            device.queue_depth_sum += m_forward_queue.size() + count;
+            if (device.in_flight++ == 0) {
+                device.busy_since = std::chrono::steady_clock::now();
+            }
         }
-    } else {
-        auto opencl = std::make_unique<OpenCL>();
-        auto net = std::make_unique<OpenCL_Network>(*opencl);
-        opencl->initialize(channels, {});
 
-        m_opencl.push_back(std::move(opencl));
-        m_networks.push_back(std::move(net));
+        const auto in_size = batch.front()->in.size();
+        const auto out_size = batch.front()->out.size();
+        batch_input.resize(in_size * batch.size());
+        batch_output.resize(out_size * batch.size());
+
+        auto index = size_t{0};
+        for (const auto& entry : batch) {
+            std::copy(begin(entry->in), end(entry->in),
+                      begin(batch_input) + in_size * index);
+            index++;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        if (m_devices[gnum].is_cpu) {
+            TraceScope trace("cpu_batch", "batch", batch.size());
+            m_cpu_forward(batch_input, batch_output, batch.size());
+        } else {
+            TraceScope trace("gpu_batch", "batch", batch.size());
+            m_networks[gnum]->forward(batch_input, batch_output, batch.size());
+        }
+        const auto stop = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto& device = m_devices[gnum];
+            const auto elapsed_us =
+                std::chrono::duration<double, std::micro>(stop - start).count();
+            const auto sample = elapsed_us / batch.size();
+            if (device.us_per_position == 0.0) {
+                device.us_per_position = sample;
+            } else {
+                device.us_per_position +=
+                    LATENCY_DECAY * (sample - device.us_per_position);
+            }
+            device.batches++;
+            device.positions += batch.size();
+            if (device.is_cpu) {
+                // Summed over the workers.
+                device.busy_us += elapsed_us;
+                device.in_flight--;
+            } else if (--device.in_flight == 0) {
+                device.busy_us += std::chrono::duration<double, std::micro>(
+                    stop - device.busy_since).count();
+            }
+        }
+        // Workers that left this batch to us may now be the better choice.
+        m_cv.notify_all();
+
+        index = 0;
+        for (const auto& entry : batch) {
+            const auto out_begin = begin(batch_output) + out_size * index;
+            std::copy(out_begin, out_begin + out_size, begin(entry->out));
+            {
+                std::lock_guard<std::mutex> lock(entry->mutex);
+                entry->ready = true;
+            }
+            entry->cv.notify_one();
+            index++;
+        }
     }
 }
 
 void OpenCLScheduler::forward(const std::vector<net_t>& input,
                               std::vector<net_t>& output) {
-    if (m_networks.size() == 1) {
+    if (m_worker_threads.empty()) {
         m_networks[0]->forward(input, output);
         return;
     }
 
-    auto f = m_threadpool.add_task([this, &input, &output]{
-        m_networks[current_thread_gpu_num]->forward(input, output);
-    });
+    auto entry = std::make_shared<ForwardQueueEntry>(input, output);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_forward_queue.push_back(entry);
+    }
+    // Wake everyone: a worker waiting for its batch to fill up should
+    // re-check the queue size, an idle one should start a new batch.
+    m_cv.notify_all();
+
+    TraceScope trace("gpu_wait", "search");
+    std::unique_lock<std::mutex> lock(entry->mutex);
+    entry->cv.wait(lock, [&entry] { return entry->ready; });
+}
+
+std::vector<std::unique_ptr<OpenCL_Network>>
+OpenCLScheduler::make_networks() {
+    auto networks = std::vector<std::unique_ptr<OpenCL_Network>>{};
+    for (auto gnum = size_t{0}; gnum < m_opencl.size(); gnum++) {
+        networks.emplace_back(std::make_unique<OpenCL_Network>(
+            *m_opencl[gnum], m_devices[gnum].max_in_flight));
+    }
+    return networks;
+}
+
+void OpenCLScheduler::swap_layers(
+    std::vector<std::unique_ptr<OpenCL_Network>>& networks) {
+    assert(networks.size() == m_networks.size());
+    for (auto gnum = size_t{0}; gnum < m_networks.size(); gnum++) {
+        m_networks[gnum]->swap_layers(*networks[gnum]);
+    }
+}
+
+void OpenCLScheduler::dump_stats() {
+    if (m_worker_threads.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    const auto wall_us = std::chrono::duration<double, std::micro>(
+        now - m_stats_start).count();
+    m_stats_start = now;
+    if (wall_us <= 0.0) {
+        return;
+    }
 
-    f.get();
+    for (size_t gnum = 0; gnum < m_devices.size(); gnum++) {
+        auto& device = m_devices[gnum];
+        if (device.in_flight > 0 && !device.is_cpu) {
+            device.busy_us += std::chrono::duration<double, std::micro>(
+                now - device.busy_since).count();
+            device.busy_since = now;
+        }
+        const auto batches = std::max(device.batches, size_t{1});
+        const auto name = device.is_cpu ? std::string{"CPU"}
+            : "GPU " + std::to_string(cfg_gpus.empty() ? 0 : cfg_gpus[gnum]);
+        // For the CPU, util is the average over the workers.
+        const auto slots = device.is_cpu ? device.max_in_flight : 1;
+        myprintf("%s: %d batches, %.1f pos/batch (max %d), "
+                 "%.3f ms/pos, queue %.1f, util %.1f%%\n",
+                 name.c_str(),
+                 static_cast<int>(device.batches),
+                 device.positions / static_cast<double>(batches),
+                 static_cast<int>(device.batch_size),
+                 device.us_per_position / 1000.0,
+                 device.queue_depth_sum / static_cast<double>(batches),
+                 100.0 * device.busy_us / (wall_us * slots));
+        device.batches = 0;
+        device.positions = 0;
+        device.queue_depth_sum = 0;
+        device.busy_us = 0.0;
+    }
 }
 #endif
@@ -20,35 +20,108 @@
 #define OPENCL_SCHEDULER_H_INCLUDED
 #include "config.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
-#include <future>
 
 #include "OpenCL.h"
-#include "ThreadPool.h"
 
 class OpenCLScheduler {
 public:
-    void initialize(const int channels);
+    // Evaluates batch_size positions on the CPU, with the same output
+    // layout as OpenCL_Network::forward.
+    using CPUForward = std::function<void(const std::vector<net_t>& input,
+                                          std::vector<net_t>& output,
+                                          size_t batch_size)>;
+
+    ~OpenCLScheduler();
+    // With cpu_forward, cpu_workers threads evaluate positions on the
+    // CPU as another, slower device. It only gets a position when it
+    // would be done with it before any GPU could.
+    void initialize(const int channels,
+                    CPUForward cpu_forward = nullptr,
+                    int cpu_workers = 0);
     std::vector<std::unique_ptr<OpenCL_Network>> & get_networks() {
         return m_networks;
     }
     void forward(const std::vector<net_t>& input,
                  std::vector<net_t>& output);
+    // Print per-GPU utilization since the last call and reset it.
+    void dump_stats();
+    // Networks without weights, one on each device of get_networks(),
+    // to load other weights into while these keep running.
+    std::vector<std::unique_ptr<OpenCL_Network>> make_networks();
+    // Takes over the weights of networks from make_networks and leaves
+    // the old ones there. No batch may be running.
+    void swap_layers(std::vector<std::unique_ptr<OpenCL_Network>>& networks);
 private:
-    class ForwardTask {
+    // A position waiting in the forward queue.  The submitting thread
+    // sleeps on cv until a batch worker has filled in the output.
+    class ForwardQueueEntry {
     public:
-        const std::vector<net_t> *input;
-        std::vector<net_t> * output;
-        std::promise<void> prom;
-        ForwardTask() : input(nullptr), output(nullptr) {}
-        ForwardTask(const std::vector<net_t> * in,
-                    std::vector<net_t> * out)
-            : input(in), output(out) {}
+        std::mutex mutex;
+        std::condition_variable cv;
+        const std::vector<net_t>& in;
+        std::vector<net_t>& out;
+        bool ready{false};
+        ForwardQueueEntry(const std::vector<net_t>& input,
+                          std::vector<net_t>& output)
+            : in(input), out(output) {}
     };
 
+    // How long a batch worker waits for a batch to fill up before
+    // running whatever it has.
+    static constexpr auto BATCH_TIMEOUT_US = 1000;
+
+    // Weight of the newest sample in the latency moving average.
+    static constexpr auto LATENCY_DECAY = 0.1;
+
+    // Scheduling state and counters of one GPU, protected by m_mutex.
+    struct DeviceState {
+        // The CPU runs its batches side by side, one per worker, and
+        // not one after another like a GPU.
+        bool is_cpu{false};
+        size_t batch_size{1};
+        int max_in_flight{1};
+        int in_flight{0};
+        // Moving average of the wall time per position, 0 until
+        // the first batch has been measured.
+        double us_per_position{0.0};
+        // Counters since the last dump_stats().
+        size_t batches{0};
+        size_t positions{0};
+        size_t queue_depth_sum{0};
+        double busy_us{0.0};
+        // Start of the current stretch with a batch in flight.
+        std::chrono::steady_clock::time_point busy_since;
+    };
+
+    void batch_worker(const size_t gnum);
+    // Estimated time until a batch dispatched now would finish on gnum.
+    double estimated_finish_us(const size_t gnum) const;
+    // Returns true if gnum should take the next batch rather than leave
+    // it to a less loaded GPU with a free slot.
+    bool should_dispatch(const size_t gnum) const;
+
     std::vector<std::unique_ptr<OpenCL_Network>> m_networks;
     std::vector<std::unique_ptr<OpenCL>> m_opencl;
-    Utils::ThreadPool m_threadpool;
+    // Only set with a CPU device, which comes after the GPUs in
+    // m_devices and has no network.
+    CPUForward m_cpu_forward;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
+    std::vector<DeviceState> m_devices;
+    std::chrono::steady_clock::time_point m_stats_start;
+    std::atomic<bool> m_running{true};
+    std::vector<std::thread> m_worker_threads;
 };
 
 extern OpenCLScheduler opencl;
@@ -0,0 +1,178 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "PerfStats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/format.hpp>
+
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+
+const char* const PHASE_NAMES[] = {
+    "playout", "nn_eval", "nn_cache", "nn_forward", "nn_compute", "ttable"
+};
+static_assert(sizeof(PHASE_NAMES) / sizeof(PHASE_NAMES[0])
+              == PerfStats::NUM_PHASES, "A phase has no name.");
+
+struct Totals {
+    std::array<std::uint64_t, PerfStats::NUM_PHASES> calls{};
+    std::array<std::uint64_t, PerfStats::NUM_PHASES> samples{};
+    std::array<std::uint64_t, PerfStats::NUM_PHASES> sampled_ns{};
+
+    void add(const PerfStats::Counters& counters) {
+        for (auto i = 0; i < PerfStats::NUM_PHASES; i++) {
+            calls[i] += counters.calls[i].load(std::memory_order_relaxed);
+            samples[i] += counters.samples[i].load(std::memory_order_relaxed);
+            sampled_ns[i] +=
+                counters.sampled_ns[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    Totals operator-(const Totals& other) const {
+        auto diff = Totals{};
+        for (auto i = 0; i < PerfStats::NUM_PHASES; i++) {
+            diff.calls[i] = calls[i] - other.calls[i];
+            diff.samples[i] = samples[i] - other.samples[i];
+            diff.sampled_ns[i] = sampled_ns[i] - other.sampled_ns[i];
+        }
+        return diff;
+    }
+
+    // Extrapolated from the sampled calls.
+    double total_ms(int phase) const {
+        if (samples[phase] == 0) {
+            return 0.0;
+        }
+        return 1e-6 * sampled_ns[phase] * calls[phase] / samples[phase];
+    }
+};
+
+// Counters of the running threads, and the sum of those that exited.
+struct Registry {
+    std::mutex mutex;
+    std::vector<const PerfStats::Counters*> live;
+    Totals retired;
+    // Where to_json and dump_stats count from.
+    Totals baseline;
+    Totals last_dump;
+
+    // Never destroyed: the thread pool threads exit after the statics
+    // are gone, and their slots still retire into it.
+    static Registry& get() {
+        static auto registry = new Registry;
+        return *registry;
+    }
+
+    // What happened since mark. With update, mark moves up to now.
+    Totals since(Totals& mark, bool update) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto totals = retired;
+        for (const auto counters : live) {
+            totals.add(*counters);
+        }
+        const auto diff = totals - mark;
+        if (update) {
+            mark = totals;
+        }
+        return diff;
+    }
+};
+
+struct ThreadSlot {
+    PerfStats::Counters counters;
+
+    ThreadSlot() {
+        auto& registry = Registry::get();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.live.emplace_back(&counters);
+    }
+    ~ThreadSlot() {
+        auto& registry = Registry::get();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.retired.add(counters);
+        registry.live.erase(std::find(begin(registry.live),
+                                      end(registry.live), &counters));
+    }
+};
+
+}
+
+PerfStats::Counters& PerfStats::get_counters() {
+    thread_local ThreadSlot slot;
+    return slot.counters;
+}
+
+std::string PerfStats::to_json() {
+    auto& registry = Registry::get();
+    const auto totals = registry.since(registry.baseline, false);
+    auto json = std::string{"{"};
+    for (auto i = 0; i < NUM_PHASES; i++) {
+        const auto ms = totals.total_ms(i);
+        const auto calls = totals.calls[i];
+        json += str(boost::format("%s\"%s\": {\"calls\": %d, \"ms\": %.1f, "
+                                  "\"us_per_call\": %.2f}")
+                    % (i ? ", " : "") % PHASE_NAMES[i] % calls % ms
+                    % (calls ? ms * 1000.0 / calls : 0.0));
+    }
+    return json + "}";
+}
+
+void PerfStats::reset() {
+    auto& registry = Registry::get();
+    registry.since(registry.baseline, true);
+}
+
+void PerfStats::dump_stats() {
+    auto& registry = Registry::get();
+    const auto totals = registry.since(registry.last_dump, true);
+    if (totals.calls[PLAYOUT] == 0) {
+        return;
+    }
+    auto line = std::string{"Time per phase:"};
+    for (auto i = 0; i < NUM_PHASES; i++) {
+        if (totals.calls[i] != 0) {
+            line += str(boost::format(" %s %.0f ms (%.1f us)")
+                        % PHASE_NAMES[i] % totals.total_ms(i)
+                        % (totals.total_ms(i) * 1000.0 / totals.calls[i]));
+        }
+    }
+    myprintf("%s\n", line.c_str());
+}
+
+void PerfStats::start_log(const std::string& filename, const int interval) {
+    std::thread([filename, interval]() {
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::seconds(interval));
+            const auto seconds =
+                std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::system_clock::now().time_since_epoch());
+            auto log = std::ofstream{filename, std::ios::app};
+            log << "{\"time\": " << seconds.count()
+                << ", \"phases\": " << to_json() << "}" << std::endl;
+        }
+    }).detach();
+}
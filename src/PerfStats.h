@@ -0,0 +1,114 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PERFSTATS_H_INCLUDED
+#define PERFSTATS_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+    Where the search spends its time. Every thread counts the calls of
+    each phase in counters of its own, and times one call in
+    SAMPLE_INTERVAL, so the common case costs no more than an increment.
+    The totals are estimated from the sampled calls. Phases nest: a
+    playout includes its network evaluations, which include the cache
+    and the forward pass.
+*/
+class PerfStats {
+public:
+    enum Phase {
+        PLAYOUT,      // play_simulation from the root down and back up
+        NN_EVAL,      // Network::get_scored_moves
+        NN_CACHE,     // NNCache lookups and inserts, with the shard lock
+        NN_FORWARD,   // a search thread waiting for its forward pass
+        NN_COMPUTE,   // a backend running one batch
+        TTABLE,       // transposition table syncs and updates
+        NUM_PHASES
+    };
+
+    static constexpr auto SAMPLE_INTERVAL = 8;
+
+    // Estimated totals per phase since the last reset, summed over the
+    // threads, as one line of JSON:
+    //   {"playout": {"calls": N, "ms": T, "us_per_call": U}, ...}
+    static std::string to_json();
+    static void reset();
+    // Prints what happened since the last dump_stats.
+    static void dump_stats();
+    // Appends to_json with a timestamp to filename every interval
+    // seconds, from a thread of its own.
+    static void start_log(const std::string& filename, int interval);
+
+    struct Counters {
+        std::array<std::atomic<std::uint64_t>, NUM_PHASES> calls{};
+        std::array<std::atomic<std::uint64_t>, NUM_PHASES> samples{};
+        std::array<std::atomic<std::uint64_t>, NUM_PHASES> sampled_ns{};
+    };
+    // The counters of the calling thread.
+    static Counters& get_counters();
+};
+
+// Counts and, for one call in SAMPLE_INTERVAL, times the enclosing scope.
+class PerfTimer {
+public:
+    explicit PerfTimer(PerfStats::Phase phase, bool enabled = true)
+        : m_phase(phase) {
+        if (!enabled) {
+            return;
+        }
+        m_counters = &PerfStats::get_counters();
+        // Only this thread writes its counters.
+        auto& calls = m_counters->calls[phase];
+        const auto count = calls.load(std::memory_order_relaxed);
+        calls.store(count + 1, std::memory_order_relaxed);
+        if (count % PerfStats::SAMPLE_INTERVAL == 0) {
+            m_start = std::chrono::steady_clock::now();
+            m_sampled = true;
+        }
+    }
+    ~PerfTimer() {
+        if (!m_sampled) {
+            return;
+        }
+        const auto end = std::chrono::steady_clock::now();
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - m_start).count();
+        auto& samples = m_counters->samples[m_phase];
+        auto& sampled_ns = m_counters->sampled_ns[m_phase];
+        samples.store(samples.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+        sampled_ns.store(sampled_ns.load(std::memory_order_relaxed) + ns,
+                         std::memory_order_relaxed);
+    }
+    PerfTimer(const PerfTimer&) = delete;
+    PerfTimer& operator=(const PerfTimer&) = delete;
+
+private:
+    PerfStats::Phase m_phase;
+    PerfStats::Counters* m_counters{nullptr};
+    bool m_sampled{false};
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif
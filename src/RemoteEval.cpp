@@ -0,0 +1,523 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "RemoteEval.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <boost/asio.hpp>
+
+#include "Network.h"
+#include "ThreadPool.h"
+#include "Utils.h"
+
+using namespace Utils;
+using boost::asio::ip::tcp;
+
+constexpr int RemoteEvaluator::MAX_RECONNECT_S;
+constexpr int RemoteEvaluator::IO_TIMEOUT_S;
+
+namespace {
+
+constexpr auto INPUT_SIZE = size_t{Network::INPUT_CHANNELS
+                                   * NUM_INTERSECTIONS};
+constexpr auto PACKED_INPUT_SIZE = (INPUT_SIZE + 7) / 8;
+constexpr auto OUTPUT_SIZE = size_t{POTENTIAL_MOVES + 1};
+constexpr auto HELLO_SIZE = 4 * sizeof(std::uint32_t);
+
+void put_u32(std::vector<std::uint8_t>& buf, const std::uint32_t val) {
+    for (auto i = 0; i < 4; i++) {
+        buf.push_back(static_cast<std::uint8_t>(val >> (8 * i)));
+    }
+}
+
+std::uint32_t get_u32(const std::uint8_t* buf) {
+    auto val = std::uint32_t{0};
+    for (auto i = 0; i < 4; i++) {
+        val |= std::uint32_t{buf[i]} << (8 * i);
+    }
+    return val;
+}
+
+void put_f32(std::vector<std::uint8_t>& buf, const float val) {
+    auto bits = std::uint32_t{};
+    std::memcpy(&bits, &val, sizeof(bits));
+    put_u32(buf, bits);
+}
+
+float get_f32(const std::uint8_t* buf) {
+    const auto bits = get_u32(buf);
+    auto val = float{};
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+// The input planes only hold zeros and ones.
+void pack_input(std::vector<std::uint8_t>& buf,
+                const std::vector<float>& input) {
+    assert(input.size() == INPUT_SIZE);
+    const auto start = buf.size();
+    buf.resize(start + PACKED_INPUT_SIZE, 0);
+    for (auto i = size_t{0}; i < INPUT_SIZE; i++) {
+        if (input[i] != 0.0f) {
+            buf[start + i / 8] |= std::uint8_t(1u << (i % 8));
+        }
+    }
+}
+
+void unpack_input(const std::uint8_t* buf, std::vector<float>& input) {
+    input.resize(INPUT_SIZE);
+    for (auto i = size_t{0}; i < INPUT_SIZE; i++) {
+        input[i] = (buf[i / 8] >> (i % 8)) & 1 ? 1.0f : 0.0f;
+    }
+}
+
+std::uint32_t read_u32(tcp::socket& socket) {
+    std::uint8_t buf[4];
+    boost::asio::read(socket, boost::asio::buffer(buf));
+    return get_u32(buf);
+}
+
+void serve_connection(std::shared_ptr<tcp::socket> socket) {
+    const auto client = socket->remote_endpoint().address().to_string();
+    myprintf("Evaluation client %s connected.\n", client.c_str());
+    try {
+        socket->set_option(tcp::no_delay(true));
+        auto hello = std::vector<std::uint8_t>{};
+        put_u32(hello, RemoteEvaluator::MAGIC);
+        put_u32(hello, RemoteEvaluator::VERSION);
+        put_u32(hello, BOARD_SIZE);
+        put_u32(hello, Network::INPUT_CHANNELS);
+        boost::asio::write(*socket, boost::asio::buffer(hello));
+
+        auto packed = std::vector<std::uint8_t>{};
+        auto reply = std::vector<std::uint8_t>{};
+        for (;;) {
+            const auto count = read_u32(*socket);
+            if (count == 0 || count > RemoteEvaluator::MAX_BATCH) {
+                throw std::runtime_error("bad batch size");
+            }
+            packed.resize(count * PACKED_INPUT_SIZE);
+            boost::asio::read(*socket, boost::asio::buffer(packed));
+
+            auto inputs = std::vector<std::vector<float>>(count);
+            auto policies = std::vector<std::vector<float>>(
+                count, std::vector<float>(POTENTIAL_MOVES));
+            auto winrates = std::vector<std::vector<float>>(
+                count, std::vector<float>(1));
+            // Run them concurrently so the backend can batch them.
+            auto tg = ThreadGroup(thread_pool);
+            for (auto i = size_t{0}; i < count; i++) {
+                tg.add_task([&, i]() {
+                    unpack_input(&packed[i * PACKED_INPUT_SIZE], inputs[i]);
+                    Network::forward_raw(inputs[i], policies[i], winrates[i]);
+                });
+            }
+            tg.wait_all();
+
+            reply.clear();
+            put_u32(reply, count);
+            for (auto i = size_t{0}; i < count; i++) {
+                for (const auto val : policies[i]) {
+                    put_f32(reply, val);
+                }
+                put_f32(reply, winrates[i][0]);
+            }
+            boost::asio::write(*socket, boost::asio::buffer(reply));
+        }
+    } catch (const std::exception& e) {
+        myprintf("Evaluation client %s disconnected: %s\n",
+                 client.c_str(), e.what());
+    }
+}
+
+}
+
+struct RemoteEvaluator::Peer {
+    std::string name;
+    std::string host;
+    std::string port;
+    // Exponential moving average of the request round trip.
+    // Guarded by m_mutex.
+    double rtt_us{0.0};
+    // Set when the peer runs a different board size or network format.
+    std::atomic<bool> incompatible{false};
+};
+
+class RemoteEvaluator::Connection {
+public:
+    explicit Connection(Peer& peer) : m_peer(peer) {}
+
+    Peer& peer() { return m_peer; }
+    bool is_open() const { return m_socket != nullptr; }
+
+    // Connects and checks the server hello. Returns the time it took
+    // in microseconds, or -1 on failure.
+    double connect() {
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            m_socket = std::make_unique<tcp::socket>(m_io);
+            tcp::resolver resolver(m_io);
+            auto endpoints = tcp::resolver::iterator{};
+            run_with_deadline([&](Handler handler) {
+                resolver.async_resolve(
+                    tcp::resolver::query(m_peer.host, m_peer.port),
+                    [&endpoints, handler](
+                        const boost::system::error_code& ec,
+                        tcp::resolver::iterator it) {
+                        endpoints = it;
+                        handler(ec);
+                    });
+            }, [&resolver]() { resolver.cancel(); });
+            run_with_deadline([&](Handler handler) {
+                boost::asio::async_connect(*m_socket, endpoints,
+                    [handler](const boost::system::error_code& ec,
+                              tcp::resolver::iterator) {
+                        handler(ec);
+                    });
+            });
+            m_socket->set_option(tcp::no_delay(true));
+
+            std::uint8_t hello[HELLO_SIZE];
+            read(boost::asio::buffer(hello));
+            if (get_u32(&hello[0]) != MAGIC
+                || get_u32(&hello[4]) != VERSION) {
+                myprintf("Evaluation peer %s is not a compatible "
+                         "leelaz --eval-server.\n", m_peer.name.c_str());
+                m_peer.incompatible = true;
+            } else if (get_u32(&hello[8]) != BOARD_SIZE
+                       || get_u32(&hello[12]) != Network::INPUT_CHANNELS) {
+                myprintf("Evaluation peer %s uses a different board size "
+                         "or input format.\n", m_peer.name.c_str());
+                m_peer.incompatible = true;
+            }
+            if (m_peer.incompatible) {
+                close();
+                return -1.0;
+            }
+        } catch (const std::exception&) {
+            close();
+            return -1.0;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::micro>(elapsed).count();
+    }
+
+    void close() {
+        m_socket.reset();
+    }
+
+    // Throws on any network or protocol error.
+    void evaluate(const std::vector<Entry*>& batch) {
+        m_buffer.clear();
+        put_u32(m_buffer, std::uint32_t(batch.size()));
+        for (const auto entry : batch) {
+            pack_input(m_buffer, entry->in);
+        }
+        write(boost::asio::buffer(m_buffer));
+
+        std::uint8_t count[4];
+        read(boost::asio::buffer(count));
+        if (get_u32(count) != batch.size()) {
+            throw std::runtime_error("reply size mismatch");
+        }
+        m_buffer.resize(batch.size() * OUTPUT_SIZE * sizeof(float));
+        read(boost::asio::buffer(m_buffer));
+        auto pos = m_buffer.data();
+        for (const auto entry : batch) {
+            for (auto& val : entry->policy) {
+                val = get_f32(pos);
+                pos += sizeof(float);
+            }
+            entry->winrate[0] = get_f32(pos);
+            pos += sizeof(float);
+        }
+    }
+
+private:
+    using Handler = std::function<void(const boost::system::error_code&)>;
+
+    // Runs one asynchronous operation to completion, cancelling it if
+    // it takes longer than IO_TIMEOUT_S. Throws on error or timeout.
+    template <typename Start>
+    void run_with_deadline(Start start, std::function<void()> cancel = {}) {
+        auto done = false;
+        auto timed_out = false;
+        auto result = boost::system::error_code{};
+        auto timer = boost::asio::steady_timer(
+            m_io, std::chrono::seconds(IO_TIMEOUT_S));
+        timer.async_wait([&](const boost::system::error_code& ec) {
+            if (!ec && !done) {
+                timed_out = true;
+                if (cancel) {
+                    cancel();
+                } else {
+                    auto ignored = boost::system::error_code{};
+                    m_socket->close(ignored);
+                }
+            }
+        });
+        m_io.reset();
+        start([&](const boost::system::error_code& ec) {
+            done = true;
+            result = ec;
+            timer.cancel();
+        });
+        // Returns once both the operation and the timer are finished.
+        m_io.run();
+        if (timed_out) {
+            throw std::runtime_error("timed out");
+        }
+        if (result) {
+            throw boost::system::system_error(result);
+        }
+    }
+
+    template <typename Buffer>
+    void read(const Buffer& buffer) {
+        run_with_deadline([&](Handler handler) {
+            boost::asio::async_read(*m_socket, buffer,
+                [handler](const boost::system::error_code& ec, size_t) {
+                    handler(ec);
+                });
+        });
+    }
+
+    template <typename Buffer>
+    void write(const Buffer& buffer) {
+        run_with_deadline([&](Handler handler) {
+            boost::asio::async_write(*m_socket, buffer,
+                [handler](const boost::system::error_code& ec, size_t) {
+                    handler(ec);
+                });
+        });
+    }
+
+    Peer& m_peer;
+    boost::asio::io_service m_io;
+    std::unique_ptr<tcp::socket> m_socket;
+    std::vector<std::uint8_t> m_buffer;
+};
+
+RemoteEvaluator::RemoteEvaluator(const std::vector<std::string>& peers,
+                                 size_t batch_size)
+    : m_batch_size(batch_size) {
+    for (const auto& name : peers) {
+        auto peer = std::make_unique<Peer>();
+        const auto colon = name.rfind(':');
+        peer->name = name;
+        peer->host = name.substr(0, colon);
+        peer->port = name.substr(colon + 1);
+        for (auto i = 0; i < CONNECTIONS_PER_PEER; i++) {
+            m_connections.emplace_back(std::make_unique<Connection>(*peer));
+        }
+        m_peers.emplace_back(std::move(peer));
+    }
+
+    // Connect once up front, so the first search doesn't fall back to
+    // the local network while the peers are still being set up.
+    for (auto& conn : m_connections) {
+        const auto rtt = conn->connect();
+        if (rtt >= 0.0) {
+            m_connected++;
+            conn->peer().rtt_us = rtt;
+        }
+    }
+    for (const auto& peer : m_peers) {
+        if (peer->rtt_us > 0.0) {
+            myprintf("Connected to evaluation peer %s (%.1f ms).\n",
+                     peer->name.c_str(), peer->rtt_us / 1000.0);
+        } else if (!peer->incompatible) {
+            myprintf("Evaluation peer %s is not reachable, "
+                     "will keep trying.\n", peer->name.c_str());
+        }
+    }
+    if (m_connected == 0) {
+        myprintf("Evaluating locally until a peer is reachable.\n");
+    }
+
+    for (auto& conn : m_connections) {
+        m_threads.emplace_back(&RemoteEvaluator::connection_loop,
+                               this, std::ref(*conn));
+    }
+}
+
+RemoteEvaluator::~RemoteEvaluator() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_work_cv.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+bool RemoteEvaluator::forward(const std::vector<float>& input,
+                              std::vector<float>& policy_out,
+                              std::vector<float>& winrate_out) {
+    auto entry = Entry{input, policy_out, winrate_out,
+                       std::chrono::steady_clock::now(), State::QUEUED};
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_connected == 0) {
+        return false;
+    }
+    m_queue.push_back(&entry);
+    // Idle and filling connections all wait on this.
+    m_work_cv.notify_all();
+    m_done_cv.wait(lock, [&entry]() {
+        return entry.state == State::DONE || entry.state == State::FAILED;
+    });
+    return entry.state == State::DONE;
+}
+
+std::vector<RemoteEvaluator::Entry*> RemoteEvaluator::take_batch(Peer& peer) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_work_cv.wait(lock, [this]() {
+            return !m_running || !m_queue.empty();
+        });
+        if (!m_running) {
+            return {};
+        }
+        // Waiting for a fuller batch is worth it for as long as it is
+        // small compared to the round trip the batch costs anyway.
+        const auto wait_us = std::min(std::max(peer.rtt_us / 4.0,
+                                               double{MIN_BATCH_WAIT_US}),
+                                      double{MAX_BATCH_WAIT_US});
+        const auto deadline = m_queue.front()->queued
+            + std::chrono::microseconds(static_cast<int>(wait_us));
+        while (m_running && !m_queue.empty()
+               && m_queue.size() < m_batch_size
+               && std::chrono::steady_clock::now() < deadline) {
+            m_work_cv.wait_until(lock, deadline);
+        }
+        if (!m_running) {
+            return {};
+        }
+        if (m_queue.empty()) {
+            // Another connection took them.
+            continue;
+        }
+        const auto count = std::min(m_queue.size(), m_batch_size);
+        auto batch = std::vector<Entry*>(begin(m_queue),
+                                         begin(m_queue) + count);
+        m_queue.erase(begin(m_queue), begin(m_queue) + count);
+        for (const auto entry : batch) {
+            entry->state = State::RUNNING;
+        }
+        return batch;
+    }
+}
+
+void RemoteEvaluator::requeue(std::vector<Entry*>& batch) {
+    if (m_connected == 0) {
+        for (const auto entry : batch) {
+            entry->state = State::FAILED;
+        }
+        for (const auto entry : m_queue) {
+            entry->state = State::FAILED;
+        }
+        m_queue.clear();
+        m_done_cv.notify_all();
+        return;
+    }
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+        (*it)->state = State::QUEUED;
+        m_queue.push_front(*it);
+    }
+    m_work_cv.notify_all();
+}
+
+void RemoteEvaluator::connection_loop(Connection& conn) {
+    auto& peer = conn.peer();
+    auto backoff = 1;
+    for (;;) {
+        if (!conn.is_open()) {
+            if (peer.incompatible) {
+                return;
+            }
+            const auto rtt = conn.connect();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (rtt < 0.0) {
+                m_work_cv.wait_for(lock, std::chrono::seconds(backoff),
+                                   [this]() { return !m_running; });
+                if (!m_running) {
+                    return;
+                }
+                backoff = std::min(2 * backoff, MAX_RECONNECT_S);
+                continue;
+            }
+            backoff = 1;
+            m_connected++;
+            myprintf("Connected to evaluation peer %s.\n", peer.name.c_str());
+        }
+
+        auto batch = take_batch(peer);
+        if (batch.empty()) {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            conn.evaluate(batch);
+        } catch (const std::exception& e) {
+            conn.close();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            myprintf("Lost evaluation peer %s: %s\n",
+                     peer.name.c_str(), e.what());
+            m_connected--;
+            requeue(batch);
+            continue;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto rtt = std::chrono::duration<double, std::micro>(
+            elapsed).count();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        peer.rtt_us = 0.9 * peer.rtt_us + 0.1 * rtt;
+        for (const auto entry : batch) {
+            entry->state = State::DONE;
+        }
+        m_done_cv.notify_all();
+    }
+}
+
+void RemoteEvaluator::serve(unsigned short port) {
+    try {
+        boost::asio::io_service io;
+        tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+        myprintf("Serving network evaluations on port %d.\n", int(port));
+        for (;;) {
+            auto socket = std::make_shared<tcp::socket>(io);
+            acceptor.accept(*socket);
+            std::thread(serve_connection, socket).detach();
+        }
+    } catch (const std::exception& e) {
+        myprintf("Evaluation server failed: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+}
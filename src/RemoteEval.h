@@ -0,0 +1,119 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REMOTEEVAL_H_INCLUDED
+#define REMOTEEVAL_H_INCLUDED
+
+#include "config.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Sends network evaluations to other machines running
+    "leelaz --eval-server PORT", so one search can use the GPUs of
+    several hosts.
+
+    Search threads queue their (already rotated) input planes and sleep.
+    Every peer has a few connection threads that take batches off the
+    shared queue, so a faster peer simply takes more of the work. A
+    connection that finds fewer positions queued than --batchsize waits
+    for more, but never longer than a quarter of its measured round trip:
+    sending a half empty batch costs a full round trip anyway.
+
+    Wire format, all fields little-endian:
+      server hello:  u32 magic, u32 version, u32 board size,
+                     u32 input channels
+      request:       u32 count, count * bit-packed input planes
+      reply:         u32 count, count * (policy logits + value) as f32
+*/
+class RemoteEvaluator {
+public:
+    // Each peer is "host:port".
+    RemoteEvaluator(const std::vector<std::string>& peers,
+                    size_t batch_size);
+    ~RemoteEvaluator();
+
+    // Returns the raw policy and value head outputs. Returns false if
+    // no peer is reachable, the caller should evaluate locally then.
+    bool forward(const std::vector<float>& input,
+                 std::vector<float>& policy_out,
+                 std::vector<float>& winrate_out);
+
+    // Serves evaluations with the local network until killed.
+    static void serve(unsigned short port);
+
+    static constexpr std::uint32_t MAGIC = 0x45525a4c; // "LZRE"
+    static constexpr std::uint32_t VERSION = 1;
+    // Upper bound on positions per request, to reject garbage.
+    static constexpr std::uint32_t MAX_BATCH = 256;
+
+private:
+    enum class State { QUEUED, RUNNING, DONE, FAILED };
+    struct Entry {
+        const std::vector<float>& in;
+        std::vector<float>& policy;
+        std::vector<float>& winrate;
+        std::chrono::steady_clock::time_point queued;
+        State state;
+    };
+    struct Peer;
+    class Connection;
+
+    // Connections kept open to every peer, so one can send while the
+    // other waits for its reply.
+    static constexpr auto CONNECTIONS_PER_PEER = 2;
+    // Limits on how long a connection waits for a batch to fill.
+    static constexpr auto MIN_BATCH_WAIT_US = 100;
+    static constexpr auto MAX_BATCH_WAIT_US = 5000;
+    static constexpr auto MAX_RECONNECT_S = 30;
+    // A peer that doesn't connect, send or reply within this long is
+    // treated as lost, so it can't stall the search threads.
+    static constexpr auto IO_TIMEOUT_S = 10;
+
+    void connection_loop(Connection& conn);
+    // Waits for work and takes up to m_batch_size entries off the queue.
+    // Returns an empty batch on shutdown.
+    std::vector<Entry*> take_batch(Peer& peer);
+    // Puts the entries back after a failed request. Fails every queued
+    // entry if that was the last working connection.
+    void requeue(std::vector<Entry*>& batch);
+
+    const size_t m_batch_size;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    std::deque<Entry*> m_queue;
+    int m_connected{0};
+    bool m_running{true};
+
+    std::vector<std::unique_ptr<Peer>> m_peers;
+    std::vector<std::unique_ptr<Connection>> m_connections;
+    std::vector<std::thread> m_threads;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Review.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <boost/format.hpp>
+
+#include "FastBoard.h"
+#include "GameState.h"
+#include "GTP.h"
+#include "Numa.h"
+#include "SGFTree.h"
+#include "UCTSearch.h"
+
+std::vector<std::string> Review::run(const std::string& filename,
+                                     const int visits, const int parallel) {
+    auto sgftree = std::make_unique<SGFTree>();
+    sgftree->load_from_file(filename);
+    const auto moves = sgftree->get_mainline();
+
+    // The position after the last move as well, it tells how that
+    // move turned out.
+    auto positions = std::vector<Position>(moves.size() + 1);
+    const auto runs = std::max(1, std::min(parallel,
+                                           static_cast<int>(positions.size())));
+    auto threads = std::vector<std::thread>{};
+    for (auto i = 0; i < runs; i++) {
+        const auto first = positions.size() * i / runs;
+        const auto last = positions.size() * (i + 1) / runs;
+        threads.emplace_back(review_run,
+                             sgftree->follow_mainline_state(first),
+                             std::cref(moves), first, last, visits,
+                             std::ref(positions));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto lines = std::vector<std::string>{};
+    auto game = sgftree->follow_mainline_state(0);
+    for (auto i = size_t{0}; i < moves.size(); i++) {
+        const auto& position = positions[i];
+        const auto color = game.get_to_move();
+        const auto winrate = 1.0f - positions[i + 1].winrate;
+        lines.emplace_back(str(
+            boost::format("%d %s %s visits %d winrate %d best %s "
+                          "bestwinrate %d pv %s")
+            % (game.get_movenum() + 1)
+            % (color == FastBoard::BLACK ? "B" : "W")
+            % game.move_to_text(moves[i])
+            % position.visits
+            % static_cast<int>(winrate * 10000)
+            % game.move_to_text(position.best_move)
+            % static_cast<int>(position.best_winrate * 10000)
+            % position.pv));
+        game.play_move(moves[i]);
+    }
+    return lines;
+}
+
+void Review::review_run(GameState game, const std::vector<int>& moves,
+                        const size_t first, const size_t last,
+                        const int visits, std::vector<Position>& positions) {
+    if (cfg_numa) {
+        Numa::bind_next_thread();
+    }
+    auto search = std::make_unique<UCTSearch>();
+    for (auto i = first; i < last; i++) {
+        // The tree of the last position still holds the move that was
+        // played, start_search continues from there.
+        search->start_search(game);
+        search->run_playouts(std::max(0, visits - search->get_root_visits()));
+
+        auto& position = positions[i];
+        position.visits = search->get_root_visits();
+        position.winrate = search->get_root_eval();
+        const auto root_moves = search->get_root_moves();
+        if (root_moves.empty()) {
+            position.best_move = FastBoard::PASS;
+            position.best_winrate = position.winrate;
+        } else {
+            position.best_move = root_moves[0].vertex;
+            position.best_winrate = root_moves[0].winrate;
+        }
+        position.pv = search->get_best_pv();
+        if (i < moves.size()) {
+            game.play_move(moves[i]);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REVIEW_H_INCLUDED
+#define REVIEW_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+class GameState;
+
+/*
+    Reviews every move of a game in one go. The positions of the main
+    line are split into as many runs of consecutive moves as positions
+    are searched at once. Each run has a thread and a search tree of its
+    own and walks forward through its moves, so every search starts from
+    the subtree of the move that was played, and the network batches
+    evaluations from all of the runs.
+
+    One line per move:
+      <movenum> <color> <move> visits <v> winrate <w> best <move>
+          bestwinrate <w> pv <moves...>
+    winrate is how the played move turned out and bestwinrate how the
+    best move looked, both for the player of the move and in units of
+    1/10000 like lz-analyze.
+*/
+class Review {
+public:
+    // Searches every position of filename until its root has visits
+    // visits. Throws like SGFTree::load_from_file.
+    static std::vector<std::string> run(const std::string& filename,
+                                        int visits, int parallel);
+
+private:
+    struct Position {
+        int visits;
+        // For the side to move.
+        float winrate;
+        int best_move;
+        float best_winrate;
+        std::string pv;
+    };
+
+    // Searches positions first to last, the moves of the main line
+    // played from game.
+    static void review_run(GameState game, const std::vector<int>& moves,
+                           size_t first, size_t last, int visits,
+                           std::vector<Position>& positions);
+};
+
+#endif
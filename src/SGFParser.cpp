@@ -18,6 +18,7 @@
 
 #include "SGFParser.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <fstream>
@@ -85,6 +86,61 @@ std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
     return result;
 }
 
+std::vector<std::pair<size_t, size_t>> SGFParser::index_games(
+    const char* data, const size_t size) {
+    auto result = std::vector<std::pair<size_t, size_t>>{};
+
+    auto nesting = 0;      // parentheses
+    auto intag = false;    // brackets
+    auto line = 0;
+    auto start = size_t{0};
+
+    for (auto pos = size_t{0}; pos < size; pos++) {
+        const auto c = data[pos];
+        if (c == '\n') line++;
+
+        if (c == '\\') {
+            // skip the literal char
+            pos++;
+            continue;
+        }
+
+        if (c == '(' && !intag) {
+            if (nesting == 0) {
+                // eat ; too
+                do {
+                    pos++;
+                } while (pos < size
+                         && std::isspace(static_cast<unsigned char>(data[pos]))
+                         && data[pos] != ';');
+                start = pos + 1;
+            }
+            nesting++;
+        } else if (c == ')' && !intag) {
+            nesting--;
+
+            if (nesting == 0) {
+                result.emplace_back(start, pos + 1 - start);
+            }
+        } else if (c == '[' && !intag) {
+            intag = true;
+        } else if (c == ']') {
+            if (intag == false) {
+                Utils::myprintf("Tag error on line %d", line);
+            }
+            intag = false;
+        }
+    }
+
+    // No game found? Assume closing tag was missing (OGS)
+    if (result.empty()) {
+        start = std::min(start, size);
+        result.emplace_back(start, size - start);
+    }
+
+    return result;
+}
+
 std::vector<std::string> SGFParser::chop_all(std::string filename,
                                              size_t stopat) {
     std::ifstream ins(filename.c_str(), std::ifstream::binary | std::ifstream::in);
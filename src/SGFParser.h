@@ -24,6 +24,7 @@
 #include <climits>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "SGFTree.h"
@@ -38,6 +39,10 @@ public:
                                              size_t stopat = SIZE_MAX);
     static std::vector<std::string> chop_stream(std::istream& ins,
                                                 size_t stopat = SIZE_MAX);
+    // Where chop_stream would cut the games from a collection in
+    // memory, as (offset, length) pairs, without copying them.
+    static std::vector<std::pair<size_t, size_t>> index_games(
+        const char* data, size_t size);
     static void parse(std::istringstream & strm, SGFTree * node);
 };
 
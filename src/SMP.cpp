@@ -18,10 +18,45 @@
 
 #include "SMP.h"
 
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
 #include <thread>
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#endif
+
+namespace {
+    // How often a waiting thread checks the lock before going to sleep.
+    constexpr auto SPIN_COUNT = 100;
+
+    inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_pause();
+#endif
+    }
+
+    // Threads that gave up spinning sleep on the bucket of the Mutex
+    // they want. Mutexes that share a bucket only cause extra wakeups.
+    struct ParkingBucket {
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    ParkingBucket& parking_bucket(const void* address) {
+        constexpr auto BUCKETS = size_t{64};
+        static std::array<ParkingBucket, BUCKETS> buckets;
+        auto index = (reinterpret_cast<std::uintptr_t>(address) >> 4) % BUCKETS;
+        return buckets[index];
+    }
+}
+
 SMP::Mutex::Mutex() {
-    m_lock = false;
+    m_lock = UNLOCKED;
 }
 
 SMP::Lock::Lock(Mutex & m) {
@@ -30,11 +65,53 @@ SMP::Lock::Lock(Mutex & m) {
 }
 
 void SMP::Lock::lock() {
-    while (m_mutex->m_lock.exchange(true, std::memory_order_acquire) == true);
+    auto& state = m_mutex->m_lock;
+    m_owns_lock = true;
+
+    auto current = Mutex::UNLOCKED;
+    if (state.compare_exchange_strong(current, Mutex::LOCKED,
+                                      std::memory_order_acquire)) {
+        return;
+    }
+    // Only read the lock while spinning, so waiting threads don't keep
+    // taking the cache line away from the one that holds it.
+    for (auto i = 0; i < SPIN_COUNT; i++) {
+        cpu_relax();
+        if (state.load(std::memory_order_relaxed) == Mutex::UNLOCKED) {
+            current = Mutex::UNLOCKED;
+            if (state.compare_exchange_weak(current, Mutex::LOCKED,
+                                            std::memory_order_acquire)) {
+                return;
+            }
+        }
+    }
+    // Give up and sleep. We don't know if anyone else is sleeping, so
+    // once we get the lock it stays CONTENDED and the unlock wakes
+    // the bucket up.
+    auto& bucket = parking_bucket(&state);
+    while (state.exchange(Mutex::CONTENDED, std::memory_order_acquire)
+           != Mutex::UNLOCKED) {
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        if (state.load(std::memory_order_relaxed) == Mutex::CONTENDED) {
+            bucket.cv.wait(lock);
+        }
+    }
 }
 
 void SMP::Lock::unlock() {
-    m_mutex->m_lock.store(false, std::memory_order_release);
+    if (!m_owns_lock) {
+        return;
+    }
+    m_owns_lock = false;
+    auto& state = m_mutex->m_lock;
+    if (state.exchange(Mutex::UNLOCKED, std::memory_order_release)
+        == Mutex::CONTENDED) {
+        // Taking the bucket lock makes sure that a thread that saw
+        // CONTENDED is really waiting before we notify.
+        auto& bucket = parking_bucket(&state);
+        std::lock_guard<std::mutex> lock(bucket.mutex);
+        bucket.cv.notify_all();
+    }
 }
 
 SMP::Lock::~Lock() {
@@ -22,17 +22,30 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstdint>
 
 namespace SMP {
     int get_num_cpus();
 
+    /*
+        A one byte lock. Waiting threads spin for a short while, as the
+        lock is normally only held for a few instructions, and then go
+        to sleep until the holder wakes them up. Sleeping threads wait
+        in a small shared table, so the Mutex itself stays small enough
+        to embed in large arrays.
+    */
     class Mutex {
     public:
         Mutex();
         ~Mutex() = default;
         friend class Lock;
     private:
-        std::atomic<bool> m_lock;
+        static constexpr std::uint8_t UNLOCKED = 0;
+        static constexpr std::uint8_t LOCKED = 1;
+        // Locked, and someone may be sleeping on it.
+        static constexpr std::uint8_t CONTENDED = 2;
+
+        std::atomic<std::uint8_t> m_lock;
     };
 
     class Lock {
@@ -43,6 +56,7 @@ namespace SMP {
         void unlock();
     private:
         Mutex * m_mutex;
+        bool m_owns_lock{false};
     };
 }
 
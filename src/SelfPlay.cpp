@@ -0,0 +1,137 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "SelfPlay.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GameState.h"
+#include "GTP.h"
+#include "Numa.h"
+#include "Random.h"
+#include "SGFTree.h"
+#include "Training.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+void SelfPlay::run(int games, int total) {
+    SelfPlay selfplay(total);
+    auto threads = std::vector<std::thread>{};
+    for (auto i = 0; i < games; i++) {
+        threads.emplace_back(&SelfPlay::worker, &selfplay);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void SelfPlay::worker() {
+    if (cfg_numa) {
+        Numa::bind_next_thread();
+    }
+    while (m_total == 0 || m_started++ < m_total) {
+        play_game();
+    }
+}
+
+std::string SelfPlay::result_string(const GameState& game, int& winner) {
+    auto out = std::ostringstream{};
+    if (game.has_resigned()) {
+        if (game.who_resigned() == FastBoard::BLACK) {
+            winner = FastBoard::WHITE;
+            return "W+Resign";
+        }
+        winner = FastBoard::BLACK;
+        return "B+Resign";
+    }
+    const auto score = game.final_score();
+    out << std::fixed << std::setprecision(1);
+    if (score < -0.1f) {
+        winner = FastBoard::WHITE;
+        out << "W+" << std::fabs(score);
+    } else if (score > 0.1f) {
+        winner = FastBoard::BLACK;
+        out << "B+" << score;
+    } else {
+        winner = FastBoard::EMPTY;
+        out << "0";
+    }
+    return out.str();
+}
+
+void SelfPlay::play_game() {
+    // The recorded positions are kept per thread.
+    Training::clear_training();
+    auto game = GameState{};
+    game.init_game(BOARD_SIZE, 7.5f);
+    auto search = std::make_unique<UCTSearch>();
+
+    do {
+        const auto color = game.get_to_move();
+        const auto move = search->think(color, game);
+        game.play_move(move);
+    } while (!game.has_resigned() && game.get_passes() < 2
+             && game.get_movenum() < MAX_MOVES);
+
+    auto winner = int{FastBoard::EMPTY};
+    const auto result = result_string(game, winner);
+
+    // Random names, so several processes can share a directory.
+    auto name = std::ostringstream{};
+    name << std::hex << std::setfill('0');
+    for (auto i = 0; i < 2; i++) {
+        name << std::setw(16) << Random::get_Rng()();
+    }
+    const auto filename = name.str();
+
+    auto sgf = std::ofstream{filename + ".sgf"};
+    sgf << SGFTree::state_to_string(game, 0) << std::endl;
+    sgf.close();
+    // A jigo has no winner to learn from.
+    if (winner != FastBoard::EMPTY) {
+        try {
+            Training::dump_training(winner, filename + ".txt");
+            if (cfg_selfplay_debug) {
+                Training::dump_debug(filename + ".debug.txt");
+            }
+        } catch (const std::exception& e) {
+            // Games without their training data are of no use.
+            myprintf("%s\n", e.what());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const auto winner_name = winner == FastBoard::BLACK ? "black"
+                           : winner == FastBoard::WHITE ? "white" : "none";
+    gtp_printf_raw("selfplay %s %s %d %s\n", filename.c_str(),
+                   winner_name, int(game.get_movenum()), result.c_str());
+}
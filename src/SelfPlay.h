@@ -0,0 +1,60 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SELFPLAY_H_INCLUDED
+#define SELFPLAY_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+class GameState;
+
+/*
+    Plays training games against itself, several at once in one
+    process. Every game has its own thread and search tree, but they
+    share the network, its batching and the NNCache, so the evaluator
+    sees positions from all of them.
+
+    Each finished game leaves <name>.sgf and <name>.txt.0.gz (plus
+    <name>.debug.txt.0.gz with --selfplay-debug) in the current
+    directory, like autogtp's files, and prints
+      selfplay <name> <winner> <moves> <result>
+    to stdout, e.g. "selfplay 3f2a... white 215 W+Resign".
+*/
+class SelfPlay {
+public:
+    // Plays games at once until total games are done, 0 for no limit.
+    static void run(int games, int total);
+
+private:
+    // Move count after which a game is stopped and scored.
+    static constexpr auto MAX_MOVES = size_t{NUM_INTERSECTIONS * 2};
+
+    explicit SelfPlay(int total) : m_total(total) {}
+    void worker();
+    void play_game();
+    static std::string result_string(const GameState& game, int& winner);
+
+    const int m_total;
+    std::atomic<int> m_started{0};
+};
+
+#endif
@@ -0,0 +1,182 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Speculator.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "NNCache.h"
+#include "Numa.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+
+// Positions waiting per batch slot, the older ones are dropped.
+constexpr auto QUEUED_PER_SLOT = 4;
+
+struct Job {
+    std::shared_ptr<const KoState> state;
+    int move;
+};
+
+struct Queue {
+    std::mutex mutex;
+    // Jobs were queued, a search evaluation started or a job finished.
+    std::condition_variable cv;
+    // running went down to zero.
+    std::condition_variable idle_cv;
+    // Newest first.
+    std::deque<Job> jobs;
+    size_t max_jobs;
+    int running{0};
+    // The NNCache counters at the last dump_stats.
+    std::pair<int, int> last_dump{0, 0};
+
+    // Starts the workers on first use. Never destroyed, like the
+    // workers, which never exit.
+    static Queue& get() {
+        static auto queue = new Queue;
+        return *queue;
+    }
+
+    Queue() {
+        // Every search evaluation fills one slot of a batch. The others
+        // are what there is to speculate into.
+        const auto slots = std::max(1, cfg_batch_size - 1);
+        max_jobs = size_t(slots) * QUEUED_PER_SLOT;
+        for (auto i = 0; i < slots; i++) {
+            std::thread(&Queue::worker, this).detach();
+        }
+    }
+
+    // A batch is being filled and has room left.
+    bool has_spare_slot() const {
+        const auto in_flight = Network::evaluations_in_flight();
+        return in_flight > 0 && in_flight + running < cfg_batch_size;
+    }
+
+    void worker() {
+        if (cfg_numa) {
+            Numa::bind_next_thread();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [this]() {
+                return !jobs.empty() && has_spare_slot();
+            });
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            running++;
+            lock.unlock();
+
+            auto state = *job.state;
+            if (job.move == FastBoard::PASS) {
+                state.play_pass();
+            } else {
+                state.play_move(job.move);
+            }
+            if (!state.superko()) {
+                Network::prefetch(&state);
+            }
+
+            lock.lock();
+            running--;
+            if (running == 0) {
+                idle_cv.notify_all();
+            }
+            // Our slot is free for another job.
+            cv.notify_one();
+        }
+    }
+};
+
+}
+
+void Speculator::add(const KoState& state,
+                     const Network::scored_node* nodelist,
+                     const size_t count) {
+    if (count == 0) {
+        return;
+    }
+    auto& queue = Queue::get();
+    // One copy of the state for all of its children.
+    const auto shared = std::make_shared<const KoState>(state);
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (auto i = count; i-- > 0;) {
+            queue.jobs.push_front(Job{shared, nodelist[i].second});
+        }
+        while (queue.jobs.size() > queue.max_jobs) {
+            queue.jobs.pop_back();
+        }
+    }
+    queue.cv.notify_all();
+}
+
+void Speculator::clear() {
+    if (cfg_speculate == 0) {
+        return;
+    }
+    auto& queue = Queue::get();
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    queue.jobs.clear();
+    // The jobs already taken still use the network and the NNCache.
+    queue.idle_cv.wait(lock, [&queue]() { return queue.running == 0; });
+}
+
+void Speculator::evaluation_started() {
+    auto& queue = Queue::get();
+    // Under the mutex, so a worker can't miss it between checking for a
+    // spare slot and waiting.
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.jobs.empty()) {
+        queue.cv.notify_one();
+    }
+}
+
+void Speculator::dump_stats() {
+    if (cfg_speculate == 0) {
+        return;
+    }
+    auto& queue = Queue::get();
+    const auto now = NNCache::get_NNCache().speculative_hit_rate();
+    auto last = now;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        std::swap(last, queue.last_dump);
+    }
+    const auto hits = now.first - last.first;
+    const auto evaluations = now.second - last.second;
+    if (evaluations == 0) {
+        return;
+    }
+    myprintf("Speculation: %d evaluations, %d hits (%.1f%%)\n",
+             evaluations, hits, 100.0f * hits / evaluations);
+}
@@ -0,0 +1,56 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPECULATOR_H_INCLUDED
+#define SPECULATOR_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+
+#include "KoState.h"
+#include "Network.h"
+
+/*
+    Speculative network evaluations for the batch slots the search leaves
+    empty, as it does with fewer busy threads than the batch size, near a
+    visit limit or at the end of a move. Every node the search expands
+    queues the positions after its --speculate children with the highest
+    priors, the first ones a later playout along this line will expand.
+    While a batch is being filled by fewer evaluations than it holds,
+    worker threads evaluate the newest queued positions with
+    Network::prefetch, so the playouts that get there later find them in
+    the NNCache.
+*/
+class Speculator {
+public:
+    // Queues the positions after the first count moves of nodelist, best
+    // first, with state before them.
+    static void add(const KoState& state,
+                    const Network::scored_node* nodelist, size_t count);
+    // Drops the queued positions and waits for the ones being evaluated,
+    // for when the search stops or the network changes.
+    static void clear();
+    // Called by Network when a search evaluation starts filling a batch,
+    // which may leave room for speculation.
+    static void evaluation_started();
+    // Prints the evaluations and hits since the last dump_stats.
+    static void dump_stats();
+};
+
+#endif
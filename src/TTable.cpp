@@ -19,63 +19,192 @@
 #include "config.h"
 #include "TTable.h"
 
-#include <algorithm>
-#include <iterator>
-#include <memory>
+#include <cstring>
 #include <vector>
 
+#include "GTP.h"
+#include "PerfStats.h"
 #include "UCTNode.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+/*
+    The counters are kept per thread and only added to the table every
+    so often, so counting doesn't bring back the contention the lockless
+    table gets rid of. Search threads flush what is left when they stop.
+*/
+struct TTCounters {
+    static constexpr auto FLUSH_INTERVAL = std::uint64_t{4096};
+
+    std::uint64_t lookups{0};
+    std::uint64_t hits{0};
+    std::uint64_t syncs{0};
+    std::uint64_t stores{0};
+    std::uint64_t overwrites{0};
+
+    void maybe_flush(TTable& table) {
+        if (lookups + stores >= FLUSH_INTERVAL) {
+            flush(table);
+        }
+    }
+
+    void flush(TTable& table) {
+        table.m_lookups += lookups;
+        table.m_hits += hits;
+        table.m_syncs += syncs;
+        table.m_stores += stores;
+        table.m_overwrites += overwrites;
+        *this = TTCounters{};
+    }
+};
+
+static thread_local TTCounters t_counters;
 
 TTable& TTable::get_TT(void) {
-    static TTable s_ttable;
+    static TTable s_ttable(cfg_tt_memory);
     return s_ttable;
 }
 
-TTable::TTable(int size) {
-    LOCK(m_mutex, lock);
-    m_buckets.resize(size);
+TTable::TTable(size_t megabytes) {
+    auto buckets = (megabytes << 20) / sizeof(TTBucket);
+    m_buckets = std::vector<TTBucket>(buckets);
 }
 
-void TTable::update(std::uint64_t hash, const float komi, const UCTNode * node) {
-    LOCK(m_mutex, lock);
+std::uint64_t TTable::position_key(std::uint64_t hash, float komi) const {
+    // Mix the komi into the key instead of clearing the table when it
+    // changes.
+    auto komi_bits = std::uint32_t{0};
+    std::memcpy(&komi_bits, &komi, sizeof(komi_bits));
+    return hash ^ (std::uint64_t{komi_bits} * 0x9E3779B97F4A7C15ULL);
+}
 
-    unsigned int index = (unsigned int)hash;
-    index %= m_buckets.size();
+TTable::TTBucket& TTable::get_bucket(std::uint64_t key) {
+    return m_buckets[(key >> 8) % m_buckets.size()];
+}
 
-    /*
-        update TT
-    */
-    m_buckets[index].m_hash       = hash;
-    m_buckets[index].m_visits     = node->get_visits();
-    m_buckets[index].m_eval_sum   = node->get_blackevals();
+bool TTable::matches(std::uint64_t key,
+                     std::uint64_t entry_key, std::uint64_t data) {
+    return ((entry_key ^ data) & ~GENERATION_MASK) == (key & ~GENERATION_MASK);
+}
 
-    if (m_komi != komi) {
-        std::fill(begin(m_buckets), end(m_buckets), TTEntry());
-        m_komi = komi;
+void TTable::new_generation() {
+    m_generation++;
+}
+
+void TTable::clear() {
+    for (auto& bucket : m_buckets) {
+        for (auto& entry : bucket) {
+            entry.m_key.store(0, std::memory_order_relaxed);
+            entry.m_data.store(0, std::memory_order_relaxed);
+        }
     }
 }
 
-void TTable::sync(std::uint64_t hash, const float komi, UCTNode * node) {
-    LOCK(m_mutex, lock);
+void TTable::update(std::uint64_t hash, const float komi, const UCTNode * node) {
+    PerfTimer timer(PerfStats::TTABLE);
+    if (m_buckets.empty()) {
+        return;
+    }
 
-    unsigned int index = (unsigned int)hash;
-    index %= m_buckets.size();
+    const auto key = position_key(hash, komi);
+    const auto data = node->get_stats();
+    const auto visits = UCTNode::unpack_visits(data);
+    const auto generation = std::uint64_t{m_generation.load()};
+    auto& bucket = get_bucket(key);
 
     /*
-        check for hash fail
+        replace the entry for this position, or else the one from the
+        oldest search with the fewest visits
     */
-    if (m_buckets[index].m_hash != hash || m_komi != komi) {
+    auto victim = &bucket[0];
+    auto victim_score = std::int64_t{0};
+    auto found = false;
+    for (auto& entry : bucket) {
+        auto entry_key = entry.m_key.load(std::memory_order_relaxed);
+        auto entry_data = entry.m_data.load(std::memory_order_relaxed);
+        if (matches(key, entry_key, entry_data)) {
+            // Another transposition may know more about this position.
+            if (UCTNode::unpack_visits(entry_data) > visits) {
+                return;
+            }
+            victim = &entry;
+            found = true;
+            break;
+        }
+        auto age = (generation - entry_key) & GENERATION_MASK;
+        auto score = std::int64_t{UCTNode::unpack_visits(entry_data)}
+                     - (static_cast<std::int64_t>(age) << 32);
+        if (&entry == &bucket[0] || score < victim_score) {
+            victim = &entry;
+            victim_score = score;
+        }
+    }
+
+    auto& counters = t_counters;
+    counters.stores++;
+    if (!found && UCTNode::unpack_visits(
+                      victim->m_data.load(std::memory_order_relaxed)) > 0) {
+        counters.overwrites++;
+    }
+    victim->m_data.store(data, std::memory_order_relaxed);
+    victim->m_key.store(((key ^ data) & ~GENERATION_MASK) | generation,
+                        std::memory_order_relaxed);
+    counters.maybe_flush(*this);
+}
+
+void TTable::sync(std::uint64_t hash, const float komi, UCTNode * node) {
+    PerfTimer timer(PerfStats::TTABLE);
+    if (m_buckets.empty()) {
         return;
     }
 
-    /*
-        valid entry in TT should have more info than tree
-    */
-    if (m_buckets[index].m_visits > node->get_visits()) {
+    const auto key = position_key(hash, komi);
+    auto& bucket = get_bucket(key);
+    auto& counters = t_counters;
+    counters.lookups++;
+
+    for (auto& entry : bucket) {
+        auto entry_key = entry.m_key.load(std::memory_order_relaxed);
+        auto entry_data = entry.m_data.load(std::memory_order_relaxed);
+        if (!matches(key, entry_key, entry_data)) {
+            continue;
+        }
+        counters.hits++;
         /*
-            entry in TT has more info (new node)
+            valid entry in TT should have more info than tree
         */
-        node->set_visits(m_buckets[index].m_visits);
-        node->set_blackevals(m_buckets[index].m_eval_sum);
+        if (UCTNode::unpack_visits(entry_data) > node->get_visits()) {
+            /*
+                entry in TT has more info (new node)
+            */
+            node->set_stats(entry_data);
+            counters.syncs++;
+        }
+        break;
+    }
+    counters.maybe_flush(*this);
+}
+
+void TTable::flush_stats() {
+    t_counters.flush(*this);
+}
+
+void TTable::dump_stats() {
+    if (m_buckets.empty()) {
+        return;
+    }
+    auto lookups = m_lookups.exchange(0);
+    auto hits = m_hits.exchange(0);
+    auto syncs = m_syncs.exchange(0);
+    auto stores = m_stores.exchange(0);
+    auto overwrites = m_overwrites.exchange(0);
+    if (lookups == 0 || stores == 0) {
+        return;
     }
+    myprintf("TT: %llu lookups, %.1f%% hits, %.1f%% of lookups synced, "
+             "%.1f%% of stores overwrote another position\n",
+             static_cast<unsigned long long>(lookups),
+             100.0 * hits / lookups, 100.0 * syncs / lookups,
+             100.0 * overwrites / stores);
 }
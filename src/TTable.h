@@ -21,18 +21,27 @@
 
 #include "config.h"
 
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
-#include "SMP.h"
 #include "UCTNode.h"
 
+/*
+    Entries are written without a lock. The key is stored XORed with the
+    data, so an entry that is torn by two threads writing it at once no
+    longer matches any position and is simply ignored. The low bits of
+    the key hold the search generation the entry was written in.
+*/
 class TTEntry {
 public:
     TTEntry() = default;
 
-    std::uint64_t m_hash{0};
-    int m_visits;
-    double m_eval_sum;
+    std::atomic<std::uint64_t> m_key{0};
+    // Visits and evals as packed by UCTNode.
+    std::atomic<std::uint64_t> m_data{0};
 };
 
 class TTable {
@@ -52,12 +61,50 @@ public:
     */
     void sync(std::uint64_t hash, const float komi, UCTNode * node);
 
+    /*
+        start a new search, older entries are replaced first
+    */
+    void new_generation();
+
+    /*
+        forget every entry, they are useless once the network changes
+    */
+    void clear();
+
+    /*
+        add the counts of the calling thread to the totals, done by
+        every search thread when it stops
+    */
+    void flush_stats();
+
+    /*
+        print and reset the hit and overwrite counts
+    */
+    void dump_stats();
+
 private:
-    TTable(int size = 500000);
+    // One bucket fills a 64 byte cache line.
+    static constexpr auto BUCKET_SIZE = 4;
+    static constexpr auto GENERATION_MASK = std::uint64_t{0xFF};
+    using TTBucket = std::array<TTEntry, BUCKET_SIZE>;
+
+    explicit TTable(size_t megabytes);
+
+    std::uint64_t position_key(std::uint64_t hash, float komi) const;
+    TTBucket& get_bucket(std::uint64_t key);
+    static bool matches(std::uint64_t key,
+                        std::uint64_t entry_key, std::uint64_t data);
+
+    std::vector<TTBucket> m_buckets;
+    std::atomic<std::uint8_t> m_generation{0};
+
+    std::atomic<std::uint64_t> m_lookups{0};
+    std::atomic<std::uint64_t> m_hits{0};
+    std::atomic<std::uint64_t> m_syncs{0};
+    std::atomic<std::uint64_t> m_stores{0};
+    std::atomic<std::uint64_t> m_overwrites{0};
 
-    SMP::Mutex m_mutex;
-    std::vector<TTEntry> m_buckets;
-    float m_komi;
+    friend struct TTCounters;
 };
 
 #endif
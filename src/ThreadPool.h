@@ -24,68 +24,191 @@
     distribution.
 */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <deque>
 #include <vector>
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
 #include <future>
 #include <functional>
+#include <stdexcept>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace Utils {
 
+/*
+    Each worker has its own task deque. A worker takes tasks from the
+    back of its own deque (most recently added first), and when that is
+    empty it steals from the front of the others. Tasks added from inside
+    a worker go to that worker's deque, other tasks are spread round robin
+    unless the caller asks for a specific worker with add_task_on.
+*/
 class ThreadPool {
 public:
+    static constexpr size_t MAX_THREADS = 256;
+
     ThreadPool() = default;
     ~ThreadPool();
 
     // create worker threads.  This version has no initializers.
-    void initialize(std::size_t);
+    // If pin_threads is set, worker i is bound to cpu i modulo the
+    // number of cpus (only supported on Linux).
+    void initialize(std::size_t, bool pin_threads = false);
 
     // add an extra thread.  The thread calls initializer() before doing anything,
     // so that the user can initialize per-thread data structures before doing work.
-    void add_thread(std::function<void()> initializer);
+    void add_thread(std::function<void()> initializer, bool pin_thread = false);
     template<class F, class... Args>
     auto add_task(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    // Same, but queue the task on a given worker (modulo the number of
+    // workers), e.g. to keep work near the thread that owns a device.
+    // Idle workers can still steal it.
+    template<class F, class... Args>
+    auto add_task_on(size_t worker, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
+    size_t get_num_threads() const;
 private:
+    struct WorkQueue {
+        std::mutex m_mutex;
+        std::deque<std::function<void()>> m_tasks;
+    };
+    // Index of the worker the calling thread is, or -1 if it isn't one.
+    int current_worker() const;
+    void push_task(size_t worker, std::function<void()> task);
+    bool pop_task(size_t worker, std::function<void()>& task);
+    template<class F, class... Args>
+    auto make_task(std::function<void()>& out, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
+    static void pin_to_cpu(size_t cpu);
+
     std::vector<std::thread> m_threads;
-    std::queue<std::function<void()>> m_tasks;
+    // Fixed size so the workers can look at each other's deques
+    // while more threads are being added.
+    std::array<WorkQueue, MAX_THREADS> m_queues;
+    std::atomic<size_t> m_num_queues{0};
+    std::atomic<size_t> m_next_queue{0};
 
+    // Sleeping workers wait here for m_pending to become non-zero.
     std::mutex m_mutex;
     std::condition_variable m_condvar;
+    std::atomic<int> m_pending{0};
     bool m_exit{false};
+
+    struct WorkerId {
+        const ThreadPool* pool;
+        int index;
+    };
+    static WorkerId& this_worker() {
+        static thread_local WorkerId id{nullptr, -1};
+        return id;
+    }
 };
 
-inline void ThreadPool::add_thread(std::function<void()> initializer) {
-    m_threads.emplace_back([this, initializer] {
+inline int ThreadPool::current_worker() const {
+    const auto& id = this_worker();
+    return id.pool == this ? id.index : -1;
+}
+
+inline size_t ThreadPool::get_num_threads() const {
+    return m_num_queues;
+}
+
+inline void ThreadPool::pin_to_cpu(size_t cpu) {
+#ifdef __linux__
+    auto cpus = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu % cpus, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#else
+    (void)cpu;
+#endif
+}
+
+inline void ThreadPool::push_task(size_t worker,
+                                  std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(m_queues[worker].m_mutex);
+        m_queues[worker].m_tasks.emplace_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending++;
+    }
+    m_condvar.notify_one();
+}
+
+inline bool ThreadPool::pop_task(size_t worker,
+                                 std::function<void()>& task) {
+    {
+        auto& own = m_queues[worker];
+        std::lock_guard<std::mutex> lock(own.m_mutex);
+        if (!own.m_tasks.empty()) {
+            task = std::move(own.m_tasks.back());
+            own.m_tasks.pop_back();
+            m_pending--;
+            return true;
+        }
+    }
+    const auto num_queues = size_t{m_num_queues};
+    for (auto i = size_t{1}; i < num_queues; i++) {
+        auto& victim = m_queues[(worker + i) % num_queues];
+        std::lock_guard<std::mutex> lock(victim.m_mutex);
+        if (!victim.m_tasks.empty()) {
+            task = std::move(victim.m_tasks.front());
+            victim.m_tasks.pop_front();
+            m_pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::add_thread(std::function<void()> initializer,
+                                   bool pin_thread) {
+    const auto index = m_threads.size();
+    if (index >= MAX_THREADS) {
+        throw std::runtime_error("Too many threads in thread pool.");
+    }
+    m_num_queues = index + 1;
+    m_threads.emplace_back([this, index, initializer, pin_thread] {
+        this_worker() = WorkerId{this, static_cast<int>(index)};
+        if (pin_thread) {
+            pin_to_cpu(index);
+        }
         initializer();
         for (;;) {
             std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(m_mutex);
-                m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
-                if (m_exit && m_tasks.empty()) {
-                    return;
-                }
-                task = std::move(m_tasks.front());
-                m_tasks.pop();
+            if (pop_task(index, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condvar.wait(lock, [this]{ return m_exit || m_pending > 0; });
+            if (m_exit && m_pending <= 0) {
+                return;
             }
-            task();
         }
     });
 }
 
-inline void ThreadPool::initialize(size_t threads) {
+inline void ThreadPool::initialize(size_t threads, bool pin_threads) {
     for (size_t i = 0; i < threads; i++) {
-        add_thread( [](){} /* null function */);
+        add_thread( [](){} /* null function */, pin_threads);
     }
 }
 
 template<class F, class... Args>
-auto ThreadPool::add_task(F&& f, Args&&... args)
+auto ThreadPool::make_task(std::function<void()>& out, F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type> {
     using return_type = typename std::result_of<F(Args...)>::type;
 
@@ -93,12 +216,29 @@ auto ThreadPool::add_task(F&& f, Args&&... args)
         std::bind(std::forward<F>(f), std::forward<Args>(args)...)
     );
 
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace([task](){(*task)();});
+    out = [task](){(*task)();};
+    return task->get_future();
+}
+
+template<class F, class... Args>
+auto ThreadPool::add_task(F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+    auto worker = current_worker();
+    if (worker < 0) {
+        return add_task_on(m_next_queue++,
+                           std::forward<F>(f), std::forward<Args>(args)...);
     }
-    m_condvar.notify_one();
+    return add_task_on(worker, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+auto ThreadPool::add_task_on(size_t worker, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+    std::function<void()> task;
+    auto res = make_task(task, std::forward<F>(f), std::forward<Args>(args)...);
+    // Without workers the task just waits in the first deque.
+    const auto num_queues = std::max(size_t{1}, size_t{m_num_queues});
+    push_task(worker % num_queues, std::move(task));
     return res;
 }
 
@@ -126,12 +266,37 @@ public:
         for (auto && result: m_taskresults) {
             result.get();
         }
+        m_taskresults.clear();
     }
 private:
     ThreadPool & m_pool;
     std::vector<std::future<void>> m_taskresults;
 };
 
+// Calls body(i) for every i below count, on as many threads as there
+// are cpus, the caller included. The threads are started for the call,
+// so one-off work like loading a network doesn't queue up behind the
+// search in the pool.
+template<class F>
+void parallel_for(size_t count, F&& body) {
+    const auto cpus = size_t{std::max(1u, std::thread::hardware_concurrency())};
+    const auto num_threads = std::min(count, cpus);
+    std::atomic<size_t> next{0};
+    auto worker = [&next, &body, count]() {
+        for (auto i = next++; i < count; i = next++) {
+            body(i);
+        }
+    };
+    auto threads = std::vector<std::thread>{};
+    for (auto i = size_t{1}; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 }
 
 #endif
@@ -194,6 +194,24 @@ int TimeControl::max_time_for_move(int color) {
     return base_time + inc_time;
 }
 
+int TimeControl::extended_time_for_move(int color) {
+    const auto base_time = max_time_for_move(color);
+    if (m_byotime != 0 && m_byostones == 0 && m_byoperiods == 0) {
+        // infinite
+        return base_time;
+    }
+    if (m_inbyo[color] && !m_byostones) {
+        // Every move gets the same period.
+        return base_time;
+    }
+    // Time stopping early saved stays on this clock, so later moves get
+    // it back through max_time_for_move. Only borrow a part of what is
+    // not already set aside for this move.
+    auto spare = m_remaining_time[color] - cfg_lagbuffer_cs - base_time;
+    spare = std::max(spare, 0) / 4;
+    return base_time + std::min(spare, base_time * (MAX_EXTENSION - 1));
+}
+
 void TimeControl::adjust_time(int color, int time, int stones) {
     m_remaining_time[color] = time;
     // From pachi: some GTP things send 0 0 at the end of main time
@@ -19,6 +19,8 @@
 #ifndef TIMECONTROL_H_INCLUDED
 #define TIMECONTROL_H_INCLUDED
 
+#include "config.h"
+
 #include <array>
 
 #include "Timing.h"
@@ -28,7 +30,7 @@ public:
     /*
         Initialize time control. Timing info is per GTP and in centiseconds
     */
-    TimeControl(int boardsize = 19,
+    TimeControl(int boardsize = BOARD_SIZE,
                 int maintime = 60 * 60 * 100,
                 int byotime = 0, int byostones = 25,
                 int byoperiods = 0);
@@ -36,6 +38,12 @@ public:
     void start(int color);
     void stop(int color);
     int max_time_for_move(int color);
+    // How far max_time_for_move may be stretched when the search has
+    // not settled on a move. Extra time is only borrowed from a clock
+    // that keeps what we don't use, at most MAX_EXTENSION times the
+    // normal budget, and never from a byo-yomi period that would be
+    // lost anyway.
+    int extended_time_for_move(int color);
     void adjust_time(int color, int time, int stones);
     void set_boardsize(int boardsize);
     void display_times();
@@ -43,6 +51,8 @@ public:
     std::string to_text_sgf();
 
 private:
+    static constexpr auto MAX_EXTENSION = 2;
+
     void display_color_time(int color);
 
     int m_maintime;
@@ -0,0 +1,135 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <boost/format.hpp>
+
+std::atomic<bool> Trace::s_enabled{false};
+
+namespace {
+
+struct Event {
+    // Odd while the event is being written, see record.
+    std::atomic<std::uint64_t> sequence{0};
+    const char* name;
+    const char* category;
+    std::int64_t start_ns;
+    std::int64_t duration_ns;
+    std::int64_t arg;
+    int lane;
+    int tid;
+};
+
+// Never freed, threads may still record while the statics are destroyed.
+Event* events{nullptr};
+size_t capacity;
+std::atomic<std::uint64_t> next_event{0};
+std::atomic<int> next_tid{0};
+
+const auto clock_start = std::chrono::steady_clock::now();
+
+}
+
+void Trace::enable(const size_t size) {
+    capacity = size;
+    events = new Event[capacity];
+    s_enabled = true;
+}
+
+std::int64_t Trace::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - clock_start).count();
+}
+
+int Trace::thread_id() {
+    thread_local const auto tid = next_tid++;
+    return tid;
+}
+
+void Trace::record(const char* name, const char* category,
+                   const std::int64_t start_ns,
+                   const std::int64_t duration_ns,
+                   const std::int64_t arg, const Lane lane, const int tid) {
+    if (!enabled()) {
+        return;
+    }
+    const auto index = next_event++;
+    auto& event = events[index % capacity];
+    // The sequence tells dump whether a slot was rewritten while it
+    // was being read, and which lap of the ring it belongs to.
+    event.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name = name;
+    event.category = category;
+    event.start_ns = start_ns;
+    event.duration_ns = duration_ns;
+    event.arg = arg;
+    event.lane = lane;
+    event.tid = tid;
+    event.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+bool Trace::dump(const std::string& filename) {
+    if (!enabled()) {
+        return false;
+    }
+    auto file = std::fopen(filename.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    std::fprintf(file, "{\"traceEvents\": [\n"
+                       "{\"name\": \"process_name\", \"ph\": \"M\", "
+                       "\"pid\": %d, \"args\": {\"name\": \"host\"}},\n"
+                       "{\"name\": \"process_name\", \"ph\": \"M\", "
+                       "\"pid\": %d, \"args\": {\"name\": \"device\"}}",
+                 HOST, DEVICE);
+    const auto last = next_event.load();
+    const auto first = last > capacity ? last - capacity : 0;
+    for (auto index = first; index < last; index++) {
+        const auto& slot = events[index % capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != 2 * index + 2) {
+            continue;
+        }
+        const auto name = slot.name;
+        const auto category = slot.category;
+        const auto start_ns = slot.start_ns;
+        const auto duration_ns = slot.duration_ns;
+        const auto arg = slot.arg;
+        const auto lane = slot.lane;
+        const auto tid = slot.tid;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != 2 * index + 2) {
+            continue;
+        }
+        auto args = std::string{};
+        if (arg >= 0) {
+            args = str(boost::format(", \"args\": {\"n\": %d}") % arg);
+        }
+        std::fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+                           "\"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+                           "\"ts\": %.3f, \"dur\": %.3f%s}",
+                     name, category, lane, tid,
+                     start_ns / 1000.0, duration_ns / 1000.0, args.c_str());
+    }
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
+}
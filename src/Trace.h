@@ -0,0 +1,99 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+    Opt-in event tracing for looking at the search and network threads
+    on a timeline. Events go into a fixed size ring buffer, so a long
+    run keeps its most recent ones, and are written out in the Chrome
+    trace format, which chrome://tracing and Perfetto open.
+
+    Host events are laid out per thread. Device events, the OpenCL
+    kernels, are timed by the device and shifted onto the host clock,
+    one lane per command queue.
+*/
+class Trace {
+public:
+    enum Lane {
+        HOST = 1,
+        DEVICE = 2
+    };
+
+    // Starts recording, keeping the last capacity events.
+    static void enable(size_t capacity);
+    static bool enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+    // Nanoseconds on the clock the events are recorded on.
+    static std::int64_t now_ns();
+    // A small number naming the calling thread in the trace.
+    static int thread_id();
+    // name and category must be string literals, only the pointers
+    // are kept. arg is shown with the event if it is not negative.
+    static void record(const char* name, const char* category,
+                       std::int64_t start_ns, std::int64_t duration_ns,
+                       std::int64_t arg = -1, Lane lane = HOST,
+                       int tid = thread_id());
+    // Writes what the buffer holds, oldest event first. A trace
+    // written while events are recorded can miss a few of them.
+    static bool dump(const std::string& filename);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+// Records the enclosing scope as one event, if tracing is on.
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* category,
+               std::int64_t arg = -1)
+        : m_name(name), m_category(category), m_arg(arg) {
+        if (Trace::enabled()) {
+            m_start = Trace::now_ns();
+        }
+    }
+    ~TraceScope() {
+        if (m_start >= 0) {
+            Trace::record(m_name, m_category, m_start,
+                          Trace::now_ns() - m_start, m_arg);
+        }
+    }
+    // For what is only known once the scope has run, like a batch size.
+    void set_arg(std::int64_t arg) {
+        m_arg = arg;
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* m_name;
+    const char* m_category;
+    std::int64_t m_arg;
+    std::int64_t m_start{-1};
+};
+
+#endif
@@ -21,6 +21,8 @@
 #include <algorithm>
 #include <bitset>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -33,16 +35,22 @@
 #include "FullBoard.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "MappedFile.h"
 #include "Random.h"
 #include "SGFParser.h"
 #include "SGFTree.h"
+#include "ThreadPool.h"
 #include "Timing.h"
 #include "UCTNode.h"
 #include "Utils.h"
 #include "string.h"
 #include "zlib.h"
 
-std::vector<TimeStep> Training::m_data{};
+thread_local std::FILE* Training::m_steps_file{nullptr};
+thread_local size_t Training::m_step_count{0};
+constexpr std::uint8_t Training::BINARY_VERSION;
+constexpr size_t Training::PLANE_BYTES;
+constexpr size_t Training::BINARY_RECORD_SIZE;
 
 std::string OutputChunker::gen_chunk_name(void) const {
     auto base = std::string{m_basename};
@@ -50,13 +58,143 @@ std::string OutputChunker::gen_chunk_name(void) const {
     return base;
 }
 
+ChunkWriter& ChunkWriter::get() {
+    static ChunkWriter s_writer;
+    return s_writer;
+}
+
+ChunkWriter::ChunkWriter() : m_thread(&ChunkWriter::worker, this) {
+}
+
+ChunkWriter::~ChunkWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    // Files whose last block never came are incomplete.
+    for (const auto& stream : m_streams) {
+        gzclose(stream.second);
+        std::remove((stream.first + ".tmp").c_str());
+    }
+}
+
+std::uint64_t ChunkWriter::write(std::string filename, std::string data,
+                                 const bool compress, const bool last) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_queue.size() < MAX_QUEUED; });
+    m_queue.push_back(Job{std::move(filename), std::move(data),
+                          compress, last});
+    m_cv.notify_all();
+    return ++m_queued;
+}
+
+void ChunkWriter::wait(const std::uint64_t ticket,
+                       const std::vector<std::string>& filenames) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this, ticket]() { return m_written >= ticket; });
+    auto error = std::string{};
+    for (const auto& filename : filenames) {
+        const auto it = m_errors.find(filename);
+        if (it != end(m_errors)) {
+            if (error.empty()) {
+                error = it->second;
+            }
+            m_errors.erase(it);
+        }
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+}
+
+void ChunkWriter::worker() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_cv.wait(lock, [this]() { return !m_queue.empty() || !m_running; });
+        // Whatever is queued still gets written on shutdown.
+        if (m_queue.empty()) {
+            return;
+        }
+        auto job = std::move(m_queue.front());
+        m_queue.pop_front();
+        const auto failed = m_errors.count(job.filename) > 0;
+        lock.unlock();
+
+        const auto error = failed ? std::string{} : write_job(job);
+
+        lock.lock();
+        if (!error.empty()) {
+            Utils::myprintf("%s\n", error.c_str());
+            m_errors.emplace(job.filename, error);
+        }
+        m_written++;
+        m_cv.notify_all();
+    }
+}
+
+std::string ChunkWriter::write_job(const Job& job) {
+    if (!job.compress) {
+        auto flags = std::ofstream::out | std::ofstream::app;
+        auto out = std::ofstream{job.filename, flags};
+        out << job.data;
+        out.close();
+        if (!out) {
+            return "Error writing " + job.filename;
+        }
+        return {};
+    }
+
+    const auto tmp_name = job.filename + ".tmp";
+    auto it = m_streams.find(job.filename);
+    if (it == end(m_streams)) {
+        const auto mode = "wb" + std::to_string(cfg_training_compression);
+        const auto out = gzopen(tmp_name.c_str(), mode.c_str());
+        if (out == nullptr) {
+            return "Error opening " + tmp_name;
+        }
+        it = m_streams.emplace(job.filename, out).first;
+    }
+    auto ok = true;
+    if (!job.data.empty()) {
+        ok = gzwrite(it->second, job.data.data(), job.data.size())
+             == int(job.data.size());
+    }
+    if (!ok || job.last) {
+        ok = gzclose(it->second) == Z_OK && ok;
+        m_streams.erase(it);
+        if (!ok || std::rename(tmp_name.c_str(), job.filename.c_str()) != 0) {
+            std::remove(tmp_name.c_str());
+            return "Error in gzip output to " + job.filename;
+        }
+    }
+    return {};
+}
+
 OutputChunker::OutputChunker(const std::string& basename,
                              bool compress)
     : m_basename(basename), m_compress(compress) {
 }
 
 OutputChunker::~OutputChunker() {
-    flush_chunks();
+    if (!m_finished) {
+        try {
+            finish();
+        } catch (const std::exception&) {
+            // The writer printed it already.
+        }
+    }
+}
+
+void OutputChunker::finish() {
+    // Don't leave an empty chunk behind a full one, but always write
+    // at least one.
+    if (m_step_count > 0 || m_chunk_count == 0) {
+        flush_chunks();
+    }
+    m_finished = true;
+    ChunkWriter::get().wait(m_ticket, m_filenames);
 }
 
 void OutputChunker::append(const std::string& str) {
@@ -64,39 +202,97 @@ void OutputChunker::append(const std::string& str) {
     m_step_count++;
     if (m_step_count >= CHUNK_SIZE) {
         flush_chunks();
+    } else if (m_buffer.size() >= BLOCK_BYTES) {
+        write_block(false);
     }
 }
 
+void OutputChunker::write_block(const bool last) {
+    const auto filename = m_compress ? gen_chunk_name() : m_basename;
+    if (m_filenames.empty() || m_filenames.back() != filename) {
+        m_filenames.emplace_back(filename);
+    }
+    m_ticket = ChunkWriter::get().write(filename, std::move(m_buffer),
+                                        m_compress, last);
+    m_buffer.clear();
+}
+
 void OutputChunker::flush_chunks() {
     if (m_compress) {
-        auto chunk_name = gen_chunk_name();
-        auto out = gzopen(chunk_name.c_str(), "wb9");
-
-        auto in_buff_size = m_buffer.size();
-        auto in_buff = std::make_unique<char[]>(in_buff_size);
-        memcpy(in_buff.get(), m_buffer.data(), in_buff_size);
-
-        auto comp_size = gzwrite(out, in_buff.get(), in_buff_size);
-        if (!comp_size) {
-            throw std::runtime_error("Error in gzip output");
-        }
         Utils::myprintf("Writing chunk %d\n",  m_chunk_count);
-        gzclose(out);
-    } else {
-        auto chunk_name = m_basename;
-        auto flags = std::ofstream::out | std::ofstream::app;
-        auto out = std::ofstream{chunk_name, flags};
-        out << m_buffer;
-        out.close();
     }
-
-    m_buffer.clear();
+    write_block(true);
     m_chunk_count++;
     m_step_count = 0;
 }
 
 void Training::clear_training() {
-    Training::m_data.clear();
+    m_step_count = 0;
+}
+
+void Training::pack_plane(const Network::BoardPlane& plane,
+                          std::uint8_t* out) {
+    std::fill(out, out + PLANE_BYTES, std::uint8_t{0});
+    for (auto idx = size_t{0}; idx < plane.size(); idx++) {
+        if (plane[idx]) {
+            out[idx / 8] |= std::uint8_t(0x80 >> (idx % 8));
+        }
+    }
+}
+
+void Training::store_step(const TimeStep& step) {
+    if (m_steps_file == nullptr) {
+        // Deleted by the OS when we exit.
+        m_steps_file = std::tmpfile();
+        if (m_steps_file == nullptr) {
+            throw std::runtime_error("Error creating training steps file");
+        }
+    }
+    auto stored = StoredStep{};
+    for (auto p = size_t{0}; p < stored.planes.size(); p++) {
+        pack_plane(step.planes[p], stored.planes[p].data());
+    }
+    std::copy(begin(step.probabilities), end(step.probabilities),
+              begin(stored.probabilities));
+    stored.to_move = step.to_move;
+    stored.net_winrate = step.net_winrate;
+    stored.root_uct_winrate = step.root_uct_winrate;
+    stored.child_uct_winrate = step.child_uct_winrate;
+    stored.bestmove_visits = step.bestmove_visits;
+
+    const auto offset = long(m_step_count * sizeof(StoredStep));
+    if (std::fseek(m_steps_file, offset, SEEK_SET) != 0
+        || std::fwrite(&stored, sizeof(stored), 1, m_steps_file) != 1) {
+        throw std::runtime_error("Error writing training steps file");
+    }
+    m_step_count++;
+}
+
+TimeStep Training::load_step(const size_t index) {
+    assert(index < m_step_count);
+    auto stored = StoredStep{};
+    const auto offset = long(index * sizeof(StoredStep));
+    if (std::fseek(m_steps_file, offset, SEEK_SET) != 0
+        || std::fread(&stored, sizeof(stored), 1, m_steps_file) != 1) {
+        throw std::runtime_error("Error reading training steps file");
+    }
+    auto step = TimeStep{};
+    // Only the planes that go into the training data are kept.
+    step.planes.resize(stored.planes.size());
+    for (auto p = size_t{0}; p < stored.planes.size(); p++) {
+        for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; idx++) {
+            step.planes[p][idx] = (stored.planes[p][idx / 8]
+                                   >> (7 - idx % 8)) & 1;
+        }
+    }
+    step.probabilities.assign(begin(stored.probabilities),
+                              end(stored.probabilities));
+    step.to_move = stored.to_move;
+    step.net_winrate = stored.net_winrate;
+    step.root_uct_winrate = stored.root_uct_winrate;
+    step.child_uct_winrate = stored.child_uct_winrate;
+    step.bestmove_visits = stored.bestmove_visits;
+    return step;
 }
 
 void Training::record(GameState& state, UCTNode& root) {
@@ -105,16 +301,15 @@ void Training::record(GameState& state, UCTNode& root) {
     step.planes = Network::NNPlanes{};
     Network::gather_features(&state, step.planes);
 
-    auto result =
-        Network::get_scored_moves(&state, Network::Ensemble::DIRECT, 0);
-    step.net_winrate = result.second;
+    // The search already evaluated the root when expanding it.
+    step.net_winrate = root.get_net_eval(step.to_move);
 
-    const auto& best_node = root.get_best_root_child(step.to_move);
+    const auto& best_node = *root.get_best_root_child(step.to_move);
     step.root_uct_winrate = root.get_eval(step.to_move);
     step.child_uct_winrate = best_node.get_eval(step.to_move);
     step.bestmove_visits = best_node.get_visits();
 
-    step.probabilities.resize((19 * 19) + 1);
+    step.probabilities.resize(POTENTIAL_MOVES);
 
     // Get total visit amount. We count rather
     // than trust the root to avoid ttable issues.
@@ -136,65 +331,136 @@ void Training::record(GameState& state, UCTNode& root) {
         auto move = child->get_move();
         if (move != FastBoard::PASS) {
             auto xy = state.board.get_xy(move);
-            step.probabilities[xy.second * 19 + xy.first] = prob;
+            step.probabilities[xy.second * BOARD_SIZE + xy.first] = prob;
         } else {
-            step.probabilities[19 * 19] = prob;
+            step.probabilities[NUM_INTERSECTIONS] = prob;
         }
     }
 
-    m_data.emplace_back(step);
+    store_step(step);
 }
 
 void Training::dump_training(int winner_color, const std::string& filename) {
     auto chunker = OutputChunker{filename, true};
     dump_training(winner_color, chunker);
+    chunker.finish();
 }
 
 void Training::dump_training(int winner_color, OutputChunker& outchunk) {
-    for (const auto& step : m_data) {
-        auto out = std::stringstream{};
-        // First output 16 times an input feature plane
-        for (auto p = size_t{0}; p < 16; p++) {
-            const auto& plane = step.planes[p];
-            // Write it out as a string of hex characters
-            for (auto bit = size_t{0}; bit + 3 < plane.size(); bit += 4) {
-                auto hexbyte =  plane[bit]     << 3
-                              | plane[bit + 1] << 2
-                              | plane[bit + 2] << 1
-                              | plane[bit + 3] << 0;
-                out << std::hex << hexbyte;
-            }
-            // 361 % 4 = 1 so the last bit goes by itself
-            assert(plane.size() % 4 == 1);
-            out << plane[plane.size() - 1];
-            out << std::dec << std::endl;
+    for (auto i = size_t{0}; i < m_step_count; i++) {
+        const auto step = load_step(i);
+        if (cfg_binary_training) {
+            outchunk.append(binary_record(step, winner_color));
+        } else {
+            outchunk.append(text_record(step, winner_color));
         }
-        // The side to move planes can be compactly encoded into a single
-        // bit, 0 = black to move.
-        out << (step.to_move == FastBoard::BLACK ? "0" : "1") << std::endl;
-        // Then a 362 long array of float probabilities
-        for (auto it = begin(step.probabilities);
-            it != end(step.probabilities); ++it) {
-            out << *it;
-            if (next(it) != end(step.probabilities)) {
-                out << " ";
-            }
+    }
+}
+
+std::string Training::text_record(const TimeStep& step,
+                                  const int winner_color) {
+    auto out = std::stringstream{};
+    // First output 16 times an input feature plane
+    for (auto p = size_t{0}; p < 16; p++) {
+        const auto& plane = step.planes[p];
+        // Write it out as a string of hex characters
+        for (auto bit = size_t{0}; bit + 3 < plane.size(); bit += 4) {
+            auto hexbyte =  plane[bit]     << 3
+                          | plane[bit + 1] << 2
+                          | plane[bit + 2] << 1
+                          | plane[bit + 3] << 0;
+            out << std::hex << hexbyte;
         }
-        out << std::endl;
-        // And the game result for the side to move
-        if (step.to_move == winner_color) {
-            out << "1";
-        } else {
-            out << "-1";
+        // Odd board sizes have NUM_INTERSECTIONS % 4 = 1, so the last
+        // bit goes by itself
+        assert(plane.size() % 4 == 1);
+        out << plane[plane.size() - 1];
+        out << std::dec << std::endl;
+    }
+    // The side to move planes can be compactly encoded into a single
+    // bit, 0 = black to move.
+    out << (step.to_move == FastBoard::BLACK ? "0" : "1") << std::endl;
+    // Then a POTENTIAL_MOVES long array of float probabilities
+    for (auto it = begin(step.probabilities);
+        it != end(step.probabilities); ++it) {
+        out << *it;
+        if (next(it) != end(step.probabilities)) {
+            out << " ";
         }
-        out << std::endl;
-        outchunk.append(out.str());
     }
+    out << std::endl;
+    // And the game result for the side to move
+    if (step.to_move == winner_color) {
+        out << "1";
+    } else {
+        out << "-1";
+    }
+    out << std::endl;
+    return out.str();
+}
+
+// Round to nearest even, like the hardware conversions.
+static std::uint16_t float_to_half(const float value) {
+    auto bits = std::uint32_t{};
+    std::memcpy(&bits, &value, sizeof(bits));
+    const auto sign = std::uint16_t((bits >> 16) & 0x8000);
+    const auto float_exponent = int((bits >> 23) & 0xff);
+    auto mantissa = bits & 0x7fffff;
+    if (float_exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    const auto exponent = float_exponent - 127 + 15;
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    auto shift = 13;
+    auto half = std::uint32_t{};
+    if (exponent <= 0) {
+        // Subnormal half, or zero.
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+    } else {
+        half = (std::uint32_t(exponent) << 10) | (mantissa >> shift);
+    }
+    // A carry out of the mantissa correctly bumps the exponent.
+    const auto rest = mantissa & ((1u << shift) - 1);
+    const auto halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+        half++;
+    }
+    return std::uint16_t(sign | half);
+}
+
+std::string Training::binary_record(const TimeStep& step,
+                                    const int winner_color) {
+    auto out = std::string(BINARY_RECORD_SIZE, '\0');
+    out[0] = char(BINARY_VERSION);
+    out[1] = char(step.to_move == FastBoard::BLACK ? 0 : 1);
+    out[2] = char(step.to_move == winner_color ? 1 : -1);
+    auto pos = size_t{4};
+    auto plane_bytes = std::array<std::uint8_t, PLANE_BYTES>{};
+    for (auto p = size_t{0}; p < 16; p++) {
+        pack_plane(step.planes[p], plane_bytes.data());
+        std::copy(begin(plane_bytes), end(plane_bytes), begin(out) + pos);
+        pos += PLANE_BYTES;
+    }
+    for (const auto prob : step.probabilities) {
+        const auto half = float_to_half(prob);
+        out[pos++] = char(half & 0xff);
+        out[pos++] = char(half >> 8);
+    }
+    assert(pos == BINARY_RECORD_SIZE);
+    return out;
 }
 
 void Training::dump_debug(const std::string& filename) {
     auto chunker = OutputChunker{filename, true};
     dump_debug(chunker);
+    chunker.finish();
 }
 
 void Training::dump_debug(OutputChunker& outchunk) {
@@ -204,7 +470,8 @@ void Training::dump_debug(OutputChunker& outchunk) {
         out << cfg_resignpct << " " << cfg_weightsfile << std::endl;
         outchunk.append(out.str());
     }
-    for (const auto& step : m_data) {
+    for (auto i = size_t{0}; i < m_step_count; i++) {
+        const auto step = load_step(i);
         auto out = std::stringstream{};
         out << step.net_winrate
             << " " << step.root_uct_winrate
@@ -214,10 +481,11 @@ void Training::dump_debug(OutputChunker& outchunk) {
     }
 }
 
-void Training::process_game(GameState& state, size_t& train_pos, int who_won,
-                            const std::vector<int>& tree_moves,
-                            OutputChunker& outchunker) {
-    clear_training();
+std::vector<std::string> Training::process_game(
+    GameState& state, const int who_won, const std::vector<int>& tree_moves,
+    const std::uint64_t seed) {
+    auto records = std::vector<std::string>{};
+    auto rng = Random{seed};
     auto counter = size_t{0};
     state.rewind();
 
@@ -229,43 +497,83 @@ void Training::process_game(GameState& state, size_t& train_pos, int who_won,
         // Detect if this SGF seems to be corrupted
         if (!state.is_move_legal(to_move, move_vertex)) {
             std::cout << "Mainline move not found: " << move_vertex << std::endl;
-            return;
+            return {};
         }
 
         if (move_vertex != FastBoard::PASS) {
             // get x y coords for actual move
             auto xy = state.board.get_xy(move_vertex);
-            move_idx = (xy.second * 19) + xy.first;
+            move_idx = (xy.second * BOARD_SIZE) + xy.first;
         } else {
-            move_idx = 19 * 19; // PASS
+            move_idx = NUM_INTERSECTIONS; // PASS
         }
 
 
         // Pick every 1/SKIP_SIZE th position.
-        auto skip = Random::get_Rng().randfix<SKIP_SIZE>();
+        auto skip = rng.randfix<SKIP_SIZE>();
         if (skip == 0) {
             auto step = TimeStep{};
             step.to_move = to_move;
             step.planes = Network::NNPlanes{};
             Network::gather_features(&state, step.planes);
 
-            step.probabilities.resize((19 * 19) + 1);
+            step.probabilities.resize(POTENTIAL_MOVES);
             step.probabilities[move_idx] = 1.0f;
 
-            train_pos++;
-            m_data.emplace_back(step);
+            if (cfg_binary_training) {
+                records.emplace_back(binary_record(step, who_won));
+            } else {
+                records.emplace_back(text_record(step, who_won));
+            }
         }
 
         counter++;
     } while (state.forward_move() && counter < tree_moves.size());
 
-    dump_training(who_won, outchunker);
+    return records;
+}
+
+std::vector<std::string> Training::supervised_game(const char* sgf,
+                                                   const size_t length,
+                                                   const std::uint64_t seed) {
+    auto sgftree = std::make_unique<SGFTree>();
+    try {
+        sgftree->load_from_string(std::string(sgf, length));
+    } catch (...) {
+        return {};
+    };
+
+    auto tree_moves = sgftree->get_mainline();
+    // Empty game or couldn't be parsed?
+    if (tree_moves.size() == 0) {
+        return {};
+    }
+
+    auto who_won = sgftree->get_winner();
+    // Accept all komis and handicaps, but reject no usable result
+    if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
+        return {};
+    }
+
+    auto state =
+        std::make_unique<GameState>(sgftree->follow_mainline_state());
+    // The board size is fixed at compile time
+    if (state->board.get_boardsize() != BOARD_SIZE) {
+        return {};
+    }
+
+    return process_game(*state, who_won, tree_moves, seed);
 }
 
 void Training::dump_supervised(const std::string& sgf_name,
                                const std::string& out_filename) {
     auto outchunker = OutputChunker{out_filename, true};
-    auto games = SGFParser::chop_all(sgf_name);
+    // The games are parsed straight from the mapped file.
+    const MappedFile file(sgf_name);
+    if (file.data() == nullptr) {
+        throw std::runtime_error("Error opening file");
+    }
+    auto games = SGFParser::index_games(file.data(), file.size());
     auto gametotal = games.size();
     auto train_pos = size_t{0};
 
@@ -275,48 +583,52 @@ void Training::dump_supervised(const std::string& sgf_name,
     std::shuffle(begin(games), end(games), Random::get_Rng());
     std::cout << "done." << std::endl;
 
+    // Every game picks its positions with a generator of its own, so the
+    // output is the same however the games are spread over the threads.
+    const auto seed = Random::get_Rng()();
+    const auto threads = size_t(cfg_num_threads);
+    auto records = std::vector<std::vector<std::string>>(SUPERVISED_BATCH);
+
     Time start;
     // Loop over the database multiple times. We will select different
     // positions from each game on every pass.
     for (auto repeat = size_t{0}; repeat < SKIP_SIZE; repeat++) {
-        for (auto gamecount = size_t{0}; gamecount < gametotal; gamecount++) {
-            auto sgftree = std::make_unique<SGFTree>();
-            try {
-                sgftree->load_from_string(games[gamecount]);
-            } catch (...) {
-                continue;
-            };
-
-            if (gamecount > 0 && gamecount % 1000 == 0) {
+        for (auto first = size_t{0}; first < gametotal;
+             first += SUPERVISED_BATCH) {
+            if (first > 0 && first % 1000 == 0) {
                 Time elapsed;
                 auto elapsed_s = Time::timediff_seconds(start, elapsed);
                 Utils::myprintf("Game %5d, %5d positions in %5.2f seconds -> %d pos/s\n",
-                    gamecount, train_pos, elapsed_s, (int)(train_pos / elapsed_s));
+                    first, train_pos, elapsed_s, (int)(train_pos / elapsed_s));
             }
 
-            auto tree_moves = sgftree->get_mainline();
-            // Empty game or couldn't be parsed?
-            if (tree_moves.size() == 0) {
-                continue;
+            const auto last = std::min(gametotal, first + SUPERVISED_BATCH);
+            Utils::ThreadGroup tg(thread_pool);
+            for (auto t = size_t{0}; t < threads; t++) {
+                tg.add_task([&, t]() {
+                    for (auto game = first + t; game < last; game += threads) {
+                        const auto game_seed = seed
+                            + (repeat * gametotal + game)
+                              * 0x9e3779b97f4a7c15ULL;
+                        records[game - first] = supervised_game(
+                            file.data() + games[game].first,
+                            games[game].second, game_seed);
+                    }
+                });
             }
-
-            auto who_won = sgftree->get_winner();
-            // Accept all komis and handicaps, but reject no usable result
-            if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
-                continue;
+            tg.wait_all();
+
+            // Written in the order of the games, not as they finished.
+            for (auto game = first; game < last; game++) {
+                for (const auto& record : records[game - first]) {
+                    outchunker.append(record);
+                }
+                train_pos += records[game - first].size();
+                records[game - first].clear();
             }
-
-            auto state =
-                std::make_unique<GameState>(sgftree->follow_mainline_state());
-            // Our board size is hardcoded in several places
-            if (state->board.get_boardsize() != 19) {
-                continue;
-            }
-
-            process_game(*state, train_pos, who_won, tree_moves,
-                        outchunker);
         }
     }
+    outchunker.finish();
 
     std::cout << "Dumped " << train_pos << " training positions." << std::endl;
 }
@@ -21,14 +21,23 @@
 
 #include "config.h"
 
+#include <array>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "GameState.h"
 #include "Network.h"
 #include "UCTNode.h"
+#include "zlib.h"
 
 class TimeStep {
 public:
@@ -41,22 +50,85 @@ public:
     int bestmove_visits;
 };
 
+/*
+    Compresses and writes training chunks on a background thread, so
+    the game doesn't stall on it. The data comes in blocks as it is
+    produced and goes straight into the compressor, there is no copy of
+    the whole chunk. A compressed chunk is written under a temporary
+    name and renamed when its last block is in: once the final name
+    exists, the file can be picked up. The writer finishes the queue
+    before the program exits.
+*/
+class ChunkWriter {
+public:
+    static ChunkWriter& get();
+    ~ChunkWriter();
+
+    // Queues a block of data to be gzipped into filename, or appended to
+    // it as is. A compressed file is complete with the block that has
+    // last set. Blocks while MAX_QUEUED blocks are waiting. Returns the
+    // ticket to wait for it.
+    std::uint64_t write(std::string filename, std::string data,
+                        bool compress, bool last);
+    // Waits until the block with ticket, and everything queued before
+    // it, is written. Throws if writing any of filenames failed.
+    void wait(std::uint64_t ticket,
+              const std::vector<std::string>& filenames);
+
+    static constexpr size_t MAX_QUEUED = 64;
+private:
+    struct Job {
+        std::string filename;
+        std::string data;
+        bool compress;
+        bool last;
+    };
+
+    ChunkWriter();
+    void worker();
+    // Returns an error message, empty if it went fine.
+    std::string write_job(const Job& job);
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_queue;
+    std::uint64_t m_queued{0};
+    std::uint64_t m_written{0};
+    // Files that failed, until wait reports them. Later blocks of a
+    // failed file are dropped.
+    std::map<std::string, std::string> m_errors;
+    bool m_running{true};
+    // The compressed files being written, only used by the worker.
+    std::map<std::string, gzFile> m_streams;
+    std::thread m_thread;
+};
+
 class OutputChunker {
 public:
     OutputChunker(const std::string& basename, bool compress = false);
+    // Finishes, if that wasn't done yet, reporting errors only.
     ~OutputChunker();
     void append(const std::string& str);
+    // Writes the last chunk and waits until all of them are on disk.
+    // Throws if any of them could not be written.
+    void finish();
 
     // Group this many positions in a batch.
     static constexpr size_t CHUNK_SIZE = 16384;
+    // Data goes to the ChunkWriter in blocks of about this size.
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
 private:
     std::string gen_chunk_name() const;
+    void write_block(bool last);
     void flush_chunks();
     size_t m_step_count{0};
     size_t m_chunk_count{0};
     std::string m_buffer;
     std::string m_basename;
     bool m_compress{false};
+    bool m_finished{false};
+    std::uint64_t m_ticket{0};
+    std::vector<std::string> m_filenames;
 };
 
 class Training {
@@ -69,18 +141,65 @@ public:
 
     static void dump_supervised(const std::string& sgf_file,
                                 const std::string& out_filename);
+
+    /*
+        With --binary-training every position is a record of
+        BINARY_RECORD_SIZE bytes:
+          u8  BINARY_VERSION (text chunks never start with this byte)
+          u8  side to move, 0 = black
+          i8  game result for the side to move, 1 or -1
+          u8  zero
+          16 input planes of PLANE_BYTES each, bit-packed with the
+             first intersection in the most significant bit
+          POTENTIAL_MOVES probabilities as little-endian IEEE fp16
+    */
+    static constexpr std::uint8_t BINARY_VERSION = 1;
+    static constexpr size_t PLANE_BYTES = (NUM_INTERSECTIONS + 7) / 8;
+    static constexpr size_t BINARY_RECORD_SIZE =
+        4 + 16 * PLANE_BYTES + 2 * POTENTIAL_MOVES;
+
 private:
     // Consider only every 1/th position in a game.
     // This ensures that positions in a chunk are from disjoint games.
     static constexpr size_t SKIP_SIZE = 16;
+    // dump_supervised hands the threads this many games at a time.
+    static constexpr size_t SUPERVISED_BATCH = 250;
 
-    static void process_game(GameState& state, size_t& train_pos, int who_won,
-                             const std::vector<int>& tree_moves,
-                             OutputChunker& outchunker);
+    // The training records for one game of an SGF collection, with
+    // positions picked by a generator seeded from seed.
+    static std::vector<std::string> supervised_game(const char* sgf,
+                                                    size_t length,
+                                                    std::uint64_t seed);
+    static std::vector<std::string> process_game(
+        GameState& state, int who_won, const std::vector<int>& tree_moves,
+        std::uint64_t seed);
     static void dump_training(int winner_color,
                               OutputChunker& outchunker);
+    static std::string text_record(const TimeStep& step, int winner_color);
+    static std::string binary_record(const TimeStep& step, int winner_color);
     static void dump_debug(OutputChunker& outchunker);
-    static std::vector<TimeStep> m_data;
+
+    // A TimeStep as it is kept in the steps file.
+    struct StoredStep {
+        std::array<std::array<std::uint8_t, PLANE_BYTES>, 16> planes;
+        std::array<float, POTENTIAL_MOVES> probabilities;
+        std::int32_t to_move;
+        float net_winrate;
+        float root_uct_winrate;
+        float child_uct_winrate;
+        std::int32_t bestmove_visits;
+    };
+    static void pack_plane(const Network::BoardPlane& plane,
+                           std::uint8_t* out);
+    static void store_step(const TimeStep& step);
+    static TimeStep load_step(size_t index);
+
+    // The positions of the game go to a temporary file as they are
+    // recorded, so memory use doesn't grow with the game. A new game
+    // overwrites the records of the previous one. Every thread records
+    // its own game, see SelfPlay.
+    static thread_local std::FILE* m_steps_file;
+    static thread_local size_t m_step_count;
 };
 
 #endif
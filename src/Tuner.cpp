@@ -19,18 +19,26 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <map>
+#include <mutex>
 #include <random>
 #include <cmath>
 #include <fstream>
+#include <thread>
 
 #include "GTP.h"
 #include "OpenCL.h"
+#include "SMP.h"
 #include "Tuner.h"
 #include "Utils.h"
 #include "Random.h"
@@ -46,10 +54,37 @@
 #endif
 
 const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
+#ifdef USE_HALF
+// Mean squared error. Half precision accumulation over a few hundred
+// channels alone gives errors around 1e-2, broken kernels give garbage.
+constexpr auto MAX_ERROR = 1e-1f;
+constexpr auto SGEMM_KERNEL_TAG = "XgemmBatchedHalf";
+#else
 constexpr auto MAX_ERROR = 1e-4f;
+constexpr auto SGEMM_KERNEL_TAG = "XgemmBatched";
+#endif
+
+// Kernels left after ranking them by one run, see tune_sgemm.
+constexpr auto MAX_FINALISTS = size_t{16};
+
+// GPUs tuning at the same time would lose each other's results, and an
+// export must not read a half-written file.
+static std::mutex tuning_file_mutex;
 
 using namespace Utils;
 
+namespace {
+
+// A configuration that built, with its timings so far.
+struct Candidate {
+    int index;
+    cl::Kernel kernel;
+    double time_sum;
+    int runs;
+};
+
+}
+
 static void sgemmBatched_ref(const std::vector<float>& a,
                              const std::vector<float>& b,
                              std::vector<float>& c,
@@ -151,6 +186,12 @@ std::string Tuner::parameters_to_string(const Parameters& p) {
     return s;
 }
 
+static std::vector<device_net_t> to_device(const std::vector<float>& x) {
+    auto result = std::vector<device_net_t>(x.size());
+    std::transform(begin(x), end(x), begin(result), to_device_net_t);
+    return result;
+}
+
 static size_t next_power_of_two(const size_t x) {
     return 2 << (size_t)(std::ceil(std::log2(x)) - 1);
 }
@@ -225,8 +266,14 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
             {"MDIMA", {8, 16, 32}},
             {"NDIMB", {8, 16, 32}},
             {"KWI", {2}},
+#ifdef USE_HALF
+            // Half vectors are half as wide, so wider loads are cheap.
+            {"VWM", {1, 2, 4, 8}},
+            {"VWN", {1, 2, 4, 8}},
+#else
             {"VWM", {1, 2, 4}},
             {"VWN", {1, 2, 4}},
+#endif
             {"STRM", {0}},
             {"STRN", {0}},
             {"SA", {0, 1}},
@@ -258,15 +305,17 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
     sgemmBatched_ref(at, b, c_ref, m, n, k, batch_size);
 
+    auto c_device = std::vector<device_net_t>(c_size);
+
     auto aBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * at_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, sizeof(device_net_t) * at_size, nullptr, nullptr);
     auto bBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * b_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, sizeof(device_net_t) * b_size, nullptr, nullptr);
     auto cBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * c_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, sizeof(device_net_t) * c_size, nullptr, nullptr);
 
     myprintf("\nStarted OpenCL SGEMM tuner.\n");
 
@@ -292,75 +341,60 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
     }
     myprintf("Will try %zu valid configurations.\n", valid_params.size());
 
-    std::string best_params;
-    auto best_time = unsigned{0};
-
     auto queue = cl::CommandQueue(m_context,
                                   m_device,
                                   CL_QUEUE_PROFILING_ENABLE);
     auto event = cl::Event();
-    auto program = cl::Program(m_context, sourceCode_sgemm);
 
     auto m_ceil_prev = 0;
     auto n_ceil_prev = 0;
     auto k_ceil_prev = 0;
-    auto param_counter = size_t{0};
-
-    for (const auto& i : valid_params) {
-        param_counter++;
-
-        auto p = get_parameters_by_int(opts, i);
-        auto defines = parameters_to_defines(p);
-
-        try {
-            auto args = m_opencl.m_cl_args + " " + defines;
-            program.build(args.c_str());
-        } catch (const cl::Error&) {
-            // Failed to compile, get next parameter
-            continue;
-        }
-
-        auto sgemm_kernel = cl::Kernel(program, "XgemmBatched");
 
+    // Adds the time of runs launches to the candidate. False if the
+    // kernel fails or computes the wrong result.
+    const auto time_kernel = [&](Candidate& candidate, const int runs) {
+        auto p = get_parameters_by_int(opts, candidate.index);
         auto m_ceil = (int)lcm(lcm(m, p["MWG"]), p["VWM"]);
         auto n_ceil = (int)lcm(lcm(n, p["NWG"]), p["VWN"]);
         auto k_ceil = (int)lcm(lcm(k, p["KWG"]), p["VWM"]);
 
-        if (m_ceil != m_ceil_prev
-            || n_ceil != n_ceil_prev
-            || k_ceil != k_ceil_prev) {
-            m_ceil_prev = m_ceil;
-            n_ceil_prev = n_ceil;
-            k_ceil_prev = k_ceil;
-
-            sgemm_generate_data(at, k, m, batch_size, k_ceil, m_ceil);
-            sgemm_generate_data(b, n, k, batch_size, n_ceil, k_ceil);
-
-            queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0,
-                                     at_size * sizeof(float), at.data());
-            queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0,
-                                     b_size * sizeof(float), b.data());
-            queue.finish();
-        }
-
-        sgemm_kernel.setArg(0, m_ceil);
-        sgemm_kernel.setArg(1, n_ceil);
-        sgemm_kernel.setArg(2, k_ceil);
-        sgemm_kernel.setArg(3, aBuffer);
-        sgemm_kernel.setArg(4, bBuffer);
-        sgemm_kernel.setArg(5, cBuffer);
+        try {
+            if (m_ceil != m_ceil_prev
+                || n_ceil != n_ceil_prev
+                || k_ceil != k_ceil_prev) {
+                m_ceil_prev = m_ceil;
+                n_ceil_prev = n_ceil;
+                k_ceil_prev = k_ceil;
+
+                sgemm_generate_data(at, k, m, batch_size, k_ceil, m_ceil);
+                sgemm_generate_data(b, n, k, batch_size, n_ceil, k_ceil);
+
+                auto at_device = to_device(at);
+                auto b_device = to_device(b);
+                queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0,
+                                         at_size * sizeof(device_net_t),
+                                         at_device.data());
+                queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0,
+                                         b_size * sizeof(device_net_t),
+                                         b_device.data());
+                queue.finish();
+            }
 
-        cl::NDRange local_sgemm = {p["MDIMC"], p["NDIMC"], 1};
+            auto& sgemm_kernel = candidate.kernel;
+            sgemm_kernel.setArg(0, m_ceil);
+            sgemm_kernel.setArg(1, n_ceil);
+            sgemm_kernel.setArg(2, k_ceil);
+            sgemm_kernel.setArg(3, aBuffer);
+            sgemm_kernel.setArg(4, bBuffer);
+            sgemm_kernel.setArg(5, cBuffer);
 
+            cl::NDRange local_sgemm = {p["MDIMC"], p["NDIMC"], 1};
 
-        cl::NDRange size_sgemm = {(m_ceil * p["MDIMC"]) / p["MWG"],
-                                  (n_ceil * p["NDIMC"]) / p["NWG"],
-                                  (size_t)batch_size};
+            cl::NDRange size_sgemm = {(m_ceil * p["MDIMC"]) / p["MWG"],
+                                      (n_ceil * p["NDIMC"]) / p["NWG"],
+                                      (size_t)batch_size};
 
-        auto sum = 0.0f;
-        auto max_error = 0.0f;
-        for (auto r = 0; r < runs; r++) {
-            try {
+            for (auto r = 0; r < runs; r++) {
                 queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
                                            size_sgemm, local_sgemm,
                                            nullptr, &event);
@@ -368,91 +402,315 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
                 event.wait();
 
                 queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0,
-                                        c_size * sizeof(float), c.data());
+                                        c_size * sizeof(device_net_t),
+                                        c_device.data());
                 queue.finish();
+                std::transform(begin(c_device), end(c_device), begin(c),
+                               from_device_net_t);
 
                 auto this_error = compare_ref(c, c_ref, n, m, batch_size,
                                               n_ceil, m_ceil);
-                max_error = std::max(max_error, this_error);
+                if (this_error >= MAX_ERROR) {
+                    return false;
+                }
 
                 auto elapsed =
                     event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
                     event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
 
-                sum += elapsed;
+                candidate.time_sum += elapsed;
+                candidate.runs++;
+            }
+        } catch (const cl::Error&) {
+            // Failed to enqueue kernel.
+            return false;
+        }
+        return true;
+    };
+
+    const auto print_candidate = [&](const Candidate& candidate) {
+        auto param_str =
+            parameters_to_string(get_parameters_by_int(opts, candidate.index));
+        auto mean = candidate.time_sum / candidate.runs;
+        auto kernel_ms = 1e-6 * mean;
+        // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
+        auto kernel_gflops = total_flops / mean;
+        myprintf("%s %.4f ms (%.1f GFLOPS)\n",
+                 param_str.c_str(), kernel_ms, kernel_gflops);
+    };
+
+    // Building the kernels takes much longer than running them, so all
+    // cores build while this thread times the kernels that are ready.
+    struct Built {
+        int index;
+        bool ok;
+        cl::Kernel kernel;
+    };
+    std::mutex built_mutex;
+    std::condition_variable built_cv;
+    auto built = std::deque<Built>{};
+    std::atomic<size_t> next_build{0};
+    auto stop_building = false;
+    auto builders_done = size_t{0};
+    const auto num_builders = size_t(std::max(1, SMP::get_num_cpus()));
+    const auto max_built = 2 * num_builders;
+
+    const auto builder = [&]() {
+        for (;;) {
+            const auto build = next_build++;
+            if (build >= valid_params.size() || m_opencl.m_tuner_cancel) {
+                break;
+            }
+            auto result = Built{valid_params[build], false, cl::Kernel()};
+            auto defines =
+                parameters_to_defines(get_parameters_by_int(opts,
+                                                            result.index));
+            try {
+                auto program = cl::Program(m_context, sourceCode_sgemm);
+                auto args = m_opencl.m_cl_args + " " + defines;
+                program.build(args.c_str());
+                result.kernel = cl::Kernel(program, "XgemmBatched");
+                result.ok = true;
             } catch (const cl::Error&) {
-                // Failed to enqueue kernel. Set error to max.
-                max_error = MAX_ERROR;
+                // Failed to compile, it gets skipped.
+            }
+
+            std::unique_lock<std::mutex> lock(built_mutex);
+            built_cv.wait(lock, [&]() {
+                return built.size() < max_built || stop_building;
+            });
+            if (stop_building) {
                 break;
             }
+            built.emplace_back(std::move(result));
+            built_cv.notify_all();
         }
-        if (max_error < MAX_ERROR && (best_time == 0 || sum < best_time)) {
-            auto param_str = parameters_to_string(p);
-            auto kernel_ms = 1e-6f * (sum / runs);
-            // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
-            auto kernel_gflops = total_flops / (sum / runs);
-            myprintf("(%u/%u) %s %.4f ms (%.1f GFLOPS)\n",
-               param_counter, valid_params.size(), param_str.c_str(),
-               kernel_ms, kernel_gflops);
-            best_time = sum;
-            best_params = defines;
+        std::lock_guard<std::mutex> lock(built_mutex);
+        builders_done++;
+        built_cv.notify_all();
+    };
+    auto builders = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < num_builders; i++) {
+        builders.emplace_back(builder);
+    }
+
+    // Successive halving: one run of every kernel ranks them, the best
+    // go on with runs more at a time, and the slower half of those
+    // drops out after every round. Only the finalists keep a kernel.
+    auto finalists = std::vector<Candidate>{};
+    const auto faster = [](const Candidate& a, const Candidate& b) {
+        return a.time_sum / a.runs < b.time_sum / b.runs;
+    };
+    auto param_counter = size_t{0};
+    for (;;) {
+        std::unique_lock<std::mutex> lock(built_mutex);
+        built_cv.wait(lock, [&]() {
+            return !built.empty() || builders_done == num_builders;
+        });
+        // The OpenCL object is going away, see ~OpenCL().
+        if (built.empty() || m_opencl.m_tuner_cancel) {
+            stop_building = true;
+            built_cv.notify_all();
+            break;
         }
+        auto next = std::move(built.front());
+        built.pop_front();
+        built_cv.notify_all();
+        lock.unlock();
+
+        param_counter++;
+        if (!next.ok) {
+            continue;
+        }
+        auto candidate = Candidate{next.index, std::move(next.kernel), 0.0, 0};
+        if (!time_kernel(candidate, 1)) {
+            continue;
+        }
+        if (finalists.empty() || faster(candidate, finalists.front())) {
+            myprintf("(%zu/%zu) ", param_counter, valid_params.size());
+            print_candidate(candidate);
+        }
+        const auto pos = std::upper_bound(begin(finalists), end(finalists),
+                                          candidate, faster);
+        if (size_t(pos - begin(finalists)) < MAX_FINALISTS) {
+            finalists.insert(pos, std::move(candidate));
+            if (finalists.size() > MAX_FINALISTS) {
+                finalists.pop_back();
+            }
+        }
+    }
+    for (auto& thread : builders) {
+        thread.join();
     }
-    if (best_time == 0) {
+    if (m_opencl.m_tuner_cancel) {
+        return "";
+    }
+
+    while (finalists.size() > 1) {
+        finalists.erase(std::remove_if(begin(finalists), end(finalists),
+                                       [&](Candidate& candidate) {
+                                           return !time_kernel(candidate,
+                                                               runs);
+                                       }),
+                        end(finalists));
+        std::sort(begin(finalists), end(finalists), faster);
+        finalists.resize((finalists.size() + 1) / 2);
+    }
+
+    if (finalists.empty()) {
         printf("Failed to find a working configuration.\nCheck your OpenCL drivers.\n");
         throw std::runtime_error("Tuner failed to find working configuration.");
     }
-    return best_params;
+    myprintf("Best of %zu runs: ", size_t(finalists.front().runs));
+    print_candidate(finalists.front());
+    return parameters_to_defines(get_parameters_by_int(opts,
+                                                       finalists.front().index));
 }
 
-void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
-                               const int batch_size, std::string tuners) {
-    auto file_contents = std::vector<std::string>();
-    {
-        // Read the previous contents to string
-        auto file = std::ifstream{TUNER_FILE_LOCAL};
-        if (file.good()) {
-            auto line = std::string{};
-            while (std::getline(file, line)) {
-                file_contents.emplace_back(line);
-            }
-        }
+// A tuning line is
+// version;kernel;m;n;k;batch_size;parameters;device name;driver version
+// where the kernel tag also encodes the precision and n the number of
+// positions per network batch.  Version 0 lines lack the driver.
+static std::vector<std::string> split_tuning_line(const std::string& line) {
+    auto s = std::vector<std::string>{};
+    auto ss = std::stringstream{line};
+    auto item = std::string{};
+
+    while (std::getline(ss, item, ';')) {
+        s.emplace_back(item);
     }
-    auto file = std::ofstream{TUNER_FILE_LOCAL};
+    return s;
+}
 
-    auto device_name = m_opencl.get_device_name();
-    auto tuning_params = std::stringstream{};
-    tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
+// Everything but the parameters identifies an entry.
+static std::string tuning_line_key(const std::string& line) {
+    auto s = split_tuning_line(line);
+    if (s.size() < 8) {
+        return "";
+    }
+    s.erase(begin(s) + 6);
+    auto key = std::string{};
+    for (const auto& item : s) {
+        key += item + ";";
+    }
+    return key;
+}
 
-    auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";XgemmBatched;"
-        + tuning_params.str() + ";";
-    auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
+static std::vector<std::string> read_tuning_file(const std::string& filename) {
+    auto lines = std::vector<std::string>{};
+    auto file = std::ifstream{filename};
+    auto line = std::string{};
+    while (std::getline(file, line)) {
+        lines.emplace_back(line);
+    }
+    return lines;
+}
 
-    // Write back previous data as long as it's not the device and
-    // tuning we just tuned
-    for (const auto& line: file_contents) {
-        if (line.find(tuning_line_prefix) == std::string::npos
-            || line.find(device_name) == std::string::npos) {
-            file << line << std::endl;
+// Replaces the entries of lines that have the same key as one of
+// new_lines, then appends new_lines.
+static void merge_tuning_lines(std::vector<std::string>& lines,
+                               const std::vector<std::string>& new_lines) {
+    for (const auto& new_line : new_lines) {
+        const auto key = tuning_line_key(new_line);
+        if (key.empty()) {
+            continue;
         }
+        lines.erase(std::remove_if(begin(lines), end(lines),
+                                   [&key](const std::string& line) {
+                                       return tuning_line_key(line) == key;
+                                   }),
+                    end(lines));
+        lines.emplace_back(new_line);
     }
+}
+
+static void write_tuning_file(const std::string& filename,
+                              const std::vector<std::string>& lines) {
+    auto file = std::ofstream{filename};
+    for (const auto& line : lines) {
+        file << line << std::endl;
+    }
+}
+
+void Tuner::import_database(const std::string& filename) {
+    auto imported = read_tuning_file(filename);
+    if (imported.empty()) {
+        myprintf("No tuning entries found in %s.\n", filename.c_str());
+        return;
+    }
+    auto lines = read_tuning_file(TUNER_FILE_LOCAL);
+    merge_tuning_lines(lines, imported);
+    write_tuning_file(TUNER_FILE_LOCAL, lines);
+    myprintf("Imported %zu tuning entries from %s.\n",
+             imported.size(), filename.c_str());
+}
+
+void Tuner::export_database(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(tuning_file_mutex);
+    const auto lines = read_tuning_file(TUNER_FILE_LOCAL);
+    write_tuning_file(filename, lines);
+    myprintf("Exported %zu tuning entries to %s.\n",
+             lines.size(), filename.c_str());
+}
+
+std::string Tuner::get_driver_version() {
+    return m_device.getInfo<CL_DRIVER_VERSION>();
+}
+
+void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
+                               const int batch_size, std::string tuners) {
+    std::lock_guard<std::mutex> lock(tuning_file_mutex);
+    auto lines = read_tuning_file(TUNER_FILE_LOCAL);
 
-    // Write new tuning
-    file << tuning_line << std::endl;
+    auto tuning_line = std::stringstream{};
+    tuning_line << TUNER_VERSION << ";" << SGEMM_KERNEL_TAG << ";"
+                << m << ";" << n << ";" << k << ";" << batch_size << ";"
+                << tuners << ";" << m_opencl.get_device_name() << ";"
+                << get_driver_version();
+
+    merge_tuning_lines(lines, {tuning_line.str()});
+    write_tuning_file(TUNER_FILE_LOCAL, lines);
+}
+
+std::string Tuner::tune_and_store(const int m, const int n, const int k,
+                                  const int batch_size) {
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_future<std::string>> tunings;
+
+    const auto key = m_opencl.get_device_name() + ";" + get_driver_version()
+        + ";" + std::to_string(m) + ";" + std::to_string(n)
+        + ";" + std::to_string(k) + ";" + std::to_string(batch_size);
+    auto promise = std::promise<std::string>{};
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto it = tunings.find(key);
+        if (it != end(tunings)) {
+            auto tuning = it->second;
+            lock.unlock();
+            myprintf("Waiting for the SGEMM tuning of an identical device.\n");
+            return tuning.get();
+        }
+        tunings.emplace(key, promise.get_future().share());
+    }
+    try {
+        auto tuners = tune_sgemm(m, n, k, batch_size);
+        if (!tuners.empty()) {
+            store_sgemm_tuners(m, n, k, batch_size, tuners);
+        }
+        promise.set_value(tuners);
+        return tuners;
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+        throw;
+    }
 }
 
 std::string Tuner::sgemm_tuners_from_line(std::string line,
                                           const int m, const int n, const int k,
                                           const int batch_size) {
-    auto s = std::vector<std::string>{};
-    auto ss = std::stringstream{line};
-    auto item = std::string{};
+    auto s = split_tuning_line(line);
 
-    while (std::getline(ss, item, ';')) {
-        s.emplace_back(item);
-    }
-
-    if (s.size() != 8) {
+    if (s.size() != 9) {
         return "";
     }
 
@@ -460,7 +718,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         return "";
     }
 
-    if (s[1] != "XgemmBatched") {
+    if (s[1] != SGEMM_KERNEL_TAG) {
         return "";
     }
 
@@ -484,15 +742,41 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         return "";
     }
 
+    if (s[8] != get_driver_version()) {
+        return "";
+    }
+
     return s[6];
 }
 
+std::string Tuner::default_sgemm_tuners(const std::vector<std::string>& lines) {
+    // Any earlier tuning of this device, even one for another driver or
+    // batch size, beats guessing.
+    const auto device_name = m_opencl.get_device_name();
+    for (auto it = lines.crbegin(); it != lines.crend(); ++it) {
+        const auto s = split_tuning_line(*it);
+        if (s.size() >= 8 && s[1] == SGEMM_KERNEL_TAG
+            && s[7] == device_name) {
+            return s[6];
+        }
+    }
+    // Small work groups, no local memory and no vector loads, which
+    // every OpenCL device can run.
+    auto p = Parameters{
+        {"MWG", 16}, {"NWG", 16}, {"KWG", 16},
+        {"MDIMC", 8}, {"NDIMC", 8}, {"MDIMA", 8}, {"NDIMB", 8},
+        {"KWI", 2}, {"VWM", 1}, {"VWN", 1},
+        {"STRM", 0}, {"STRN", 0}, {"SA", 0}, {"SB", 0},
+    };
+    assert(valid_config_sgemm(p, false));
+    return parameters_to_defines(p);
+}
+
 std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
                                      const int batch_size) {
-    auto file = std::ifstream{TUNER_FILE_LOCAL};
-    if (!cfg_sgemm_exhaustive && file.good()) {
-        auto line = std::string{};
-        while (std::getline(file, line)) {
+    const auto lines = read_tuning_file(TUNER_FILE_LOCAL);
+    if (!cfg_sgemm_exhaustive) {
+        for (const auto& line : lines) {
             auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
             if (tuners.size() != 0) {
                 myprintf("Loaded existing SGEMM tuning.\n");
@@ -500,9 +784,30 @@ std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
             }
         }
     }
-    auto tuners = tune_sgemm(m, n, k, batch_size);
-    store_sgemm_tuners(m, n, k, batch_size, tuners);
-    return tuners;
+    if (cfg_tune_background && !cfg_tune_only) {
+        // Play with a known-good configuration right away.  The tuner gets
+        // its own copy of us and the result is picked up on the next start.
+        auto tuner = *this;
+        m_opencl.m_tuner_thread = std::thread([tuner, m, n, k, batch_size]()
+                                              mutable {
+            try {
+                auto tuners = tuner.tune_and_store(m, n, k, batch_size);
+                if (!tuners.empty()) {
+                    myprintf("Background SGEMM tuning done, "
+                             "it will be used from the next start.\n");
+                    // The export at startup didn't have it yet.
+                    if (!cfg_tuner_export.empty()) {
+                        Tuner::export_database(cfg_tuner_export);
+                    }
+                }
+            } catch (const std::exception& e) {
+                myprintf("Background SGEMM tuning failed: %s\n", e.what());
+            }
+        });
+        myprintf("Using default SGEMM tuning, tuning in the background.\n");
+        return default_sgemm_tuners(lines);
+    }
+    return tune_and_store(m, n, k, batch_size);
 }
 
 #endif
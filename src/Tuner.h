@@ -34,17 +34,31 @@ class Tuner {
     cl::Context m_context;
     cl::Device m_device;
 public:
+    // Builds the candidate kernels on all cores and prunes them by
+    // successive halving, the finalists get runs runs per round.
     std::string tune_sgemm(const int m, const int n, const int k,
                            const int batch_size, const int runs = 4);
     std::string load_sgemm_tuners(const int m, const int n, const int k,
                                   const int batch_size);
 
-    static constexpr auto TUNER_VERSION = 0;
+    // Merge the entries of a tuning file into the local one, entries
+    // from the file win.
+    static void import_database(const std::string& filename);
+    // Copy the local tuning file.
+    static void export_database(const std::string& filename);
+
+    static constexpr auto TUNER_VERSION = 1;
     Tuner(OpenCL & opencl, cl::Context context, cl::Device device) :
         m_opencl(opencl), m_context(context), m_device(device) {}
 private:
+    // Tunes and stores the result. Devices of the same model and driver
+    // tune only once, the others wait for that result.
+    std::string tune_and_store(const int m, const int n, const int k,
+                               const int batch_size);
     void store_sgemm_tuners(const int m, const int n, const int k,
                             const int batch_size, std::string tuners);
+    std::string get_driver_version();
+    std::string default_sgemm_tuners(const std::vector<std::string>& lines);
     bool valid_config_sgemm(Parameters p, bool exhaustive);
     std::string parameters_to_defines(const Parameters& p);
     std::string parameters_to_string(const Parameters& p);
@@ -18,9 +18,12 @@
 
 #include "config.h"
 
+#include <array>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
 #include <cmath>
 #include <functional>
@@ -40,52 +43,90 @@
 #include "KoState.h"
 #include "Network.h"
 #include "Random.h"
+#include "Speculator.h"
+#include "UCTNodeArena.h"
 #include "Utils.h"
 
 using namespace Utils;
 
+constexpr size_t UCTNode::EDGE_BYTES;
+
+UCTNodePointer::UCTNodePointer(std::int16_t vertex, float score) {
+    auto score_bits = std::uint32_t{0};
+    std::memcpy(&score_bits, &score, sizeof(score_bits));
+    m_data = (std::uint64_t{score_bits} << 32)
+             | (std::uint64_t{static_cast<std::uint16_t>(vertex)} << 16)
+             | INLINE_TAG;
+}
+
+UCTNodePointer::UCTNodePointer(UCTNode* node)
+    : m_data(reinterpret_cast<std::uint64_t>(node)) {
+    assert(is_inflated());
+}
+
+UCTNode* UCTNodePointer::inflate(UCTNodeArena& arena, float init_eval) {
+    auto data = m_data.load();
+    if (!(data & INLINE_TAG)) {
+        return reinterpret_cast<UCTNode*>(data);
+    }
+    auto node = arena.create<UCTNode>(inline_move(data), inline_score(data),
+                                      init_eval);
+    if (node == nullptr) {
+        return nullptr;
+    }
+    auto node_data = reinterpret_cast<std::uint64_t>(node);
+    if (!m_data.compare_exchange_strong(data, node_data)) {
+        // Someone else inflated it first. Our copy just stays unused
+        // in the arena.
+        return reinterpret_cast<UCTNode*>(data);
+    }
+    return node;
+}
+
+void UCTNodePointer::set_score(float score) {
+    auto node = get();
+    if (node != nullptr) {
+        node->set_score(score);
+    } else {
+        *this = UCTNodePointer(inline_move(m_data), score);
+    }
+}
+
 UCTNode::UCTNode(int vertex, float score, float init_eval)
     : m_move(vertex), m_score(score), m_init_eval(init_eval) {
 }
 
 bool UCTNode::first_visit() const {
-    return m_visits == 0;
+    return get_visits() == 0;
 }
 
-SMP::Mutex& UCTNode::get_mutex() {
-    return m_nodemutex;
-}
-
-bool UCTNode::create_children(std::atomic<int> & nodecount,
-                              GameState & state,
+bool UCTNode::create_children(UCTNodeArena & arena,
+                              std::atomic<int> & nodecount,
+                              KoState & state,
                               float & eval) {
     // check whether somebody beat us to it (atomic)
     if (has_children()) {
         return false;
     }
-    // acquire the lock
-    LOCK(get_mutex(), lock);
     // no successors in final state
     if (state.get_passes() >= 2) {
         return false;
     }
-    // check whether somebody beat us to it (after taking the lock)
-    if (has_children()) {
-        return false;
-    }
-    // Someone else is running the expansion
-    if (m_is_expanding) {
+    // We'll be the one queueing this node for expansion, unless someone
+    // else already is. Nobody waits for the expansion to finish, see
+    // is_expanding.
+    auto expanding = false;
+    if (!m_is_expanding.compare_exchange_strong(expanding, true)) {
         return false;
     }
-    // We'll be the one queueing this node for expansion, stop others
-    m_is_expanding = true;
-    lock.unlock();
 
-    const auto raw_netlist = Network::get_scored_moves(
-        &state, Network::Ensemble::RANDOM_ROTATION);
+    const auto raw_netlist = cfg_symmetries > 1
+        ? Network::get_scored_moves(&state, Network::Ensemble::AVERAGE)
+        : Network::get_scored_moves(&state,
+                                    Network::Ensemble::RANDOM_ROTATION);
 
     // DCNN returns winrate as side to move
-    auto net_eval = raw_netlist.second;
+    auto net_eval = raw_netlist.winrate;
     const auto to_move = state.board.get_to_move();
     // our search functions evaluate from black's point of view
     if (state.board.white_to_move()) {
@@ -93,80 +134,170 @@ bool UCTNode::create_children(std::atomic<int> & nodecount,
     }
     eval = net_eval;
 
-    std::vector<Network::scored_node> nodelist;
-
+    // The legal moves, in one pass over the policy.
+    std::array<Network::scored_node, POTENTIAL_MOVES> nodelist;
+    auto count = size_t{0};
     auto legal_sum = 0.0f;
-    for (const auto& node : raw_netlist.first) {
-        auto vertex = node.second;
+    for (auto idx = 0; idx < POTENTIAL_MOVES; idx++) {
+        const auto vertex = idx == NUM_INTERSECTIONS
+            ? int{FastBoard::PASS}
+            : state.board.get_vertex(idx % BOARD_SIZE, idx / BOARD_SIZE);
         if (state.is_move_legal(to_move, vertex)) {
-            nodelist.emplace_back(node);
-            legal_sum += node.first;
+            nodelist[count++] = {raw_netlist.policy[idx], vertex};
+            legal_sum += raw_netlist.policy[idx];
         }
     }
 
     // If the sum is 0 or a denormal, then don't try to normalize.
     if (legal_sum > std::numeric_limits<float>::min()) {
         // re-normalize after removing illegal moves.
-        for (auto& node : nodelist) {
-            node.first /= legal_sum;
+        for (auto i = size_t{0}; i < count; i++) {
+            nodelist[i].first /= legal_sum;
         }
     }
 
-    link_nodelist(nodecount, nodelist, net_eval);
+    link_nodelist(arena, nodecount, nodelist.data(), count, net_eval);
+    if (cfg_speculate > 0) {
+        // link_nodelist sorted them best first.
+        Speculator::add(state, nodelist.data(),
+                        std::min(count, size_t(cfg_speculate)));
+    }
     return true;
 }
 
-void UCTNode::link_nodelist(std::atomic<int> & nodecount,
-                            std::vector<Network::scored_node> & nodelist,
+void UCTNode::link_nodelist(UCTNodeArena & arena,
+                            std::atomic<int> & nodecount,
+                            Network::scored_node* nodelist,
+                            const size_t count,
                             float init_eval) {
-    if (nodelist.empty()) {
+    if (count == 0) {
         return;
     }
 
     // Use best to worst order, so highest go first
-    std::stable_sort(rbegin(nodelist), rend(nodelist));
-
-    LOCK(get_mutex(), lock);
+    std::sort(nodelist, nodelist + count,
+              std::greater<Network::scored_node>());
+
+    // Children start out as bare edges, full nodes are only created
+    // when they are first visited.
+    auto children = allocate_children(arena, count);
+    if (children == nullptr) {
+        // Tree is full, stay a leaf.
+        m_is_expanding = false;
+        return;
+    }
 
-    m_children.reserve(nodelist.size());
-    for (const auto& node : nodelist) {
-        m_children.emplace_back(
-            std::make_unique<UCTNode>(node.second, node.first, init_eval)
-        );
+    for (auto i = size_t{0}; i < count; i++) {
+        const auto& node = nodelist[i];
+        new (&children[i]) UCTNodePointer(node.second, node.first);
     }
 
-    nodecount += m_children.size();
+    // Everything is in place before m_has_children tells the other
+    // threads to look at the children.
+    m_net_eval = init_eval;
+    m_children = children;
+    m_childcount = static_cast<std::uint16_t>(count);
+    m_childcapacity = m_childcount;
+    refresh_children();
+    nodecount += m_childcount;
     m_has_children = true;
 }
 
+UCTNodePointer* UCTNode::allocate_children(UCTNodeArena& arena,
+                                           size_t count) {
+    auto words = (count * EDGE_BYTES + sizeof(std::uint64_t) - 1)
+                 / sizeof(std::uint64_t);
+    auto block = arena.allocate<std::uint64_t>(words);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    // The edges are constructed by the caller.
+    auto children = reinterpret_cast<UCTNodePointer*>(block);
+    // Visits, black evals and priors.
+    auto floats = reinterpret_cast<std::atomic<float>*>(children + count);
+    auto virtual_losses = reinterpret_cast<std::atomic<std::int16_t>*>(
+        floats + 3 * count);
+    for (auto i = size_t{0}; i < 3 * count; i++) {
+        new (&floats[i]) std::atomic<float>(0.0f);
+    }
+    for (auto i = size_t{0}; i < count; i++) {
+        new (&virtual_losses[i]) std::atomic<std::int16_t>(0);
+    }
+    return children;
+}
+
+std::atomic<float>* UCTNode::child_visits() const {
+    return reinterpret_cast<std::atomic<float>*>(
+        m_children + m_childcapacity);
+}
+
+std::atomic<float>* UCTNode::child_blackevals() const {
+    return child_visits() + m_childcapacity;
+}
+
+std::atomic<float>* UCTNode::child_priors() const {
+    return child_blackevals() + m_childcapacity;
+}
+
+std::atomic<std::int16_t>* UCTNode::child_virtual_losses() const {
+    return reinterpret_cast<std::atomic<std::int16_t>*>(
+        child_priors() + m_childcapacity);
+}
+
+void UCTNode::refresh_child(int index) {
+    auto node = m_children[index].get();
+    auto stats = node ? node->m_stats.load() : 0;
+    child_visits()[index].store(static_cast<float>(unpack_visits(stats)),
+                                std::memory_order_relaxed);
+    child_blackevals()[index].store(
+        static_cast<float>(unpack_blackevals(stats)),
+        std::memory_order_relaxed);
+}
+
+void UCTNode::refresh_children() {
+    auto priors = child_priors();
+    auto virtual_losses = child_virtual_losses();
+    for (auto i = 0; i < m_childcount; i++) {
+        const auto& child = m_children[i];
+        refresh_child(i);
+        priors[i] = child.valid() ? child.get_score() : -1.0f;
+        virtual_losses[i] = 0;
+    }
+}
+
+void UCTNode::inflate_all_children(UCTNodeArena& arena) {
+    for (auto i = 0; i < m_childcount; i++) {
+        m_children[i].inflate(arena, m_net_eval);
+    }
+}
+
 void UCTNode::kill_superkos(const KoState& state) {
-    for (auto& child : m_children) {
-        auto move = child->get_move();
-        if (move != FastBoard::PASS) {
-            KoState mystate = state;
-            mystate.play_move(move);
-
-            if (mystate.superko()) {
-                // Don't delete nodes for now, just mark them invalid.
-                child->invalidate();
-            }
+    auto is_superko = [&state](const UCTNodePointer& child) {
+        auto move = child.get_move();
+        if (move == FastBoard::PASS) {
+            return false;
         }
-    }
+        KoState mystate = state;
+        mystate.play_move(move);
+        return mystate.superko();
+    };
 
-    // Now do the actual deletion.
-    m_children.erase(
-        std::remove_if(begin(m_children), end(m_children),
-                       [](const auto &child) { return !child->valid(); }),
-        end(m_children)
-    );
+    // Drop the edges. Any inflated nodes stay in the arena until the
+    // tree is discarded.
+    auto last = std::remove_if(m_children, m_children + m_childcount,
+                               is_superko);
+    m_childcount = static_cast<std::uint16_t>(last - m_children);
+    refresh_children();
 }
 
-float UCTNode::eval_state(GameState& state) {
+float UCTNode::eval_state(KoState& state) {
     auto raw_netlist = Network::get_scored_moves(
-        &state, Network::Ensemble::RANDOM_ROTATION, -1, true);
+        &state, cfg_symmetries > 1 ? Network::Ensemble::AVERAGE
+                                   : Network::Ensemble::RANDOM_ROTATION,
+        -1, true);
 
     // DCNN returns winrate as side to move
-    auto net_eval = raw_netlist.second;
+    auto net_eval = raw_netlist.winrate;
 
     // But we score from black's point of view
     if (state.board.white_to_move()) {
@@ -177,7 +308,7 @@ float UCTNode::eval_state(GameState& state) {
 }
 
 void UCTNode::dirichlet_noise(float epsilon, float alpha) {
-    auto child_cnt = m_children.size();
+    auto child_cnt = size_t{m_childcount};
 
     auto dirichlet_vector = std::vector<float>{};
     std::gamma_distribution<float> gamma(alpha, 1.0f);
@@ -199,19 +330,21 @@ void UCTNode::dirichlet_noise(float epsilon, float alpha) {
     }
 
     child_cnt = 0;
-    for (auto& child : m_children) {
-        auto score = child->get_score();
+    for (auto i = 0; i < m_childcount; i++) {
+        auto& child = m_children[i];
+        auto score = child.get_score();
         auto eta_a = dirichlet_vector[child_cnt++];
         score = score * (1 - epsilon) + epsilon * eta_a;
-        child->set_score(score);
+        child.set_score(score);
     }
+    refresh_children();
 }
 
 void UCTNode::randomize_first_proportionally() {
     auto accum = std::uint32_t{0};
     auto accum_vector = std::vector<decltype(accum)>{};
-    for (const auto& child : m_children) {
-        accum += child->get_visits();
+    for (const auto& child : get_children()) {
+        accum += child.get_visits();
         accum_vector.emplace_back(accum);
     }
 
@@ -229,37 +362,53 @@ void UCTNode::randomize_first_proportionally() {
         return;
     }
 
-    assert(m_children.size() >= index);
+    assert(m_childcount >= index);
 
     // Now swap the child at index with the first child
-    std::iter_swap(begin(m_children), begin(m_children) + index);
+    std::iter_swap(m_children, m_children + index);
+    refresh_children();
 }
 
 int UCTNode::get_move() const {
     return m_move;
 }
 
-void UCTNode::virtual_loss() {
-    m_virtual_loss += VIRTUAL_LOSS_COUNT;
+void UCTNode::virtual_loss(int index) {
+    child_virtual_losses()[index] += VIRTUAL_LOSS_COUNT;
 }
 
-void UCTNode::virtual_loss_undo() {
-    m_virtual_loss -= VIRTUAL_LOSS_COUNT;
+void UCTNode::virtual_loss_undo(int index) {
+    child_virtual_losses()[index] -= VIRTUAL_LOSS_COUNT;
+    // Another thread may store an older copy right after us, that is
+    // fixed up again by the next visit.
+    refresh_child(index);
+}
+
+void UCTNode::invalidate_child(int index) {
+    m_children[index]->invalidate();
+    child_priors()[index].store(-1.0f, std::memory_order_relaxed);
 }
 
 void UCTNode::update(float eval) {
-    m_visits++;
-    accumulate_eval(eval);
+    m_stats.fetch_add(pack_stats(1, eval));
+}
+
+void UCTNode::update(PendingStats& pending) {
+    if (pending.m_visits > 0) {
+        m_stats.fetch_add(pending.m_stats);
+    }
+    pending = PendingStats{};
 }
 
 bool UCTNode::has_children() const {
     return m_has_children;
 }
 
-void UCTNode::set_visits(int visits) {
-    m_visits = visits;
+bool UCTNode::is_expanding() const {
+    return m_is_expanding && !m_has_children && !m_terminal;
 }
 
+
 float UCTNode::get_score() const {
     return m_score;
 }
@@ -269,20 +418,43 @@ void UCTNode::set_score(float score) {
 }
 
 int UCTNode::get_visits() const {
-    return m_visits;
+    return unpack_visits(m_stats.load());
+}
+
+float UCTNode::get_net_eval(int tomove) const {
+    if (tomove == FastBoard::WHITE) {
+        return 1.0f - m_net_eval;
+    }
+    return m_net_eval;
+}
+
+bool UCTNode::get_terminal_eval(float& eval) const {
+    if (!m_terminal) {
+        return false;
+    }
+    eval = m_net_eval;
+    return true;
+}
+
+void UCTNode::set_terminal_eval(float eval) {
+    // Claimed like an expansion, so only one thread ever writes
+    // m_net_eval. Terminal nodes never get children, so nothing else
+    // takes it. The eval goes first, so whoever sees m_terminal also
+    // sees it.
+    auto expanding = false;
+    if (!m_is_expanding.compare_exchange_strong(expanding, true)) {
+        return;
+    }
+    m_net_eval = eval;
+    m_terminal = true;
 }
 
 float UCTNode::get_eval(int tomove) const {
-    // Due to the use of atomic updates and virtual losses, it is
-    // possible for the visit count to change underneath us. Make sure
-    // to return a consistent result to the caller by caching the values.
-    auto virtual_loss = int{m_virtual_loss};
-    auto visits = get_visits() + virtual_loss;
+    // Visits and evals are read in one go, so they always match up.
+    auto stats = m_stats.load();
+    auto visits = unpack_visits(stats);
     if (visits > 0) {
-        auto blackeval = get_blackevals();
-        if (tomove == FastBoard::WHITE) {
-            blackeval += static_cast<double>(virtual_loss);
-        }
+        auto blackeval = unpack_blackevals(stats);
         auto score = static_cast<float>(blackeval / (double)visits);
         if (tomove == FastBoard::WHITE) {
             score = 1.0f - score;
@@ -300,160 +472,410 @@ float UCTNode::get_eval(int tomove) const {
 }
 
 double UCTNode::get_blackevals() const {
-    return m_blackevals;
+    return unpack_blackevals(m_stats.load());
 }
 
-void UCTNode::set_blackevals(double blackevals) {
-    m_blackevals = blackevals;
+void UCTNode::set_stats(int visits, double blackevals) {
+    m_stats = pack_stats(visits, blackevals);
 }
 
-void UCTNode::accumulate_eval(float eval) {
-    atomic_add(m_blackevals, (double)eval);
+std::uint64_t UCTNode::get_stats() const {
+    return m_stats.load();
 }
 
-UCTNode* UCTNode::uct_select_child(int color) {
-    UCTNode* best = nullptr;
-    auto best_value = -1000.0f;
+void UCTNode::set_stats(std::uint64_t stats) {
+    m_stats = stats;
+}
+
+int UCTNode::uct_select_child(int color) {
+    const auto count = int{m_childcount};
+    const auto child_n = child_visits();
+    const auto child_w = child_blackevals();
+    const auto priors = child_priors();
+    const auto virtual_losses = child_virtual_losses();
 
-    LOCK(get_mutex(), lock);
+    // Take a snapshot of the children first. The atomic loads keep the
+    // compiler from vectorizing, the loops after this work on plain
+    // arrays and do get vectorized. Only the first count entries are
+    // used, so don't bother clearing them.
+    std::array<float, POTENTIAL_MOVES> visits;
+    std::array<float, POTENTIAL_MOVES> blackevals;
+    std::array<float, POTENTIAL_MOVES> vloss;
+    std::array<float, POTENTIAL_MOVES> psa;
+    for (auto i = 0; i < count; i++) {
+        visits[i] = child_n[i].load(std::memory_order_relaxed);
+        blackevals[i] = child_w[i].load(std::memory_order_relaxed);
+        vloss[i] = virtual_losses[i].load(std::memory_order_relaxed);
+        psa[i] = priors[i].load(std::memory_order_relaxed);
+    }
 
     // Count parentvisits.
     // We do this manually to avoid issues with transpositions.
-    auto parentvisits = size_t{0};
-    for (const auto& child : m_children) {
-        if (child->valid()) {
-            parentvisits += child->get_visits();
-        }
+    auto parentvisits = 0.0f;
+    for (auto i = 0; i < count; i++) {
+        parentvisits += (psa[i] >= 0.0f) ? visits[i] : 0.0f;
+    }
+    const auto numerator = std::sqrt(parentvisits);
+    const auto white = (color == FastBoard::WHITE);
+
+    // Children that were never visited get our own network eval
+    // as first-play-urgency.
+    auto unvisited_eval = m_net_eval;
+    if (white) {
+        unvisited_eval = 1.0f - unvisited_eval;
     }
-    auto numerator = static_cast<float>(std::sqrt((double)parentvisits));
 
-    for (const auto& child : m_children) {
-        if (!child->valid()) {
-            continue;
+    // Virtual losses count as a loss for the side to move.
+    std::array<float, POTENTIAL_MOVES> values;
+    for (auto i = 0; i < count; i++) {
+        auto total = visits[i] + vloss[i];
+        auto blackeval = blackevals[i] + (white ? vloss[i] : 0.0f);
+        auto winrate = blackeval / std::max(total, 1.0f);
+        winrate = white ? 1.0f - winrate : winrate;
+        winrate = total > 0.0f ? winrate : unvisited_eval;
+        auto puct = cfg_puct * psa[i] * (numerator / (1.0f + visits[i]));
+        values[i] = psa[i] >= 0.0f ? winrate + puct : -1000.0f;
+    }
+
+    // Find the best value first, that reduction vectorizes, then the
+    // first child that has it.
+    auto best_value = -1000.0f;
+    for (auto i = 0; i < count; i++) {
+        best_value = std::max(best_value, values[i]);
+    }
+    for (auto i = 0; i < count; i++) {
+        if (values[i] == best_value) {
+            return i;
         }
+    }
 
-        // get_eval() will automatically set first-play-urgency
-        auto winrate = child->get_eval(color);
-        auto psa = child->get_score();
-        auto denom = 1.0f + child->get_visits();
-        auto puct = cfg_puct * psa * (numerator / denom);
-        auto value = winrate + puct;
-        assert(value > -1000.0f);
-
-        if (value > best_value) {
-            best_value = value;
-            best = child.get();
+    assert(false);
+    return 0;
+}
+
+UCTNode* UCTNode::inflate_child(int index, UCTNodeArena& arena) {
+    return m_children[index].inflate(arena, m_net_eval);
+}
+
+double UCTNode::benchmark(int iterations) {
+    // Enough positions that they don't all fit in the cache, like the
+    // nodes a search passes through.
+    constexpr auto POSITIONS = 1024;
+
+    auto rng = Random{5489};
+    UCTNodeArena arena(size_t{64} << 20);
+    std::atomic<int> nodecount{0};
+    auto nodes = std::vector<UCTNode*>{};
+
+    for (auto n = 0; n < POSITIONS; n++) {
+        auto nodelist = std::vector<Network::scored_node>{};
+        auto prior_sum = 0.0f;
+        for (auto vertex = 0; vertex < POTENTIAL_MOVES; vertex++) {
+            auto prior = (1 + rng.randuint32(1000)) / 1000.0f;
+            nodelist.emplace_back(prior, vertex);
+            prior_sum += prior;
+        }
+        for (auto& node : nodelist) {
+            node.first /= prior_sum;
         }
+        auto node = arena.create<UCTNode>(FastBoard::PASS, 1.0f, 0.5f);
+        node->link_nodelist(arena, nodecount, nodelist.data(),
+                            nodelist.size(), 0.5f);
+
+        // Give the best few dozen children some visits, like a node
+        // that has been searched for a while.
+        for (auto i = 0; i < 40; i++) {
+            auto visits = 1 + static_cast<int>(rng.randuint32(1000));
+            auto eval = rng.randuint32(1000) / 1000.0;
+            node->inflate_child(i, arena)->set_stats(visits, visits * eval);
+        }
+        node->refresh_children();
+        nodes.emplace_back(node);
+    }
+
+    auto checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; i++) {
+        auto color = (i & 1) ? FastBoard::WHITE : FastBoard::BLACK;
+        checksum += nodes[i % POSITIONS]->uct_select_child(color);
     }
+    const auto end = std::chrono::steady_clock::now();
+    const auto seconds = std::chrono::duration<double>(end - start).count();
 
-    assert(best != nullptr);
-    return best;
+    const auto ns_each = seconds * 1e9 / std::max(iterations, 1);
+    myprintf("%d selections over %d children in %5.2f seconds -> "
+             "%.1f ns each, checksum %d\n",
+             iterations, POTENTIAL_MOVES, seconds, ns_each, checksum);
+    return ns_each;
 }
 
-class NodeComp : public std::binary_function<UCTNode::node_ptr_t&,
-                                             UCTNode::node_ptr_t&, bool> {
+class NodeComp : public std::binary_function<UCTNodePointer&,
+                                             UCTNodePointer&, bool> {
 public:
     NodeComp(int color) : m_color(color) {};
-    bool operator()(const UCTNode::node_ptr_t& a,
-                    const UCTNode::node_ptr_t& b) {
+    bool operator()(const UCTNodePointer& a,
+                    const UCTNodePointer& b) {
         // if visits are not same, sort on visits
-        if (a->get_visits() != b->get_visits()) {
-            return a->get_visits() < b->get_visits();
+        if (a.get_visits() != b.get_visits()) {
+            return a.get_visits() < b.get_visits();
         }
 
         // neither has visits, sort on prior score
-        if (a->get_visits() == 0) {
-            return a->get_score() < b->get_score();
+        if (a.get_visits() == 0) {
+            return a.get_score() < b.get_score();
         }
 
         // both have same non-zero number of visits
-        return a->get_eval(m_color) < b->get_eval(m_color);
+        return a.get_eval(m_color) < b.get_eval(m_color);
     }
 private:
     int m_color;
 };
 
 void UCTNode::sort_children(int color) {
-    LOCK(get_mutex(), lock);
-    std::stable_sort(begin(m_children), end(m_children), NodeComp(color));
-    std::reverse(begin(m_children), end(m_children));
+    std::stable_sort(m_children, m_children + m_childcount, NodeComp(color));
+    std::reverse(m_children, m_children + m_childcount);
+    refresh_children();
 }
 
-UCTNode& UCTNode::get_best_root_child(int color) {
-    LOCK(get_mutex(), lock);
-    assert(!m_children.empty());
+void UCTNode::focus_children(const std::vector<int>& moves) {
+    auto priors = child_priors();
+    for (auto i = 0; i < m_childcount; i++) {
+        const auto move = m_children[i].get_move();
+        if (std::find(begin(moves), end(moves), move) == end(moves)) {
+            priors[i] = -1.0f;
+        }
+    }
+}
+
+void UCTNode::clear_focus() {
+    refresh_children();
+}
+
+void UCTNode::seed_children(const std::vector<Seed>& seeds) {
+    auto visits = 1;
+    auto blackevals = double{m_net_eval};
+    for (auto i = 0; i < m_childcount; i++) {
+        const auto child = m_children[i].get();
+        if (child == nullptr || !child->valid()) {
+            continue;
+        }
+        const auto move = child->get_move();
+        const auto seed = std::find_if(begin(seeds), end(seeds),
+            [move](const Seed& s) { return s.move == move; });
+        if (seed != end(seeds) && seed->visits > child->get_visits()) {
+            child->set_stats(seed->visits, static_cast<double>(seed->visits)
+                                           * seed->blackeval);
+        }
+        visits += child->get_visits();
+        blackevals += child->get_blackevals();
+    }
+    if (visits > get_visits()) {
+        set_stats(visits, blackevals);
+    }
+    refresh_children();
+}
+
+UCTNode* UCTNode::get_best_root_child(int color) {
+    assert(m_childcount > 0);
 
-    return *(std::max_element(begin(m_children), end(m_children),
-                              NodeComp(color))->get());
+    return std::max_element(m_children, m_children + m_childcount,
+                            NodeComp(color))->get();
 }
 
 UCTNode* UCTNode::get_first_child() const {
-    if (m_children.empty()) {
+    if (m_childcount == 0) {
         return nullptr;
     }
-    return m_children.front().get();
+    return m_children[0].get();
 }
 
-const std::vector<UCTNode::node_ptr_t>& UCTNode::get_children() const {
-    return m_children;
+UCTNode::ChildList UCTNode::get_children() const {
+    return ChildList(m_children, m_childcount);
 }
 
-size_t UCTNode::count_nodes() const {
+size_t UCTNode::count_nodes(int min_visits) const {
     auto nodecount = size_t{0};
     if (m_has_children) {
-        nodecount += m_children.size();
-        for (auto& child : m_children) {
-            nodecount += child->count_nodes();
+        nodecount += m_childcount;
+        for (const auto& child : get_children()) {
+            if (child.is_inflated() && child->get_visits() >= min_visits) {
+                nodecount += child->count_nodes(min_visits);
+            }
         }
     }
     return nodecount;
 }
 
-// Use this version if you know the child is directly under the parent.
-UCTNode::node_ptr_t UCTNode::find_new_root(const int move) {
-    if (m_has_children) {
-        for (auto& child : m_children) {
-            if (child->get_move() == move) {
-                return std::move(child);
+UCTNode* UCTNode::copy_node_to(UCTNodeArena& arena) const {
+    auto node = arena.create<UCTNode>(m_move, m_score, m_init_eval);
+    if (node != nullptr) {
+        node->m_stats = m_stats.load();
+        node->m_valid = bool{m_valid};
+    }
+    return node;
+}
+
+UCTNode* UCTNode::copy_to(UCTNodeArena& arena, int min_visits) const {
+    auto node = copy_node_to(arena);
+    if (node != nullptr) {
+        copy_children_to(arena, *node, min_visits);
+    }
+    return node;
+}
+
+void UCTNode::copy_children_to(UCTNodeArena& arena, UCTNode& dst,
+                               int min_visits) const {
+    if (!m_has_children || m_childcount == 0) {
+        return;
+    }
+
+    auto children = allocate_children(arena, m_childcount);
+    if (children == nullptr) {
+        // Out of room, the copy stays a leaf that can be expanded again.
+        return;
+    }
+
+    // Copy all direct children before descending, so that if we run out
+    // of room it is the deepest parts of the tree that get lost.
+    for (auto i = 0; i < m_childcount; i++) {
+        const auto& src = m_children[i];
+        auto copy = UCTNodePointer(src.get_move(), src.get_score());
+        if (src.is_inflated() && src->get_visits() >= min_visits) {
+            auto node = src->copy_node_to(arena);
+            if (node != nullptr) {
+                copy = UCTNodePointer(node);
             }
         }
+        new (&children[i]) UCTNodePointer(copy);
+    }
+    for (auto i = 0; i < m_childcount; i++) {
+        if (m_children[i].is_inflated() && children[i].is_inflated()) {
+            m_children[i]->copy_children_to(arena, *children[i].get(),
+                                            min_visits);
+        }
+    }
+
+    dst.m_net_eval = m_net_eval;
+    dst.m_children = children;
+    dst.m_childcount = m_childcount;
+    dst.m_childcapacity = m_childcount;
+    dst.refresh_children();
+    dst.m_is_expanding = true;
+    dst.m_has_children = true;
+}
+
+void UCTNode::save(std::vector<SavedNode>& nodes,
+                   std::vector<SavedEdge>& edges, int min_visits) const {
+    const auto childcount = m_has_children ? m_childcount : 0;
+    auto node = SavedNode{};
+    node.stats = m_stats.load();
+    node.init_eval = m_init_eval;
+    node.net_eval = m_net_eval;
+    node.move = m_move;
+    node.childcount = childcount;
+    node.flags = (m_valid ? SAVED_VALID : 0)
+               | (m_terminal ? SAVED_TERMINAL : 0);
+    nodes.emplace_back(node);
+
+    // All the edges go first, the subtrees follow in the same order.
+    for (auto i = 0; i < childcount; i++) {
+        const auto& child = m_children[i];
+        auto edge = SavedEdge{};
+        edge.score = child.get_score();
+        edge.move = child.get_move();
+        edge.inflated = child.is_inflated()
+                        && child->get_visits() >= min_visits;
+        edges.emplace_back(edge);
+    }
+    for (auto i = 0; i < childcount; i++) {
+        const auto& child = m_children[i];
+        if (child.is_inflated() && child->get_visits() >= min_visits) {
+            child->save(nodes, edges, min_visits);
+        }
     }
-    // Can happen for example if we resigned. Return a clean
-    // root for the next game or position.
-    return std::make_unique<UCTNode>(FastBoard::PASS, 0.0f, 0.5f);
 }
 
-// Use this version if the child could be anywhere.
-// Also updates the GameState.
-// Gives up after searching the direct children.
-UCTNode::node_ptr_t UCTNode::find_new_root(const GameState& g_new,
-                                           GameState& g_curr) {
-    if (m_has_children) {
-        for (auto& child : m_children) {
-            auto move = child->get_move();
-            if (g_new.get_last_move() == move) {
-                g_curr.play_move(move);
-                if (g_curr.board.get_hash() == g_new.board.get_hash()) {
-                    return std::move(child);
-                }
-                g_curr.undo_move();
+static bool is_saved_move(const int move) {
+    return move >= FastBoard::PASS && move < FastBoard::MAXSQ;
+}
+
+UCTNode* UCTNode::restore(UCTNodeArena& arena, SavedTree& tree,
+                          float score) {
+    if (tree.nodes == tree.nodes_end) {
+        return nullptr;
+    }
+    const auto& saved = *tree.nodes++;
+    if (!is_saved_move(saved.move)
+        || saved.childcount > tree.edges_end - tree.edges) {
+        return nullptr;
+    }
+    auto node = arena.create<UCTNode>(saved.move, score, saved.init_eval);
+    if (node == nullptr) {
+        return nullptr;
+    }
+    node->m_stats = saved.stats;
+    node->m_net_eval = saved.net_eval;
+    node->m_valid = (saved.flags & SAVED_VALID) != 0;
+    node->m_terminal = (saved.flags & SAVED_TERMINAL) != 0;
+    if (saved.childcount == 0) {
+        return node;
+    }
+
+    auto children = allocate_children(arena, saved.childcount);
+    if (children == nullptr) {
+        return nullptr;
+    }
+    const auto edges = tree.edges;
+    tree.edges += saved.childcount;
+    for (auto i = 0; i < saved.childcount; i++) {
+        if (!is_saved_move(edges[i].move)) {
+            return nullptr;
+        }
+    }
+    for (auto i = 0; i < saved.childcount; i++) {
+        new (&children[i]) UCTNodePointer(edges[i].move, edges[i].score);
+    }
+    for (auto i = 0; i < saved.childcount; i++) {
+        if (edges[i].inflated) {
+            auto child = restore(arena, tree, edges[i].score);
+            if (child == nullptr || child->get_move() != edges[i].move) {
+                return nullptr;
             }
+            children[i] = UCTNodePointer(child);
         }
     }
 
-    // No match. Copy new GameState and create a new root.
-    g_curr = g_new;
-    return std::make_unique<UCTNode>(FastBoard::PASS, 0.0f, 0.5f);
+    node->m_children = children;
+    node->m_childcount = saved.childcount;
+    node->m_childcapacity = saved.childcount;
+    node->refresh_children();
+    node->m_is_expanding = true;
+    node->m_has_children = true;
+    return node;
+}
+
+// Find the child node reached by playing move from this position.
+UCTNode* UCTNode::find_new_root(const int move) {
+    if (m_has_children) {
+        for (const auto& child : get_children()) {
+            if (child.get_move() == move) {
+                return child.get();
+            }
+        }
+    }
+    // Can happen for example if we resigned.
+    return nullptr;
 }
 
 UCTNode* UCTNode::get_nopass_child(FastState& state) const {
-    for (const auto& child : m_children) {
+    for (const auto& child : get_children()) {
         /* If we prevent the engine from passing, we must bail out when
            we only have unreasonable moves to pick, like filling eyes.
            Note that this isn't knowledge isn't required by the engine,
            we require it because we're overruling its moves. */
-        if (child->m_move != FastBoard::PASS
-            && !state.board.is_eye(state.get_to_move(), child->m_move)) {
+        if (child.get_move() != FastBoard::PASS
+            && !state.board.is_eye(state.get_to_move(), child.get_move())) {
             return child.get();
         }
     }
@@ -22,13 +22,78 @@
 #include "config.h"
 
 #include <atomic>
-#include <limits>
-#include <memory>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include "GameState.h"
+#include "KoState.h"
 #include "Network.h"
-#include "SMP.h"
+#include "UCTNodeArena.h"
+
+class UCTNode;
+
+/*
+    A child edge of a UCTNode. Until the child is visited for the first
+    time this only holds the move and its policy prior, packed in one
+    word with the low bit set. After that it points to a full UCTNode
+    in the tree arena. Most children are never visited, so this keeps
+    the tree several times smaller than creating every child up front.
+*/
+class UCTNodePointer {
+public:
+    UCTNodePointer(std::int16_t vertex, float score);
+    explicit UCTNodePointer(UCTNode* node);
+    // Edges are only copied or sorted while no search is running.
+    UCTNodePointer(const UCTNodePointer& other) : m_data(other.m_data.load()) {}
+    UCTNodePointer& operator=(const UCTNodePointer& other) {
+        m_data = other.m_data.load();
+        return *this;
+    }
+
+    bool is_inflated() const {
+        return (m_data.load() & INLINE_TAG) == 0;
+    }
+    // nullptr if the child was never visited.
+    UCTNode* get() const {
+        auto data = m_data.load();
+        if (data & INLINE_TAG) {
+            return nullptr;
+        }
+        return reinterpret_cast<UCTNode*>(data);
+    }
+    UCTNode* operator->() const;
+    // Create the full node, unless someone already did. Returns nullptr
+    // if the arena is out of room.
+    UCTNode* inflate(UCTNodeArena& arena, float init_eval);
+
+    int get_move() const;
+    float get_score() const;
+    void set_score(float score);
+    int get_visits() const;
+    bool valid() const;
+    // Only valid for inflated children.
+    float get_eval(int tomove) const;
+
+private:
+    static constexpr auto INLINE_TAG = std::uint64_t{1};
+
+    static std::int16_t inline_move(std::uint64_t data) {
+        return static_cast<std::int16_t>((data >> 16) & 0xFFFF);
+    }
+    static float inline_score(std::uint64_t data) {
+        auto bits = static_cast<std::uint32_t>(data >> 32);
+        auto score = 0.0f;
+        std::memcpy(&score, &bits, sizeof(score));
+        return score;
+    }
+
+    // [63..32] prior as float, [31..16] move, [0] INLINE_TAG
+    // or a pointer to the inflated UCTNode.
+    std::atomic<std::uint64_t> m_data;
+};
 
 class UCTNode {
 public:
@@ -37,16 +102,74 @@ public:
     // search tree.
     static constexpr auto VIRTUAL_LOSS_COUNT = 3;
 
-    using node_ptr_t = std::unique_ptr<UCTNode>;
+    // Visits and the sum of black evals share one 64-bit word so that an
+    // update is a single fetch_add: [63..38] visits, [37..0] the eval sum
+    // in units of 1/EVAL_SCALE. Evals are at most 1, so the eval field can
+    // not carry into the visits as long as visits stay below 2^26.
+    static constexpr auto EVAL_BITS = 38;
+    static constexpr auto EVAL_SCALE = 4096.0;
+    // The search stops well before the visit field could overflow.
+    static constexpr auto MAX_VISITS = 1 << 25;
+
+    // Arena space taken by each child edge, see allocate_children.
+    static constexpr auto EDGE_BYTES = sizeof(UCTNodePointer)
+                                     + 3 * sizeof(std::atomic<float>)
+                                     + sizeof(std::atomic<std::int16_t>);
+
+    static std::uint64_t pack_stats(int visits, double blackevals) {
+        auto evals = static_cast<std::uint64_t>(blackevals * EVAL_SCALE + 0.5);
+        return (static_cast<std::uint64_t>(visits) << EVAL_BITS) + evals;
+    }
+    static int unpack_visits(std::uint64_t stats) {
+        return static_cast<int>(stats >> EVAL_BITS);
+    }
+    static double unpack_blackevals(std::uint64_t stats) {
+        auto evals = stats & ((std::uint64_t{1} << EVAL_BITS) - 1);
+        return static_cast<double>(evals) / EVAL_SCALE;
+    }
+
+    // Updates gathered by one search thread, so that busy nodes like the
+    // root are only written every so often instead of on every playout.
+    class PendingStats {
+    public:
+        void add(float eval) {
+            m_stats += pack_stats(1, eval);
+            m_visits++;
+        }
+        int get_visits() const { return m_visits; }
+    private:
+        friend class UCTNode;
+        std::uint64_t m_stats{0};
+        int m_visits{0};
+    };
+
+    // Non-owning view of the children of a node.
+    class ChildList {
+    public:
+        ChildList(UCTNodePointer const * first, size_t count)
+            : m_first(first), m_count(count) {}
+        UCTNodePointer const * begin() const { return m_first; }
+        UCTNodePointer const * end() const { return m_first + m_count; }
+        size_t size() const { return m_count; }
+        bool empty() const { return m_count == 0; }
+    private:
+        UCTNodePointer const * m_first;
+        size_t m_count;
+    };
 
     explicit UCTNode(int vertex, float score, float init_eval);
     UCTNode() = delete;
     ~UCTNode() = default;
     bool first_visit() const;
     bool has_children() const;
-    bool create_children(std::atomic<int>& nodecount,
-                         GameState& state, float& eval);
-    float eval_state(GameState& state);
+    // True while another thread is waiting for the network to expand
+    // this node.
+    bool is_expanding() const;
+    bool create_children(UCTNodeArena& arena, std::atomic<int>& nodecount,
+                         KoState& state, float& eval);
+    // Makes sure every child has a full node, needed at the root.
+    void inflate_all_children(UCTNodeArena& arena);
+    float eval_state(KoState& state);
     void kill_superkos(const KoState& state);
     void invalidate();
     bool valid() const;
@@ -55,55 +178,193 @@ public:
     float get_score() const;
     void set_score(float score);
     float get_eval(int tomove) const;
+    // The network's winrate for the position, from its expansion.
+    float get_net_eval(int tomove) const;
+    // The black eval of a game that ended here, once set_terminal_eval
+    // stored it on the first visit. False if it wasn't stored yet.
+    bool get_terminal_eval(float& eval) const;
+    void set_terminal_eval(float eval);
     double get_blackevals() const;
-    void set_visits(int visits);
-    void set_blackevals(double blacevals);
-    void accumulate_eval(float eval);
-    void virtual_loss(void);
-    void virtual_loss_undo(void);
+    void set_stats(int visits, double blackevals);
+    // Visits and evals packed as described at EVAL_BITS.
+    std::uint64_t get_stats() const;
+    void set_stats(std::uint64_t stats);
     void dirichlet_noise(float epsilon, float alpha);
     void randomize_first_proportionally();
-    void update(float eval = std::numeric_limits<float>::quiet_NaN());
+    void update(float eval);
+    // Adds and clears the updates batched up in pending.
+    void update(PendingStats& pending);
 
-    UCTNode* uct_select_child(int color);
+    // Index of the child with the best PUCT score.
+    int uct_select_child(int color);
+    // Returns nullptr if there is no room left in the arena.
+    UCTNode* inflate_child(int index, UCTNodeArena& arena);
+    // Done by the thread passing through this node on its way to child
+    // index. The undo also brings our copy of the child stats up to date.
+    void virtual_loss(int index);
+    void virtual_loss_undo(int index);
+    void invalidate_child(int index);
     UCTNode* get_first_child() const;
     UCTNode* get_nopass_child(FastState& state) const;
-    const std::vector<node_ptr_t>& get_children() const;
-    size_t count_nodes() const;
-    node_ptr_t find_new_root(const int move);
-    node_ptr_t find_new_root(const GameState& g_new, GameState& g_curr);
+    ChildList get_children() const;
+    // Only descends into children with at least min_visits visits.
+    size_t count_nodes(int min_visits = 0) const;
+    // Copy this node and its subtree into another arena. Children with
+    // fewer than min_visits visits are dropped back to bare edges.
+    // Returns nullptr if not even the node itself fits.
+    UCTNode* copy_to(UCTNodeArena& arena, int min_visits = 0) const;
+
+    // A subtree as UCTSearch::save_tree writes it: its nodes in
+    // preorder, and the edges of every node with children, in the same
+    // order. An inflated edge is followed, in the nodes, by the subtree
+    // of its child.
+    struct SavedNode {
+        std::uint64_t stats;
+        float init_eval;
+        float net_eval;
+        std::int16_t move;
+        std::uint16_t childcount;
+        std::uint8_t flags;
+        std::uint8_t padding[3];
+    };
+    struct SavedEdge {
+        float score;
+        std::int16_t move;
+        std::uint8_t inflated;
+        std::uint8_t padding;
+    };
+    static constexpr std::uint8_t SAVED_VALID = 1;
+    static constexpr std::uint8_t SAVED_TERMINAL = 2;
+    // Where restore reads from, moved past what it read.
+    struct SavedTree {
+        const SavedNode* nodes;
+        const SavedNode* nodes_end;
+        const SavedEdge* edges;
+        const SavedEdge* edges_end;
+    };
+    // Appends this subtree. Children with fewer than min_visits visits
+    // are saved as bare edges, like copy_to does.
+    void save(std::vector<SavedNode>& nodes, std::vector<SavedEdge>& edges,
+              int min_visits = 0) const;
+    // Rebuilds the subtree at the front of tree in arena. Returns
+    // nullptr if the records don't add up or the arena is out of room.
+    static UCTNode* restore(UCTNodeArena& arena, SavedTree& tree,
+                            float score = 0.0f);
+    // Returns nullptr if no such child was created.
+    UCTNode* find_new_root(const int move);
 
     void sort_children(int color);
-    UCTNode& get_best_root_child(int color);
-    SMP::Mutex& get_mutex();
+    // Hides every child not playing one of moves from uct_select_child,
+    // until clear_focus. Only while no search is running.
+    void focus_children(const std::vector<int>& moves);
+    void clear_focus();
+    // Visits and black evals of a root child from earlier analysis, like
+    // an opening book.
+    struct Seed {
+        int move;
+        int visits;
+        float blackeval;
+    };
+    // Gives the children in seeds at least their visits, and this node
+    // the sum of them, so the search starts from where the analysis
+    // stopped. Only while no search is running.
+    void seed_children(const std::vector<Seed>& seeds);
+    // nullptr if the best child was never visited.
+    UCTNode* get_best_root_child(int color);
+
+    // Times uct_select_child on a made up position with a full board
+    // of children. Returns the nanoseconds per selection.
+    static double benchmark(int iterations = 1000000);
 
 private:
-    void link_nodelist(std::atomic<int>& nodecount,
-                       std::vector<Network::scored_node>& nodelist,
+    // Children are one block in the arena: the edges, followed by
+    // copies of what uct_select_child needs from each child, each in an
+    // array of its own. Selection then reads them sequentially instead
+    // of chasing a pointer per child, and scores every child in one loop
+    // over plain floats that the compiler can vectorize.
+    static UCTNodePointer* allocate_children(UCTNodeArena& arena,
+                                             size_t count);
+    std::atomic<float>* child_visits() const;
+    std::atomic<float>* child_blackevals() const;
+    // A negative prior marks an invalid child.
+    std::atomic<float>* child_priors() const;
+    std::atomic<std::int16_t>* child_virtual_losses() const;
+    void refresh_child(int index);
+    // Rebuild all the copies, only while no search is running.
+    void refresh_children();
+
+    // Sorts the count moves of nodelist and makes them our children.
+    void link_nodelist(UCTNodeArena& arena,
+                       std::atomic<int>& nodecount,
+                       Network::scored_node* nodelist, size_t count,
                        float init_eval);
+    UCTNode* copy_node_to(UCTNodeArena& arena) const;
+    void copy_children_to(UCTNodeArena& arena, UCTNode& dst,
+                          int min_visits) const;
     // Note : This class is very size-sensitive as we are going to create
     // tens of millions of instances of these.  Please put extra caution
     // if you want to add/remove/reorder any variables here.
 
     // Move
     std::int16_t m_move;
-    // UCT
-    std::atomic<std::int16_t> m_virtual_loss{0};
-    std::atomic<int> m_visits{0};
+    // Size of the children block, which kill_superkos does not shrink.
+    std::uint16_t m_childcapacity{0};
     // UCT eval
     float m_score;
     float m_init_eval;
-    std::atomic<double> m_blackevals{0};
+    // Network eval of this node, used for children not visited yet.
+    float m_net_eval{0.5f};
+    // Visits and black evals, see EVAL_BITS.
+    std::atomic<std::uint64_t> m_stats{0};
     // node alive (not superko)
     std::atomic<bool> m_valid{true};
-    // Is someone adding scores to this node?
-    // We don't need to unset this.
-    bool m_is_expanding{false};
-    SMP::Mutex m_nodemutex;
+    // Has someone started expanding this node? Only unset again if
+    // there was no room for the children.
+    std::atomic<bool> m_is_expanding{false};
+    // The game ended here and m_net_eval holds its result. Such nodes
+    // never get children, so they don't need the network eval.
+    std::atomic<bool> m_terminal{false};
 
     // Tree data
     std::atomic<bool> m_has_children{false};
-    std::vector<node_ptr_t> m_children;
+    std::uint16_t m_childcount{0};
+    UCTNodePointer * m_children{nullptr};
 };
 
+inline UCTNode* UCTNodePointer::operator->() const {
+    auto node = get();
+    assert(node != nullptr);
+    return node;
+}
+
+inline int UCTNodePointer::get_move() const {
+    auto data = m_data.load();
+    if (data & INLINE_TAG) {
+        return inline_move(data);
+    }
+    return reinterpret_cast<UCTNode*>(data)->get_move();
+}
+
+inline float UCTNodePointer::get_score() const {
+    auto data = m_data.load();
+    if (data & INLINE_TAG) {
+        return inline_score(data);
+    }
+    return reinterpret_cast<UCTNode*>(data)->get_score();
+}
+
+inline int UCTNodePointer::get_visits() const {
+    auto node = get();
+    return node ? node->get_visits() : 0;
+}
+
+inline bool UCTNodePointer::valid() const {
+    auto node = get();
+    return node ? node->valid() : true;
+}
+
+inline float UCTNodePointer::get_eval(int tomove) const {
+    return operator->()->get_eval(tomove);
+}
+
 #endif
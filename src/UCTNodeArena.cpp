@@ -0,0 +1,57 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "UCTNodeArena.h"
+
+UCTNodeArena::UCTNodeArena(size_t max_bytes)
+    : m_max_chunks(std::max(size_t{1}, max_bytes / CHUNK_SIZE)) {
+}
+
+void* UCTNodeArena::allocate_bytes(size_t bytes, size_t align) {
+    assert(bytes <= CHUNK_SIZE);
+    LOCK(m_mutex, lock);
+
+    auto offset = (m_chunk_used + align - 1) / align * align;
+    if (offset + bytes > CHUNK_SIZE) {
+        if (m_chunks.size() >= m_max_chunks) {
+            return nullptr;
+        }
+        m_chunks.emplace_back(new char[CHUNK_SIZE]);
+        m_chunk_count = m_chunks.size();
+        offset = 0;
+    }
+    m_chunk_used = offset + bytes;
+    return m_chunks.back().get() + offset;
+}
+
+bool UCTNodeArena::full() const {
+    return m_chunk_count >= m_max_chunks;
+}
+
+size_t UCTNodeArena::get_used_bytes() const {
+    return m_chunk_count * CHUNK_SIZE;
+}
+
+size_t UCTNodeArena::get_max_bytes() const {
+    return m_max_chunks * CHUNK_SIZE;
+}
@@ -0,0 +1,77 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UCTNODEARENA_H_INCLUDED
+#define UCTNODEARENA_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "SMP.h"
+
+/*
+    Bump allocator for the search tree. Nodes are never freed one by one,
+    all memory is released at once when the arena is destroyed. To keep
+    part of a tree, copy it into a fresh arena (see UCTNode::copy_to).
+*/
+class UCTNodeArena {
+public:
+    explicit UCTNodeArena(size_t max_bytes);
+
+    // Construct a T in the arena, or return nullptr if the arena is full.
+    template<typename T, typename... Args>
+    T* create(Args&&... args) {
+        auto mem = allocate_bytes(sizeof(T), alignof(T));
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        return new (mem) T(std::forward<Args>(args)...);
+    }
+
+    // Uninitialized storage for count objects of type T, or nullptr.
+    template<typename T>
+    T* allocate(size_t count) {
+        return static_cast<T*>(allocate_bytes(count * sizeof(T), alignof(T)));
+    }
+
+    // True once the last chunk we are allowed to allocate is in use.
+    bool full() const;
+    // Memory reserved from the system so far, and at most.
+    size_t get_used_bytes() const;
+    size_t get_max_bytes() const;
+
+private:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    void* allocate_bytes(size_t bytes, size_t align);
+
+    SMP::Mutex m_mutex;
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    // Same as m_chunks.size(), but can be read without taking the lock.
+    std::atomic<size_t> m_chunk_count{0};
+    size_t m_chunk_used{CHUNK_SIZE};
+    size_t m_max_chunks;
+};
+
+#endif
@@ -19,17 +19,29 @@
 #include "config.h"
 #include "UCTSearch.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
+#include <fstream>
 #include <limits>
 #include <memory>
 #include <type_traits>
+#include <vector>
 
 #include "FastBoard.h"
 #include "FullBoard.h"
 #include "GTP.h"
 #include "GameState.h"
 #include "KoState.h"
+#include "MappedFile.h"
+#include "NNCache.h"
+#include "PerfStats.h"
+#ifdef USE_OPENCL
+#include "OpenCLScheduler.h"
+#endif
+#include "Speculator.h"
 #include "ThreadPool.h"
 #include "TimeControl.h"
 #include "Timing.h"
@@ -39,10 +51,145 @@
 
 using namespace Utils;
 
+constexpr size_t UCTSearch::MAX_TREE_BYTES;
+
+// The searches sharing the tree budget, see get_tree_budget.
+static std::atomic<int> s_searches{0};
+
 UCTSearch::UCTSearch() {
+    s_searches++;
     set_playout_limit(cfg_max_playouts);
     set_visit_limit(cfg_max_visits);
-    m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f, 0.5f);
+    promote_root(nullptr);
+}
+
+UCTSearch::~UCTSearch() {
+    s_searches--;
+}
+
+size_t UCTSearch::get_tree_budget() {
+    auto budget = MAX_TREE_BYTES;
+    if (cfg_max_memory != 0) {
+        const auto memory = size_t(cfg_max_memory) * 1024 * 1024;
+        const auto cache = NNCache::get_NNCache().get_memory_used();
+        budget = std::min(budget, memory > cache ? memory - cache : 0);
+    }
+    // An arena gets its share when it is made, for a new tree or when
+    // a full one is pruned, so the split catches up with the number of
+    // searches then.
+    return budget / std::max(1, s_searches.load());
+}
+
+// Make new_root, part of the current tree, the root. The rest of the
+// tree stays in the arena until prune_tree copies out what is still
+// reachable once the arena is full, during a search and not while we
+// reply. With nullptr, start a new arena with an empty root. The old
+// tree is handed to the thread pool to be freed, so we don't wait for
+// it before replying.
+void UCTSearch::promote_root(UCTNode* new_root) {
+    if (new_root != nullptr) {
+        m_root = new_root;
+        myprintf("Reusing %d visits from the previous search.\n",
+                 new_root->get_visits());
+        return;
+    }
+    auto arena = std::make_unique<UCTNodeArena>(get_tree_budget());
+    m_root = arena->create<UCTNode>(FastBoard::PASS, 0.0f, 0.5f);
+    assert(m_root != nullptr);
+    std::swap(m_arena, arena);
+    reclaim(std::move(arena));
+}
+
+UCTNode* UCTSearch::copy_trimmed(const UCTNode& root, UCTNodeArena& arena) {
+    // Leave room to search: drop the least visited branches until
+    // what we keep fills about half the arena. Most edges are never
+    // inflated, so go by the room the current tree takes per node.
+    const auto tree_nodes = std::max(size_t{1}, m_root->count_nodes());
+    const auto node_bytes = std::max<size_t>(
+        UCTNode::EDGE_BYTES, m_arena->get_used_bytes() / tree_nodes);
+    const auto max_nodes = arena.get_max_bytes() / node_bytes / 2;
+    auto min_visits = 0;
+    while (root.count_nodes(min_visits) > max_nodes) {
+        min_visits = std::max(1, min_visits * 2);
+    }
+    return root.copy_to(arena, min_visits);
+}
+
+void UCTSearch::reclaim(std::unique_ptr<UCTNodeArena> arena) {
+    if (arena) {
+        // std::function needs a copyable callable.
+        auto old_arena = std::shared_ptr<UCTNodeArena>(std::move(arena));
+        m_reclaim = thread_pool.add_task([old_arena]() mutable {
+            auto start = Time();
+            old_arena.reset();
+            return Time::timediff_seconds(start, Time());
+        });
+    }
+}
+
+void UCTSearch::start_helpers(ThreadGroup& tg) {
+    for (auto i = 1; i < cfg_num_threads; i++) {
+        tg.add_task(UCTWorker(m_rootstate, this, m_root));
+    }
+}
+
+void UCTSearch::prune_tree(ThreadGroup& tg,
+                           UCTNode::PendingStats& root_stats) {
+    m_run = false;
+    flush_root_stats(root_stats, true);
+    tg.wait_all();
+
+    const auto nodes_before = m_nodes.load();
+    auto arena = std::make_unique<UCTNodeArena>(get_tree_budget());
+    m_root = copy_trimmed(*m_root, *arena);
+    assert(m_root != nullptr);
+    std::swap(m_arena, arena);
+    reclaim(std::move(arena));
+    // The copy starts out without focus, and with only the children
+    // that had enough visits.
+    m_root->inflate_all_children(*m_arena);
+    if (!m_ponder_replies.empty()) {
+        m_root->focus_children(m_ponder_replies);
+    }
+    m_nodes = m_root->count_nodes();
+    myprintf("Tree full, pruned from %d to %d nodes.\n",
+             nodes_before, static_cast<int>(m_nodes));
+
+    m_run = true;
+    start_helpers(tg);
+}
+
+// Find the node for g in the current tree. This works if g can be reached
+// from the root position by the moves in its history, which covers both
+// the opponent's replies we looked at while pondering, and any number of
+// moves played (or loaded from an SGF) since the last search.
+UCTNode* UCTSearch::find_reusable_root(const GameState& g) {
+    if (m_rootstate.get_komi() != g.get_komi()
+        || g.get_movenum() < m_rootstate.get_movenum()) {
+        return nullptr;
+    }
+
+    auto moves = std::vector<int>{};
+    auto prevstate = g;
+    while (prevstate.get_movenum() > m_rootstate.get_movenum()) {
+        moves.emplace_back(prevstate.get_last_move());
+        if (!prevstate.undo_move()) {
+            return nullptr;
+        }
+    }
+    if (prevstate.board.get_hash() != m_rootstate.board.get_hash()
+        || prevstate.board.get_ko_hash() != m_rootstate.board.get_ko_hash()) {
+        return nullptr;
+    }
+
+    auto node = m_root;
+    for (auto it = moves.rbegin(); it != moves.rend(); ++it) {
+        node = node->find_new_root(*it);
+        if (node == nullptr) {
+            return nullptr;
+        }
+    }
+    return node;
 }
 
 void UCTSearch::set_gamestate(const GameState & g) {
@@ -51,12 +198,20 @@ void UCTSearch::set_gamestate(const GameState & g) {
     m_playouts = 0;
     if (m_rootstate.get_komi() != g.get_komi()
         || m_rootstate.board.get_hash() != g.board.get_hash()) {
-        m_root = m_root->find_new_root(g, m_rootstate);
+        count_ponder_hit(g);
+        auto new_root = find_reusable_root(g);
+        m_rootstate = g;
+        promote_root(new_root);
     }
+    // Once per move, instead of in every playout that goes deep enough.
+    m_rootstate.compact_ko_history();
     m_nodes = m_root->count_nodes();
 }
 
-SearchResult UCTSearch::play_simulation(GameState & currstate, UCTNode* const node) {
+SearchResult UCTSearch::play_simulation(KoState & currstate, UCTNode* const node,
+                                        UCTNode::PendingStats* root_stats) {
+    // Only the calls for the root, the rest are part of them.
+    PerfTimer timer(PerfStats::PLAYOUT, root_stats != nullptr);
     const auto color = currstate.get_to_move();
     const auto hash = currstate.board.get_hash();
     const auto komi = currstate.get_komi();
@@ -64,15 +219,21 @@ SearchResult UCTSearch::play_simulation(GameState & currstate, UCTNode* const no
     auto result = SearchResult{};
 
     TTable::get_TT().sync(hash, komi, node);
-    node->virtual_loss();
 
     if (!node->has_children()) {
         if (currstate.get_passes() >= 2) {
-            auto score = currstate.final_score();
-            result = SearchResult::from_score(score);
-        } else if (m_nodes < MAX_TREE_SIZE) {
+            // The same position every time, so only score it once.
+            auto eval = 0.0f;
+            if (!node->get_terminal_eval(eval)) {
+                auto score = currstate.final_score();
+                eval = SearchResult::from_score(score).eval();
+                node->set_terminal_eval(eval);
+            }
+            result = SearchResult::from_eval(eval);
+        } else if (!m_arena->full()) {
             float eval;
-            auto success = node->create_children(m_nodes, currstate, eval);
+            auto success = node->create_children(*m_arena, m_nodes,
+                                                 currstate, eval);
             if (success) {
                 result = SearchResult::from_eval(eval);
             }
@@ -83,35 +244,74 @@ SearchResult UCTSearch::play_simulation(GameState & currstate, UCTNode* const no
     }
 
     if (node->has_children() && !result.valid()) {
-        auto next = node->uct_select_child(color);
+        auto index = node->uct_select_child(color);
+        auto next = node->inflate_child(index, *m_arena);
+
+        // A child that another thread is still expanding can't give us
+        // a result. Put a virtual loss on it and look again, so we take
+        // another path instead of coming back here until it's done.
+        std::array<int, BUSY_RESELECTS> busy;
+        auto busy_count = 0;
+        while (next != nullptr && next->is_expanding()
+               && busy_count < BUSY_RESELECTS) {
+            node->virtual_loss(index);
+            busy[busy_count++] = index;
+            index = node->uct_select_child(color);
+            next = node->inflate_child(index, *m_arena);
+        }
 
-        if (next != nullptr) {
+        if (next == nullptr) {
+            // No room left to create the child, evaluate here instead.
+            auto eval = node->eval_state(currstate);
+            result = SearchResult::from_eval(eval);
+        } else {
             auto move = next->get_move();
 
+            node->virtual_loss(index);
             if (move != FastBoard::PASS) {
                 currstate.play_move(move);
 
                 if (!currstate.superko()) {
                     result = play_simulation(currstate, next);
                 } else {
-                    next->invalidate();
+                    node->invalidate_child(index);
                 }
             } else {
                 currstate.play_pass();
                 result = play_simulation(currstate, next);
             }
+            node->virtual_loss_undo(index);
+        }
+        for (auto i = 0; i < busy_count; i++) {
+            node->virtual_loss_undo(busy[i]);
+        }
+    }
+
+    if (root_stats != nullptr) {
+        if (result.valid()) {
+            root_stats->add(result.eval());
         }
+        return result;
     }
 
     if (result.valid()) {
         node->update(result.eval());
     }
-    node->virtual_loss_undo();
     TTable::get_TT().update(hash, komi, node);
 
     return result;
 }
 
+void UCTSearch::flush_root_stats(UCTNode::PendingStats& root_stats,
+                                 bool force) {
+    // Every playout passes through the root, so with many threads
+    // updating it each time would keep its cache line bouncing between
+    // the cores.
+    if (force || root_stats.get_visits() >= ROOT_STATS_BATCH) {
+        m_root->update(root_stats);
+    }
+}
+
 void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
     if (cfg_quiet || !parent.has_children()) {
         return;
@@ -145,10 +345,203 @@ void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
         KoState tmpstate = state;
 
         tmpstate.play_move(node->get_move());
-        pvstring += " " + get_pv(tmpstate, *node);
+        pvstring += " " + get_pv(tmpstate, *node.get());
 
         myprintf("%s\n", pvstring.c_str());
     }
+
+    TTable::get_TT().dump_stats();
+    Speculator::dump_stats();
+    constexpr auto MiB = 1024.0 * 1024.0;
+    myprintf("Memory: tree %.0f of %.0f MiB, NNCache %.0f MiB\n",
+             m_arena->get_used_bytes() / MiB, m_arena->get_max_bytes() / MiB,
+             NNCache::get_NNCache().get_memory_used() / MiB);
+#ifdef USE_OPENCL
+    opencl.dump_stats();
+#endif
+    PerfStats::dump_stats();
+}
+
+UCTSearch::TopChildren UCTSearch::get_top_children() const {
+    auto top = TopChildren{FastBoard::PASS, 0, 0};
+    if (!m_root->has_children()) {
+        return top;
+    }
+    for (const auto& child : m_root->get_children()) {
+        const auto node = child.get();
+        if (node == nullptr || !node->valid()) {
+            continue;
+        }
+        const auto visits = node->get_visits();
+        if (visits > top.visits) {
+            top.runner_up_visits = top.visits;
+            top.visits = visits;
+            top.move = node->get_move();
+        } else if (visits > top.runner_up_visits) {
+            top.runner_up_visits = visits;
+        }
+    }
+    return top;
+}
+
+std::vector<Book::Move> UCTSearch::get_root_moves() const {
+    auto moves = std::vector<Book::Move>{};
+    if (!m_root->has_children()) {
+        return moves;
+    }
+    const auto color = m_rootstate.get_to_move();
+    for (const auto& child : m_root->get_children()) {
+        const auto node = child.get();
+        if (node == nullptr || !node->valid() || node->get_visits() == 0) {
+            continue;
+        }
+        moves.push_back({node->get_move(), node->get_visits(),
+                         node->get_eval(color)});
+    }
+    std::stable_sort(begin(moves), end(moves),
+        [](const Book::Move& a, const Book::Move& b) {
+            if (a.visits != b.visits) {
+                return a.visits > b.visits;
+            }
+            return a.winrate > b.winrate;
+        });
+    return moves;
+}
+
+int UCTSearch::get_root_visits() const {
+    return m_root->get_visits();
+}
+
+float UCTSearch::get_root_eval() const {
+    return m_root->get_eval(m_rootstate.get_to_move());
+}
+
+std::string UCTSearch::get_best_pv() {
+    auto state = KoState{m_rootstate};
+    return get_pv(state, *m_root);
+}
+
+static constexpr std::array<char, 8> TREE_MAGIC = {
+    {'L', 'Z', 'T', 'R', 'E', 'E', '0', '1'}
+};
+
+bool UCTSearch::save_tree(const std::string& filename, const GameState& g,
+                          const int min_visits) {
+    const auto root = find_reusable_root(g);
+    if (root == nullptr || root->get_visits() == 0) {
+        myprintf("There is no search tree for this position.\n");
+        return false;
+    }
+    auto nodes = std::vector<UCTNode::SavedNode>{};
+    auto edges = std::vector<UCTNode::SavedEdge>{};
+    root->save(nodes, edges, min_visits);
+
+    auto header = TreeHeader{};
+    header.magic = TREE_MAGIC;
+    header.version = TREE_VERSION;
+    header.board_size = BOARD_SIZE;
+    header.komi = g.get_komi();
+    header.min_visits = min_visits;
+    header.hash = g.board.get_hash();
+    header.ko_hash = g.board.get_ko_hash();
+    header.network_hash = Network::get_network_hash();
+    header.node_count = nodes.size();
+    header.edge_count = edges.size();
+
+    auto out = std::ofstream{filename, std::ios::binary};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(nodes.data()),
+              nodes.size() * sizeof(UCTNode::SavedNode));
+    out.write(reinterpret_cast<const char*>(edges.data()),
+              edges.size() * sizeof(UCTNode::SavedEdge));
+    out.close();
+    if (!out) {
+        return false;
+    }
+    // Counted like count_nodes does, as the search reports them.
+    myprintf("Saved search tree %s: %d visits, %zu nodes.\n",
+             filename.c_str(), root->get_visits(), edges.size());
+    return true;
+}
+
+bool UCTSearch::load_tree(const std::string& filename, const GameState& g) {
+    const MappedFile file(filename);
+    if (file.data() == nullptr) {
+        myprintf("Could not read search tree %s.\n", filename.c_str());
+        return false;
+    }
+    const auto header = reinterpret_cast<const TreeHeader*>(file.data());
+    if (file.size() < sizeof(TreeHeader)
+        || header->magic != TREE_MAGIC || header->version != TREE_VERSION) {
+        myprintf("%s is not a search tree.\n", filename.c_str());
+        return false;
+    }
+    // The counts are bounded by the file size before they are multiplied,
+    // so a damaged header can't overflow the size check.
+    const auto node_bytes = file.size() - sizeof(TreeHeader);
+    if (header->node_count > node_bytes / sizeof(UCTNode::SavedNode)) {
+        myprintf("Search tree %s is damaged.\n", filename.c_str());
+        return false;
+    }
+    const auto edge_bytes = node_bytes
+        - header->node_count * sizeof(UCTNode::SavedNode);
+    if (header->edge_count > edge_bytes / sizeof(UCTNode::SavedEdge)
+        || edge_bytes != header->edge_count * sizeof(UCTNode::SavedEdge)) {
+        myprintf("Search tree %s is damaged.\n", filename.c_str());
+        return false;
+    }
+    if (header->board_size != BOARD_SIZE || header->komi != g.get_komi()
+        || header->hash != g.board.get_hash()
+        || header->ko_hash != g.board.get_ko_hash()) {
+        myprintf("Search tree %s is for another position.\n",
+                 filename.c_str());
+        return false;
+    }
+    if (header->network_hash != Network::get_network_hash()) {
+        myprintf("Search tree %s was searched with another network.\n",
+                 filename.c_str());
+        return false;
+    }
+
+    auto tree = UCTNode::SavedTree{};
+    tree.nodes = reinterpret_cast<const UCTNode::SavedNode*>(
+        file.data() + sizeof(TreeHeader));
+    tree.nodes_end = tree.nodes + header->node_count;
+    tree.edges = reinterpret_cast<const UCTNode::SavedEdge*>(tree.nodes_end);
+    tree.edges_end = tree.edges + header->edge_count;
+
+    auto arena = std::make_unique<UCTNodeArena>(get_tree_budget());
+    const auto root = UCTNode::restore(*arena, tree);
+    if (root == nullptr) {
+        myprintf(arena->full() ? "Search tree %s does not fit in memory.\n"
+                               : "Search tree %s is damaged.\n",
+                 filename.c_str());
+        return false;
+    }
+    if (tree.nodes != tree.nodes_end || tree.edges != tree.edges_end) {
+        myprintf("Search tree %s is damaged.\n", filename.c_str());
+        return false;
+    }
+
+    m_rootstate = g;
+    m_root = root;
+    std::swap(m_arena, arena);
+    reclaim(std::move(arena));
+    m_nodes = m_root->count_nodes();
+    myprintf("Loaded search tree %s: %d visits, %d nodes.\n",
+             filename.c_str(), m_root->get_visits(), m_nodes.load());
+    return true;
+}
+
+void UCTSearch::seed_root(const std::vector<Book::Move>& moves) {
+    const auto color = m_rootstate.get_to_move();
+    auto seeds = std::vector<UCTNode::Seed>{};
+    for (const auto& move : moves) {
+        const auto blackeval = color == FastBoard::BLACK
+                             ? move.winrate : 1.0f - move.winrate;
+        seeds.push_back({move.vertex, move.visits, blackeval});
+    }
+    m_root->seed_children(seeds);
 }
 
 bool UCTSearch::should_resign(passflag_t passflag, float bestscore) {
@@ -326,16 +719,16 @@ std::string UCTSearch::get_pv(KoState & state, UCTNode& parent) {
         return std::string();
     }
 
-    auto& best_child = parent.get_best_root_child(state.get_to_move());
-    if (best_child.first_visit()) {
+    auto best_child = parent.get_best_root_child(state.get_to_move());
+    if (best_child == nullptr || best_child->first_visit()) {
         return std::string();
     }
-    auto best_move = best_child.get_move();
+    auto best_move = best_child->get_move();
     auto res = state.move_to_text(best_move);
 
     state.play_move(best_move);
 
-    auto next = get_pv(state, best_child);
+    auto next = get_pv(state, *best_child);
     if (!next.empty()) {
         res.append(" ").append(next);
     }
@@ -356,22 +749,97 @@ void UCTSearch::dump_analysis(int playouts) {
              playouts, winrate, pvstring.c_str());
 }
 
+std::string UCTSearch::get_analysis() {
+    if (!m_root->has_children()) {
+        return std::string();
+    }
+    struct ChildInfo {
+        UCTNode* node;
+        int visits;
+        float winrate;
+        float prior;
+    };
+    const auto color = m_rootstate.board.get_to_move();
+    auto children = std::vector<ChildInfo>{};
+    for (const auto& child : m_root->get_children()) {
+        const auto node = child.get();
+        if (node == nullptr || !node->valid()) {
+            continue;
+        }
+        // Visits and evals come from a single load, so they match even
+        // while the search threads keep updating the node.
+        const auto stats = node->get_stats();
+        const auto visits = UCTNode::unpack_visits(stats);
+        if (visits == 0) {
+            continue;
+        }
+        auto winrate = static_cast<float>(
+            UCTNode::unpack_blackevals(stats) / visits);
+        if (color == FastBoard::WHITE) {
+            winrate = 1.0f - winrate;
+        }
+        children.push_back({node, visits, winrate, node->get_score()});
+    }
+    std::stable_sort(begin(children), end(children),
+        [](const ChildInfo& a, const ChildInfo& b) {
+            if (a.visits != b.visits) {
+                return a.visits > b.visits;
+            }
+            return a.winrate > b.winrate;
+        });
+
+    auto out = std::string{};
+    for (auto i = size_t{0}; i < children.size(); i++) {
+        const auto& info = children[i];
+        const auto move = info.node->get_move();
+        KoState state = m_rootstate;
+        auto pv = state.move_to_text(move);
+        state.play_move(move);
+        const auto rest = get_pv(state, *info.node);
+        if (!rest.empty()) {
+            pv.append(" ").append(rest);
+        }
+        if (!out.empty()) {
+            out.append(" ");
+        }
+        out.append("info move " + m_rootstate.move_to_text(move)
+                   + " visits " + std::to_string(info.visits)
+                   + " winrate "
+                   + std::to_string(static_cast<int>(info.winrate * 10000))
+                   + " prior "
+                   + std::to_string(static_cast<int>(info.prior * 10000))
+                   + " order " + std::to_string(i)
+                   + " pv " + pv);
+    }
+    return out;
+}
+
 bool UCTSearch::is_running() const {
     return m_run;
 }
 
 bool UCTSearch::playout_or_visit_limit_reached() const {
-    return m_playouts >= m_maxplayouts || m_root->get_visits() >= m_maxvisits;
+    return m_playouts >= m_maxplayouts
+           || m_root_visits + m_playouts >= m_maxvisits;
 }
 
 void UCTWorker::operator()() {
+    // Playouts only need the board and ko history, not the game record
+    // with a KoState per move.  Reusing the same state keeps resetting it
+    // to the root free of allocations.
+    auto currstate = KoState{};
+    auto root_stats = UCTNode::PendingStats{};
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-        auto result = m_search->play_simulation(*currstate, m_root);
+        currstate = m_rootstate;
+        auto result = m_search->play_simulation(currstate, m_root,
+                                                &root_stats);
         if (result.valid()) {
             m_search->increment_playouts();
         }
+        m_search->flush_root_stats(root_stats, false);
     } while(m_search->is_running() && !m_search->playout_or_visit_limit_reached());
+    m_search->flush_root_stats(root_stats, true);
+    TTable::get_TT().flush_stats();
 }
 
 void UCTSearch::increment_playouts() {
@@ -392,18 +860,33 @@ int UCTSearch::think(int color, const GameState& g, passflag_t passflag) {
 
     m_rootstate.get_timecontrol().set_boardsize(m_rootstate.board.get_boardsize());
     auto time_for_move = m_rootstate.get_timecontrol().max_time_for_move(color);
+    auto extended_time = m_rootstate.get_timecontrol().extended_time_for_move(color);
 
-    myprintf("Thinking at most %.1f seconds...\n", time_for_move/100.0f);
+    myprintf("Thinking at most %.1f seconds...\n", extended_time/100.0f);
 
     // create a sorted list off legal moves (make sure we
     // play something legal and decent even in time trouble)
     float root_eval;
     if (!m_root->has_children()) {
-        m_root->create_children(m_nodes, m_rootstate, root_eval);
+        m_root->create_children(*m_arena, m_nodes, m_rootstate, root_eval);
     } else {
         root_eval = m_root->get_eval(color);
     }
+    // The root children are looked at directly after the search,
+    // so make sure they all exist.
+    m_root->inflate_all_children(*m_arena);
     m_root->kill_superkos(m_rootstate);
+    const auto book_moves = Book::get_Book().lookup(m_rootstate);
+    if (!book_moves.empty()) {
+        seed_root(book_moves);
+        if (!cfg_book_seed) {
+            myprintf("Playing from the book.\n");
+            m_rootstate.stop_clock(color);
+            dump_stats(m_rootstate, *m_root);
+            Training::record(m_rootstate, *m_root);
+            return finish_search(passflag);
+        }
+    }
     if (cfg_noise) {
         m_root->dirichlet_noise(0.25f, 0.03f);
     }
@@ -411,22 +894,31 @@ int UCTSearch::think(int color, const GameState& g, passflag_t passflag) {
     myprintf("NN eval=%f\n",
              (color == FastBoard::BLACK ? root_eval : 1.0f - root_eval));
 
+    m_root_visits = m_root->get_visits();
+    TTable::get_TT().new_generation();
     m_run = true;
-    int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
-    }
+    start_helpers(tg);
 
     bool keeprunning = true;
     int last_update = 0;
+    int last_check = 0;
+    int last_best_change = 0;
+    int best_move = FastBoard::PASS;
+    int time_limit = time_for_move;
+    auto currstate = KoState{};
+    auto root_stats = UCTNode::PendingStats{};
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
+        currstate = m_rootstate;
 
-        auto result = play_simulation(*currstate, m_root.get());
+        auto result = play_simulation(currstate, m_root, &root_stats);
         if (result.valid()) {
             increment_playouts();
         }
+        flush_root_stats(root_stats, false);
+        if (m_arena->full()) {
+            prune_tree(tg, root_stats);
+        }
 
         Time elapsed;
         int elapsed_centis = Time::timediff_centis(start, elapsed);
@@ -437,14 +929,39 @@ int UCTSearch::think(int color, const GameState& g, passflag_t passflag) {
             last_update = elapsed_centis;
             dump_analysis(static_cast<int>(m_playouts));
         }
-        keeprunning  = is_running();
-        keeprunning &= (elapsed_centis < time_for_move);
+        if (elapsed_centis - last_check >= STABILITY_CHECK_CS) {
+            last_check = elapsed_centis;
+            const auto top = get_top_children();
+            if (top.move != best_move) {
+                best_move = top.move;
+                last_best_change = elapsed_centis;
+            }
+            // Keep going past the normal budget while the runner up is
+            // close or the best move only just changed.
+            const auto unstable = top.runner_up_visits * 5 >= top.visits * 4
+                || elapsed_centis - last_best_change < time_for_move / 4;
+            time_limit = unstable ? extended_time : time_for_move;
+            // Playouts left at the current speed. If all of them went to
+            // the runner up and it still would have fewer visits, the
+            // rest of the time can only be wasted.
+            const auto playouts_left = static_cast<double>(m_playouts)
+                * (time_limit - elapsed_centis) / (elapsed_centis + 1);
+            if (top.visits - top.runner_up_visits > playouts_left) {
+                myprintf("Best move can't change anymore, stopping early.\n");
+                keeprunning = false;
+            }
+        }
+        keeprunning &= is_running();
+        keeprunning &= (elapsed_centis < time_limit);
         keeprunning &= !playout_or_visit_limit_reached();
     } while(keeprunning);
 
     // stop the search
     m_run = false;
+    flush_root_stats(root_stats, true);
+    TTable::get_TT().flush_stats();
     tg.wait_all();
+    Speculator::clear();
     m_rootstate.stop_clock(color);
     if (!m_root->has_children()) {
         return FastBoard::PASS;
@@ -465,32 +982,139 @@ int UCTSearch::think(int color, const GameState& g, passflag_t passflag) {
                  static_cast<int>(m_playouts),
                  (m_playouts * 100) / (elapsed_centis+1));
     }
+    if (m_reclaim.valid()
+        && m_reclaim.wait_for(std::chrono::seconds(0))
+           == std::future_status::ready) {
+        myprintf("Previous tree freed in %.1f ms.\n\n",
+                 m_reclaim.get() * 1000.0);
+    }
     int bestmove = get_best_move(passflag);
     m_rootstate.play_move(bestmove);
-    m_root = m_root->find_new_root(bestmove);
+    promote_root(m_root->find_new_root(bestmove));
     return bestmove;
 }
 
-void UCTSearch::ponder(const GameState& g) {
+std::vector<int> UCTSearch::predict_replies() const {
+    struct Reply {
+        int move;
+        float probability;
+    };
+    auto replies = std::vector<Reply>{};
+    auto total_visits = 0;
+    for (const auto& child : m_root->get_children()) {
+        total_visits += child.get_visits();
+    }
+    for (const auto& child : m_root->get_children()) {
+        if (!child.valid()) {
+            continue;
+        }
+        // Where the search already has an opinion, trust it as much as
+        // the policy network.
+        auto probability = child.get_score();
+        if (total_visits > 0) {
+            probability = (probability
+                + child.get_visits() / static_cast<float>(total_visits)) / 2;
+        }
+        replies.push_back({child.get_move(), probability});
+    }
+    std::stable_sort(begin(replies), end(replies),
+        [](const Reply& a, const Reply& b) {
+            return a.probability > b.probability;
+        });
+
+    auto moves = std::vector<int>{};
+    auto coverage = 0.0f;
+    for (const auto& reply : replies) {
+        if (coverage >= PONDER_COVERAGE
+            || moves.size() >= size_t{PONDER_REPLIES}) {
+            break;
+        }
+        moves.emplace_back(reply.move);
+        coverage += reply.probability;
+    }
+    return moves;
+}
+
+void UCTSearch::count_ponder_hit(const GameState& g) {
+    if (m_ponder_replies.empty()) {
+        return;
+    }
+    auto prevstate = g;
+    if (g.get_movenum() == m_rootstate.get_movenum() + 1
+        && prevstate.undo_move()
+        && prevstate.board.get_hash() == m_rootstate.board.get_hash()) {
+        const auto reply = g.get_last_move();
+        const auto hit = std::find(begin(m_ponder_replies),
+                                   end(m_ponder_replies), reply)
+                         != end(m_ponder_replies);
+        m_ponder_count++;
+        if (hit) {
+            m_ponder_hits++;
+        }
+        myprintf("Pondered reply %s: %s, %d of %d hit (%.0f%%).\n",
+                 m_rootstate.move_to_text(reply).c_str(),
+                 hit ? "hit" : "miss", m_ponder_hits, m_ponder_count,
+                 100.0f * m_ponder_hits / m_ponder_count);
+    }
+    m_ponder_replies.clear();
+}
+
+void UCTSearch::ponder(const GameState& g, int analysis_centis) {
     set_gamestate(g);
+    if (!m_root->has_children()) {
+        float root_eval;
+        m_root->create_children(*m_arena, m_nodes, m_rootstate, root_eval);
+    }
+    m_root->inflate_all_children(*m_arena);
+    // Spend the opponent's time on the replies we expect, so the tree
+    // we keep once the actual reply arrives is as big as possible.
+    // Analysis wants to hear about every move, though.
+    if (analysis_centis == 0 && m_root->has_children()) {
+        m_ponder_replies = predict_replies();
+        m_root->focus_children(m_ponder_replies);
+    }
 
+    m_root_visits = m_root->get_visits();
+    TTable::get_TT().new_generation();
     m_run = true;
-    int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
-    }
+    start_helpers(tg);
+    Time start;
+    auto last_analysis = 0;
+    auto currstate = KoState{};
+    auto root_stats = UCTNode::PendingStats{};
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-        auto result = play_simulation(*currstate, m_root.get());
+        currstate = m_rootstate;
+        auto result = play_simulation(currstate, m_root, &root_stats);
         if (result.valid()) {
             increment_playouts();
         }
-    } while(!Utils::input_pending() && is_running());
+        flush_root_stats(root_stats, false);
+        if (m_arena->full()) {
+            prune_tree(tg, root_stats);
+        }
+
+        if (analysis_centis > 0) {
+            Time now;
+            const auto elapsed_centis = Time::timediff_centis(start, now);
+            if (elapsed_centis - last_analysis >= analysis_centis) {
+                last_analysis = elapsed_centis;
+                const auto analysis = get_analysis();
+                if (!analysis.empty()) {
+                    gtp_printf_raw("%s\n", analysis.c_str());
+                }
+            }
+        }
+    } while(!GTP::input_pending() && is_running()
+            && m_root_visits + m_playouts < UCTNode::MAX_VISITS);
 
     // stop the search
     m_run = false;
+    flush_root_stats(root_stats, true);
+    TTable::get_TT().flush_stats();
     tg.wait_all();
+    Speculator::clear();
+    m_root->clear_focus();
     // display search info
     myprintf("\n");
     dump_stats(m_rootstate, *m_root);
@@ -498,6 +1122,48 @@ void UCTSearch::ponder(const GameState& g) {
     myprintf("\n%d visits, %d nodes\n\n", m_root->get_visits(), (int)m_nodes);
 }
 
+void UCTSearch::start_search(const GameState& g) {
+    set_gamestate(g);
+    if (!m_root->has_children()) {
+        float root_eval;
+        m_root->create_children(*m_arena, m_nodes, m_rootstate, root_eval);
+    }
+    m_root->inflate_all_children(*m_arena);
+    m_root->kill_superkos(m_rootstate);
+
+    m_root_visits = m_root->get_visits();
+    TTable::get_TT().new_generation();
+    m_run = true;
+}
+
+void UCTSearch::run_playouts(int playouts) {
+    auto currstate = KoState{};
+    auto root_stats = UCTNode::PendingStats{};
+    for (auto i = 0; i < playouts
+         && m_root_visits + m_playouts < UCTNode::MAX_VISITS; i++) {
+        currstate = m_rootstate;
+        auto result = play_simulation(currstate, m_root, &root_stats);
+        if (result.valid()) {
+            increment_playouts();
+        }
+        flush_root_stats(root_stats, false);
+    }
+    flush_root_stats(root_stats, true);
+    TTable::get_TT().flush_stats();
+}
+
+int UCTSearch::finish_search(passflag_t passflag) {
+    m_run = false;
+    Speculator::clear();
+    if (!m_root->has_children()) {
+        return FastBoard::PASS;
+    }
+    int bestmove = get_best_move(passflag);
+    m_rootstate.play_move(bestmove);
+    promote_root(m_root->find_new_root(bestmove));
+    return bestmove;
+}
+
 void UCTSearch::set_playout_limit(int playouts) {
     static_assert(std::is_convertible<decltype(playouts),
                                       decltype(m_maxplayouts)>::value,
@@ -513,8 +1179,8 @@ void UCTSearch::set_visit_limit(int visits) {
     static_assert(std::is_convertible<decltype(visits),
                                       decltype(m_maxvisits)>::value,
                   "Inconsistent types for visits amount.");
-    if (visits == 0) {
-        m_maxvisits = std::numeric_limits<decltype(m_maxvisits)>::max();
+    if (visits == 0 || visits > UCTNode::MAX_VISITS) {
+        m_maxvisits = UCTNode::MAX_VISITS;
     } else {
         m_maxvisits = visits;
     }
@@ -19,16 +19,23 @@
 #ifndef UCTSEARCH_H_INCLUDED
 #define UCTSEARCH_H_INCLUDED
 
+#include <array>
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <future>
 #include <string>
 #include <tuple>
 
+#include "Book.h"
 #include "FastBoard.h"
 #include "GameState.h"
 #include "KoState.h"
 #include "UCTNode.h"
 
+namespace Utils {
+    class ThreadGroup;
+}
 
 class SearchResult {
 public:
@@ -67,38 +74,149 @@ public:
     static constexpr passflag_t NORESIGN = 1 << 1;
 
     /*
-        Maximum size of the tree in memory. Nodes are about
-        48 bytes, so limit to ~1.2G on 32-bits and about 5.5G
-        on 64-bits.
+        Maximum size of the tree in memory. A node and its edge
+        take about 60 bytes, so limit to ~1.4G on 32-bits and about
+        6G on 64-bits. This sets the capacity of the tree arena,
+        unless --max-memory asks for less.
     */
     static constexpr auto MAX_TREE_SIZE =
         (sizeof(void*) == 4 ? 25'000'000 : 100'000'000);
+    static constexpr auto MAX_TREE_BYTES =
+        size_t{MAX_TREE_SIZE} * (sizeof(UCTNode) + UCTNode::EDGE_BYTES);
+    // Bytes the tree arena may take: MAX_TREE_BYTES, or with
+    // --max-memory whatever the NNCache leaves of it, split evenly over
+    // the searches that exist, like those of self-play games or
+    // analysis sessions.
+    static size_t get_tree_budget();
+    // Playouts each thread gathers before adding them to the root.
+    static constexpr auto ROOT_STATS_BATCH = 16;
+    // How often a playout looks for another child when the one it
+    // picked is being expanded by someone else.
+    static constexpr auto BUSY_RESELECTS = 4;
+    // How often think looks at the root children to decide whether to
+    // stop early or take extra time, in centiseconds.
+    static constexpr auto STABILITY_CHECK_CS = 10;
+    // Pondering only looks at the opponent's most likely replies: the
+    // fewest that together are expected with PONDER_COVERAGE, but no
+    // more than PONDER_REPLIES of them.
+    static constexpr auto PONDER_REPLIES = 8;
+    static constexpr auto PONDER_COVERAGE = 0.9f;
 
     UCTSearch();
+    ~UCTSearch();
     void set_gamestate(const GameState& g);
     int think(int color, const GameState& g, passflag_t passflag = NORMAL);
     void set_playout_limit(int playouts);
     void set_visit_limit(int visits);
-    void ponder(const GameState& g);
+    // With analysis_centis, prints lz-analyze info lines that often.
+    void ponder(const GameState& g, int analysis_centis = 0);
     bool is_running() const;
     bool playout_or_visit_limit_reached() const;
     void increment_playouts();
-    SearchResult play_simulation(GameState& currstate, UCTNode* const node);
+    // With root_stats the update of node goes there instead, to be added
+    // to the node later by flush_root_stats. Only used for the root.
+    SearchResult play_simulation(KoState& currstate, UCTNode* const node,
+                                 UCTNode::PendingStats* root_stats = nullptr);
+    void flush_root_stats(UCTNode::PendingStats& root_stats, bool force);
+
+    // For searches driven by threads of the caller, as in the analysis
+    // server: after start_search, any number of threads may be in
+    // run_playouts at once.
+    void start_search(const GameState& g);
+    void run_playouts(int playouts);
+    // Ends such a search and returns the move think would have played.
+    // The tree is kept for the next start_search.
+    int finish_search(passflag_t passflag = NORMAL);
+    // One lz-analyze line for the root children, safe during the search.
+    std::string get_analysis();
+    // The visited root children, most visited first, as a book stores
+    // them.
+    std::vector<Book::Move> get_root_moves() const;
+    int get_root_visits() const;
+    // For the side to move.
+    float get_root_eval() const;
+    // The principal variation from the root, as vertices separated by
+    // spaces.
+    std::string get_best_pv();
+
+    // Writes the tree of the position of g to filename, without the
+    // branches that have fewer than min_visits visits. False if there
+    // is no tree for g or the file can't be written.
+    bool save_tree(const std::string& filename, const GameState& g,
+                   int min_visits);
+    // Makes a tree from save_tree the root of the next search of g.
+    // The file is mapped into memory and copied into a fresh arena.
+    // False if it can't be read, doesn't fit, or was saved for another
+    // position or network.
+    bool load_tree(const std::string& filename, const GameState& g);
 
 private:
+    static constexpr auto TREE_VERSION = 1;
+
+    // Followed by the nodes and the edges, see UCTNode::SavedNode.
+    struct TreeHeader {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t board_size;
+        float komi;
+        std::uint32_t min_visits;
+        std::uint64_t hash;
+        std::uint64_t ko_hash;
+        std::uint64_t network_hash;
+        std::uint64_t node_count;
+        std::uint64_t edge_count;
+    };
+
     void dump_stats(KoState& state, UCTNode& parent);
     std::string get_pv(KoState& state, UCTNode& parent);
     void dump_analysis(int playouts);
+    // The most visited root child, and the visits of the runner up.
+    struct TopChildren {
+        int move;
+        int visits;
+        int runner_up_visits;
+    };
+    TopChildren get_top_children() const;
+    // Starts the root from the analysis of an opening book.
+    void seed_root(const std::vector<Book::Move>& moves);
+    std::vector<int> predict_replies() const;
+    // Reports whether the move that led to g was one we pondered on.
+    void count_ponder_hit(const GameState& g);
     bool should_resign(passflag_t passflag, float bestscore);
     int get_best_move(passflag_t passflag);
+    UCTNode* find_reusable_root(const GameState& g);
+    void promote_root(UCTNode* new_root);
+    // Copies the tree at root, which is part of the current tree, into
+    // arena, without as many of the least visited branches as it takes
+    // to fill no more than half of it.
+    UCTNode* copy_trimmed(const UCTNode& root, UCTNodeArena& arena);
+    void reclaim(std::unique_ptr<UCTNodeArena> arena);
+    // Makes room in a full tree halfway through a search, so that it can
+    // keep expanding instead of throwing away evaluations at the leaves.
+    // The helper threads of tg are stopped and started again.
+    void prune_tree(Utils::ThreadGroup& tg,
+                    UCTNode::PendingStats& root_stats);
+    void start_helpers(Utils::ThreadGroup& tg);
 
     GameState m_rootstate;
-    std::unique_ptr<UCTNode> m_root;
+    std::unique_ptr<UCTNodeArena> m_arena;
+    // Seconds spent freeing the last discarded tree.
+    std::future<double> m_reclaim;
+    UCTNode* m_root{nullptr};
     std::atomic<int> m_nodes{0};
     std::atomic<int> m_playouts{0};
     std::atomic<bool> m_run{false};
+    // Root visits when the search started. The root itself lags behind
+    // while threads hold back their updates, so the visit limit is
+    // checked against this plus m_playouts.
+    int m_root_visits{0};
     int m_maxplayouts;
     int m_maxvisits;
+    // Replies the last ponder looked at, and how often the opponent
+    // played one of them.
+    std::vector<int> m_ponder_replies;
+    int m_ponder_hits{0};
+    int m_ponder_count{0};
 };
 
 class UCTWorker {
@@ -23,59 +23,13 @@
 #include <cstdarg>
 #include <cstdio>
 
-#ifdef _WIN32
-#include <windows.h>
-#else
-#include <sys/select.h>
-#endif
-
 #include "GTP.h"
 
 Utils::ThreadPool thread_pool;
 
-bool Utils::input_pending(void) {
-#ifdef HAVE_SELECT
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(0,&read_fds);
-    struct timeval timeout{0,0};
-    select(1,&read_fds,NULL,NULL,&timeout);
-    return FD_ISSET(0, &read_fds);
-#else
-    static int init = 0, pipe;
-    static HANDLE inh;
-    DWORD dw;
-
-    if (!init) {
-        init = 1;
-        inh = GetStdHandle(STD_INPUT_HANDLE);
-        pipe = !GetConsoleMode(inh, &dw);
-        if (!pipe) {
-            SetConsoleMode(inh, dw & ~(ENABLE_MOUSE_INPUT | ENABLE_WINDOW_INPUT));
-            FlushConsoleInputBuffer(inh);
-        }
-    }
-
-    if (pipe) {
-        if (!PeekNamedPipe(inh, NULL, 0, NULL, &dw, NULL)) {
-            myprintf("Nothing at other end - exiting\n");
-            exit(EXIT_FAILURE);
-        }
-
-        return dw;
-    } else {
-        if (!GetNumberOfConsoleInputEvents(inh, &dw)) {
-            myprintf("Nothing at other end - exiting\n");
-            exit(EXIT_FAILURE);
-        }
-
-        return dw > 1;
-    }
-    return false;
-#endif
-}
-
 static std::mutex IOmutex;
+// The responses come from the main thread and the input thread.
+static std::mutex GTPmutex;
 
 void Utils::myprintf(const char *fmt, ...) {
     if (cfg_quiet) {
@@ -107,6 +61,7 @@ static void gtp_base_printf(int id, std::string prefix,
         prefix += std::to_string(id);
     }
 
+    std::lock_guard<std::mutex> gtp_lock(GTPmutex);
     gtp_fprintf(stdout, prefix, fmt, ap);
 
     if (cfg_logfile_handle) {
@@ -129,6 +84,21 @@ void Utils::gtp_fail_printf(int id, const char *fmt, ...) {
     va_end(ap);
 }
 
+void Utils::gtp_printf_raw(const char *fmt, ...) {
+    std::lock_guard<std::mutex> gtp_lock(GTPmutex);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+
+    if (cfg_logfile_handle) {
+        std::lock_guard<std::mutex> lock(IOmutex);
+        va_start(ap, fmt);
+        vfprintf(cfg_logfile_handle, fmt, ap);
+        va_end(ap);
+    }
+}
+
 void Utils::log_input(const std::string& input) {
     if (cfg_logfile_handle) {
         std::lock_guard<std::mutex> lock(IOmutex);
@@ -136,6 +106,13 @@ void Utils::log_input(const std::string& input) {
     }
 }
 
+void Utils::flush_log() {
+    if (cfg_logfile_handle) {
+        std::lock_guard<std::mutex> lock(IOmutex);
+        fflush(cfg_logfile_handle);
+    }
+}
+
 size_t Utils::lcm(size_t a, size_t b) {
     if (a % b == 0) {
         return a;
@@ -33,8 +33,10 @@ namespace Utils {
     void myprintf(const char *fmt, ...);
     void gtp_printf(int id, const char *fmt, ...);
     void gtp_fail_printf(int id, const char *fmt, ...);
+    // Plain output to stdout, for responses that are streamed.
+    void gtp_printf_raw(const char *fmt, ...);
     void log_input(const std::string& input);
-    bool input_pending();
+    void flush_log();
 
     template<class T>
     void atomic_add(std::atomic<T> &f, T d) {
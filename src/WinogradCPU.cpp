@@ -0,0 +1,311 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "config.h"
+#include "WinogradCPU.h"
+
+#include <algorithm>
+#include <array>
+
+#include "Network.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WINOGRAD_MULTIVERSION
+#define WINOGRAD_INLINE inline __attribute__((always_inline))
+#else
+#define WINOGRAD_INLINE inline
+#endif
+
+namespace {
+
+constexpr auto W = BOARD_SIZE;
+constexpr auto H = BOARD_SIZE;
+static_assert(W % 2 == 1, "the tile split below needs an odd board size");
+constexpr auto WTILES = (W + 1) / 2;
+constexpr auto P = WTILES * WTILES;
+constexpr auto ALPHA = 4;
+
+// Padded rows -1..20, padded columns -1..20 split into the even ones
+// (-1, 1, ..., 19) and the odd ones (0, 2, ..., 20). Tile x then covers
+// even[x], odd[x], even[x + 1] and odd[x + 1].
+constexpr auto PAD_ROWS = 2 * WTILES + 2;
+constexpr auto PAD_COLS = WTILES + 1;
+using HalfRow = std::array<float, PAD_COLS>;
+using TileRow = std::array<float, WTILES>;
+
+// With FIXED_C the channel count is a compile time constant, which turns
+// the channel split into shifts and the strides between the tile blocks
+// into constants. 0 takes it from C at runtime.
+template <int FIXED_C>
+WINOGRAD_INLINE void transform_in_shape(const float* in, float* V,
+                                        const int runtime_C,
+                                        const int batch_size) {
+    const auto C = FIXED_C ? FIXED_C : runtime_C;
+    const auto BP = batch_size * P;
+    std::array<HalfRow, PAD_ROWS> even, odd;
+    for (auto ch = 0; ch < C * batch_size; ch++) {
+        const auto b = ch / C;
+        const auto c = ch % C;
+        const auto plane = in + ch * W * H;
+        even.front().fill(0.0f);
+        odd.front().fill(0.0f);
+        for (auto y = 0; y < H; y++) {
+            auto& e = even[y + 1];
+            auto& o = odd[y + 1];
+            e[0] = 0.0f;
+            for (auto x = 0; x < WTILES - 1; x++) {
+                o[x] = plane[y * W + 2 * x];
+                e[x + 1] = plane[y * W + 2 * x + 1];
+            }
+            o[WTILES - 1] = plane[y * W + W - 1];
+            e[WTILES] = 0.0f;
+            o[WTILES] = 0.0f;
+        }
+        for (auto y = H + 1; y < PAD_ROWS; y++) {
+            even[y].fill(0.0f);
+            odd[y].fill(0.0f);
+        }
+
+        for (auto block_y = 0; block_y < WTILES; block_y++) {
+            const auto r = 2 * block_y;
+            // transpose(B).x, separately for the even and odd columns.
+            std::array<HalfRow, ALPHA> te, to;
+            for (auto i = 0; i < PAD_COLS; i++) {
+                te[0][i] = even[r + 0][i] - even[r + 2][i];
+                te[1][i] = even[r + 1][i] + even[r + 2][i];
+                te[2][i] = even[r + 2][i] - even[r + 1][i];
+                te[3][i] = even[r + 1][i] - even[r + 3][i];
+                to[0][i] = odd[r + 0][i] - odd[r + 2][i];
+                to[1][i] = odd[r + 1][i] + odd[r + 2][i];
+                to[2][i] = odd[r + 2][i] - odd[r + 1][i];
+                to[3][i] = odd[r + 1][i] - odd[r + 3][i];
+            }
+            // (transpose(B).x).B, one output array per tile element.
+            const auto offset = c * BP + b * P + block_y * WTILES;
+            for (auto i = 0; i < ALPHA; i++) {
+                auto v0 = V + (i * ALPHA + 0) * C * BP + offset;
+                auto v1 = V + (i * ALPHA + 1) * C * BP + offset;
+                auto v2 = V + (i * ALPHA + 2) * C * BP + offset;
+                auto v3 = V + (i * ALPHA + 3) * C * BP + offset;
+                for (auto x = 0; x < WTILES; x++) {
+                    v0[x] = te[i][x] - te[i][x + 1];
+                    v1[x] = to[i][x] + te[i][x + 1];
+                    v2[x] = te[i][x + 1] - to[i][x];
+                    v3[x] = to[i][x] - to[i][x + 1];
+                }
+            }
+        }
+    }
+}
+
+// Writes one board row of the output, applying batchnorm, the residual
+// and ReLU if means is not nullptr.
+WINOGRAD_INLINE void store_out_row(const float* row, float* out,
+                                   const float* means, const float* stddivs,
+                                   const float* residual, const int k) {
+    if (means == nullptr) {
+        std::copy(row, row + W, out);
+        return;
+    }
+    const auto mean = means[k];
+    const auto scale_stddiv = stddivs[k];
+    if (residual == nullptr) {
+        for (auto x = 0; x < W; x++) {
+            out[x] = std::max(0.0f, scale_stddiv * (row[x] - mean));
+        }
+    } else {
+        for (auto x = 0; x < W; x++) {
+            out[x] = std::max(0.0f,
+                              residual[x] + scale_stddiv * (row[x] - mean));
+        }
+    }
+}
+
+template <int FIXED_K>
+WINOGRAD_INLINE void transform_out_shape(const float* M, float* Y,
+                                         const int runtime_K,
+                                         const int batch_size,
+                                         const float* means,
+                                         const float* stddivs,
+                                         const float* residual) {
+    const auto K = FIXED_K ? FIXED_K : runtime_K;
+    const auto BP = batch_size * P;
+    for (auto bk = 0; bk < K * batch_size; bk++) {
+        const auto b = bk / K;
+        const auto k = bk % K;
+        for (auto block_y = 0; block_y < WTILES; block_y++) {
+            const auto offset = k * BP + b * P + block_y * WTILES;
+            // transpose(A).m, one array per column of the tile.
+            std::array<TileRow, ALPHA> r0, r1;
+            for (auto nu = 0; nu < ALPHA; nu++) {
+                auto m0 = M + (0 * ALPHA + nu) * K * BP + offset;
+                auto m1 = M + (1 * ALPHA + nu) * K * BP + offset;
+                auto m2 = M + (2 * ALPHA + nu) * K * BP + offset;
+                auto m3 = M + (3 * ALPHA + nu) * K * BP + offset;
+                for (auto x = 0; x < WTILES; x++) {
+                    r0[nu][x] = m0[x] + m1[x] + m2[x];
+                    r1[nu][x] = m1[x] - m2[x] - m3[x];
+                }
+            }
+            // (transpose(A).m).A, interleaved back into board rows.
+            std::array<float, 2 * WTILES> out0, out1;
+            for (auto x = 0; x < WTILES; x++) {
+                out0[2 * x]     = r0[0][x] + r0[1][x] + r0[2][x];
+                out0[2 * x + 1] = r0[1][x] - r0[2][x] - r0[3][x];
+                out1[2 * x]     = r1[0][x] + r1[1][x] + r1[2][x];
+                out1[2 * x + 1] = r1[1][x] - r1[2][x] - r1[3][x];
+            }
+            const auto y = 2 * block_y;
+            const auto res = residual ? residual + bk * W * H : nullptr;
+            store_out_row(out0.data(), Y + bk * W * H + y * W,
+                          means, stddivs, res ? res + y * W : nullptr, k);
+            if (y + 1 < H) {
+                store_out_row(out1.data(), Y + bk * W * H + (y + 1) * W,
+                              means, stddivs,
+                              res ? res + (y + 1) * W : nullptr, k);
+            }
+        }
+    }
+}
+
+// The input planes and the tower widths of the networks we run, see
+// transform_in_shape. Others take the runtime path.
+WINOGRAD_INLINE void transform_in_impl(const float* in, float* V,
+                                       const int C, const int batch_size) {
+    switch (C) {
+    case Network::INPUT_CHANNELS:
+        transform_in_shape<Network::INPUT_CHANNELS>(in, V, C, batch_size);
+        break;
+    case 64:  transform_in_shape<64>(in, V, C, batch_size); break;
+    case 128: transform_in_shape<128>(in, V, C, batch_size); break;
+    case 192: transform_in_shape<192>(in, V, C, batch_size); break;
+    case 256: transform_in_shape<256>(in, V, C, batch_size); break;
+    default:  transform_in_shape<0>(in, V, C, batch_size); break;
+    }
+}
+
+WINOGRAD_INLINE void transform_out_impl(const float* M, float* Y,
+                                        const int K,
+                                        const int batch_size,
+                                        const float* means,
+                                        const float* stddivs,
+                                        const float* residual) {
+    switch (K) {
+    case 64:
+        transform_out_shape<64>(M, Y, K, batch_size,
+                                means, stddivs, residual);
+        break;
+    case 128:
+        transform_out_shape<128>(M, Y, K, batch_size,
+                                 means, stddivs, residual);
+        break;
+    case 192:
+        transform_out_shape<192>(M, Y, K, batch_size,
+                                 means, stddivs, residual);
+        break;
+    case 256:
+        transform_out_shape<256>(M, Y, K, batch_size,
+                                 means, stddivs, residual);
+        break;
+    default:
+        transform_out_shape<0>(M, Y, K, batch_size,
+                               means, stddivs, residual);
+        break;
+    }
+}
+
+void transform_in_generic(const float* in, float* V, const int C,
+                          const int batch_size) {
+    transform_in_impl(in, V, C, batch_size);
+}
+
+void transform_out_generic(const float* M, float* Y, const int K,
+                           const int batch_size,
+                           const float* means, const float* stddivs,
+                           const float* residual) {
+    transform_out_impl(M, Y, K, batch_size, means, stddivs, residual);
+}
+
+#ifdef WINOGRAD_MULTIVERSION
+#define WINOGRAD_VARIANT(isa, flags)                                    \
+__attribute__((target(flags)))                                          \
+void transform_in_##isa(const float* in, float* V, const int C,         \
+                        const int batch_size) {                         \
+    transform_in_impl(in, V, C, batch_size);                            \
+}                                                                       \
+__attribute__((target(flags)))                                          \
+void transform_out_##isa(const float* M, float* Y, const int K,         \
+                         const int batch_size,                          \
+                         const float* means, const float* stddivs,      \
+                         const float* residual) {                       \
+    transform_out_impl(M, Y, K, batch_size, means, stddivs, residual);  \
+}
+
+WINOGRAD_VARIANT(sse41, "sse4.1")
+WINOGRAD_VARIANT(avx2, "avx2,fma")
+WINOGRAD_VARIANT(avx512, "avx512f")
+#undef WINOGRAD_VARIANT
+#endif
+
+struct Kernels {
+    const char* name;
+    void (*transform_in)(const float*, float*, int, int);
+    void (*transform_out)(const float*, float*, int, int,
+                          const float*, const float*, const float*);
+};
+
+Kernels select_kernels() {
+#ifdef WINOGRAD_MULTIVERSION
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return {"AVX-512", transform_in_avx512, transform_out_avx512};
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return {"AVX2", transform_in_avx2, transform_out_avx2};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return {"SSE4.1", transform_in_sse41, transform_out_sse41};
+    }
+#endif
+    return {"generic", transform_in_generic, transform_out_generic};
+}
+
+const Kernels& get_kernels() {
+    static const auto kernels = select_kernels();
+    return kernels;
+}
+
+}
+
+void WinogradCPU::transform_in(const float* in, float* V, const int C,
+                               const int batch_size) {
+    get_kernels().transform_in(in, V, C, batch_size);
+}
+
+void WinogradCPU::transform_out(const float* M, float* Y, const int K,
+                                const int batch_size,
+                                const float* means, const float* stddivs,
+                                const float* residual) {
+    get_kernels().transform_out(M, Y, K, batch_size,
+                                means, stddivs, residual);
+}
+
+const char* WinogradCPU::get_isa_name() {
+    return get_kernels().name;
+}
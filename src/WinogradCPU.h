@@ -0,0 +1,51 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WINOGRADCPU_H_INCLUDED
+#define WINOGRADCPU_H_INCLUDED
+
+#include "config.h"
+
+/*
+    Winograd F(2x2, 3x3) input and output transforms for the CPU backend.
+    Instead of transforming one 4x4 tile at a time, a whole row of tiles
+    is done with straight-line arithmetic on contiguous arrays, which the
+    compiler turns into vector code. The same code is built for several
+    instruction sets and the best one supported by the CPU is picked at
+    runtime. It is also built for the common channel counts, 64, 128,
+    192 and 256, and the input planes. The one matching the network is
+    picked on every call.
+*/
+namespace WinogradCPU {
+    // in is batch_size x C planes of BOARD_SIZE x BOARD_SIZE, V is WINOGRAD_TILE blocks of
+    // C x (batch_size * P), so all positions share one GEMM per block.
+    void transform_in(const float* in, float* V, int C, int batch_size);
+    // M is WINOGRAD_TILE blocks of K x (batch_size * P), Y is
+    // batch_size x K planes of BOARD_SIZE x BOARD_SIZE.
+    // If means is not nullptr, batchnorm and ReLU are applied to the
+    // result, with the residual planes (if any) added before the ReLU.
+    void transform_out(const float* M, float* Y, int K, int batch_size,
+                       const float* means = nullptr,
+                       const float* stddivs = nullptr,
+                       const float* residual = nullptr);
+    // Name of the instruction set the transforms use.
+    const char* get_isa_name();
+}
+
+#endif
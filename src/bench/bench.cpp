@@ -0,0 +1,296 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    Microbenchmarks of the search, board and network hot paths.
+
+      bench [-w weights] [-t threads] [--batchsize N] [filter]
+
+    Every benchmark whose name contains filter is run and prints one
+    line of JSON to stdout:
+      {"name": "gather_features", "iterations": 100000, "ns_per_op": 812.3}
+    All positions and keys come from fixed seeds, so runs on the same
+    build are comparable. The network benchmarks and the end to end
+    search only run with -w.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "KoState.h"
+#include "NNCache.h"
+#include "Network.h"
+#include "Random.h"
+#include "TTable.h"
+#include "ThreadPool.h"
+#include "UCTNode.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+#include "WinogradCPU.h"
+#include "Zobrist.h"
+
+using namespace Utils;
+
+namespace {
+
+std::string filter;
+
+void report(const std::string& name, const int iterations,
+            const double ns_per_op) {
+    std::printf("{\"name\": \"%s\", \"iterations\": %d, "
+                "\"ns_per_op\": %.1f}\n",
+                name.c_str(), iterations, ns_per_op);
+    std::fflush(stdout);
+}
+
+bool selected(const std::string& name) {
+    return name.find(filter) != std::string::npos;
+}
+
+// Times iterations calls of body(i).
+template <typename F>
+void run(const std::string& name, const int iterations, F&& body) {
+    if (!selected(name)) {
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; i++) {
+        body(i);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const auto ns = std::chrono::duration<double, std::nano>(end - start);
+    report(name, iterations, ns.count() / iterations);
+}
+
+// Legal moves of the side to move, excluding pass.
+std::vector<int> legal_moves(GameState& state) {
+    auto moves = std::vector<int>{};
+    const auto color = state.get_to_move();
+    for (auto i = 0; i < BOARD_SIZE; i++) {
+        for (auto j = 0; j < BOARD_SIZE; j++) {
+            const auto vertex = state.board.get_vertex(i, j);
+            if (state.is_move_legal(color, vertex)) {
+                moves.emplace_back(vertex);
+            }
+        }
+    }
+    return moves;
+}
+
+// The same middle game position every run.
+GameState make_position(const int moves) {
+    auto rng = Random{5489};
+    auto state = GameState{};
+    state.init_game(BOARD_SIZE, 7.5f);
+    for (auto i = 0; i < moves; i++) {
+        const auto legal = legal_moves(state);
+        state.play_move(legal[rng.randuint32(legal.size())]);
+    }
+    return state;
+}
+
+void bench_board(GameState& position) {
+    const auto moves = legal_moves(position);
+
+    run("board_play_undo", 100000, [&](int i) {
+        position.play_move(moves[i % moves.size()]);
+        position.undo_move();
+    });
+    // What every playout does on its way down the tree.
+    auto rootstate = static_cast<KoState&>(position);
+    auto currstate = KoState{};
+    run("kostate_copy_play", 100000, [&](int i) {
+        currstate = rootstate;
+        currstate.play_move(moves[i % moves.size()]);
+    });
+    auto planes = Network::NNPlanes{};
+    run("gather_features", 100000, [&](int) {
+        Network::gather_features(&position, planes);
+    });
+}
+
+void bench_caches(GameState& position) {
+    auto result = Network::Netresult{};
+    const auto moves = legal_moves(position);
+    for (const auto vertex : moves) {
+        const auto xy = position.board.get_xy(vertex);
+        result.policy[xy.second * BOARD_SIZE + xy.first] = 1.0f / moves.size();
+    }
+    result.winrate = 0.5f;
+
+    constexpr auto KEYS = 65536;
+    auto rng = Random{5489};
+    auto keys = std::vector<std::uint64_t>{};
+    for (auto i = 0; i < KEYS; i++) {
+        const auto high = std::uint64_t{rng.randuint32()};
+        keys.emplace_back((high << 32) | rng.randuint32());
+    }
+    auto& cache = NNCache::get_NNCache();
+    run("nncache_insert", KEYS, [&](int i) {
+        cache.insert(keys[i], result);
+    });
+    auto found = Network::Netresult{};
+    run("nncache_lookup", KEYS, [&](int i) {
+        cache.lookup(keys[i], found);
+    });
+
+    auto& tt = TTable::get_TT();
+    UCTNode node(FastBoard::PASS, 1.0f, 0.5f);
+    node.set_stats(100, 55.0);
+    run("ttable_update", KEYS, [&](int i) {
+        tt.update(keys[i], 7.5f, &node);
+    });
+    run("ttable_sync", KEYS, [&](int i) {
+        tt.sync(keys[i], 7.5f, &node);
+    });
+}
+
+void bench_winograd() {
+    constexpr auto CHANNELS = 128;
+    auto rng = Random{5489};
+    auto in = std::vector<float>(CHANNELS * NUM_INTERSECTIONS);
+    for (auto& v : in) {
+        v = rng.randflt() - 0.5f;
+    }
+    auto V = std::vector<float>(Network::WINOGRAD_TILE * CHANNELS
+                                * Network::WINOGRAD_P);
+    run("winograd_transform_in_128", 20000, [&](int) {
+        WinogradCPU::transform_in(in.data(), V.data(), CHANNELS, 1);
+    });
+    auto means = std::vector<float>(CHANNELS, 0.1f);
+    auto stddivs = std::vector<float>(CHANNELS, 0.9f);
+    run("winograd_transform_out_128", 20000, [&](int) {
+        WinogradCPU::transform_out(V.data(), in.data(), CHANNELS, 1,
+                                   means.data(), stddivs.data());
+    });
+}
+
+void bench_select() {
+    const auto name = std::string{"uct_select_child"};
+    if (selected(name)) {
+        constexpr auto ITERATIONS = 1000000;
+        report(name, ITERATIONS, UCTNode::benchmark(ITERATIONS));
+    }
+}
+
+void bench_network(GameState& position) {
+    run("nn_eval", 400, [&](int) {
+        Network::get_scored_moves(&position, Network::Ensemble::DIRECT, 0,
+                                  true);
+    });
+    for (auto batch_size = 1; batch_size <= cfg_batch_size; batch_size *= 2) {
+        const auto name = "nn_batch_" + std::to_string(batch_size);
+        if (selected(name)) {
+            constexpr auto ITERATIONS = 100;
+            const auto us = Network::benchmark_batch(&position, batch_size,
+                                                     ITERATIONS);
+            report(name, ITERATIONS, us * 1000.0);
+        }
+    }
+}
+
+// Playouts per second of a whole search, reported as ns per playout.
+void bench_search(GameState& position) {
+    const auto name = std::string{"search_playouts"};
+    if (!selected(name)) {
+        return;
+    }
+    constexpr auto PLAYOUTS = 3200;
+    // Start from an empty cache, or a second run measures only hits.
+    NNCache::get_NNCache().clear();
+    TTable::get_TT().clear();
+    auto search = std::make_unique<UCTSearch>();
+    const auto start = std::chrono::steady_clock::now();
+    search->start_search(position);
+    ThreadGroup tg(thread_pool);
+    for (auto i = 0; i < cfg_num_threads; i++) {
+        tg.add_task([&search]() {
+            search->run_playouts(PLAYOUTS / cfg_num_threads);
+        });
+    }
+    tg.wait_all();
+    search->finish_search();
+    const auto end = std::chrono::steady_clock::now();
+    const auto ns = std::chrono::duration<double, std::nano>(end - start);
+    report(name, PLAYOUTS, ns.count() / PLAYOUTS);
+}
+
+void usage() {
+    std::fprintf(stderr, "Usage: bench [-w weights] [-t threads] "
+                         "[--batchsize N] [filter]\n");
+    exit(EXIT_FAILURE);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    GTP::setup_default_parameters();
+    cfg_quiet = true;
+    cfg_rng_seed = 5489;
+    cfg_num_threads = 1;
+
+    for (auto i = 1; i < argc; i++) {
+        const auto arg = std::string{argv[i]};
+        if (arg == "-w" || arg == "-t" || arg == "--batchsize") {
+            if (++i == argc) {
+                usage();
+            }
+            if (arg == "-w") {
+                cfg_weightsfile = argv[i];
+            } else if (arg == "-t") {
+                cfg_num_threads = std::max(1, std::atoi(argv[i]));
+            } else {
+                cfg_batch_size = std::max(1, std::atoi(argv[i]));
+            }
+        } else if (arg[0] == '-') {
+            usage();
+        } else {
+            filter = arg;
+        }
+    }
+
+    thread_pool.initialize(cfg_num_threads);
+    auto rng = std::make_unique<Random>(5489);
+    Zobrist::init_zobrist(*rng);
+    Random::get_Rng().seedrandom(cfg_rng_seed);
+    NNCache::get_NNCache().set_size_from_playouts(cfg_max_playouts);
+
+    auto position = make_position(60);
+    bench_board(position);
+    bench_caches(position);
+    bench_winograd();
+    bench_select();
+    if (!cfg_weightsfile.empty()) {
+        Network::initialize();
+        bench_network(position);
+        bench_search(position);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,430 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "ChunkDecoder.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#include "Network.h"
+#include "Training.h"
+
+namespace {
+
+constexpr auto INPUT_PLANES = 16;
+// The input planes and the two side to move planes.
+constexpr auto OUTPUT_PLANES = INPUT_PLANES + 2;
+// Lines of a text record: the input planes, the side to move, the
+// probabilities and the winner.
+constexpr auto TEXT_LINES = INPUT_PLANES + 3;
+// The 360 first intersections of a text plane are hex digits, the
+// last one is a digit of its own.
+constexpr auto HEX_DIGITS = (NUM_INTERSECTIONS - 1) / 4;
+
+// A decoded position, symmetry applied.
+struct Position {
+    std::array<Network::BoardPlane, INPUT_PLANES> planes;
+    std::uint8_t to_move;
+    float winner;
+    std::array<float, POTENTIAL_MOVES> probs;
+};
+
+// The inverse of float_to_half in Training.cpp.
+float half_to_float(const std::uint16_t half) {
+    const auto sign = std::uint32_t(half & 0x8000) << 16;
+    auto exponent = int((half >> 10) & 0x1f);
+    auto mantissa = std::uint32_t(half & 0x3ff);
+    auto bits = sign;
+    if (exponent == 0x1f) {
+        bits |= 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0 || mantissa != 0) {
+        if (exponent == 0) {
+            // Subnormal half, normal float.
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3ff;
+        }
+        bits |= (std::uint32_t(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    auto value = float{};
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+int hex_value(const char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+class ChunkDecoder {
+public:
+    ChunkDecoder(std::vector<std::string> chunks, int threads,
+                 size_t shuffle_size, std::uint32_t seed);
+    ~ChunkDecoder();
+
+    int next_batch(int batch_size, std::uint8_t* planes, float* probs,
+                   float* winners);
+    std::uint64_t skipped() const { return m_skipped; }
+
+private:
+    using Positions = std::vector<Position>;
+
+    void worker(std::uint32_t seed);
+    bool read_chunk(const std::string& filename, std::string& data);
+    void decode_text(const std::string& data, std::mt19937& rng,
+                     Positions& out);
+    void decode_binary(const std::string& data, std::mt19937& rng,
+                       Positions& out);
+    // Reads one text record starting at line, false if it is broken.
+    bool decode_text_record(const char* const* line, Position& out);
+    void transform(Position& position, int symmetry) const;
+
+    const std::vector<std::string> m_chunks;
+    const size_t m_shuffle_size;
+    // Source vertex of every vertex, for every symmetry.
+    std::array<std::array<int, NUM_INTERSECTIONS>, 8> m_symmetry_table;
+
+    std::mutex m_mutex;
+    std::condition_variable m_space_cv;
+    std::condition_variable m_fill_cv;
+    std::vector<Position> m_buffer;
+    std::mt19937 m_rng;
+    // Workers that went through all chunks without finding a position.
+    int m_idle_workers{0};
+    std::atomic<bool> m_stop{false};
+    std::atomic<std::uint64_t> m_skipped{0};
+    std::vector<std::thread> m_threads;
+};
+
+ChunkDecoder::ChunkDecoder(std::vector<std::string> chunks,
+                           const int threads, const size_t shuffle_size,
+                           const std::uint32_t seed)
+    : m_chunks(std::move(chunks)),
+      m_shuffle_size(std::max(shuffle_size, size_t{1})),
+      m_rng(seed) {
+    for (auto s = 0; s < 8; s++) {
+        for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+            m_symmetry_table[s][v] = Network::rotate_nn_idx(v, s);
+        }
+    }
+    m_buffer.reserve(m_shuffle_size);
+    for (auto i = 0; i < std::max(threads, 1); i++) {
+        m_threads.emplace_back(&ChunkDecoder::worker, this, seed + 1 + i);
+    }
+}
+
+ChunkDecoder::~ChunkDecoder() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_space_cv.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+bool ChunkDecoder::read_chunk(const std::string& filename,
+                              std::string& data) {
+    data.clear();
+    auto file = gzopen(filename.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    auto buffer = std::array<char, 65536>{};
+    auto bytes = 0;
+    while ((bytes = gzread(file, buffer.data(), buffer.size())) > 0) {
+        data.append(buffer.data(), bytes);
+    }
+    gzclose(file);
+    return bytes == 0;
+}
+
+void ChunkDecoder::transform(Position& position, const int symmetry) const {
+    if (symmetry == 0) {
+        return;
+    }
+    const auto& table = m_symmetry_table[symmetry];
+    for (auto& plane : position.planes) {
+        const auto in = plane;
+        for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+            plane[v] = in[table[v]];
+        }
+    }
+    // Pass stays where it is.
+    const auto in = position.probs;
+    for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+        position.probs[v] = in[table[v]];
+    }
+}
+
+bool ChunkDecoder::decode_text_record(const char* const* line,
+                                      Position& out) {
+    for (auto p = 0; p < INPUT_PLANES; p++) {
+        const auto text = line[p];
+        if (line[p + 1] - text < HEX_DIGITS + 1) {
+            return false;
+        }
+        auto& plane = out.planes[p];
+        for (auto i = 0; i < HEX_DIGITS; i++) {
+            const auto digit = hex_value(text[i]);
+            if (digit < 0) {
+                return false;
+            }
+            // Most significant bit first.
+            for (auto bit = 0; bit < 4; bit++) {
+                plane[4 * i + bit] = (digit >> (3 - bit)) & 1;
+            }
+        }
+        const auto last = text[HEX_DIGITS];
+        if (last != '0' && last != '1') {
+            return false;
+        }
+        plane[NUM_INTERSECTIONS - 1] = (last == '1');
+    }
+
+    const auto stm = line[INPUT_PLANES][0];
+    if (stm != '0' && stm != '1') {
+        return false;
+    }
+    out.to_move = std::uint8_t(stm - '0');
+
+    auto text = line[INPUT_PLANES + 1];
+    const auto text_end = line[INPUT_PLANES + 2];
+    for (auto& prob : out.probs) {
+        auto end = static_cast<char*>(nullptr);
+        prob = std::strtof(text, &end);
+        if (end == text || end > text_end) {
+            return false;
+        }
+        if (std::isnan(prob)) {
+            // Work around a bug in leela-zero v0.3, like parse.py.
+            return false;
+        }
+        text = end;
+    }
+
+    const auto winner = std::atoi(line[INPUT_PLANES + 2]);
+    if (winner != 1 && winner != -1) {
+        return false;
+    }
+    out.winner = float(winner);
+    return true;
+}
+
+void ChunkDecoder::decode_text(const std::string& data, std::mt19937& rng,
+                               Positions& out) {
+    // Start of every line, and one past the end.
+    auto lines = std::vector<const char*>{};
+    auto start = data.c_str();
+    const auto end = start + data.size();
+    while (start < end) {
+        lines.emplace_back(start);
+        const auto newline = static_cast<const char*>(
+            std::memchr(start, '\n', end - start));
+        start = newline ? newline + 1 : end;
+    }
+    lines.emplace_back(end);
+
+    auto symmetry = std::uniform_int_distribution<int>{0, 7};
+    const auto records = (lines.size() - 1) / TEXT_LINES;
+    auto position = Position{};
+    for (auto r = size_t{0}; r < records; r++) {
+        if (!decode_text_record(&lines[r * TEXT_LINES], position)) {
+            m_skipped++;
+            continue;
+        }
+        transform(position, symmetry(rng));
+        out.emplace_back(position);
+    }
+}
+
+void ChunkDecoder::decode_binary(const std::string& data, std::mt19937& rng,
+                                 Positions& out) {
+    const auto record_size = size_t{Training::BINARY_RECORD_SIZE};
+    const auto plane_bytes = size_t{Training::PLANE_BYTES};
+    auto symmetry = std::uniform_int_distribution<int>{0, 7};
+    auto position = Position{};
+    for (auto pos = size_t{0}; pos + record_size <= data.size();
+         pos += record_size) {
+        const auto record =
+            reinterpret_cast<const std::uint8_t*>(data.data() + pos);
+        const auto winner = std::int8_t(record[2]);
+        if (record[0] != Training::BINARY_VERSION || record[1] > 1
+            || (winner != 1 && winner != -1)) {
+            m_skipped++;
+            continue;
+        }
+        position.to_move = record[1];
+        position.winner = float(winner);
+        auto bytes = record + 4;
+        for (auto& plane : position.planes) {
+            for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+                plane[v] = (bytes[v / 8] >> (7 - v % 8)) & 1;
+            }
+            bytes += plane_bytes;
+        }
+        auto broken = false;
+        for (auto& prob : position.probs) {
+            prob = half_to_float(std::uint16_t(bytes[0] | (bytes[1] << 8)));
+            broken |= std::isnan(prob);
+            bytes += 2;
+        }
+        if (broken) {
+            m_skipped++;
+            continue;
+        }
+        transform(position, symmetry(rng));
+        out.emplace_back(position);
+    }
+}
+
+void ChunkDecoder::worker(const std::uint32_t seed) {
+    auto rng = std::mt19937{seed};
+    auto chunks = m_chunks;
+    auto data = std::string{};
+    auto positions = Positions{};
+    while (!m_stop) {
+        std::shuffle(begin(chunks), end(chunks), rng);
+        auto found = false;
+        for (const auto& chunk : chunks) {
+            if (m_stop) {
+                return;
+            }
+            positions.clear();
+            if (!read_chunk(chunk, data) || data.empty()) {
+                continue;
+            }
+            if (std::uint8_t(data[0]) == Training::BINARY_VERSION) {
+                decode_binary(data, rng, positions);
+            } else {
+                decode_text(data, rng, positions);
+            }
+            found |= !positions.empty();
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (auto& position : positions) {
+                if (m_buffer.size() >= m_shuffle_size) {
+                    // A chunk can hold more than the buffer.
+                    m_fill_cv.notify_all();
+                }
+                m_space_cv.wait(lock, [this]() {
+                    return m_stop || m_buffer.size() < m_shuffle_size;
+                });
+                if (m_stop) {
+                    return;
+                }
+                m_buffer.emplace_back(position);
+            }
+            lock.unlock();
+            m_fill_cv.notify_all();
+        }
+        if (!found) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_idle_workers++;
+            m_fill_cv.notify_all();
+            return;
+        }
+    }
+}
+
+int ChunkDecoder::next_batch(const int batch_size, std::uint8_t* planes,
+                             float* probs, float* winners) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (auto b = 0; b < batch_size; b++) {
+        // Only a buffer at least half full shuffles well.
+        m_fill_cv.wait(lock, [this]() {
+            return m_buffer.size() > m_shuffle_size / 2
+                || size_t(m_idle_workers) == m_threads.size();
+        });
+        if (m_buffer.empty()) {
+            return b;
+        }
+        auto pick = std::uniform_int_distribution<size_t>{
+            0, m_buffer.size() - 1}(m_rng);
+        std::swap(m_buffer[pick], m_buffer.back());
+        const auto& position = m_buffer.back();
+
+        auto out = planes + size_t(b) * OUTPUT_PLANES * NUM_INTERSECTIONS;
+        for (const auto& plane : position.planes) {
+            for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+                out[v] = plane[v];
+            }
+            out += NUM_INTERSECTIONS;
+        }
+        std::fill(out, out + NUM_INTERSECTIONS, 1 - position.to_move);
+        out += NUM_INTERSECTIONS;
+        std::fill(out, out + NUM_INTERSECTIONS, position.to_move);
+        std::copy(begin(position.probs), end(position.probs),
+                  probs + size_t(b) * POTENTIAL_MOVES);
+        winners[b] = position.winner;
+
+        m_buffer.pop_back();
+        m_space_cv.notify_one();
+    }
+    return batch_size;
+}
+
+}
+
+void* chunkdecoder_open(const char* const* chunks, const int count,
+                        const int threads, const int shuffle_size,
+                        const std::uint32_t seed) {
+    if (count <= 0) {
+        return nullptr;
+    }
+    return new ChunkDecoder(std::vector<std::string>(chunks, chunks + count),
+                            threads, size_t(std::max(shuffle_size, 1)),
+                            seed);
+}
+
+int chunkdecoder_next_batch(void* decoder, const int batch_size,
+                            std::uint8_t* planes, float* probs,
+                            float* winners) {
+    return static_cast<ChunkDecoder*>(decoder)->next_batch(
+        batch_size, planes, probs, winners);
+}
+
+std::uint64_t chunkdecoder_skipped(void* decoder) {
+    return static_cast<ChunkDecoder*>(decoder)->skipped();
+}
+
+void chunkdecoder_close(void* decoder) {
+    delete static_cast<ChunkDecoder*>(decoder);
+}
@@ -0,0 +1,61 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHUNKDECODER_H_INCLUDED
+#define CHUNKDECODER_H_INCLUDED
+
+#include <cstdint>
+
+/*
+    Decodes the training chunks of Training::dump_training for
+    training/tf, as a shared library with a C interface for ctypes, see
+    training/tf/chunkdecoder.py. It does what ChunkParser in parse.py
+    does, on threads: the chunks are read in random order, every
+    position gets one of the 8 symmetries of Network::rotate_nn_idx,
+    and the positions come out of a shuffle buffer in batches of packed
+    arrays:
+      planes   uint8 [batch][18][NUM_INTERSECTIONS], the 16 input planes
+               and the side to move planes, 1 for black then for white
+      probs    float [batch][POTENTIAL_MOVES]
+      winners  float [batch], the result for the side to move, 1 or -1
+    Text and --binary-training chunks can be mixed. Positions with NaN
+    probabilities, from leela-zero v0.3, and broken records are skipped.
+*/
+
+#ifdef _WIN32
+#define CHUNKDECODER_API extern "C" __declspec(dllexport)
+#else
+#define CHUNKDECODER_API extern "C"
+#endif
+
+// Starts threads threads decoding the count gzipped chunks. The buffer
+// shuffles shuffle_size positions. Returns nullptr without chunks.
+CHUNKDECODER_API void* chunkdecoder_open(const char* const* chunks, int count,
+                                         int threads, int shuffle_size,
+                                         std::uint32_t seed);
+// Fills the arrays with batch_size positions, waiting for them if need
+// be. Returns the number of positions, less than batch_size only if the
+// chunks have no positions left.
+CHUNKDECODER_API int chunkdecoder_next_batch(void* decoder, int batch_size,
+                                             std::uint8_t* planes,
+                                             float* probs, float* winners);
+// Positions skipped so far.
+CHUNKDECODER_API std::uint64_t chunkdecoder_skipped(void* decoder);
+CHUNKDECODER_API void chunkdecoder_close(void* decoder);
+
+#endif
@@ -18,15 +18,8 @@
 #ifndef CONFIG_INCLUDED
 #define CONFIG_INCLUDED
 
-/*
- * We need to check for input while we are thinking.
- * That code isn't portable, so select something appropriate for the system.
- */
 #ifdef _WIN32
-#undef HAVE_SELECT
 #define NOMINMAX
-#else
-#define HAVE_SELECT
 #endif
 
 /*
@@ -58,12 +51,40 @@
  * OpenCL drivers - the BLAS version is much faster for those.
  */
 #define USE_OPENCL
+/*
+ * USE_HALF: Store the network weights and activations on the OpenCL device
+ * as 16-bit floats, and run the SGEMM in half precision. This roughly halves
+ * the memory traffic of the GPU code. The device needs cl_khr_fp16.
+ * The CPU code (and the self-check reference) always uses single precision.
+ */
+// #define USE_HALF
+/*
+ * USE_CUDNN: Add a backend for NVIDIA GPUs that runs the residual tower
+ * with cuDNN convolutions, picked with --backend cudnn. It can be built
+ * with or without USE_OPENCL. USE_HALF makes it run in fp16 as well.
+ * Needs the CUDA toolkit and cuDNN 7 or later.
+ */
+// #define USE_CUDNN
 /*
  * USE_TUNER: Expose some extra command line parameters that allow tuning the
  * search algorithm.
  */
 // #define USE_TUNER
 
+/*
+ * BOARD_SIZE: The board size (per dimension) this build plays on. It sizes
+ * the board arrays, the network input and output layers, and the CPU and
+ * OpenCL convolution code at compile time, so a 9x9 or 13x13 build gets
+ * smaller arrays and fixed loop bounds throughout. Networks are tied to
+ * the size they were trained for. Only odd sizes are supported.
+ */
+#ifndef BOARD_SIZE
+#define BOARD_SIZE 19
+#endif
+static constexpr auto NUM_INTERSECTIONS = BOARD_SIZE * BOARD_SIZE;
+// All the intersections plus pass.
+static constexpr auto POTENTIAL_MOVES = NUM_INTERSECTIONS + 1;
+
 #define PROGRAM_NAME "Leela Zero"
 #define PROGRAM_VERSION "0.11"
 
@@ -79,7 +100,7 @@
 
 using net_t = float;
 
-#if defined(USE_BLAS) && defined(USE_OPENCL) && !defined(USE_HALF)
+#if defined(USE_BLAS) && defined(USE_OPENCL)
 // If both BLAS and OpenCL are fully usable, then check the OpenCL
 // results against BLAS with some probability.
 #define USE_OPENCL_SELFCHECK
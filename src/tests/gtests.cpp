@@ -21,21 +21,109 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <vector>
 
+#include "Book.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "Network.h"
 #include "NNCache.h"
+#include "NNCacheFile.h"
 #include "Random.h"
+#include "TTable.h"
 #include "ThreadPool.h"
+#include "Training.h"
+#include "UCTNode.h"
+#include "UCTNodeArena.h"
 #include "Utils.h"
 #include "Zobrist.h"
+#include "chunkdecoder/ChunkDecoder.h"
 
 using namespace Utils;
 
+// Reads all of a gzipped file, empty if it can't be opened.
+static std::string read_gzip(const std::string& filename) {
+    auto out = std::string{};
+    auto file = gzopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+        return out;
+    }
+    char buffer[64 * 1024];
+    int bytes;
+    while ((bytes = gzread(file, buffer, sizeof(buffer))) > 0) {
+        out.append(buffer, bytes);
+    }
+    gzclose(file);
+    return out;
+}
+
+// A network in the text format with made up weights.
+static void write_test_weights(const std::string& filename,
+                               const int channels, const int blocks) {
+    auto out = std::ofstream{filename};
+    auto n = 0;
+    auto line = [&out, &n](const int count, const bool positive) {
+        for (auto i = 0; i < count; i++, n++) {
+            const auto value = ((n * 37) % 101 - 50) / 500.0f;
+            out << (positive ? 1.0f + std::abs(value) : value)
+                << (i + 1 < count ? " " : "\n");
+        }
+    };
+    auto conv = [&line, channels](const int inputs) {
+        line(channels * inputs * 9, false);
+        line(channels, false);
+        line(channels, false);
+        line(channels, true);
+    };
+    out << "1\n";
+    conv(18);
+    for (auto i = 0; i < 2 * blocks; i++) {
+        conv(channels);
+    }
+    line(2 * channels, false);
+    line(2, false);
+    line(2, false);
+    line(2, true);
+    line(POTENTIAL_MOVES * 2 * NUM_INTERSECTIONS, false);
+    line(POTENTIAL_MOVES, false);
+    line(channels, false);
+    line(1, false);
+    line(1, false);
+    line(1, true);
+    line(256 * NUM_INTERSECTIONS, false);
+    line(256, false);
+    line(256, false);
+    line(1, false);
+}
+
+// A game without captures that black wins. Black fills the 3rd and
+// 17th rows, white the 5th and 15th, so the rows of every side are the
+// same seen from either edge of the board.
+static void write_test_sgf(const std::string& filename) {
+    auto sgf = std::ofstream{filename};
+    sgf << "(;GM[1]FF[4]SZ[19]KM[7.5]RE[B+Resign]";
+    const auto* black_rows = "cq";
+    const auto* white_rows = "eo";
+    for (auto r = 0; r < 2; r++) {
+        for (auto x = 0; x < 19; x++) {
+            const auto col = char('a' + x);
+            sgf << ";B[" << col << black_rows[r] << "]";
+            sgf << ";W[" << col << white_rows[r] << "]";
+        }
+    }
+    sgf << ")" << std::endl;
+}
+
 // Setup global objects after command line has been parsed
 void init_global_objects() {
     thread_pool.initialize(cfg_num_threads);
@@ -149,3 +237,484 @@ TEST_F(LeelaTest, KoSqNotSame) {
     // But ko (square) is not
     EXPECT_NE(hash, maingame.board.get_hash());
 }
+
+TEST_F(LeelaTest, SuperkoAcrossKoHistory) {
+    auto maingame = get_gamestate();
+
+    // More plies than the ko tail keeps.
+    for (auto x = 0; x < 10; x++) {
+        maingame.play_move(maingame.board.get_vertex(x, 3));
+        maingame.play_move(maingame.board.get_vertex(x, 15));
+    }
+    EXPECT_FALSE(maingame.superko());
+    maingame.compact_ko_history();
+    EXPECT_FALSE(maingame.superko());
+
+    // Copies share the older positions, but not what is played after.
+    auto copy = maingame;
+    // A pass repeats the position before it.
+    maingame.play_pass();
+    EXPECT_TRUE(maingame.superko());
+    EXPECT_FALSE(copy.superko());
+
+    // Now the repeated position is only found in KoHistory.
+    maingame.compact_ko_history();
+    EXPECT_TRUE(maingame.superko());
+
+    copy.play_move(copy.board.get_vertex(10, 3));
+    EXPECT_FALSE(copy.superko());
+}
+
+TEST_F(LeelaTest, BinaryTrainingRecords) {
+    const auto sgf_name = std::string{"gtest_supervised.sgf"};
+    const auto out_name = std::string{"gtest_supervised"};
+    write_test_sgf(sgf_name);
+    cfg_binary_training = true;
+
+    testing::internal::CaptureStdout();
+    Training::dump_supervised(sgf_name, out_name);
+    std::string output = testing::internal::GetCapturedStdout();
+    const auto data = read_gzip(out_name + ".0.gz");
+    std::remove(sgf_name.c_str());
+    std::remove((out_name + ".0.gz").c_str());
+
+    ASSERT_FALSE(data.empty());
+    ASSERT_EQ(data.size() % Training::BINARY_RECORD_SIZE, size_t{0});
+    const auto records = data.size() / Training::BINARY_RECORD_SIZE;
+    for (auto r = size_t{0}; r < records; r++) {
+        const auto record = reinterpret_cast<const std::uint8_t*>(
+            data.data() + r * Training::BINARY_RECORD_SIZE);
+        EXPECT_EQ(record[0], Training::BINARY_VERSION);
+        const auto black = record[1] == 0;
+        EXPECT_TRUE(record[1] == 0 || record[1] == 1);
+        // Black won.
+        EXPECT_EQ(std::int8_t(record[2]), black ? 1 : -1);
+        EXPECT_EQ(record[3], 0);
+
+        // Nothing is captured, so the side to move has as many stones
+        // as the other side if it is black, one less if it is white.
+        auto count_stones = [record](const int plane) {
+            auto stones = size_t{0};
+            const auto bytes = record + 4 + plane * Training::PLANE_BYTES;
+            for (auto i = size_t{0}; i < Training::PLANE_BYTES; i++) {
+                stones += std::bitset<8>(bytes[i]).count();
+            }
+            return stones;
+        };
+        const auto own = count_stones(0);
+        const auto other = count_stones(8);
+        EXPECT_EQ(own + (black ? 0 : 1), other);
+
+        // The move played, and only that, has probability 1.0.
+        const auto probs = record + 4 + 16 * Training::PLANE_BYTES;
+        auto moves = 0;
+        for (auto i = 0; i < POTENTIAL_MOVES; i++) {
+            const auto half = probs[2 * i] | (probs[2 * i + 1] << 8);
+            if (half == 0) {
+                continue;
+            }
+            moves++;
+            EXPECT_EQ(half, 0x3c00);
+            const auto row = i / BOARD_SIZE;
+            if (black) {
+                EXPECT_TRUE(row == 2 || row == 16);
+            } else {
+                EXPECT_TRUE(row == 4 || row == 14);
+            }
+        }
+        EXPECT_EQ(moves, 1);
+    }
+}
+
+TEST_F(LeelaTest, TrainingWriteErrorThrows) {
+    auto chunker = OutputChunker{"gtest_no_such_dir/chunk", true};
+    chunker.append(std::string(1000, 'x'));
+    testing::internal::CaptureStdout();
+    testing::internal::CaptureStderr();
+    EXPECT_THROW(chunker.finish(), std::runtime_error);
+    std::string output = testing::internal::GetCapturedStdout();
+    std::string error = testing::internal::GetCapturedStderr();
+}
+
+TEST_F(LeelaTest, ChunkDecoderReadsBothFormats) {
+    const auto sgf_name = std::string{"gtest_decoder.sgf"};
+    write_test_sgf(sgf_name);
+    auto chunks = std::vector<std::string>{};
+    testing::internal::CaptureStdout();
+    for (const auto binary : {false, true}) {
+        cfg_binary_training = binary;
+        const auto out_name = std::string{"gtest_decoder"}
+                              + (binary ? "_binary" : "_text");
+        Training::dump_supervised(sgf_name, out_name);
+        chunks.emplace_back(out_name + ".0.gz");
+    }
+    std::string output = testing::internal::GetCapturedStdout();
+    std::remove(sgf_name.c_str());
+
+    auto names = std::vector<const char*>{};
+    for (const auto& chunk : chunks) {
+        names.emplace_back(chunk.c_str());
+    }
+    const auto decoder = chunkdecoder_open(names.data(), int(names.size()),
+                                           2, 64, 1234);
+    ASSERT_NE(decoder, nullptr);
+    constexpr auto batch_size = 100;
+    constexpr auto planes_size = 18 * NUM_INTERSECTIONS;
+    auto planes = std::vector<std::uint8_t>(batch_size * planes_size);
+    auto probs = std::vector<float>(batch_size * POTENTIAL_MOVES);
+    auto winners = std::vector<float>(batch_size);
+    // The chunks are read again when they run out.
+    EXPECT_EQ(chunkdecoder_next_batch(decoder, batch_size, planes.data(),
+                                      probs.data(), winners.data()),
+              batch_size);
+    EXPECT_EQ(chunkdecoder_skipped(decoder), std::uint64_t{0});
+    chunkdecoder_close(decoder);
+    for (const auto& chunk : chunks) {
+        std::remove(chunk.c_str());
+    }
+
+    for (auto b = 0; b < batch_size; b++) {
+        const auto plane = [&](const int p) {
+            return planes.data() + (b * 18 + p) * NUM_INTERSECTIONS;
+        };
+        const auto black = plane(16)[0] == 1;
+        for (auto v = 0; v < NUM_INTERSECTIONS; v++) {
+            EXPECT_EQ(plane(16)[v], black ? 1 : 0);
+            EXPECT_EQ(plane(17)[v], black ? 0 : 1);
+        }
+        // Black won.
+        EXPECT_EQ(winners[b], black ? 1.0f : -1.0f);
+
+        // Symmetries keep the number of stones, and the move played
+        // on an empty intersection.
+        const auto own = std::count(plane(0), plane(0) + NUM_INTERSECTIONS, 1);
+        const auto other = std::count(plane(8), plane(8) + NUM_INTERSECTIONS, 1);
+        EXPECT_EQ(own + (black ? 0 : 1), other);
+        const auto prob = probs.data() + b * POTENTIAL_MOVES;
+        const auto move = std::max_element(prob, prob + POTENTIAL_MOVES) - prob;
+        EXPECT_EQ(prob[move], 1.0f);
+        EXPECT_EQ(std::accumulate(prob, prob + POTENTIAL_MOVES, 0.0f), 1.0f);
+        ASSERT_LT(move, NUM_INTERSECTIONS);
+        EXPECT_EQ(plane(0)[move] + plane(8)[move], 0);
+    }
+}
+
+#ifndef _WIN32
+TEST_F(LeelaTest, NNCacheFileKeepsEntries) {
+    const auto filename = std::string{"gtest_nncache.bin"};
+    std::remove(filename.c_str());
+    auto policy = NNCacheFile::Policy{};
+    for (auto i = size_t{0}; i < policy.size(); i++) {
+        policy[i] = std::uint16_t(7 * i);
+    }
+    auto winrate = 0.0f;
+    auto out = NNCacheFile::Policy{};
+    {
+        auto file = NNCacheFile::open(filename, 1);
+        ASSERT_NE(file, nullptr);
+        file->insert(0x1234, 1, 0.25f, policy);
+        EXPECT_TRUE(file->lookup(0x1234, 1, winrate, out));
+        EXPECT_EQ(winrate, 0.25f);
+        EXPECT_EQ(out, policy);
+        // Every network has entries of its own.
+        EXPECT_FALSE(file->lookup(0x1234, 2, winrate, out));
+
+        // Whoever opens the file next only reads it, but sees what the
+        // writer adds.
+        auto reader = NNCacheFile::open(filename, 1);
+        ASSERT_NE(reader, nullptr);
+        reader->insert(0x5678, 1, 0.5f, policy);
+        EXPECT_FALSE(reader->lookup(0x5678, 1, winrate, out));
+        file->insert(0x9abc, 1, 0.75f, policy);
+        EXPECT_TRUE(reader->lookup(0x9abc, 1, winrate, out));
+        EXPECT_EQ(winrate, 0.75f);
+    }
+    {
+        // Kept across runs.
+        auto file = NNCacheFile::open(filename, 1);
+        ASSERT_NE(file, nullptr);
+        EXPECT_TRUE(file->lookup(0x1234, 1, winrate, out));
+        EXPECT_EQ(winrate, 0.25f);
+        EXPECT_EQ(out, policy);
+        EXPECT_TRUE(file->lookup(0x9abc, 1, winrate, out));
+    }
+    {
+        auto garbage = std::ofstream{filename};
+        garbage << "not a cache file";
+    }
+    EXPECT_EQ(NNCacheFile::open(filename, 1), nullptr);
+    std::remove(filename.c_str());
+}
+#endif
+
+TEST_F(LeelaTest, SavedTreeRoundTrip) {
+    auto maingame = get_gamestate();
+    const auto vertex = [&maingame](const int x, const int y) {
+        return std::int16_t(maingame.board.get_vertex(x, y));
+    };
+    const auto make_node = [](const int visits, const double blackevals,
+                              const int move, const int childcount,
+                              const std::uint8_t flags) {
+        auto node = UCTNode::SavedNode{};
+        node.stats = UCTNode::pack_stats(visits, blackevals);
+        node.init_eval = 0.5f;
+        node.net_eval = 0.25f;
+        node.move = std::int16_t(move);
+        node.childcount = std::uint16_t(childcount);
+        node.flags = flags;
+        return node;
+    };
+    const auto make_edge = [](const float score, const std::int16_t move,
+                              const bool inflated) {
+        auto edge = UCTNode::SavedEdge{};
+        edge.score = score;
+        edge.move = move;
+        edge.inflated = inflated;
+        return edge;
+    };
+
+    // A root with two visited children and a bare edge, the first child
+    // has a bare edge of its own and the second ended the game.
+    const auto nodes = std::vector<UCTNode::SavedNode>{
+        make_node(10, 6.0, FastBoard::PASS, 3, UCTNode::SAVED_VALID),
+        make_node(6, 3.5, vertex(3, 3), 1, UCTNode::SAVED_VALID),
+        make_node(3, 1.5, vertex(15, 15), 0,
+                  UCTNode::SAVED_VALID | UCTNode::SAVED_TERMINAL)
+    };
+    auto edges = std::vector<UCTNode::SavedEdge>{
+        make_edge(0.5f, vertex(3, 3), true),
+        make_edge(0.3f, vertex(15, 15), true),
+        make_edge(0.2f, vertex(3, 15), false),
+        make_edge(1.0f, vertex(15, 3), false)
+    };
+    const auto make_tree = [&nodes, &edges]() {
+        return UCTNode::SavedTree{nodes.data(), nodes.data() + nodes.size(),
+                                  edges.data(), edges.data() + edges.size()};
+    };
+
+    UCTNodeArena arena(1 << 20);
+    auto tree = make_tree();
+    const auto root = UCTNode::restore(arena, tree);
+    ASSERT_NE(root, nullptr);
+    EXPECT_EQ(tree.nodes, tree.nodes_end);
+    EXPECT_EQ(tree.edges, tree.edges_end);
+    EXPECT_EQ(root->get_visits(), 10);
+    const auto children = root->get_children();
+    ASSERT_EQ(children.size(), size_t{3});
+    EXPECT_EQ(children.begin()[0]->get_visits(), 6);
+    EXPECT_EQ(children.begin()[1]->get_visits(), 3);
+    EXPECT_FALSE(children.begin()[2].is_inflated());
+    EXPECT_EQ(children.begin()[2].get_score(), 0.2f);
+    auto terminal_eval = 0.0f;
+    EXPECT_FALSE(children.begin()[0]->get_terminal_eval(terminal_eval));
+
+    // Saved again, the records are the same.
+    auto saved_nodes = std::vector<UCTNode::SavedNode>{};
+    auto saved_edges = std::vector<UCTNode::SavedEdge>{};
+    root->save(saved_nodes, saved_edges);
+    ASSERT_EQ(saved_nodes.size(), nodes.size());
+    ASSERT_EQ(saved_edges.size(), edges.size());
+    EXPECT_EQ(std::memcmp(saved_nodes.data(), nodes.data(),
+                          nodes.size() * sizeof(UCTNode::SavedNode)), 0);
+    EXPECT_EQ(std::memcmp(saved_edges.data(), edges.data(),
+                          edges.size() * sizeof(UCTNode::SavedEdge)), 0);
+
+    // Children with too few visits become bare edges.
+    saved_nodes.clear();
+    saved_edges.clear();
+    root->save(saved_nodes, saved_edges, 4);
+    EXPECT_EQ(saved_nodes.size(), size_t{2});
+    ASSERT_EQ(saved_edges.size(), edges.size());
+    EXPECT_FALSE(saved_edges[1].inflated);
+
+    // Records that don't add up are refused.
+    tree = make_tree();
+    tree.edges_end--;
+    EXPECT_EQ(UCTNode::restore(arena, tree), nullptr);
+    edges[2].move = 30000;
+    tree = make_tree();
+    EXPECT_EQ(UCTNode::restore(arena, tree), nullptr);
+}
+
+#if GTEST_HAS_DEATH_TEST
+TEST_F(LeelaTest, BinaryWeightsRoundTrip) {
+    // Converting exits, and the child must have the thread pool.
+    ::testing::GTEST_FLAG(death_test_style) = "threadsafe";
+    const auto text_name = std::string{"gtest_weights.txt"};
+    const auto binary_name = std::string{"gtest_weights.bin"};
+    const auto again_name = std::string{"gtest_weights_again.bin"};
+    write_test_weights(text_name, 8, 1);
+
+    cfg_weightsfile = text_name;
+    cfg_binary_weightsfile = binary_name;
+    EXPECT_EXIT(Network::initialize(), ::testing::ExitedWithCode(0), "");
+    // The binary file holds the weights as they are used, converting it
+    // again changes nothing.
+    cfg_weightsfile = binary_name;
+    cfg_binary_weightsfile = again_name;
+    EXPECT_EXIT(Network::initialize(), ::testing::ExitedWithCode(0), "");
+
+    const auto read_file = [](const std::string& filename) {
+        auto in = std::ifstream{filename, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>()};
+    };
+    const auto binary = read_file(binary_name);
+    const auto again = read_file(again_name);
+    std::remove(text_name.c_str());
+    std::remove(binary_name.c_str());
+    std::remove(again_name.c_str());
+    EXPECT_FALSE(binary.empty());
+    EXPECT_EQ(binary, again);
+}
+#endif
+
+TEST_F(LeelaTest, NNCacheQuantizesPolicy) {
+    auto& cache = NNCache::get_NNCache();
+    cache.clear();
+    auto result = Network::Netresult{};
+    for (auto i = 0; i < POTENTIAL_MOVES; i++) {
+        result.policy[i] = i % 3 == 0 ? 0.0f : float(i) / POTENTIAL_MOVES;
+    }
+    result.winrate = 0.625f;
+    const auto key = std::uint64_t{0x123456789abcdefULL};
+    cache.insert(key, result);
+
+    auto cached = Network::Netresult{};
+    ASSERT_TRUE(cache.lookup(key, cached));
+    EXPECT_EQ(cached.winrate, result.winrate);
+    for (auto i = 0; i < POTENTIAL_MOVES; i++) {
+        // Occupied points keep a probability of exactly 0.
+        if (result.policy[i] == 0.0f) {
+            EXPECT_EQ(cached.policy[i], 0.0f);
+        } else {
+            EXPECT_NEAR(cached.policy[i], result.policy[i], 1.0f / 65534);
+        }
+    }
+    EXPECT_FALSE(cache.lookup(key + 1, cached));
+    cache.clear();
+    EXPECT_FALSE(cache.lookup(key, cached));
+}
+
+TEST_F(LeelaTest, TTableSyncsTranspositions) {
+    auto& tt = TTable::get_TT();
+    tt.clear();
+    tt.new_generation();
+    const auto hash = std::uint64_t{0xfedcba9876543210ULL};
+
+    UCTNode searched(FastBoard::PASS, 0.0f, 0.5f);
+    searched.set_stats(40, 30.0);
+    tt.update(hash, 7.5f, &searched);
+
+    // A transposition picks up what the table knows.
+    UCTNode node(FastBoard::PASS, 0.0f, 0.5f);
+    tt.sync(hash, 7.5f, &node);
+    EXPECT_EQ(node.get_visits(), 40);
+    EXPECT_EQ(node.get_blackevals(), 30.0);
+
+    // But the same stones with another komi are another position.
+    UCTNode other_komi(FastBoard::PASS, 0.0f, 0.5f);
+    tt.sync(hash, 6.5f, &other_komi);
+    EXPECT_EQ(other_komi.get_visits(), 0);
+
+    // An entry is only replaced by one with more visits, and never
+    // makes a node forget visits.
+    UCTNode fewer(FastBoard::PASS, 0.0f, 0.5f);
+    fewer.set_stats(10, 5.0);
+    tt.update(hash, 7.5f, &fewer);
+    tt.sync(hash, 7.5f, &fewer);
+    EXPECT_EQ(fewer.get_visits(), 40);
+    searched.set_stats(100, 60.0);
+    tt.sync(hash, 7.5f, &searched);
+    EXPECT_EQ(searched.get_visits(), 100);
+
+    tt.clear();
+    UCTNode cleared(FastBoard::PASS, 0.0f, 0.5f);
+    tt.sync(hash, 7.5f, &cleared);
+    EXPECT_EQ(cleared.get_visits(), 0);
+    tt.flush_stats();
+}
+
+TEST_F(LeelaTest, BookAnswersEverySymmetry) {
+    // The records of a book file, as Book writes them.
+    struct Header {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t board_size;
+        float komi;
+        std::uint32_t padding;
+        std::uint64_t count;
+    };
+    struct Entry {
+        std::uint64_t key;
+        std::uint32_t visits;
+        float winrate;
+        std::array<std::uint16_t, Book::MAX_MOVES> moves;
+        std::array<std::uint32_t, Book::MAX_MOVES> move_visits;
+        std::array<float, Book::MAX_MOVES> move_winrates;
+    };
+
+    // One black stone on a 4-4 point with white to move. The key is
+    // that of the corner with the smallest key, and the book answers
+    // with the 3-3 point of that corner.
+    auto maingame = get_gamestate();
+    const auto corners = std::array<int, 2>{{3, BOARD_SIZE - 4}};
+    auto key = ~std::uint64_t{0};
+    auto key_x = 0;
+    auto key_y = 0;
+    for (const auto x : corners) {
+        for (const auto y : corners) {
+            const auto vertex = maingame.board.get_vertex(x, y);
+            if (Zobrist::zobrist[FastBoard::BLACK][vertex] < key) {
+                key = Zobrist::zobrist[FastBoard::BLACK][vertex];
+                key_x = x;
+                key_y = y;
+            }
+        }
+    }
+    const auto inner = [](const int c) { return c == 3 ? 2 : BOARD_SIZE - 3; };
+
+    auto header = Header{};
+    header.magic = {{'L', 'Z', 'B', 'O', 'O', 'K', '0', '1'}};
+    header.version = 1;
+    header.board_size = BOARD_SIZE;
+    header.komi = 7.5f;
+    header.count = 1;
+    auto entry = Entry{};
+    entry.key = key;
+    entry.visits = 1000;
+    entry.winrate = 0.5f;
+    entry.moves.fill(0xffff);
+    entry.moves[0] = std::uint16_t(inner(key_y) * BOARD_SIZE + inner(key_x));
+    entry.move_visits[0] = 900;
+    entry.move_winrates[0] = 0.55f;
+    const auto filename = std::string{"gtest_book.bin"};
+    {
+        auto out = std::ofstream{filename, std::ios::binary};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    }
+    auto& book = Book::get_Book();
+    ASSERT_TRUE(book.load(filename));
+    std::remove(filename.c_str());
+
+    for (const auto x : corners) {
+        for (const auto y : corners) {
+            auto game = get_gamestate();
+            game.play_move(FastBoard::BLACK, game.board.get_vertex(x, y));
+            const auto moves = book.lookup(game);
+            ASSERT_EQ(moves.size(), size_t{1});
+            EXPECT_EQ(moves[0].vertex,
+                      game.board.get_vertex(inner(x), inner(y)));
+            EXPECT_EQ(moves[0].visits, 900);
+            EXPECT_EQ(moves[0].winrate, 0.55f);
+
+            // Positions the book doesn't have.
+            game.play_move(FastBoard::BLACK,
+                           game.board.get_vertex(BOARD_SIZE / 2,
+                                                 BOARD_SIZE / 2));
+            EXPECT_TRUE(book.lookup(game).empty());
+        }
+    }
+    EXPECT_TRUE(book.lookup(maingame).empty());
+}
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+#    This file is part of Leela Zero.
+#    Copyright (C) 2017 Gian-Carlo Pascutto
+#
+#    Leela Zero is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    Leela Zero is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+"""
+    Python side of src/chunkdecoder, the native training chunk decoder.
+    Build it with the chunkdecoder target of CMakeLists.txt and point
+    LEELAZ_CHUNKDECODER at the library if it is not in ../../build.
+
+        chunkdecoder.py <training data prefix>
+
+    runs the same benchmark as parse.py.
+"""
+
+import ctypes
+import glob
+import os
+import sys
+import time
+import numpy as np
+
+NUM_INTERSECTIONS = 19 * 19
+POTENTIAL_MOVES = NUM_INTERSECTIONS + 1
+# 16 input planes and the 2 side to move planes
+PLANES = 18
+
+def load_library():
+    """
+        The decoder library, or None if there is none.
+    """
+    names = ['libchunkdecoder.so', 'libchunkdecoder.dylib', 'chunkdecoder.dll']
+    here = os.path.dirname(os.path.abspath(__file__))
+    paths = [os.environ.get('LEELAZ_CHUNKDECODER')]
+    paths += [os.path.join(here, '..', '..', 'build', name) for name in names]
+    for path in paths:
+        if not path or not os.path.isfile(path):
+            continue
+        lib = ctypes.CDLL(path)
+        lib.chunkdecoder_open.restype = ctypes.c_void_p
+        lib.chunkdecoder_open.argtypes = [
+            ctypes.POINTER(ctypes.c_char_p), ctypes.c_int, ctypes.c_int,
+            ctypes.c_int, ctypes.c_uint32]
+        lib.chunkdecoder_next_batch.restype = ctypes.c_int
+        lib.chunkdecoder_next_batch.argtypes = [
+            ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p,
+            ctypes.c_void_p]
+        lib.chunkdecoder_skipped.restype = ctypes.c_uint64
+        lib.chunkdecoder_skipped.argtypes = [ctypes.c_void_p]
+        lib.chunkdecoder_close.restype = None
+        lib.chunkdecoder_close.argtypes = [ctypes.c_void_p]
+        return lib
+    return None
+
+class ChunkDecoder:
+    """
+        Decodes chunks on threads of the library, in random order, with
+        random symmetries, through a shuffle buffer of shuffle_size
+        positions. Batches are numpy arrays:
+            planes  uint8 (batch, 18, 361)
+            probs   float32 (batch, 362)
+            winners float32 (batch, 1)
+    """
+    def __init__(self, lib, chunks, threads=None, shuffle_size=65536,
+                 seed=None):
+        if threads is None:
+            # Leave 1 for TensorFlow, like parse.py.
+            threads = max(1, os.cpu_count() - 1)
+        if seed is None:
+            seed = int.from_bytes(os.urandom(4), 'little')
+        self.lib = lib
+        names = (ctypes.c_char_p * len(chunks))(
+            *[chunk.encode() for chunk in chunks])
+        self.handle = lib.chunkdecoder_open(names, len(chunks), threads,
+                                            shuffle_size, seed)
+        if not self.handle:
+            raise ValueError("No chunks to decode")
+
+    def next_batch(self, batch_size):
+        planes = np.empty((batch_size, PLANES, NUM_INTERSECTIONS),
+                          dtype=np.uint8)
+        probs = np.empty((batch_size, POTENTIAL_MOVES), dtype=np.float32)
+        winners = np.empty((batch_size, 1), dtype=np.float32)
+        count = self.lib.chunkdecoder_next_batch(
+            self.handle, batch_size, planes.ctypes.data, probs.ctypes.data,
+            winners.ctypes.data)
+        if count < batch_size:
+            raise ValueError("The chunks have no positions")
+        return planes, probs, winners
+
+    def batches(self, batch_size):
+        while True:
+            yield self.next_batch(batch_size)
+
+    def skipped(self):
+        return self.lib.chunkdecoder_skipped(self.handle)
+
+    def close(self):
+        if self.handle:
+            self.lib.chunkdecoder_close(self.handle)
+            self.handle = None
+
+    def __del__(self):
+        self.close()
+
+def benchmark(decoder, batch_size=250):
+    """
+        Like benchmark() in parse.py: the time of every 10000 positions.
+    """
+    while True:
+        start = time.time()
+        for _ in range(10000 // batch_size):
+            decoder.next_batch(batch_size)
+        end = time.time()
+        print("{} pos/sec {} secs".format(10000. / (end - start), (end - start)))
+
+def main(args):
+    lib = load_library()
+    if lib is None:
+        print("No chunkdecoder library, set LEELAZ_CHUNKDECODER.")
+        return
+    chunks = glob.glob(args[0] + "*.gz")
+    print("Found {0} chunks".format(len(chunks)))
+    if not chunks:
+        return
+    benchmark(ChunkDecoder(lib, chunks))
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -26,10 +26,18 @@ import numpy as np
 import time
 import tensorflow as tf
 from tfprocess import TFProcess
+import chunkdecoder
 
 # 16 planes, 1 stm, 1 x 362 probs, 1 winner = 19 lines
 DATA_ITEM_LINES = 16 + 1 + 1 + 1
 
+# leelaz --binary-training records, see Training.h
+BINARY_VERSION = 1
+BINARY_RECORD = np.dtype([('version', 'u1'), ('stm', 'u1'),
+                          ('winner', 'i1'), ('pad', 'u1'),
+                          ('planes', 'u1', (16, 46)),
+                          ('probs', '<f2', 362)])
+
 BATCH_SIZE = 256
 
 def remap_vertex(vertex, symmetry):
@@ -141,23 +149,64 @@ class ChunkParser:
             'winner' : tf.train.Feature(float_list=tf.train.FloatList(value=[winner]))}))
         return True, example.SerializeToString()
 
+    def convert_binary_data(self, record, symmetry):
+        """
+            Convert a binary training record to a tf.train.Example
+        """
+        assert symmetry >= 0 and symmetry < 8
+
+        # Drop the padding bits after the 361st of every plane.
+        planes = np.unpackbits(record['planes'], axis=1)[:, 0:361]
+        planes = planes.reshape(16 * 361)[self.full_reflection_table[symmetry]]
+        stm = int(record['stm'])
+        planes = b''.join([planes.tobytes(),
+                           self.flat_planes[1 - stm], self.flat_planes[stm]])
+        assert len(planes) == (18 * 19 * 19)
+
+        probabilities = record['probs'].astype(float)
+        if np.any(np.isnan(probabilities)):
+            return False, None
+        probabilities = probabilities[self.prob_reflection_table[symmetry]]
+
+        winner = float(record['winner'])
+        assert winner == 1.0 or winner == -1.0
+
+        example = tf.train.Example(features=tf.train.Features(feature={
+            'planes' : tf.train.Feature(bytes_list=tf.train.BytesList(value=[planes])),
+            'probs' : tf.train.Feature(float_list=tf.train.FloatList(value=probabilities)),
+            'winner' : tf.train.Feature(float_list=tf.train.FloatList(value=[winner]))}))
+        return True, example.SerializeToString()
+
     def task(self, chunks, writer):
         while True:
             random.shuffle(chunks)
             for chunk in chunks:
                 with gzip.open(chunk, 'r') as chunk_file:
-                    file_content = chunk_file.readlines()
-                    item_count = len(file_content) // DATA_ITEM_LINES
-                    for item_idx in range(item_count):
-                        pick_offset = item_idx * DATA_ITEM_LINES
-                        item = file_content[pick_offset:pick_offset + DATA_ITEM_LINES]
-                        str_items = [str(line, 'ascii') for line in item]
+                    file_data = chunk_file.read()
+                if file_data[:1] == bytes([BINARY_VERSION]):
+                    # Fixed size records, no parsing needed.
+                    count = len(file_data) // BINARY_RECORD.itemsize
+                    records = np.frombuffer(file_data, dtype=BINARY_RECORD,
+                                            count=count)
+                    for record in records:
                         # Pick a random symmetry to apply
                         symmetry = random.randrange(8)
-                        success, data = self.convert_train_data(str_items, symmetry)
+                        success, data = self.convert_binary_data(record, symmetry)
                         if success:
-                            # Send it down the pipe.
                             writer.send_bytes(data)
+                    continue
+                file_content = file_data.splitlines(True)
+                item_count = len(file_content) // DATA_ITEM_LINES
+                for item_idx in range(item_count):
+                    pick_offset = item_idx * DATA_ITEM_LINES
+                    item = file_content[pick_offset:pick_offset + DATA_ITEM_LINES]
+                    str_items = [str(line, 'ascii') for line in item]
+                    # Pick a random symmetry to apply
+                    symmetry = random.randrange(8)
+                    success, data = self.convert_train_data(str_items, symmetry)
+                    if success:
+                        # Send it down the pipe.
+                        writer.send_bytes(data)
 
     def parse_chunk(self):
         while True:
@@ -267,16 +316,29 @@ def main(args):
     if not chunks:
         return
 
-    parser = ChunkParser(chunks)
-
-    run_test(parser)
-    #benchmark(parser)
-
-    dataset = tf.data.Dataset.from_generator(
-        parser.parse_chunk, output_types=(tf.string))
-    dataset = dataset.shuffle(65536)
-    dataset = dataset.map(_parse_function)
-    dataset = dataset.batch(BATCH_SIZE)
+    lib = chunkdecoder.load_library()
+    if lib:
+        # Decoded, shuffled and batched in native threads.
+        print("Using the native chunk decoder.")
+        decoder = chunkdecoder.ChunkDecoder(lib, chunks)
+        dataset = tf.data.Dataset.from_generator(
+            lambda: decoder.batches(BATCH_SIZE),
+            output_types=(tf.uint8, tf.float32, tf.float32),
+            output_shapes=((BATCH_SIZE, 18, 19*19), (BATCH_SIZE, 19*19+1),
+                           (BATCH_SIZE, 1)))
+        dataset = dataset.map(
+            lambda planes, probs, winner: (tf.to_float(planes), probs, winner))
+    else:
+        parser = ChunkParser(chunks)
+
+        run_test(parser)
+        #benchmark(parser)
+
+        dataset = tf.data.Dataset.from_generator(
+            parser.parse_chunk, output_types=(tf.string))
+        dataset = dataset.shuffle(65536)
+        dataset = dataset.map(_parse_function)
+        dataset = dataset.batch(BATCH_SIZE)
     dataset = dataset.prefetch(16)
     iterator = dataset.make_one_shot_iterator()
     next_batch = iterator.get_next()
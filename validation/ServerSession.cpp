@@ -0,0 +1,70 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ServerSession.h"
+#include <QHostAddress>
+#include <QTextStream>
+#include <QThread>
+
+bool ServerSession::connectTo(quint16 port) {
+    for (int i = 0; i < CONNECT_TIMEOUT_S; i++) {
+        m_socket.connectToHost(QHostAddress::LocalHost, port);
+        if (m_socket.waitForConnected(1000)) {
+            return true;
+        }
+        m_socket.abort();
+        QThread::sleep(1);
+    }
+    QTextStream(stdout) << "*ERROR*: No engine on port " << port << endl;
+    return false;
+}
+
+bool ServerSession::readLine(QString& line) {
+    while (!m_socket.canReadLine()) {
+        if (!m_socket.waitForReadyRead(-1)) {
+            return false;
+        }
+    }
+    line = QString::fromUtf8(m_socket.readLine()).trimmed();
+    return true;
+}
+
+bool ServerSession::command(const QString& cmd, QString* answer) {
+    m_socket.write(qPrintable(cmd + "\n"));
+    if (!m_socket.waitForBytesWritten(-1)) {
+        return false;
+    }
+    QString reply, line;
+    if (!readLine(reply)) {
+        return false;
+    }
+    // The answer ends with an empty line.
+    do {
+        if (!readLine(line)) {
+            return false;
+        }
+    } while (!line.isEmpty());
+    if (!reply.startsWith("=")) {
+        QTextStream(stdout) << "*ERROR*: " << cmd << ": " << reply << endl;
+        return false;
+    }
+    if (answer) {
+        *answer = reply.mid(1).trimmed();
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef SERVERSESSION_H
+#define SERVERSESSION_H
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QString>
+#include <QTcpSocket>
+
+/*
+    One game on a "leelaz --analysis-server" engine. The engine plays
+    all sessions at once and batches their evaluations. The calls block,
+    so a session belongs to the thread that created it.
+*/
+class ServerSession {
+public:
+    ServerSession() = default;
+    ~ServerSession() = default;
+    // Retries for a while, the engine may still be loading or tuning.
+    bool connectTo(quint16 port);
+    // Sends cmd and stores the answer without the "= ". Returns false
+    // if the engine failed the command or the connection broke.
+    bool command(const QString& cmd, QString* answer = nullptr);
+
+private:
+    static constexpr int CONNECT_TIMEOUT_S = 600;
+    bool readLine(QString& line);
+    QTcpSocket m_socket;
+};
+
+#endif
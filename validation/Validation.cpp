@@ -18,13 +18,20 @@
 
 #include "Validation.h"
 #include <QFile>
+#include <utility>
 
 using VersionTuple = std::tuple<int, int, int>;
 // Minimal Leela Zero version we expect to see
 const VersionTuple min_leelaz_version{0, 10, 0};
+// Playouts per move, as -p of the options in ValidationWorker::init.
+constexpr int SHARED_PLAYOUTS = 1600;
 
 
 void ValidationWorker::run() {
+    if (m_shared) {
+        runShared();
+        return;
+    }
     do {
         Game first(m_firstNet,  m_option);
         if (!first.gameStart(min_leelaz_version)) {
@@ -96,6 +103,88 @@ void ValidationWorker::run() {
     } while (m_state.load() != FINISHING);
 }
 
+void ValidationWorker::runShared() {
+    ServerSession first;
+    ServerSession second;
+    if (!first.connectTo(m_firstPort) || !second.connectTo(m_secondPort)) {
+        emit resultReady(Sprt::NoResult, Game::BLACK);
+        return;
+    }
+    // The first net plays black.
+    auto black = &first;
+    auto white = &second;
+    do {
+        const auto winner = playShared(*black, *white);
+        if (winner < 0) {
+            emit resultReady(Sprt::NoResult, Game::BLACK);
+            return;
+        }
+        if (m_state.load() == RUNNING) {
+            QTextStream(stdout) << "Game has ended." << endl;
+            if (winner == m_expected) {
+                emit resultReady(Sprt::Win, m_expected);
+            } else {
+                emit resultReady(Sprt::Loss, m_expected);
+            }
+            // Change color and play again
+            std::swap(black, white);
+            if (m_expected == Game::BLACK) {
+                m_expected = Game::WHITE;
+            } else {
+                m_expected = Game::BLACK;
+            }
+        }
+    } while (m_state.load() != FINISHING);
+}
+
+int ValidationWorker::playShared(ServerSession& black, ServerSession& white) {
+    if (!black.command("clear_board") || !white.command("clear_board")
+        || !black.command("komi 7.5") || !white.command("komi 7.5")) {
+        return -1;
+    }
+    const auto genmove = QString(" %1").arg(SHARED_PLAYOUTS);
+    auto passes = 0;
+    // Same move limit as Game::checkGameEnd.
+    for (auto moveNum = 0;
+         moveNum <= 19 * 19 * 2 && passes < 2 && m_state.load() == RUNNING;
+         moveNum++) {
+        const auto blackToMove = (moveNum % 2 == 0);
+        auto& player = blackToMove ? black : white;
+        auto& opponent = blackToMove ? white : black;
+        const QString color = blackToMove ? "black" : "white";
+        QString move;
+        if (!player.command("genmove " + color + genmove, &move)) {
+            return -1;
+        }
+        if (move.compare("resign", Qt::CaseInsensitive) == 0) {
+            return blackToMove ? Game::WHITE : Game::BLACK;
+        }
+        if (move.compare("pass", Qt::CaseInsensitive) == 0) {
+            passes++;
+        } else {
+            passes = 0;
+        }
+        if (!opponent.command("play " + color + " " + move)) {
+            return -1;
+        }
+    }
+    QString score;
+    if (!black.command("final_score", &score)) {
+        return -1;
+    }
+    return score.startsWith("B+") ? Game::BLACK : Game::WHITE;
+}
+
+void ValidationWorker::initShared(const quint16 firstPort,
+                                  const quint16 secondPort,
+                                  const int expected) {
+    m_shared = true;
+    m_firstPort = firstPort;
+    m_secondPort = secondPort;
+    m_expected = expected;
+    m_state.store(RUNNING);
+}
+
 void ValidationWorker::init(const QString& gpuIndex,
                             const QString& firstNet,
                             const QString& secondNet,
@@ -118,7 +207,8 @@ Validation::Validation(const int gpus,
                        const QString& firstNet,
                        const QString& secondNet,
                        const QString& keep,
-                       QMutex* mutex) :
+                       QMutex* mutex,
+                       const quint16 sharedPort) :
     m_mainMutex(mutex),
     m_syncMutex(),
     m_gamesThreads(gpus*games),
@@ -127,13 +217,46 @@ Validation::Validation(const int gpus,
     m_gpusList(gpuslist),
     m_firstNet(firstNet),
     m_secondNet(secondNet),
-    m_keepPath(keep) {
+    m_keepPath(keep),
+    m_sharedPort(sharedPort) {
     m_statistic.initialize(0.0, 35.0, 0.05, 0.05);
     m_statistic.addGameResult(Sprt::Draw);
 }
 
+void Validation::startEngines() {
+    // Enough threads and batch room to keep every game on the GPU going.
+    const auto options = QString(" -t %1 --batchsize %2 -p %3"
+                                 " --noponder -q -d -r 0")
+        .arg(m_games * 2).arg(m_games).arg(SHARED_PLAYOUTS);
+    for (int gpu = 0; gpu < m_gpus; ++gpu) {
+        for (const auto& net : {m_firstNet, m_secondNet}) {
+            const int port = m_sharedPort + int(m_engines.size());
+            QString cmdLine = "./leelaz";
+#ifdef WIN32
+            cmdLine.append(".exe");
+#endif
+            cmdLine.append(QString(" --analysis-server %1").arg(port));
+            if (!m_gpusList.isEmpty()) {
+                cmdLine.append(" --gpu=" + m_gpusList.at(gpu));
+            }
+            cmdLine.append(options + " -w " + net);
+            auto engine = std::make_unique<QProcess>();
+            engine->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+            engine->start(cmdLine);
+            if (!engine->waitForStarted()) {
+                QTextStream(stdout)
+                    << "*ERROR*: No 'leelaz' binary found." << endl;
+            }
+            m_engines.push_back(std::move(engine));
+        }
+    }
+}
+
 void Validation::startGames() {
     m_mainMutex->lock();
+    if (m_sharedPort) {
+        startEngines();
+    }
     QString n1, n2;
     int expected;
     QString myGpu;
@@ -159,7 +282,20 @@ void Validation::startGames() {
             } else {
                 myGpu = m_gpusList.at(gpu);
             }
-            m_gamesThreads[thread_index].init(myGpu, n1, n2, m_keepPath, expected);
+            if (m_sharedPort) {
+                // Engines of the first and second net on this GPU.
+                const auto port = m_sharedPort + 2 * gpu;
+                if (game % 2) {
+                    m_gamesThreads[thread_index].initShared(port, port + 1,
+                                                            expected);
+                } else {
+                    m_gamesThreads[thread_index].initShared(port + 1, port,
+                                                            expected);
+                }
+            } else {
+                m_gamesThreads[thread_index].init(myGpu, n1, n2,
+                                                  m_keepPath, expected);
+            }
             m_gamesThreads[thread_index].start();
         }
     }
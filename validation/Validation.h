@@ -24,9 +24,13 @@
 #include <QVector>
 #include <QAtomicInt>
 #include <QMutex>
+#include <QProcess>
+#include <memory>
+#include <vector>
 #include "SPRT.h"
 #include "../autogtp/Game.h"
 #include "Results.h"
+#include "ServerSession.h"
 
 class ValidationWorker : public QThread {
     Q_OBJECT
@@ -43,12 +47,21 @@ public:
               const QString& secondNet,
               const QString& keep,
               int expected);
+    // Plays on the shared engines listening on these ports instead.
+    void initShared(quint16 firstPort, quint16 secondPort, int expected);
     void run() override;
     void doFinish() { m_state.store(FINISHING); }
 
 signals:
     void resultReady(Sprt::GameResult r, int net_one_color);
 private:
+    void runShared();
+    // Returns the winning color, or -1 if an engine failed.
+    int playShared(ServerSession& black, ServerSession& white);
+
+    bool m_shared{false};
+    quint16 m_firstPort;
+    quint16 m_secondPort;
     QString m_firstNet;
     QString m_secondNet;
     int m_expected;
@@ -66,7 +79,8 @@ public:
                const QString& firstNet,
                const QString& secondNet,
                const QString& keep,
-               QMutex* mutex);
+               QMutex* mutex,
+               quint16 sharedPort = 0);
     ~Validation() = default;
     void startGames();
     void wait();
@@ -86,6 +100,11 @@ private:
     QString m_firstNet;
     QString m_secondNet;
     QString m_keepPath;
+    // With --shared, the engines of both networks on every GPU listen
+    // on consecutive ports from here.
+    quint16 m_sharedPort;
+    std::vector<std::unique_ptr<QProcess>> m_engines;
+    void startEngines();
     void quitThreads();
 };
 
@@ -62,10 +62,18 @@ int main(int argc, char *argv[]) {
             "Save SGF files after each self-play game.",
             "output directory");
 
+    QCommandLineOption sharedOption(
+        {"s", "shared"},
+            "Keep one engine per network and GPU up for the whole run, "
+            "listening on consecutive ports from 'port'. All games on "
+            "a GPU share them.",
+            "port");
+
     parser.addOption(gamesNumOption);
     parser.addOption(gpusOption);
     parser.addOption(networkOption);
     parser.addOption(keepSgfOption);
+    parser.addOption(sharedOption);
 
     // Process the actual command line arguments given by the user
     parser.process(app);
@@ -91,10 +99,22 @@ int main(int argc, char *argv[]) {
             return EXIT_FAILURE;
         }
     }
+    quint16 sharedPort = 0;
+    if (parser.isSet(sharedOption)) {
+        sharedPort = parser.value(sharedOption).toUShort();
+        if (sharedPort == 0) {
+            cerr << "Invalid port for the shared engines." << endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.isSet(keepSgfOption)) {
+            cerr << "Shared engines can't save SGF files." << endl;
+            return EXIT_FAILURE;
+        }
+    }
     QMutex mutex;
     Validation validate(gpusNum, gamesNum, gpusList,
                         netList.at(0), netList.at(1),
-                        parser.value(keepSgfOption), &mutex);
+                        parser.value(keepSgfOption), &mutex, sharedPort);
     validate.startGames();
     mutex.lock();
     cerr.flush();
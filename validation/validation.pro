@@ -1,4 +1,5 @@
 QT  -= gui
+QT  += network
 
 TARGET = validation
 CONFIG   += c++14
@@ -12,10 +13,12 @@ SOURCES += main.cpp \
     ../autogtp/Game.cpp \
     SPRT.cpp \
     Validation.cpp \
-    Results.cpp
+    Results.cpp \
+    ServerSession.cpp
 
 HEADERS += \
     ../autogtp/Game.h \
     SPRT.h \
     Validation.h \
-    Results.h
+    Results.h \
+    ServerSession.h